@@ -0,0 +1,73 @@
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include "Wad.h"
+#include "MapBuild.h"
+
+using namespace std;
+
+// Node builder timing over every E1M* map directory.
+// Usage: bsp_bench <wad> [repeats]
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        cerr << "usage: " << argv[0] << " <wad> [repeats]" << endl;
+        return 1;
+    }
+    int repeats = argc > 2 ? atoi(argv[2]) : 5;
+    if (repeats < 1) repeats = 1;
+
+    Wad *data = Wad::loadWad(argv[1]);
+    if (!data)
+    {
+        cerr << "cannot load " << argv[1] << endl;
+        return 1;
+    }
+
+    vector<string> entries, maps;
+    data->getDirectory("/", &entries);
+    for (string entry : entries)
+        if (entry.size() == 4 && entry.compare(0, 3, "E1M") == 0 && data->isDirectory("/" + entry))
+            maps.push_back("/" + entry);
+    if (maps.empty())
+    {
+        cerr << "no E1M* maps in " << argv[1] << endl;
+        delete data;
+        return 1;
+    }
+
+    unsigned cores = max(1u, thread::hardware_concurrency());
+    vector<unsigned> threadCounts = {1};
+    for (unsigned t = 2; t < cores; t *= 2) threadCounts.push_back(t);
+    if (cores > 1) threadCounts.push_back(cores);
+
+    for (const string &path : maps)
+    {
+        MapView map = data->mapView(path);
+        NodeLumps lumps;
+        if (!buildNodes(map, &lumps, 1))
+        {
+            cout << path << ": cannot build" << endl;
+            continue;
+        }
+        cout << path << ": " << map.linedefs().size() << " lines -> "
+             << lumps.segs.size() / sizeof(MapSeg) << " segs, "
+             << lumps.subsectors.size() / sizeof(MapSubsector) << " subsectors, "
+             << lumps.nodes.size() / sizeof(MapNode) << " nodes" << endl;
+
+        for (unsigned threads : threadCounts)
+        {
+            auto start = chrono::steady_clock::now();
+            for (int r = 0; r < repeats; r++)
+                buildNodes(map, &lumps, threads);
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cout << "  " << threads << " thread(s): " << seconds / repeats * 1000 << " ms" << endl;
+        }
+    }
+
+    delete data;
+    return 0;
+}
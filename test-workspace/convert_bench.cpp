@@ -0,0 +1,85 @@
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include "Wad.h"
+#include "Convert.h"
+
+using namespace std;
+
+// Conversion throughput over every D_* (music) and DS* (sound) lump.
+// Usage: convert_bench <wad> [repeats]
+
+void collectLumps(Wad *data, const string path, vector<ConvertJob> *jobs)
+{
+    vector<string> entries;
+    data->getDirectory(path, &entries);
+
+    for (string entry : entries)
+    {
+        string entryPath = path + entry;
+        if (data->isDirectory(entryPath))
+            collectLumps(data, entryPath + "/", jobs);
+        else if (entry.size() > 2 && (entry.compare(0, 2, "D_") == 0 || entry.compare(0, 2, "DS") == 0))
+            jobs->push_back({entryPath, "", LumpEncoder::None, 0});
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        cerr << "usage: " << argv[0] << " <wad> [repeats]" << endl;
+        return 1;
+    }
+    int repeats = argc > 2 ? atoi(argv[2]) : 20;
+    if (repeats < 1) repeats = 1;
+
+    Wad *data = Wad::loadWad(argv[1]);
+    if (!data)
+    {
+        cerr << "cannot load " << argv[1] << endl;
+        return 1;
+    }
+
+    vector<ConvertJob> lumps;
+    collectLumps(data, "/", &lumps);
+    if (lumps.empty())
+    {
+        cerr << "no D_*/DS* lumps in " << argv[1] << endl;
+        delete data;
+        return 1;
+    }
+
+    // The same lumps `repeats` times over, so the timing covers enough work
+    vector<ConvertJob> jobs;
+    for (int r = 0; r < repeats; r++)
+        jobs.insert(jobs.end(), lumps.begin(), lumps.end());
+
+    Palette pal; // not needed for sound and music
+    unsigned cores = max(1u, thread::hardware_concurrency());
+    vector<unsigned> threadCounts = {1};
+    for (unsigned t = 2; t < cores; t *= 2) threadCounts.push_back(t);
+    if (cores > 1) threadCounts.push_back(cores);
+
+    cout << lumps.size() << " lumps x " << repeats << endl;
+    for (unsigned threads : threadCounts)
+    {
+        auto start = chrono::steady_clock::now();
+        int converted = convertLumps(data, jobs, pal, threads);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        double in = 0, out = 0;
+        for (const ConvertJob &job : jobs)
+        {
+            if (job.bytes < 0) continue;
+            in += data->getSize(job.path);
+            out += job.bytes;
+        }
+        cout << threads << " thread(s): " << converted << "/" << jobs.size() << " converted, "
+             << in / seconds / 1e6 << " MB/s in, " << out / seconds / 1e6 << " MB/s out" << endl;
+    }
+
+    delete data;
+    return 0;
+}
@@ -7,15 +7,27 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <cstring>
 #include <ctype.h>
 #include <algorithm>
+#include <cmath>
+#include <fstream>
 #include <cctype>
 #include <stack>
 #include <regex>
+#include <atomic>
+#include <thread>
 #include "gtest/gtest.h"
 
 #include "Wad.h"
+#include "Image.h"
+#include "Texture.h"
+#include "Convert.h"
+#include "MapBuild.h"
+#include "Digest.h"
+#include "Lz.h"
+#include "Corpus.h"
 
 
 
@@ -36,6 +48,155 @@ const std::string setupWorkspace(){
 }
 
 
+// Synthetic WADs for the map tests: lumps are laid out back to back in the
+// order given, then the directory
+struct TestLump {
+        std::string name;
+        std::vector<char> bytes;
+};
+
+static void putShort(std::vector<char> &out, int value){
+        out.push_back(static_cast<char>(value & 0xFF));
+        out.push_back(static_cast<char>((value >> 8) & 0xFF));
+}
+
+static void putName(std::vector<char> &out, const std::string &name){
+        for (size_t i = 0; i < 8; i++)
+                out.push_back(i < name.size() ? name[i] : '\0');
+}
+
+const std::string writeTestWad(const std::string &path, const std::vector<TestLump> &lumps){
+        std::vector<char> data;
+        std::vector<char> directory;
+        for (const auto &lump : lumps) {
+                uint32_t offset = 12 + data.size();
+                uint32_t length = lump.bytes.size();
+                directory.insert(directory.end(), (char*)&offset, (char*)&offset + 4);
+                directory.insert(directory.end(), (char*)&length, (char*)&length + 4);
+                putName(directory, lump.name);
+                data.insert(data.end(), lump.bytes.begin(), lump.bytes.end());
+        }
+
+        uint32_t count = lumps.size();
+        uint32_t dirOffset = 12 + data.size();
+        std::vector<char> file = {'P', 'W', 'A', 'D'};
+        file.insert(file.end(), (char*)&count, (char*)&count + 4);
+        file.insert(file.end(), (char*)&dirOffset, (char*)&dirOffset + 4);
+        file.insert(file.end(), data.begin(), data.end());
+        file.insert(file.end(), directory.begin(), directory.end());
+
+        FILE *f = fopen(path.c_str(), "wb");
+        fwrite(file.data(), 1, file.size(), f);
+        fclose(f);
+        return path;
+}
+
+// One 256x256 square sector with a player start in the middle
+std::vector<TestLump> squareRoomMap(const std::string &marker){
+        std::vector<TestLump> lumps;
+        lumps.push_back({marker, {}});
+
+        TestLump things{"THINGS", {}};
+        for (int v : {128, 128, 90, 1, 7}) putShort(things.bytes, v);
+        lumps.push_back(things);
+
+        TestLump linedefs{"LINEDEFS", {}};
+        for (int i = 0; i < 4; i++)
+                for (int v : {i, (i + 1) % 4, 1, 0, 0, i, 0xFFFF}) putShort(linedefs.bytes, v);
+        lumps.push_back(linedefs);
+
+        TestLump sidedefs{"SIDEDEFS", {}};
+        for (int i = 0; i < 4; i++) {
+                putShort(sidedefs.bytes, 0);
+                putShort(sidedefs.bytes, 0);
+                putName(sidedefs.bytes, "-");
+                putName(sidedefs.bytes, "-");
+                putName(sidedefs.bytes, "STARTAN3");
+                putShort(sidedefs.bytes, 0);
+        }
+        lumps.push_back(sidedefs);
+
+        TestLump vertexes{"VERTEXES", {}};
+        for (int v : {0, 0, 0, 256, 256, 256, 256, 0}) putShort(vertexes.bytes, v);
+        lumps.push_back(vertexes);
+
+        lumps.push_back({"SEGS", {}});
+        lumps.push_back({"SSECTORS", {}});
+        lumps.push_back({"NODES", {}});
+
+        TestLump sectors{"SECTORS", {}};
+        putShort(sectors.bytes, 0);
+        putShort(sectors.bytes, 128);
+        putName(sectors.bytes, "FLOOR4_8");
+        putName(sectors.bytes, "CEIL3_5");
+        for (int v : {160, 0, 0}) putShort(sectors.bytes, v);
+        lumps.push_back(sectors);
+
+        lumps.push_back({"REJECT", {}});
+        lumps.push_back({"BLOCKMAP", {}});
+        return lumps;
+}
+
+// A map from raw geometry: each line gets a sidedef per side, facing the
+// given sector (-1 = no side)
+struct TestLine {
+        int v1, v2;
+        int front, back;
+};
+
+std::vector<TestLump> linesMap(const std::string &marker, const std::vector<std::pair<int, int>> &vertices,
+                               const std::vector<TestLine> &lines, int sectorCount){
+        std::vector<TestLump> lumps;
+        lumps.push_back({marker, {}});
+        lumps.push_back({"THINGS", {}});
+
+        TestLump linedefs{"LINEDEFS", {}};
+        TestLump sidedefs{"SIDEDEFS", {}};
+        int sides = 0;
+        for (const TestLine &line : lines) {
+                int front = line.front >= 0 ? sides++ : 0xFFFF;
+                int back = line.back >= 0 ? sides++ : 0xFFFF;
+                for (int v : {line.v1, line.v2, line.back >= 0 ? 4 : 1, 0, 0, front, back})
+                        putShort(linedefs.bytes, v);
+                for (int sector : {line.front, line.back}) {
+                        if (sector < 0) continue;
+                        putShort(sidedefs.bytes, 0);
+                        putShort(sidedefs.bytes, 0);
+                        putName(sidedefs.bytes, "-");
+                        putName(sidedefs.bytes, "-");
+                        putName(sidedefs.bytes, line.back >= 0 ? "-" : "STARTAN3");
+                        putShort(sidedefs.bytes, sector);
+                }
+        }
+        lumps.push_back(linedefs);
+        lumps.push_back(sidedefs);
+
+        TestLump vertexes{"VERTEXES", {}};
+        for (const auto &v : vertices) {
+                putShort(vertexes.bytes, v.first);
+                putShort(vertexes.bytes, v.second);
+        }
+        lumps.push_back(vertexes);
+
+        lumps.push_back({"SEGS", {}});
+        lumps.push_back({"SSECTORS", {}});
+        lumps.push_back({"NODES", {}});
+
+        TestLump sectors{"SECTORS", {}};
+        for (int i = 0; i < sectorCount; i++) {
+                putShort(sectors.bytes, 0);
+                putShort(sectors.bytes, 128);
+                putName(sectors.bytes, "FLOOR4_8");
+                putName(sectors.bytes, "CEIL3_5");
+                for (int v : {160, 0, 0}) putShort(sectors.bytes, v);
+        }
+        lumps.push_back(sectors);
+
+        lumps.push_back({"REJECT", {}});
+        lumps.push_back({"BLOCKMAP", {}});
+        return lumps;
+}
+
 TEST(LibReadTests, getMagic){
         std::string wad_path = setupWorkspace();
         Wad* testWad = Wad::loadWad(wad_path);
@@ -1037,6 +1198,1814 @@ TEST(LibWriteTests, writeToFileTest3){
         delete testWad;      
 }
 
+TEST(LibWriteTests, writeToFileTest4){
+        std::string wad_path = setupWorkspace();
+        Wad* testWad = Wad::loadWad(wad_path);
+
+        //writeToFile Test 4, writes ending past MaxLumpSize fail without allocating
+        std::string testPath = "/Gl/far.txt";
+        testWad->createFile(testPath);
+        ASSERT_EQ(testWad->writeToFile(testPath, "x", 1, Wad::MaxLumpSize), -1);
+        ASSERT_EQ(testWad->writeToFile(testPath, "x", 1, INT64_MAX), -1);
+        Wad::LumpHandle handle = testWad->open(testPath);
+        ASSERT_EQ(testWad->write(handle, "xy", 2, Wad::MaxLumpSize - 1), -1);
+        ASSERT_EQ(testWad->getSize(testPath), 0);
+        ASSERT_EQ(testWad->writeToFile(testPath, "hello", 5, 2), 5);
+        ASSERT_EQ(testWad->getSize(testPath), 7);
+
+        delete testWad;
+}
+
+TEST(LibHandleTests, handleTest1){
+        std::string wad_path = setupWorkspace();
+        Wad* testWad = Wad::loadWad(wad_path);
+
+        //Handles only resolve content
+        ASSERT_EQ(testWad->open("/E1M0"), Wad::InvalidHandle);
+        ASSERT_EQ(testWad->open("/fake.jpg"), Wad::InvalidHandle);
+
+        Wad::LumpHandle handle = testWad->open("/Gl/ad/os/cake.jpg");
+        ASSERT_NE(handle, Wad::InvalidHandle);
+        ASSERT_EQ(handle, testWad->open("Gl/ad/os/cake.jpg/"));
+        ASSERT_EQ(testWad->size(handle), 29869);
+
+        //Chunked reads through the handle match path-based reads
+        char viaHandle[4096];
+        char viaPath[4096];
+        int total = 0;
+        int ret;
+        while ((ret = testWad->read(handle, viaHandle, 4096, total)) > 0) {
+                ASSERT_EQ(testWad->getContents("/Gl/ad/os/cake.jpg", viaPath, 4096, total), ret);
+                ASSERT_EQ(memcmp(viaHandle, viaPath, ret), 0);
+                total += ret;
+        }
+        ASSERT_EQ(total, 29869);
+
+        //Writing through a handle follows writeToFile rules
+        testWad->createFile("/Gl/new.txt");
+        Wad::LumpHandle created = testWad->open("/Gl/new.txt");
+        ASSERT_EQ(testWad->size(created), 0);
+        ASSERT_EQ(testWad->write(created, "hello", 5), 5);
+        ASSERT_EQ(testWad->size(created), 5);
+        ASSERT_EQ(testWad->write(handle, "hello", 5), 0);
+
+        delete testWad;
+}
+
+TEST(LibIoEngineTests, engineTest1){
+        //Both engines load and save the same bytes
+        Wad::LoadOptions posix;
+        posix.io = IoEngine::Posix;
+        Wad::LoadOptions uring;
+        uring.io = IoEngine::Uring;
+
+        std::string wad_path = setupWorkspace();
+        Wad* posixWad = Wad::loadWad(wad_path, posix);
+        Wad* uringWad = Wad::loadWad(wad_path, uring);
+
+        char posixBuf[30000];
+        char uringBuf[30000];
+        int posixRet = posixWad->getContents("/Gl/ad/os/cake.jpg", posixBuf, 30000);
+        int uringRet = uringWad->getContents("/Gl/ad/os/cake.jpg", uringBuf, 30000);
+        ASSERT_EQ(posixRet, 29869);
+        ASSERT_EQ(uringRet, 29869);
+        ASSERT_EQ(memcmp(posixBuf, uringBuf, posixRet), 0);
+
+        delete posixWad;
+        delete uringWad;
+
+        //Saved file reloads identically
+        Wad* reloaded = Wad::loadWad(wad_path, posix);
+        ASSERT_EQ(reloaded->getContents("/Gl/ad/os/cake.jpg", uringBuf, 30000), 29869);
+        ASSERT_EQ(memcmp(posixBuf, uringBuf, 29869), 0);
+        delete reloaded;
+
+        //More requests than the ring holds all complete
+        IoEngine* engine = IoEngine::create(IoEngine::Uring);
+        int fd = open(wad_path.c_str(), O_RDONLY);
+        std::vector<IoRequest> requests(200);
+        std::vector<char> bytes(200);
+        for (int i = 0; i < 200; i++) {
+                requests[i] = {fd, false, &bytes[i], 1, static_cast<off_t>(i), 0};
+                engine->submit(&requests[i]);
+        }
+        engine->wait();
+        char expected[200];
+        ASSERT_EQ(pread(fd, expected, 200, 0), 200);
+        for (int i = 0; i < 200; i++) {
+                ASSERT_EQ(requests[i].result, 1);
+                ASSERT_EQ(bytes[i], expected[i]);
+        }
+        close(fd);
+        delete engine;
+}
+
+TEST(LibIoEngineTests, overlapTest1){
+        //The tree build does not wait for the lump reads to be issued
+        std::vector<TestLump> lumps;
+        for (int i = 0; i < 4000; i++)
+                lumps.push_back({"L" + std::to_string(i), std::vector<char>(256, static_cast<char>(i))});
+        std::string wad_path = writeTestWad("./testfiles/overlap.wad", lumps);
+
+        for (IoEngine::Kind kind : {IoEngine::Uring, IoEngine::Posix}) {
+                Wad::LoadOptions options;
+                options.io = kind;
+                options.threads = 1;
+                bool overlapped = false;
+                for (int attempt = 0; attempt < 20 && !overlapped; attempt++) {
+                        Wad* testWad = Wad::loadWad(wad_path, options);
+                        Wad::LoadStats stats = testWad->loadStats();
+                        ASSERT_EQ(stats.lumpReads, 4000u);
+                        overlapped = stats.issuedAtTree < stats.lumpReads;
+                        char byte = 0;
+                        ASSERT_EQ(testWad->getContents("/L3999", &byte, 1, 255), 1);
+                        ASSERT_EQ(byte, static_cast<char>(3999));
+                        delete testWad;
+                }
+                ASSERT_TRUE(overlapped);
+        }
+
+        remove(wad_path.c_str());
+}
+
+TEST(LibIoEngineTests, parallelLoadTest1){
+        //Worker-pool loading matches a single synchronous load lump for lump
+        Wad::LoadOptions serial;
+        serial.io = IoEngine::Posix;
+        serial.threads = 1;
+        Wad::LoadOptions parallel;
+        parallel.io = IoEngine::Posix;
+        parallel.threads = 4;
+
+        std::string wad_path = setupWorkspace();
+        Wad* serialWad = Wad::loadWad(wad_path, serial);
+        Wad* parallelWad = Wad::loadWad(wad_path, parallel);
+
+        std::vector<std::string> paths = {"/mp.txt", "/Gl/ad/os/cake.jpg"};
+        std::vector<std::string> entries;
+        serialWad->getDirectory("/E1M0", &entries);
+        for (const auto &e : entries)
+                paths.push_back("/E1M0/" + e);
+
+        std::vector<char> a(30000), b(30000);
+        for (const auto &path : paths) {
+                int size = serialWad->getSize(path);
+                ASSERT_GT(size, 0) << path;
+                ASSERT_EQ(parallelWad->getContents(path, b.data(), 30000), size) << path;
+                serialWad->getContents(path, a.data(), 30000);
+                ASSERT_EQ(memcmp(a.data(), b.data(), size), 0) << path;
+        }
+
+        delete serialWad;
+        delete parallelWad;
+}
+
+TEST(LibMapTests, mapViewTest1){
+        std::string wad_path = writeTestWad("./testfiles/map_copy.wad", squareRoomMap("E1M1"));
+        Wad* testWad = Wad::loadWad(wad_path);
+
+        ASSERT_TRUE(testWad->isDirectory("/E1M1"));
+        MapView map = testWad->mapView("/E1M1");
+        ASSERT_TRUE(map.valid());
+
+        //Records are read in place with their on-disk layout
+        ASSERT_EQ(map.things().size(), 1);
+        ASSERT_EQ(map.things()[0].type, 1);
+        ASSERT_EQ(map.things()[0].angle, 90);
+        ASSERT_EQ(map.vertexes().size(), 4);
+        ASSERT_EQ(map.vertexes()[2].x, 256);
+        ASSERT_EQ(map.linedefs().size(), 4);
+        ASSERT_EQ(map.linedefs()[3].v2, 0);
+        ASSERT_EQ(map.linedefs()[3].sidenum[1], 0xFFFF);
+        ASSERT_EQ(std::string(map.sidedefs()[0].middleTexture, 8), "STARTAN3");
+        ASSERT_EQ(map.sectors()[0].ceilingHeight, 128);
+        ASSERT_EQ(map.sectors()[0].lightLevel, 160);
+
+        //Bounds checks and empty lumps
+        ASSERT_EQ(map.vertexes().at(4), nullptr);
+        ASSERT_NE(map.vertexes().at(3), nullptr);
+        ASSERT_TRUE(map.has(MapView::Segs));
+        ASSERT_TRUE(map.segs().empty());
+
+        //Only map directories have views
+        ASSERT_FALSE(testWad->mapView("/E1M1/THINGS").valid());
+        ASSERT_FALSE(testWad->mapView("/E1M2").valid());
+
+        delete testWad;
+        remove(wad_path.c_str());
+}
+
+TEST(LibMapTests, blockmapTest1){
+        std::string wad_path = writeTestWad("./testfiles/map_copy.wad", squareRoomMap("E1M1"));
+        Wad* testWad = Wad::loadWad(wad_path);
+
+        //256x256 room, origin (-8,-8): a 3x3 grid with the middle block empty
+        std::vector<char> blockmap;
+        ASSERT_TRUE(buildBlockmap(testWad->mapView("/E1M1"), &blockmap));
+        std::vector<uint16_t> words(blockmap.size() / 2);
+        memcpy(words.data(), blockmap.data(), blockmap.size());
+        std::vector<uint16_t> expected = {
+                0xFFF8, 0xFFF8, 3, 3,
+                15, 19, 22, 26, 13, 29, 32, 36, 39,
+                0, 0xFFFF,
+                0, 0, 3, 0xFFFF,   0, 3, 0xFFFF,   0, 2, 3, 0xFFFF,
+                0, 0, 0xFFFF,      0, 2, 0xFFFF,
+                0, 0, 1, 0xFFFF,   0, 1, 0xFFFF,   0, 1, 2, 0xFFFF};
+        ASSERT_EQ(words, expected);
+
+        //Written back through writeToFile and saved with the Wad
+        ASSERT_TRUE(rebuildBlockmapAndReject(testWad, "/E1M1", 2));
+        ASSERT_EQ(testWad->getSize("/E1M1/BLOCKMAP"), blockmap.size());
+        ASSERT_EQ(testWad->getSize("/E1M1/REJECT"), 1);
+        ASSERT_FALSE(rebuildBlockmapAndReject(testWad, "/E1M2", 2));
+        delete testWad;
+
+        testWad = Wad::loadWad(wad_path);
+        std::vector<char> saved(blockmap.size());
+        ASSERT_EQ(testWad->getContents("/E1M1/BLOCKMAP", saved.data(), saved.size()), blockmap.size());
+        ASSERT_EQ(saved, blockmap);
+        ASSERT_TRUE(testWad->isContent("/E1M1/THINGS"));
+        delete testWad;
+        remove(wad_path.c_str());
+}
+
+TEST(LibMapTests, rejectTest1){
+        //Room A, a corridor B up to a hall C, C down into a pocket D; E is
+        //unconnected. D is hidden from A and B by the corridor walls.
+        std::vector<std::pair<int, int>> vertices = {
+                {0, 0}, {0, 100}, {40, 100}, {60, 100}, {100, 100}, {100, 0},
+                {40, 300}, {60, 300}, {40, 320}, {300, 320}, {300, 300}, {280, 300},
+                {280, 100}, {300, 100},
+                {1000, 0}, {1000, 100}, {1100, 100}, {1100, 0}};
+        enum { A, B, C, D, E };
+        std::vector<TestLine> lines = {
+                {0, 1, A, -1}, {1, 2, A, -1}, {2, 3, A, B}, {3, 4, A, -1}, {4, 5, A, -1}, {5, 0, A, -1},
+                {2, 6, B, -1}, {7, 3, B, -1}, {6, 7, B, C},
+                {6, 8, C, -1}, {8, 9, C, -1}, {9, 10, C, -1}, {10, 11, C, D}, {11, 7, C, -1},
+                {12, 11, D, -1}, {10, 13, D, -1}, {13, 12, D, -1},
+                {14, 15, E, -1}, {15, 16, E, -1}, {16, 17, E, -1}, {17, 14, E, -1}};
+        std::string wad_path = writeTestWad("./testfiles/map_copy.wad", linesMap("E1M1", vertices, lines, 5));
+        Wad* testWad = Wad::loadWad(wad_path);
+        MapView map = testWad->mapView("/E1M1");
+
+        for (unsigned threads : {1u, 3u}) {
+                std::vector<char> reject;
+                ASSERT_TRUE(buildReject(map, &reject, threads));
+                ASSERT_EQ(reject.size(), 4);
+                auto rejected = [&](int i, int j) { int bit = i * 5 + j; return (reject[bit / 8] >> (bit % 8)) & 1; };
+
+                for (int i = 0; i < 5; i++) ASSERT_FALSE(rejected(i, i));
+                for (auto pair : std::vector<std::pair<int, int>>{{A, B}, {B, C}, {C, D}, {A, C}}) {
+                        ASSERT_FALSE(rejected(pair.first, pair.second));
+                        ASSERT_FALSE(rejected(pair.second, pair.first));
+                }
+                for (auto pair : std::vector<std::pair<int, int>>{{A, D}, {B, D}, {A, E}, {C, E}, {D, E}}) {
+                        ASSERT_TRUE(rejected(pair.first, pair.second));
+                        ASSERT_TRUE(rejected(pair.second, pair.first));
+                }
+        }
+
+        delete testWad;
+        remove(wad_path.c_str());
+}
+
+TEST(LibMapTests, rejectTest2){
+        //A narrow room A opens into B, whose far corner opens into C. A thin
+        //pillar in B leaves only the sight lines that pass both portals at
+        //their very edges, grazing the corners where B's walls meet them.
+        //Lowered past those lines, the pillar hides C from A.
+        enum { A, B, C };
+        for (int pillarBottom : {25, 23}) {
+                std::vector<std::pair<int, int>> vertices = {
+                        {0, 0}, {0, 16}, {64, 16}, {64, 0}, {128, 0}, {128, 48}, {128, 64}, {64, 64},
+                        {192, 48}, {192, 64},
+                        {95, pillarBottom}, {97, pillarBottom}, {97, 63}, {95, 63}};
+                std::vector<TestLine> lines = {
+                        {0, 1, A, -1}, {1, 2, A, -1}, {2, 3, A, B}, {3, 0, A, -1},
+                        {3, 4, B, -1}, {4, 5, B, -1}, {5, 6, B, C}, {6, 7, B, -1}, {7, 2, B, -1},
+                        {5, 8, C, -1}, {8, 9, C, -1}, {9, 6, C, -1},
+                        {10, 11, B, -1}, {11, 12, B, -1}, {12, 13, B, -1}, {13, 10, B, -1}};
+                std::string wad_path = writeTestWad("./testfiles/map_copy.wad", linesMap("E1M1", vertices, lines, 3));
+                Wad* testWad = Wad::loadWad(wad_path);
+                std::vector<char> reject;
+                ASSERT_TRUE(buildReject(testWad->mapView("/E1M1"), &reject, 1));
+                ASSERT_EQ(reject.size(), 2);
+                auto rejected = [&](int i, int j) { int bit = i * 3 + j; return (reject[bit / 8] >> (bit % 8)) & 1; };
+                ASSERT_EQ(rejected(A, C), pillarBottom < 25);
+                ASSERT_EQ(rejected(C, A), pillarBottom < 25);
+                ASSERT_FALSE(rejected(A, B));
+                ASSERT_FALSE(rejected(B, C));
+                delete testWad;
+                remove(wad_path.c_str());
+        }
+}
+
+TEST(LibMapTests, nodesTest1){
+        //The rejectTest1 geometry: every subsector convex, every line side
+        //covered once, and a point in each sector walks down to that sector
+        std::vector<std::pair<int, int>> vertices = {
+                {0, 0}, {0, 100}, {40, 100}, {60, 100}, {100, 100}, {100, 0},
+                {40, 300}, {60, 300}, {40, 320}, {300, 320}, {300, 300}, {280, 300},
+                {280, 100}, {300, 100},
+                {1000, 0}, {1000, 100}, {1100, 100}, {1100, 0}};
+        enum { A, B, C, D, E };
+        std::vector<TestLine> lines = {
+                {0, 1, A, -1}, {1, 2, A, -1}, {2, 3, A, B}, {3, 4, A, -1}, {4, 5, A, -1}, {5, 0, A, -1},
+                {2, 6, B, -1}, {7, 3, B, -1}, {6, 7, B, C},
+                {6, 8, C, -1}, {8, 9, C, -1}, {9, 10, C, -1}, {10, 11, C, D}, {11, 7, C, -1},
+                {12, 11, D, -1}, {10, 13, D, -1}, {13, 12, D, -1},
+                {14, 15, E, -1}, {15, 16, E, -1}, {16, 17, E, -1}, {17, 14, E, -1}};
+        std::string wad_path = writeTestWad("./testfiles/map_copy.wad", linesMap("E1M1", vertices, lines, 5));
+        Wad* testWad = Wad::loadWad(wad_path);
+        MapView map = testWad->mapView("/E1M1");
+
+        NodeLumps single, threaded;
+        ASSERT_TRUE(buildNodes(map, &single, 1));
+        ASSERT_TRUE(buildNodes(map, &threaded, 3));
+        ASSERT_EQ(single.vertexes, threaded.vertexes);
+        ASSERT_EQ(single.segs, threaded.segs);
+        ASSERT_EQ(single.subsectors, threaded.subsectors);
+        ASSERT_EQ(single.nodes, threaded.nodes);
+
+        auto records = [](const std::vector<char> &bytes, auto *out) {
+                out->resize(bytes.size() / sizeof((*out)[0]));
+                memcpy(out->data(), bytes.data(), bytes.size());
+        };
+        std::vector<MapVertex> verts;
+        std::vector<MapSeg> segs;
+        std::vector<MapSubsector> subsectors;
+        std::vector<MapNode> nodes;
+        records(single.vertexes, &verts);
+        records(single.segs, &segs);
+        records(single.subsectors, &subsectors);
+        records(single.nodes, &nodes);
+
+        ASSERT_GE(verts.size(), vertices.size());
+        for (size_t i = 0; i < vertices.size(); i++) {
+                ASSERT_EQ(verts[i].x, vertices[i].first);
+                ASSERT_EQ(verts[i].y, vertices[i].second);
+        }
+        ASSERT_EQ(nodes.size() + 1, subsectors.size());
+
+        //Each line side is covered by its segs end to end
+        std::vector<double> covered(lines.size() * 2, 0);
+        for (const MapSeg &seg : segs)
+                covered[seg.linedef * 2 + seg.side] += std::hypot(verts[seg.v2].x - verts[seg.v1].x, verts[seg.v2].y - verts[seg.v1].y);
+        for (size_t i = 0; i < lines.size(); i++) {
+                double length = std::hypot(vertices[lines[i].v2].first - vertices[lines[i].v1].first,
+                                           vertices[lines[i].v2].second - vertices[lines[i].v1].second);
+                ASSERT_NEAR(covered[i * 2], length, 2.0);
+                ASSERT_NEAR(covered[i * 2 + 1], lines[i].back >= 0 ? length : 0, 2.0);
+        }
+
+        //Nothing in a subsector lies behind any of its segs
+        auto side = [&](const MapSeg &seg, const MapVertex &p) {
+                const MapVertex &a = verts[seg.v1], &b = verts[seg.v2];
+                return ((b.y - a.y) * (p.x - a.x) - (b.x - a.x) * (p.y - a.y)) / std::hypot(b.x - a.x, b.y - a.y);
+        };
+        auto sectorOf = [&](const MapSubsector &ss) {
+                const MapSeg &seg = segs[ss.firstSeg];
+                return map.sidedefs()[map.linedefs()[seg.linedef].sidenum[seg.side]].sector;
+        };
+        for (const MapSubsector &ss : subsectors) {
+                ASSERT_GT(ss.segCount, 0);
+                for (int i = ss.firstSeg; i < ss.firstSeg + ss.segCount; i++)
+                        for (int j = ss.firstSeg; j < ss.firstSeg + ss.segCount; j++) {
+                                ASSERT_GT(side(segs[i], verts[segs[j].v1]), -1.5);
+                                ASSERT_GT(side(segs[i], verts[segs[j].v2]), -1.5);
+                        }
+        }
+
+        std::vector<std::pair<int, int>> inside = {{50, 50}, {50, 200}, {150, 310}, {290, 200}, {1050, 50}};
+        for (int sector = A; sector <= E; sector++) {
+                int x = inside[sector].first, y = inside[sector].second;
+                uint16_t child = static_cast<uint16_t>(nodes.size() - 1);
+                while (!(child & 0x8000)) {
+                        const MapNode &n = nodes[child];
+                        bool right = n.dy * (x - n.x) - n.dx * (y - n.y) > 0;
+                        child = n.children[right ? 0 : 1];
+                }
+                ASSERT_EQ(sectorOf(subsectors[child & 0x7FFF]), sector);
+        }
+
+        ASSERT_TRUE(rebuildNodes(testWad, "/E1M1/", 2));
+        ASSERT_EQ(testWad->getSize("/E1M1/NODES"), static_cast<int>(single.nodes.size()));
+        ASSERT_EQ(testWad->getSize("/E1M1/SEGS"), static_cast<int>(single.segs.size()));
+        ASSERT_EQ(testWad->getSize("/E1M1/VERTEXES"), static_cast<int>(single.vertexes.size()));
+        ASSERT_FALSE(rebuildNodes(testWad, "/E1M2/", 2));
+
+        delete testWad;
+        remove(wad_path.c_str());
+}
+
+TEST(LibValidateTests, validateTest1){
+        auto found = [](const std::vector<Wad::Issue> &issues, int lump, Wad::Issue::Severity severity, const std::string &text) {
+                for (const Wad::Issue &issue : issues)
+                        if (issue.lump == lump && issue.severity == severity && issue.message.find(text) != std::string::npos)
+                                return true;
+                return false;
+        };
+        //Rewrites one 32-bit field of a file in place
+        auto patch = [](const std::string &path, long offset, uint32_t value) {
+                std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+                file.seekp(offset);
+                file.write(reinterpret_cast<const char*>(&value), 4);
+        };
+        std::vector<Wad::Issue> issues;
+
+        //The samples (E#M# directories of plain lumps) and a saved map are clean
+        ASSERT_TRUE(Wad::validate("./testfiles/sample1.wad", &issues));
+        ASSERT_TRUE(Wad::validate("./testfiles/sample2.wad", &issues));
+        std::string wad_path = writeTestWad("./testfiles/map_copy.wad", squareRoomMap("E1M1"));
+        ASSERT_TRUE(Wad::validate(wad_path, &issues, 2));
+        ASSERT_TRUE(issues.empty());
+
+        //Square room: E1M1 #0, THINGS #1 at 12 (10 bytes), LINEDEFS #2 ... BLOCKMAP #10
+        long table = 12 + 10 + 4 * 14 + 4 * 30 + 4 * 4 + 26;
+        patch(wad_path, table + 8 * 16, 12);          // SECTORS over THINGS
+        patch(wad_path, 4, 12);                       // 12 entries listed, 11 there
+        ASSERT_FALSE(Wad::validate(wad_path, &issues));
+        ASSERT_TRUE(found(issues, -1, Wad::Issue::Error, "11 of 12 entries"));
+        ASSERT_TRUE(found(issues, 8, Wad::Issue::Error, "overlaps lump 1"));
+        ASSERT_TRUE(found(issues, 0, Wad::Issue::Error, "contiguous"));
+        remove(wad_path.c_str());
+
+        //Dangling references inside a map
+        issues.clear();
+        std::vector<std::pair<int, int>> vertices = {{0, 0}, {0, 64}, {64, 0}};
+        std::vector<TestLine> lines = {{0, 1, 0, -1}, {1, 7, 0, -1}, {2, 0, 3, -1}};
+        wad_path = writeTestWad("./testfiles/map_copy.wad", linesMap("E1M1", vertices, lines, 1));
+        ASSERT_FALSE(Wad::validate(wad_path, &issues));
+        ASSERT_TRUE(found(issues, 2, Wad::Issue::Error, "1 record(s) reference missing vertexes (first: record 1)"));
+        ASSERT_TRUE(found(issues, 3, Wad::Issue::Error, "missing sectors (first: record 2)"));
+        remove(wad_path.c_str());
+
+        //Namespaces that do not pair up
+        issues.clear();
+        wad_path = writeTestWad("./testfiles/map_copy.wad",
+                                {{"F_START", {}}, {"FLAT1", {'a'}}, {"P_END", {}}, {"S_START", {}}});
+        ASSERT_FALSE(Wad::validate(wad_path, &issues));
+        ASSERT_TRUE(found(issues, 2, Wad::Issue::Error, "no matching _START"));
+        ASSERT_TRUE(found(issues, 0, Wad::Issue::Error, "never closed"));
+        ASSERT_TRUE(found(issues, 3, Wad::Issue::Error, "never closed"));
+        remove(wad_path.c_str());
+
+        ASSERT_FALSE(Wad::validate("./testfiles/missing.wad", &issues));
+}
+
+TEST(LibDigestTests, checksumTest1){
+        //Reference values, every kernel, and pieces joined or streamed
+        ASSERT_EQ(crc32c("123456789", 9), 0xE3069283u);
+        ASSERT_EQ(xxh64("", 0), 0xEF46DB3751D8E999ull);
+        ASSERT_EQ(xxh64("abc", 3), 0x44BC2CF5AD770999ull);
+        ASSERT_EQ(xxh64("Nobody inspects the spammish repetition", 39), 0xFBCEA83C8A378BF1ull);
+
+        std::vector<char> data(40000 + 13);
+        for (size_t i = 0; i < data.size(); i++)
+                data[i] = static_cast<char>((i * 131) ^ (i >> 5));
+        uint32_t expected = crc32c(data.data() + 1, data.size() - 1, 0, CrcKernel::Scalar);
+        for (CrcKernel k : {CrcKernel::Sse42, CrcKernel::Best}) {
+                if (!crc32cKernelSupported(k)) continue;
+                ASSERT_EQ(crc32c(data.data() + 1, data.size() - 1, 0, k), expected);
+        }
+
+        uint32_t whole = crc32c(data.data(), data.size());
+        uint32_t head = crc32c(data.data(), 12345);
+        ASSERT_EQ(crc32c(data.data() + 12345, data.size() - 12345, head), whole);
+        ASSERT_EQ(crc32cCombine(head, crc32c(data.data() + 12345, data.size() - 12345), data.size() - 12345), whole);
+
+        Xxh64 state(7);
+        state.update(data.data(), 5);
+        state.update(data.data() + 5, 40);
+        state.update(data.data() + 45, data.size() - 45);
+        ASSERT_EQ(state.digest(), xxh64(data.data(), data.size(), 7));
+}
+
+TEST(LibDigestTests, digestTest1){
+        std::string wad_path = writeTestWad("./testfiles/map_copy.wad", squareRoomMap("E1M1"));
+        //Lump contents as the library reads them; the Wad saves on delete, so
+        //this comes before anything that looks at the file's mtime
+        Wad* testWad = Wad::loadWad(wad_path);
+        std::vector<std::string> names = {"E1M1", "THINGS", "LINEDEFS", "SIDEDEFS", "VERTEXES", "SEGS",
+                                          "SSECTORS", "NODES", "SECTORS", "REJECT", "BLOCKMAP"};
+        std::vector<std::vector<char>> lumps(names.size());
+        for (size_t i = 1; i < names.size(); i++) {
+                std::string path = "/E1M1/" + names[i];
+                lumps[i].resize(testWad->getSize(path));
+                testWad->getContents(path, lumps[i].data(), lumps[i].size());
+        }
+        delete testWad;
+
+        std::ifstream in(wad_path, std::ios::binary);
+        std::vector<char> file((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+        WadDigest single, threaded;
+        ASSERT_TRUE(digestWad(wad_path, &single, 1));
+        ASSERT_TRUE(digestWad(wad_path, &threaded, 3));
+        ASSERT_EQ(single.fileSize, file.size());
+        ASSERT_EQ(single.crc32c, crc32c(file.data(), file.size()));
+        ASSERT_EQ(single.xxh64, xxh64(file.data(), file.size()));
+        ASSERT_EQ(formatManifest(single), formatManifest(threaded));
+        ASSERT_EQ(single.lumps.size(), names.size());
+        for (size_t i = 1; i < names.size(); i++) {
+                ASSERT_EQ(single.lumps[i].name.str(), names[i]);
+                ASSERT_EQ(single.lumps[i].crc32c, crc32c(lumps[i].data(), lumps[i].size()));
+                ASSERT_EQ(single.lumps[i].xxh64, xxh64(lumps[i].data(), lumps[i].size()));
+        }
+
+        WadDigest parsed;
+        ASSERT_TRUE(parseManifest(formatManifest(single), &parsed));
+        ASSERT_EQ(formatManifest(parsed), formatManifest(single));
+        ASSERT_FALSE(parseManifest("WADDIGEST 1\nfile 1 2 3\n", &parsed));
+
+        //The cache is written on the first call and trusted while size and mtime match
+        std::string cache_path = wad_path + ".digest";
+        WadDigest cached;
+        ASSERT_TRUE(digestWadCached(wad_path, &cached));
+        ASSERT_EQ(formatManifest(cached), formatManifest(single));
+        single.lumps[1].crc32c ^= 1;
+        std::ofstream(cache_path, std::ios::binary) << formatManifest(single);
+        ASSERT_TRUE(digestWadCached(wad_path, &cached));
+        ASSERT_EQ(cached.lumps[1].crc32c, single.lumps[1].crc32c);
+
+        ASSERT_FALSE(digestWad("./testfiles/missing.wad", &cached));
+
+        //A count the file cannot hold fails before anything is allocated for it
+        std::string bogus_path = "./testfiles/bogus_count.wad";
+        std::vector<char> bogus = {'P', 'W', 'A', 'D', 0, 0, 0, '\xF0', 12, 0, 0, 0};
+        bogus.resize(112);
+        std::ofstream(bogus_path, std::ios::binary).write(bogus.data(), bogus.size());
+        ASSERT_FALSE(digestWad(bogus_path, &cached));
+
+        //So does a table that starts, or ends, past the end of the file
+        for (uint32_t offset : {0xFFFFFFF0u, 112u, 100u}) {
+                uint32_t count = 1;
+                memcpy(bogus.data() + 4, &count, 4);
+                memcpy(bogus.data() + 8, &offset, 4);
+                std::ofstream(bogus_path, std::ios::binary | std::ios::trunc).write(bogus.data(), bogus.size());
+                ASSERT_FALSE(digestWad(bogus_path, &cached));
+                ASSERT_FALSE(digestWad(bogus_path, &cached, 2));
+        }
+        remove(bogus_path.c_str());
+        remove(cache_path.c_str());
+        remove(wad_path.c_str());
+}
+
+TEST(LibPatchTests, diffTest1){
+        //THINGS and DATA change, GONE goes, NEW and a copy of the old DATA arrive
+        std::vector<char> data(8192);
+        for (size_t i = 0; i < data.size(); i++)
+                data[i] = static_cast<char>((i * 7) ^ (i >> 6));
+        std::vector<TestLump> source = squareRoomMap("E1M1");
+        source.push_back({"DATA", data});
+        source.push_back({"GONE", std::vector<char>(100, 'g')});
+
+        std::vector<TestLump> target = squareRoomMap("E1M1");
+        target[1].bytes[0] ^= 1;
+        std::vector<char> changed = data;
+        changed[100] ^= 0x55;
+        changed.insert(changed.begin() + 5000, {'x', 'y', 'z'});
+        target.push_back({"DATA", changed});
+        target.push_back({"NEW", {'n', 'e', 'w'}});
+        target.push_back({"COPY", data});
+
+        std::string source_path = writeTestWad("./testfiles/patch_source.wad", source);
+        std::string target_path = writeTestWad("./testfiles/patch_target.wad", target);
+        std::string patch_path = "./testfiles/patch.wadp";
+        std::string output_path = "./testfiles/patch_output.wad";
+
+        Wad::DiffStats stats;
+        ASSERT_TRUE(Wad::diff(source_path, target_path, patch_path, &stats));
+        ASSERT_EQ(stats.unchanged, 4);
+        ASSERT_EQ(stats.changed, 2);
+        ASSERT_EQ(stats.added, 2);
+        ASSERT_EQ(stats.removed, 1);
+        ASSERT_EQ(stats.deltas, 1);
+        ASSERT_LT(stats.patchBytes, 1024);
+
+        //Same layout as the target was written with, so byte for byte equal
+        ASSERT_TRUE(Wad::applyPatch(source_path, patch_path, output_path));
+        std::ifstream expected_in(target_path, std::ios::binary), output_in(output_path, std::ios::binary);
+        std::vector<char> expected((std::istreambuf_iterator<char>(expected_in)), std::istreambuf_iterator<char>());
+        std::vector<char> output((std::istreambuf_iterator<char>(output_in)), std::istreambuf_iterator<char>());
+        ASSERT_EQ(output, expected);
+
+        //Applied to anything but its source, a patch is refused
+        remove(output_path.c_str());
+        ASSERT_FALSE(Wad::applyPatch(target_path, patch_path, output_path));
+        ASSERT_EQ(access(output_path.c_str(), F_OK), -1);
+        ASSERT_EQ(access((output_path + ".tmp").c_str(), F_OK), -1);
+
+        //A delta whose ops run past its stated length, its own bytes or the
+        //source lump is refused, not decoded
+        struct stat source_stat;
+        ASSERT_EQ(stat(source_path.c_str(), &source_stat), 0);
+        auto putU32 = [](std::vector<char> &bytes, uint32_t v) { bytes.insert(bytes.end(), reinterpret_cast<char*>(&v), reinterpret_cast<char*>(&v) + 4); };
+        auto putU64 = [](std::vector<char> &bytes, uint64_t v) { bytes.insert(bytes.end(), reinterpret_cast<char*>(&v), reinterpret_cast<char*>(&v) + 8); };
+        auto copyOp = [&](std::vector<char> &ops, uint32_t from, uint32_t run) {
+                ops.push_back(0);
+                putU32(ops, from);
+                putU32(ops, run);
+        };
+        auto insertOp = [&](std::vector<char> &ops, uint32_t run, const std::vector<char> &bytes) {
+                ops.push_back(1);
+                putU32(ops, run);
+                ops.insert(ops.end(), bytes.begin(), bytes.end());
+        };
+        auto deltaPatch = [&](const std::vector<char> &ops, uint32_t length) {
+                std::vector<char> bytes = {'W', 'A', 'D', 'P'};
+                putU32(bytes, 1);
+                bytes.insert(bytes.end(), {'P', 'W', 'A', 'D'});
+                putU32(bytes, static_cast<uint32_t>(source.size()));
+                putU64(bytes, static_cast<uint64_t>(source_stat.st_size));
+                putU32(bytes, 1);
+                putName(bytes, "DATA");
+                bytes.push_back(3);
+                putU32(bytes, 11);
+                putU64(bytes, xxh64(data.data(), data.size()));
+                putU32(bytes, length);
+                putU64(bytes, xxh64(data.data(), length));
+                putU32(bytes, static_cast<uint32_t>(ops.size()));
+                bytes.insert(bytes.end(), ops.begin(), ops.end());
+                std::string path = "./testfiles/patch_delta.wadp";
+                std::ofstream(path, std::ios::binary | std::ios::trunc).write(bytes.data(), bytes.size());
+                return path;
+        };
+        std::vector<char> ops;
+        copyOp(ops, 0, 16);
+        std::string delta_path = deltaPatch(ops, 16);
+        ASSERT_TRUE(Wad::applyPatch(source_path, delta_path, output_path));
+        remove(output_path.c_str());
+        ops.clear();
+        copyOp(ops, 0, 8);
+        insertOp(ops, 8, std::vector<char>(data.begin() + 8, data.begin() + 16));
+        delta_path = deltaPatch(ops, 16);
+        ASSERT_TRUE(Wad::applyPatch(source_path, delta_path, output_path));
+        remove(output_path.c_str());
+
+        std::vector<std::vector<char>> overruns(4);
+        copyOp(overruns[0], 0, 16);
+        for (int i = 0; i < 99; i++) copyOp(overruns[0], 0, static_cast<uint32_t>(data.size()));
+        insertOp(overruns[1], 32, std::vector<char>(data.begin(), data.begin() + 32));
+        copyOp(overruns[2], 0, 8);
+        insertOp(overruns[2], 1000, std::vector<char>(data.begin() + 8, data.begin() + 16));
+        copyOp(overruns[3], static_cast<uint32_t>(data.size()) - 8, 16);
+        for (const std::vector<char> &bad : overruns) {
+                delta_path = deltaPatch(bad, 16);
+                ASSERT_FALSE(Wad::applyPatch(source_path, delta_path, output_path));
+                ASSERT_EQ(access(output_path.c_str(), F_OK), -1);
+        }
+        remove(delta_path.c_str());
+
+        //As is a source whose directory count the file cannot hold
+        std::string bogus_path = "./testfiles/patch_bogus.wad";
+        std::vector<char> bogus = {'P', 'W', 'A', 'D', 0, 0, 0, '\xF0', 12, 0, 0, 0};
+        bogus.resize(112);
+        std::ofstream(bogus_path, std::ios::binary).write(bogus.data(), bogus.size());
+        ASSERT_FALSE(Wad::applyPatch(bogus_path, patch_path, output_path));
+        ASSERT_EQ(access(output_path.c_str(), F_OK), -1);
+        ASSERT_FALSE(Wad::diff(bogus_path, target_path, "./testfiles/patch_bogus.wadp"));
+        ASSERT_EQ(access("./testfiles/patch_bogus.wadp", F_OK), -1);
+        remove(bogus_path.c_str());
+
+        //In place
+        ASSERT_TRUE(Wad::applyPatch(source_path, patch_path, source_path));
+        Wad* testWad = Wad::loadWad(source_path);
+        ASSERT_EQ(testWad->getSize("/E1M1/DATA"), static_cast<int>(changed.size()));
+        ASSERT_FALSE(testWad->isContent("/E1M1/GONE"));
+        delete testWad;
+
+        for (const std::string &path : {source_path, target_path, patch_path})
+                remove(path.c_str());
+}
+
+TEST(LibCompressTests, lzTest1){
+        //Round trips for empty, incompressible, repetitive and overlapping-match input
+        std::vector<std::vector<char>> inputs(4);
+        for (int i = 0; i < 5000; i++)
+                inputs[1].push_back(static_cast<char>((i * 2654435761u) >> 13));
+        for (int i = 0; i < 60000; i++)
+                inputs[2].push_back("THINGS LINEDEFS SIDEDEFS "[i % 25]);
+        inputs[3].assign(70000, 'a');
+
+        for (const std::vector<char> &in : inputs) {
+                std::vector<char> packed(lzBound(in.size()));
+                size_t n = lzCompress(in.data(), in.size(), packed.data());
+                ASSERT_LE(n, packed.size());
+                std::vector<char> out(in.size());
+                ASSERT_TRUE(lzDecompress(packed.data(), n, out.data(), out.size()));
+                ASSERT_EQ(out, in);
+                //a truncated stream is refused
+                if (n > 1) {
+                        ASSERT_FALSE(lzDecompress(packed.data(), n - 1, out.data(), out.size()));
+                }
+        }
+}
+
+TEST(LibCompressTests, containerTest1){
+        //A map, a text lump spanning several blocks and an incompressible one
+        std::vector<TestLump> lumps = squareRoomMap("E1M1");
+        std::vector<char> text, noise;
+        for (int i = 0; i < 200000; i++)
+                text.push_back("the quick brown fox jumps over the lazy dog\n"[i % 44] ^ (i / 9973 & 1));
+        for (int i = 0; i < 10000; i++)
+                noise.push_back(static_cast<char>((i * 2654435761u) >> 11));
+        lumps.push_back({"TEXT", text});
+        lumps.push_back({"NOISE", noise});
+        std::string wad_path = writeTestWad("./testfiles/container.wad", lumps);
+
+        auto readFile = [](const std::string &path) {
+                std::ifstream in(path, std::ios::binary);
+                return std::vector<char>((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        };
+        std::vector<char> raw = readFile(wad_path);
+
+        Wad* testWad = Wad::loadWad(wad_path);
+        ASSERT_FALSE(testWad->isCompressed());
+        testWad->setCompressed(true);
+        delete testWad;
+
+        std::vector<char> packed = readFile(wad_path);
+        ASSERT_EQ(std::string(packed.data(), 4), "WADZ");
+        ASSERT_LT(packed.size(), raw.size() / 4);
+
+        //Reads anywhere, across block boundaries included
+        testWad = Wad::loadWad(wad_path);
+        ASSERT_TRUE(testWad->isCompressed());
+        ASSERT_EQ(testWad->getMagic(), "PWAD");
+        ASSERT_TRUE(testWad->isDirectory("/E1M1"));
+        ASSERT_EQ(testWad->getSize("/E1M1/TEXT"), static_cast<int>(text.size()));
+        for (int offset : {0, 1, 65535, 65536, 131000, 199990}) {
+                char buffer[3000];
+                int got = testWad->getContents("/E1M1/TEXT", buffer, sizeof(buffer), offset);
+                int expected = std::min<int>(sizeof(buffer), text.size() - offset);
+                ASSERT_EQ(got, expected);
+                ASSERT_EQ(memcmp(buffer, text.data() + offset, got), 0);
+        }
+        std::vector<char> whole(noise.size());
+        std::vector<Wad::ReadRequest> requests;
+        requests.push_back({"/E1M1/NOISE", whole.data(), static_cast<int>(whole.size()), 0, 0});
+        ASSERT_EQ(testWad->readv(requests), 1);
+        ASSERT_EQ(whole, noise);
+
+        MapView map = testWad->mapView("/E1M1");
+        ASSERT_TRUE(map.valid());
+        ASSERT_EQ(map.linedefs().size(), 4);
+        delete testWad;
+
+        //Left alone when nothing changed
+        ASSERT_EQ(readFile(wad_path), packed);
+
+        //And back to the plain layout, byte for byte
+        testWad = Wad::loadWad(wad_path);
+        testWad->setCompressed(false);
+        delete testWad;
+        ASSERT_EQ(readFile(wad_path), raw);
+
+        remove(wad_path.c_str());
+}
+
+TEST(LibCompressTests, containerTest2){
+        //Empty map lumps stay present in a container
+        std::vector<TestLump> lumps = squareRoomMap("E1M1");
+        std::string wad_path = writeTestWad("./testfiles/container_bounds.wad", lumps);
+        Wad* testWad = Wad::loadWad(wad_path);
+        testWad->setCompressed(true);
+        delete testWad;
+
+        auto readFile = [](const std::string &path) {
+                std::ifstream in(path, std::ios::binary);
+                return std::vector<char>((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        };
+        auto writeFile = [](const std::string &path, const std::vector<char> &bytes) {
+                std::ofstream out(path, std::ios::binary | std::ios::trunc);
+                out.write(bytes.data(), bytes.size());
+        };
+        std::vector<char> packed = readFile(wad_path);
+        ASSERT_EQ(std::string(packed.data(), 4), "WADZ");
+
+        Wad::LoadOptions cached;
+        cached.cacheBytes = 1 << 20;
+        for (const Wad::LoadOptions &options : {Wad::LoadOptions(), cached}) {
+                testWad = Wad::loadWad(wad_path, options);
+                MapView map = testWad->mapView("/E1M1");
+                ASSERT_TRUE(map.has(MapView::Segs));
+                ASSERT_TRUE(map.has(MapView::Things));
+                delete testWad;
+        }
+
+        //Counts the file cannot hold fail cleanly instead of allocating them
+        std::vector<char> bogus = packed;
+        uint32_t huge = 0xFFFFFFFFu;
+        memcpy(bogus.data() + 12, &huge, 4);
+        memcpy(bogus.data() + 20, &huge, 4);
+        writeFile(wad_path, bogus);
+        testWad = Wad::loadWad(wad_path);
+        if (testWad) {
+                std::vector<std::string> entries;
+                testWad->getDirectory("/", &entries);
+                ASSERT_TRUE(entries.empty());
+                delete testWad;
+        }
+
+        //A block stored past the index ends the directory before its lump
+        bogus = packed;
+        uint32_t lumpCount;
+        uint64_t indexOffset;
+        memcpy(&lumpCount, bogus.data() + 12, 4);
+        memcpy(&indexOffset, bogus.data() + 24, 8);
+        uint64_t far = bogus.size();
+        memcpy(bogus.data() + indexOffset + static_cast<size_t>(lumpCount) * 28, &far, 8);
+        writeFile(wad_path, bogus);
+        testWad = Wad::loadWad(wad_path);
+        ASSERT_NE(testWad, nullptr);
+        ASSERT_FALSE(testWad->isContent("/E1M1/THINGS"));
+        delete testWad;
+
+        remove(wad_path.c_str());
+}
+
+// Every path in the tree with its size (-1 for directories) and first bytes
+static std::string describeTree(Wad* wad, const std::string &path = "/"){
+        std::string out;
+        std::vector<std::string> entries;
+        wad->getDirectory(path, &entries);
+        for (const std::string &entry : entries) {
+                std::string child = (path == "/" ? "/" : path + "/") + entry;
+                if (wad->isDirectory(child)) {
+                        out += child + " -1\n" + describeTree(wad, child);
+                        continue;
+                }
+                char head[8] = {};
+                int got = wad->getContents(child, head, sizeof(head));
+                out += child + " " + std::to_string(wad->getSize(child)) + " " +
+                       std::string(head, std::max(got, 0)) + "\n";
+        }
+        return out;
+}
+
+TEST(LibIndexTests, indexCacheTest1){
+        std::vector<TestLump> lumps = squareRoomMap("E1M1");
+        lumps.push_back({"F_START", {}});
+        lumps.push_back({"FLAT1", std::vector<char>(4096, 'f')});
+        lumps.push_back({"F_END", {}});
+        lumps.push_back({"DATA", {'d', 'a', 't', 'a'}});
+        std::string wad_path = writeTestWad("./testfiles/indexed.wad", lumps);
+        std::string index_path = wad_path + ".index";
+        remove(index_path.c_str());
+
+        auto readFile = [](const std::string &path) {
+                std::ifstream in(path, std::ios::binary);
+                return std::vector<char>((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        };
+
+        Wad::LoadOptions cached;
+        cached.indexCache = true;
+
+        Wad* testWad = Wad::loadWad(wad_path);
+        std::string expected = describeTree(testWad);
+        delete testWad;
+        ASSERT_EQ(access(index_path.c_str(), F_OK), -1);
+
+        //The first cached open writes the image; closing re-stamps it
+        testWad = Wad::loadWad(wad_path, cached);
+        ASSERT_EQ(describeTree(testWad), expected);
+        delete testWad;
+        std::vector<char> image = readFile(index_path);
+        ASSERT_GT(image.size(), 48u);
+
+        //Later opens build the same tree from it
+        testWad = Wad::loadWad(wad_path, cached);
+        ASSERT_EQ(describeTree(testWad), expected);
+        ASSERT_TRUE(testWad->mapView("/E1M1").valid());
+        delete testWad;
+        ASSERT_TRUE(std::equal(image.begin() + 48, image.end(), readFile(index_path).begin() + 48));
+
+        //A damaged image is ignored and replaced
+        std::vector<char> damaged = image;
+        damaged[60] ^= 0x40;
+        FILE *f = fopen(index_path.c_str(), "r+b");
+        fwrite(damaged.data(), 1, damaged.size(), f);
+        fclose(f);
+        testWad = Wad::loadWad(wad_path, cached);
+        ASSERT_EQ(describeTree(testWad), expected);
+        delete testWad;
+        ASSERT_TRUE(std::equal(image.begin() + 48, image.end(), readFile(index_path).begin() + 48));
+
+        //So is one the WAD has moved on from
+        testWad = Wad::loadWad(wad_path, cached);
+        testWad->createFile("/NEWLUMP");
+        testWad->writeToFile("/NEWLUMP", "new", 3);
+        delete testWad;
+        testWad = Wad::loadWad(wad_path, cached);
+        ASSERT_EQ(describeTree(testWad), expected + "/NEWLUMP 3 new\n");
+        delete testWad;
+        testWad = Wad::loadWad(wad_path, cached);
+        ASSERT_EQ(describeTree(testWad), expected + "/NEWLUMP 3 new\n");
+        delete testWad;
+
+        remove(wad_path.c_str());
+        remove(index_path.c_str());
+}
+
+TEST(LibSharedTests, sharedTest1){
+        std::vector<TestLump> lumps = squareRoomMap("E1M1");
+        lumps.push_back({"DATA", std::vector<char>(100000, 'd')});
+        lumps.push_back({"F_START", {}});
+        lumps.push_back({"F_END", {}});
+        std::string wad_path = writeTestWad("./testfiles/shared.wad", lumps);
+        std::string region = "/libwad-test-" + std::to_string(getpid());
+        Wad::releaseShared(region);
+
+        auto readFile = [](const std::string &path) {
+                std::ifstream in(path, std::ios::binary);
+                return std::vector<char>((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        };
+        std::vector<char> raw = readFile(wad_path);
+
+        Wad* testWad = Wad::loadWad(wad_path);
+        std::string expected = describeTree(testWad);
+        delete testWad;
+
+        Wad::LoadOptions shared;
+        shared.shared = region;
+
+        //The first open publishes, the second attaches; both see the same tree
+        Wad* publisher = Wad::loadWad(wad_path, shared);
+        int fd = shm_open(region.c_str(), O_RDONLY, 0);
+        ASSERT_GE(fd, 0);
+        close(fd);
+        Wad* attached = Wad::loadWad(wad_path, shared);
+        for (Wad* wad : {publisher, attached}) {
+                ASSERT_TRUE(wad->isReadOnly());
+                ASSERT_EQ(wad->getMagic(), "PWAD");
+                ASSERT_EQ(describeTree(wad), expected);
+                MapView map = wad->mapView("/E1M1");
+                ASSERT_TRUE(map.valid());
+                ASSERT_EQ(map.vertexes().size(), 4);
+        }
+
+        //Lumps are read in place, and changes are refused
+        std::vector<Wad::ReadRequest> requests;
+        char tail[16];
+        requests.push_back({"/E1M1/DATA", tail, sizeof(tail), 99990, 0});
+        ASSERT_EQ(attached->readv(requests), 1);
+        ASSERT_EQ(requests[0].result, 10);
+        ASSERT_EQ(attached->truncateFile("/E1M1/DATA"), -1);
+        attached->createFile("/NEWLUMP");
+        ASSERT_FALSE(attached->isContent("/NEWLUMP"));
+        delete attached;
+        delete publisher;
+        ASSERT_EQ(readFile(wad_path), raw);
+
+        //A changed WAD is published again
+        testWad = Wad::loadWad(wad_path);
+        testWad->createFile("/NEWLUMP");
+        testWad->writeToFile("/NEWLUMP", "new", 3);
+        delete testWad;
+        attached = Wad::loadWad(wad_path, shared);
+        ASSERT_EQ(describeTree(attached), expected + "/NEWLUMP 3 new\n");
+        delete attached;
+
+        ASSERT_TRUE(Wad::releaseShared(region));
+        ASSERT_FALSE(Wad::releaseShared(region));
+        remove(wad_path.c_str());
+}
+
+TEST(LibLargeTests, extendedHeaderTest1){
+        std::vector<TestLump> lumps = squareRoomMap("E1M1");
+        lumps.push_back({"F_START", {}});
+        lumps.push_back({"DATA", {'d', 'a', 't', 'a'}});
+        lumps.push_back({"F_END", {}});
+        std::string wad_path = writeTestWad("./testfiles/extended.wad", lumps);
+
+        auto readFile = [](const std::string &path) {
+                std::ifstream in(path, std::ios::binary);
+                return std::vector<char>((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        };
+        std::vector<char> raw = readFile(wad_path);
+
+        Wad* testWad = Wad::loadWad(wad_path);
+        std::string expected = describeTree(testWad);
+        ASSERT_FALSE(testWad->isExtended());
+        testWad->setExtended(true);
+        delete testWad;
+
+        std::vector<char> wide = readFile(wad_path);
+        ASSERT_EQ(std::string(wide.data(), 4), "WADX");
+        ASSERT_EQ(std::string(wide.data() + 8, 4), "PWAD");
+
+        //The standalone readers take the extended header; patches refuse it
+        std::vector<Wad::Issue> issues;
+        ASSERT_TRUE(Wad::validate(wad_path, &issues, 1));
+        ASSERT_TRUE(issues.empty());
+        WadDigest digest;
+        ASSERT_TRUE(digestWad(wad_path, &digest, 1));
+        ASSERT_EQ(digest.lumps.size(), lumps.size());
+        ASSERT_EQ(digest.lumps[lumps.size() - 2].name.str(), "DATA");
+        ASSERT_EQ(digest.lumps[lumps.size() - 2].xxh64, xxh64("data", 4));
+        ASSERT_FALSE(Wad::diff(wad_path, wad_path, "./testfiles/extended.wadp"));
+        ASSERT_EQ(access("./testfiles/extended.wadp", F_OK), -1);
+
+        //A container is refused by name rather than misread
+        std::string packed_path = writeTestWad("./testfiles/extended_packed.wad", lumps);
+        testWad = Wad::loadWad(packed_path);
+        testWad->setCompressed(true);
+        delete testWad;
+        issues.clear();
+        ASSERT_FALSE(Wad::validate(packed_path, &issues, 1));
+        ASSERT_EQ(issues.size(), 1u);
+        ASSERT_NE(issues[0].message.find("unsupported format: WADZ"), std::string::npos);
+        ASSERT_FALSE(digestWad(packed_path, &digest, 1));
+        remove(packed_path.c_str());
+
+        //Extended counts the file cannot hold fail cleanly, overflowing ones too;
+        //loadWad() reads them as a short table
+        std::string bogus_path = "./testfiles/extended_bogus.wad";
+        for (uint64_t count : {uint64_t(1) << 40, UINT64_MAX / 24 + 1, UINT64_MAX}) {
+                std::vector<char> bogus = wide;
+                memcpy(bogus.data() + 16, &count, 8);
+                std::ofstream(bogus_path, std::ios::binary | std::ios::trunc).write(bogus.data(), bogus.size());
+                issues.clear();
+                ASSERT_FALSE(Wad::validate(bogus_path, &issues, 1));
+                ASSERT_FALSE(issues.empty());
+                ASSERT_FALSE(digestWad(bogus_path, &digest, 1));
+                ASSERT_FALSE(digestWad(bogus_path, &digest, 2));
+                ASSERT_FALSE(Wad::diff(bogus_path, bogus_path, "./testfiles/extended.wadp"));
+                ASSERT_EQ(access("./testfiles/extended.wadp", F_OK), -1);
+                testWad = Wad::loadWad(bogus_path);
+                ASSERT_NE(testWad, nullptr);
+                ASSERT_EQ(describeTree(testWad), expected);
+                delete testWad;
+        }
+        remove(bogus_path.c_str());
+
+        testWad = Wad::loadWad(wad_path);
+        ASSERT_TRUE(testWad->isExtended());
+        ASSERT_EQ(testWad->getMagic(), "PWAD");
+        ASSERT_EQ(describeTree(testWad), expected);
+        ASSERT_TRUE(testWad->mapView("/E1M1").valid());
+        testWad->setExtended(false);
+        delete testWad;
+        ASSERT_EQ(readFile(wad_path), raw);
+
+        //A lump past 4 GB, in a sparse file
+        const uint64_t far = (5ULL << 30) + 3;
+        std::vector<char> header(32, 0), entry(24, 0);
+        uint32_t version = 1;
+        uint64_t count = 1, table = far + 16, length = 16;
+        memcpy(header.data(), "WADX", 4);
+        memcpy(header.data() + 4, &version, 4);
+        memcpy(header.data() + 8, "PWAD", 4);
+        memcpy(header.data() + 16, &count, 8);
+        memcpy(header.data() + 24, &table, 8);
+        memcpy(entry.data(), &far, 8);
+        memcpy(entry.data() + 8, &length, 8);
+        memcpy(entry.data() + 16, "FAR", 3);
+        int fd = ::open(wad_path.c_str(), O_WRONLY | O_TRUNC);
+        ASSERT_EQ(pwrite(fd, header.data(), header.size(), 0), 32);
+        ASSERT_EQ(pwrite(fd, "0123456789abcdef", 16, far), 16);
+        ASSERT_EQ(pwrite(fd, entry.data(), entry.size(), table), 24);
+        close(fd);
+
+        testWad = Wad::loadWad(wad_path);
+        ASSERT_EQ(testWad->getSize("/FAR"), 16);
+        char buffer[8];
+        ASSERT_EQ(testWad->getContents("/FAR", buffer, 8, 10), 6);
+        ASSERT_EQ(std::string(buffer, 6), "abcdef");
+        delete testWad;
+        issues.clear();
+        ASSERT_TRUE(Wad::validate(wad_path, &issues, 1));
+
+        //Saved compactly, and still extended
+        ASSERT_LT(readFile(wad_path).size(), 100u);
+        testWad = Wad::loadWad(wad_path);
+        ASSERT_TRUE(testWad->isExtended());
+        ASSERT_EQ(testWad->getContents("/FAR", buffer, 8, 0), 8);
+        ASSERT_EQ(std::string(buffer, 8), "01234567");
+        delete testWad;
+
+        remove(wad_path.c_str());
+}
+
+TEST(LibPrefetchTests, lazyLoadTest1){
+        std::vector<TestLump> lumps = squareRoomMap("E1M1");
+        lumps.push_back({"F_START", {}});
+        lumps.push_back({"FLAT1", std::vector<char>(4096, 'f')});
+        lumps.push_back({"FLAT2", std::vector<char>(4096, 'g')});
+        lumps.push_back({"F_END", {}});
+        lumps.push_back({"DATA", {'d', 'a', 't', 'a'}});
+        std::string wad_path = writeTestWad("./testfiles/lazy.wad", lumps);
+
+        Wad* testWad = Wad::loadWad(wad_path);
+        std::string expected = describeTree(testWad);
+        delete testWad;
+
+        for (bool prefetch : {true, false}) {
+                Wad::LoadOptions options;
+                options.lazy = true;
+                options.prefetch = prefetch;
+
+                //Lumps are read on first use, whether or not readahead is asked for
+                testWad = Wad::loadWad(wad_path, options);
+                ASSERT_EQ(describeTree(testWad), expected);
+                MapView map = testWad->mapView("/E1M1");
+                ASSERT_TRUE(map.valid());
+                ASSERT_EQ(map.things().size(), 1);
+
+                char first[4], second[4];
+                std::vector<Wad::ReadRequest> requests = {
+                        {"/F/FLAT2", second, 4, 100, 0},
+                        {"/F/FLAT1", first, 4, 0, 0},
+                };
+                ASSERT_EQ(testWad->readv(requests), 2);
+                ASSERT_EQ(std::string(first, 4), "ffff");
+                ASSERT_EQ(std::string(second, 4), "gggg");
+
+                //A save keeps the lumps that were never read
+                testWad->createFile("/NEWLUMP");
+                delete testWad;
+
+                testWad = Wad::loadWad(wad_path, options);
+                ASSERT_TRUE(testWad->isContent("/NEWLUMP"));
+                char data[4];
+                ASSERT_EQ(testWad->getContents("/DATA", data, 4), 4);
+                ASSERT_EQ(std::string(data, 4), "data");
+                ASSERT_EQ(testWad->getContents("/F/FLAT2", data, 4, 4092), 4);
+                ASSERT_EQ(std::string(data, 4), "gggg");
+                delete testWad;
+
+                writeTestWad(wad_path, lumps);
+        }
+
+        remove(wad_path.c_str());
+}
+
+TEST(LibCacheTests, lumpCacheTest1){
+        std::vector<TestLump> lumps = {{"PLAYPAL", std::vector<char>(4096, 'p')}};
+        for (const TestLump &lump : squareRoomMap("E1M1")) lumps.push_back(lump);
+        lumps.push_back({"F_START", {}});
+        for (int i = 0; i < 12; i++)
+                lumps.push_back({"FLAT" + std::to_string(10 + i), std::vector<char>(4096, static_cast<char>('a' + i))});
+        lumps.push_back({"F_END", {}});
+        std::string wad_path = writeTestWad("./testfiles/cached.wad", lumps);
+
+        Wad::LoadOptions options;
+        options.cacheBytes = 8 * 4096;
+        Wad* testWad = Wad::loadWad(wad_path, options);
+
+        auto readFlat = [&](int i) {
+                std::vector<char> bytes;
+                Wad::LumpHandle handle = testWad->open("/F/FLAT" + std::to_string(10 + i));
+                return testWad->readAll(handle, &bytes) && bytes == std::vector<char>(4096, static_cast<char>('a' + i));
+        };
+
+        char palette[4];
+        ASSERT_EQ(testWad->getContents("/PLAYPAL", palette, 4), 4);
+
+        //Two lumps read twice, then a scan of the rest read once
+        for (int pass = 0; pass < 2; pass++) {
+                ASSERT_TRUE(readFlat(0));
+                ASSERT_TRUE(readFlat(1));
+        }
+        for (int i = 2; i < 12; i++)
+                ASSERT_TRUE(readFlat(i));
+
+        Wad::CacheStats stats = testWad->cacheStats();
+        ASSERT_LE(stats.bytes, options.cacheBytes);
+        ASSERT_EQ(stats.pinnedBytes, 4096u);
+        ASSERT_GT(stats.evictions, 0u);
+        ASSERT_EQ(stats.misses, 13u);
+
+        //The scan did not push out the lumps that were reused
+        ASSERT_TRUE(readFlat(0));
+        ASSERT_TRUE(readFlat(1));
+        ASSERT_EQ(testWad->cacheStats().misses, stats.misses);
+        ASSERT_EQ(testWad->cacheStats().hits, stats.hits + 2);
+        ASSERT_TRUE(readFlat(2));
+        ASSERT_EQ(testWad->cacheStats().misses, stats.misses + 1);
+
+        bool pinned = false, reused = false;
+        for (const Wad::CacheEntry &entry : testWad->cacheEntries()) {
+                if (entry.handle == testWad->open("/PLAYPAL")) pinned = entry.pinned;
+                if (entry.handle == testWad->open("/F/FLAT10")) reused = entry.hot && entry.hits == 2;
+        }
+        ASSERT_TRUE(pinned);
+        ASSERT_TRUE(reused);
+
+        //A map view's lumps stay put
+        ASSERT_TRUE(testWad->mapView("/E1M1").valid());
+        ASSERT_GT(testWad->cacheStats().pinnedBytes, 4096u);
+        delete testWad;
+
+        //Evicted lumps were saved from the file
+        testWad = Wad::loadWad(wad_path);
+        for (int i = 0; i < 12; i++)
+                ASSERT_TRUE(readFlat(i));
+        delete testWad;
+
+        remove(wad_path.c_str());
+}
+
+TEST(LibPathTests, concurrentLookupTest1){
+        std::vector<TestLump> lumps = squareRoomMap("E1M1");
+        lumps.push_back({"F_START", {}});
+        lumps.push_back({"FLAT1", std::vector<char>(64, 'f')});
+        lumps.push_back({"F_END", {}});
+        std::string wad_path = writeTestWad("./testfiles/paths.wad", lumps);
+
+        Wad* testWad = Wad::loadWad(wad_path);
+        const std::vector<std::string> existing = {"/", "/E1M1", "/E1M1/THINGS", "/F", "/F/FLAT1", "/F/"};
+
+        //Lookups of existing paths keep finding them while paths are added
+        std::atomic<bool> done(false);
+        std::atomic<int> missed(0);
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 3; t++) {
+                readers.emplace_back([&]() {
+                        while (!done) {
+                                for (const std::string &path : existing)
+                                        if (!testWad->isContent(path) && !testWad->isDirectory(path)) missed++;
+                                if (testWad->findLump("flat1") == Wad::InvalidHandle) missed++;
+                        }
+                });
+        }
+        testWad->createDirectory("/NW");
+        for (int i = 0; i < 2000; i++)
+                testWad->createFile("/NW/L" + std::to_string(1000 + i));
+        done = true;
+        for (std::thread &reader : readers) reader.join();
+
+        ASSERT_EQ(missed, 0);
+        for (int i = 0; i < 2000; i++)
+                ASSERT_TRUE(testWad->isContent("/NW/L" + std::to_string(1000 + i)));
+        ASSERT_FALSE(testWad->isContent("/NW/L3000"));
+        ASSERT_EQ(testWad->findLump("L2999"), testWad->open("/NW/L2999"));
+        delete testWad;
+
+        remove(wad_path.c_str());
+}
+
+TEST(LibFormatTests, formatTest1){
+        //DOOM II: MAP## markers group their lumps, E#M# is just a lump
+        std::vector<TestLump> lumps = squareRoomMap("MAP01");
+        lumps.push_back({"F_START", {}});
+        lumps.push_back({"E1M1", std::vector<char>(64, 'f')});
+        lumps.push_back({"F_END", {}});
+        std::string wad_path = writeTestWad("./testfiles/format.wad", lumps);
+
+        Wad* testWad = Wad::loadWad(wad_path);
+        ASSERT_EQ(testWad->getFormat(), GameFormat::Doom2);
+        ASSERT_TRUE(testWad->isDirectory("/MAP01"));
+        ASSERT_TRUE(testWad->isContent("/MAP01/BLOCKMAP"));
+        ASSERT_TRUE(testWad->isContent("/F/E1M1"));
+        ASSERT_TRUE(testWad->mapView("/MAP01").valid());
+        delete testWad;
+
+        std::vector<Wad::Issue> issues;
+        ASSERT_TRUE(Wad::validate(wad_path, &issues));
+        ASSERT_TRUE(issues.empty());
+
+        //Told it is DOOM, MAP01 stays a plain lump
+        Wad::LoadOptions options;
+        options.format = GameFormat::Doom;
+        testWad = Wad::loadWad(wad_path, options);
+        ASSERT_EQ(testWad->getFormat(), GameFormat::Doom);
+        ASSERT_TRUE(testWad->isContent("/MAP01"));
+        ASSERT_TRUE(testWad->isContent("/THINGS"));
+        delete testWad;
+
+        //Hexen: a BEHAVIOR lump after the map lumps belongs to the map
+        lumps = squareRoomMap("MAP01");
+        lumps.push_back({"BEHAVIOR", std::vector<char>(16, 'b')});
+        lumps.push_back({"F_START", {}});
+        lumps.push_back({"FLAT1", std::vector<char>(64, 'f')});
+        lumps.push_back({"F_END", {}});
+        writeTestWad(wad_path, lumps);
+
+        testWad = Wad::loadWad(wad_path);
+        ASSERT_EQ(testWad->getFormat(), GameFormat::Hexen);
+        ASSERT_TRUE(testWad->isContent("/MAP01/BEHAVIOR"));
+        ASSERT_FALSE(testWad->mapView("/MAP01").valid());
+        delete testWad;
+        ASSERT_TRUE(Wad::validate(wad_path, &issues));
+        ASSERT_TRUE(issues.empty());
+
+        //F_END closes a PWAD's FF_START, not the namespace around it
+        lumps = squareRoomMap("E1M1");
+        lumps.push_back({"AA_START", {}});
+        lumps.push_back({"FF_START", {}});
+        lumps.push_back({"FLAT1", std::vector<char>(64, 'f')});
+        lumps.push_back({"F_END", {}});
+        lumps.push_back({"DATA", std::vector<char>(8, 'd')});
+        lumps.push_back({"AA_END", {}});
+        writeTestWad(wad_path, lumps);
+
+        testWad = Wad::loadWad(wad_path);
+        ASSERT_EQ(testWad->getFormat(), GameFormat::Doom);
+        ASSERT_TRUE(testWad->isContent("/AA/FF/FLAT1"));
+        ASSERT_TRUE(testWad->isContent("/AA/DATA"));
+        delete testWad;
+        ASSERT_TRUE(Wad::validate(wad_path, &issues));
+        ASSERT_TRUE(issues.empty());
+
+        remove(wad_path.c_str());
+}
+
+TEST(LibSearchTests, kernelTest1){
+        //Every available kernel finds what the scalar loop finds, overlapping
+        //matches, block tails and folded case included
+        std::string data(5000 + 7, '.');
+        for (size_t i = 0; i < data.size(); i++)
+                data[i] = "abcdefgh ACS_"[(i * 7 + (i >> 4)) % 13];
+        for (size_t at : {0, 28, 40, 1000, 4095, 5000})
+                data.replace(at, 7, "Script1");
+        const std::vector<std::string> patterns = {"script1", "cs_", "aaa", "h", "", "ab"};
+
+        for (bool ignoreCase : {false, true}) {
+                std::vector<PatternMatch> expected;
+                PatternMatcher(patterns, ignoreCase, SearchKernel::Scalar).scan(data.data(), data.size(), &expected);
+                ASSERT_FALSE(expected.empty());
+                for (SearchKernel k : {SearchKernel::Sse2, SearchKernel::Avx2, SearchKernel::Best}) {
+                        if (!searchKernelSupported(k)) continue;
+                        std::vector<PatternMatch> got;
+                        PatternMatcher(patterns, ignoreCase, k).scan(data.data(), data.size(), &got);
+                        ASSERT_EQ(got.size(), expected.size());
+                        for (size_t i = 0; i < got.size(); i++) {
+                                ASSERT_EQ(got[i].offset, expected[i].offset);
+                                ASSERT_EQ(got[i].pattern, expected[i].pattern);
+                        }
+                }
+        }
+
+        std::vector<PatternMatch> found;
+        PatternMatcher({"Script1"}).scan(data.data(), data.size(), &found);
+        ASSERT_EQ(found.size(), 6u);
+        ASSERT_EQ(found[5].offset, 5000u);
+
+        //Overlapping matches, and only those starting before `starts`
+        found.clear();
+        PatternMatcher({"aa"}).scan("aaaa", 4, 2, &found);
+        ASSERT_EQ(found.size(), 2u);
+        ASSERT_EQ(found[1].offset, 1u);
+}
+
+TEST(LibSearchTests, searchTest1){
+        //A big lump is scanned in pieces; matches across their seams count once
+        std::vector<char> big(3 << 20, 'x');
+        const std::string needle = "ACS_Execute";
+        const std::vector<uint64_t> placed = {5, (1 << 20) - 4, 2 << 20, (3 << 20) - 11};
+        for (uint64_t at : placed)
+                std::copy(needle.begin(), needle.end(), big.begin() + at);
+        std::string text = "[map01]\nacs_execute 1\n";
+
+        std::vector<TestLump> lumps = squareRoomMap("E1M1");
+        lumps.push_back({"F_START", {}});
+        lumps.push_back({"SCRIPTS", std::vector<char>(text.begin(), text.end())});
+        lumps.push_back({"BIG", big});
+        lumps.push_back({"F_END", {}});
+        std::string plain = writeTestWad("./testfiles/search.wad", lumps);
+        std::string packed = writeTestWad("./testfiles/search_packed.wad", lumps);
+        Wad* testWad = Wad::loadWad(packed);
+        testWad->setCompressed(true);
+        delete testWad;
+
+        std::vector<std::string> files = {plain, "./testfiles/cake.jpg", packed};
+        std::vector<Wad::SearchHit> hits;
+        std::vector<uint32_t> unreadable;
+        Wad::SearchOptions options;
+        options.threads = 3;
+        ASSERT_FALSE(Wad::search(files, {needle}, options, &hits, &unreadable));
+        ASSERT_EQ(unreadable, std::vector<uint32_t>{1});
+
+        //The same hits from the plain WAD and the container, in file order
+        ASSERT_EQ(hits.size(), 2 * placed.size());
+        for (size_t i = 0; i < hits.size(); i++) {
+                ASSERT_EQ(hits[i].file, i < placed.size() ? 0u : 2u);
+                ASSERT_EQ(hits[i].path, "/F/BIG");
+                ASSERT_EQ(hits[i].offset, placed[i % placed.size()]);
+                ASSERT_EQ(hits[i].pattern, 0u);
+        }
+
+        //Several patterns, ignoring case; a lump's hits follow directory order
+        hits.clear();
+        options.ignoreCase = true;
+        ASSERT_TRUE(Wad::search({plain}, {"[MAP01]", needle}, options, &hits));
+        ASSERT_EQ(hits.size(), 2 + placed.size());
+        ASSERT_EQ(hits[0].path, "/F/SCRIPTS");
+        ASSERT_EQ(hits[0].pattern, 0u);
+        ASSERT_EQ(hits[1].path, "/F/SCRIPTS");
+        ASSERT_EQ(hits[1].offset, 8u);
+        ASSERT_EQ(hits[2].path, "/F/BIG");
+
+        //A packed block that no longer decodes marks its file unreadable,
+        //while the rest of the file is still searched
+        std::vector<char> bytes;
+        {
+                std::ifstream in(packed, std::ios::binary);
+                bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        }
+        uint32_t lumpCount, blockCount, block = UINT32_MAX;
+        uint64_t indexOffset, blockOffset;
+        uint32_t blockSize;
+        memcpy(&lumpCount, bytes.data() + 12, 4);
+        memcpy(&blockCount, bytes.data() + 20, 4);
+        memcpy(&indexOffset, bytes.data() + 24, 8);
+        for (uint32_t i = 0; i < lumpCount; i++) {
+                const char *entry = bytes.data() + indexOffset + i * 28;
+                if (strncmp(entry + 16, "BIG", 8) == 0) memcpy(&block, entry + 24, 4);
+        }
+        ASSERT_LT(block, blockCount);
+        const char *blockEntry = bytes.data() + indexOffset + lumpCount * 28 + block * 12;
+        memcpy(&blockOffset, blockEntry, 8);
+        memcpy(&blockSize, blockEntry + 8, 4);
+        std::fill(bytes.begin() + blockOffset, bytes.begin() + blockOffset + blockSize, 0);
+        {
+                std::ofstream out(packed, std::ios::binary | std::ios::trunc);
+                out.write(bytes.data(), bytes.size());
+        }
+        hits.clear();
+        unreadable.clear();
+        options.ignoreCase = false;
+        ASSERT_FALSE(Wad::search({plain, packed}, {needle}, options, &hits, &unreadable));
+        ASSERT_EQ(unreadable, std::vector<uint32_t>{1});
+        //the first piece read, the first megabyte, is lost with its two hits
+        ASSERT_EQ(hits.size(), placed.size() + 2);
+        for (size_t i = placed.size(); i < hits.size(); i++) {
+                ASSERT_EQ(hits[i].file, 1u);
+                ASSERT_EQ(hits[i].offset, placed[i - 2]);
+        }
+
+        remove(plain.c_str());
+        remove(packed.c_str());
+}
+
+TEST(LibCorpusTests, corpusTest1){
+        //Names, words and thing types, each with the files and places they occur
+        std::string text = "[Map01]\nmusic = D_RUNNIN\nsky = SKY1\n";
+        std::vector<TestLump> first = squareRoomMap("E1M1");
+        first.push_back({"F_START", {}});
+        first.push_back({"MAPINFO", std::vector<char>(text.begin(), text.end())});
+        first.push_back({"F_END", {}});
+        first.push_back({"STBAR", std::vector<char>(64, '\x01')});
+        std::vector<TestLump> second = squareRoomMap("MAP01");
+        for (int v : {64, 64, 0, 3004, 7}) putShort(second[1].bytes, v);
+        std::string one = writeTestWad("./testfiles/corpus1.wad", first);
+        std::string two = writeTestWad("./testfiles/corpus2.wad", second);
+        std::string indexPath = "./testfiles/corpus.idx";
+        remove(indexPath.c_str());
+
+        CorpusIndex::UpdateStats stats;
+        ASSERT_TRUE(CorpusIndex::update(indexPath, {one, "./testfiles/cake.jpg", two}, 2, &stats));
+        ASSERT_EQ(stats.indexed, 2u);
+        ASSERT_EQ(stats.failed, 1u);
+        CorpusIndex* index = CorpusIndex::open(indexPath);
+        ASSERT_NE(index, nullptr);
+        ASSERT_EQ(index->fileCount(), 2u);
+        ASSERT_EQ(index->path(1), two);
+
+        std::vector<CorpusIndex::Hit> hits = index->findName("stbar");
+        ASSERT_EQ(hits.size(), 1u);
+        ASSERT_EQ(hits[0].file, 0u);
+        ASSERT_EQ(hits[0].where.str(), "");
+        hits = index->findName("THINGS");
+        ASSERT_EQ(hits.size(), 2u);
+        ASSERT_EQ(hits[0].where.str(), "E1M1");
+        ASSERT_EQ(hits[1].where.str(), "MAP01");
+        hits = index->findWord("d_runnin");
+        ASSERT_EQ(hits.size(), 1u);
+        ASSERT_EQ(hits[0].where.str(), "MAPINFO");
+        ASSERT_EQ(index->findWord("SKY1").size(), 1u);
+        ASSERT_TRUE(index->findWord("runnin").empty());
+        hits = index->findThing(3004);
+        ASSERT_EQ(hits.size(), 1u);
+        ASSERT_EQ(hits[0].file, 1u);
+        ASSERT_EQ(hits[0].where.str(), "MAP01");
+        ASSERT_EQ(index->findThing(1).size(), 2u);
+        ASSERT_TRUE(index->findThing(9).empty());
+
+        //An unchanged file keeps its postings, even moved; a changed one is read again
+        std::string moved = "./testfiles/corpus3.wad";
+        ASSERT_EQ(rename(two.c_str(), moved.c_str()), 0);
+        first.back().name = "STBAR2";
+        writeTestWad(one, first);
+        ASSERT_TRUE(CorpusIndex::update(indexPath, {moved, one}, 1, &stats));
+        ASSERT_EQ(stats.kept, 1u);
+        ASSERT_EQ(stats.indexed, 1u);
+        ASSERT_EQ(stats.removed, 1u);
+        ASSERT_EQ(stats.failed, 0u);
+
+        //The old index stays mapped and whole; a fresh open sees the update
+        ASSERT_EQ(index->findName("STBAR").size(), 1u);
+        delete index;
+        index = CorpusIndex::open(indexPath);
+        ASSERT_NE(index, nullptr);
+        ASSERT_TRUE(index->findName("STBAR").empty());
+        hits = index->findName("STBAR2");
+        ASSERT_EQ(hits.size(), 1u);
+        ASSERT_EQ(index->path(hits[0].file), one);
+        hits = index->findThing(3004);
+        ASSERT_EQ(hits.size(), 1u);
+        ASSERT_EQ(index->path(hits[0].file), moved);
+        delete index;
+
+        remove(one.c_str());
+        remove(moved.c_str());
+        remove(indexPath.c_str());
+}
+
+TEST(LibImageTests, paletteKernelTest1){
+        //Every available SIMD kernel matches the scalar lookup, tails included
+        uint32_t table[256];
+        for (int i = 0; i < 256; i++)
+                table[i] = 0xFF000000u | (i * 0x010203u);
+        std::vector<uint8_t> indices(1000 + 13);
+        for (size_t i = 0; i < indices.size(); i++)
+                indices[i] = static_cast<uint8_t>((i * 37) ^ (i >> 3));
+
+        std::vector<uint32_t> expected(indices.size());
+        paletteLookup(indices.data(), indices.size(), table, expected.data(), PaletteKernel::Scalar);
+        for (PaletteKernel k : {PaletteKernel::Ssse3, PaletteKernel::Avx2, PaletteKernel::Best}) {
+                if (!paletteKernelSupported(k)) continue;
+                std::vector<uint32_t> got(indices.size());
+                paletteLookup(indices.data(), indices.size(), table, got.data(), k);
+                ASSERT_EQ(got, expected);
+        }
+}
+
+TEST(LibImageTests, decodeTest1){
+        //Palette 0 is a gray ramp, palette 1 pure red; light 1 darkens by one index
+        std::vector<char> playpal(14 * 768, 0);
+        for (int i = 0; i < 256; i++) {
+                playpal[i * 3] = playpal[i * 3 + 1] = playpal[i * 3 + 2] = static_cast<char>(i);
+                playpal[768 + i * 3] = static_cast<char>(i);
+        }
+        std::vector<char> colormap(34 * 256);
+        for (int l = 0; l < 34; l++)
+                for (int i = 0; i < 256; i++)
+                        colormap[l * 256 + i] = static_cast<char>(std::max(0, i - l));
+        Palette pal;
+        ASSERT_TRUE(pal.load(playpal.data(), playpal.size(), colormap.data(), colormap.size()));
+
+        std::vector<char> flat(4096);
+        for (int i = 0; i < 4096; i++) flat[i] = static_cast<char>(i & 0xFF);
+        RgbaImage image;
+        ASSERT_TRUE(decodeFlat(flat.data(), flat.size(), pal, 0, 0, &image));
+        ASSERT_EQ(image.width, 64);
+        ASSERT_EQ(image.height, 64);
+        ASSERT_EQ(image.pixels[5], 0xFF050505u);
+        ASSERT_TRUE(decodeFlat(flat.data(), flat.size(), pal, 1, 1, &image));
+        ASSERT_EQ(image.pixels[5], 0xFF000004u);
+        ASSERT_FALSE(decodeFlat(flat.data(), flat.size(), pal, 14, 0, &image));
+
+        //Lookup tables are built once per palette/light and dropped on reload
+        const PaletteTable *kept = pal.lookupTable(1, 1);
+        ASSERT_NE(kept, nullptr);
+        ASSERT_EQ(pal.lookupTable(1, 1), kept);
+        ASSERT_EQ(kept->entries[5], 0xFF000004u);
+        ASSERT_EQ(pal.lookupTable(0, 34), nullptr);
+        ASSERT_TRUE(pal.load(playpal.data(), playpal.size(), colormap.data(), colormap.size()));
+        ASSERT_EQ(pal.lookupTable(1, 1)->entries[5], 0xFF000004u);
+
+        //2x3 patch: column 0 has a post at rows 0-1, column 1 one at row 2
+        std::vector<char> patch;
+        putShort(patch, 2); putShort(patch, 3); putShort(patch, 1); putShort(patch, 2);
+        uint32_t col0 = 16, col1 = 16 + 7;
+        patch.insert(patch.end(), (char*)&col0, (char*)&col0 + 4);
+        patch.insert(patch.end(), (char*)&col1, (char*)&col1 + 4);
+        for (int b : {0, 2, 0, 10, 20, 0, 0xFF}) patch.push_back(static_cast<char>(b));
+        for (int b : {2, 1, 0, 30, 0, 0xFF}) patch.push_back(static_cast<char>(b));
+
+        ASSERT_TRUE(decodePatch(patch.data(), patch.size(), pal, 0, 0, &image));
+        ASSERT_EQ(image.width, 2);
+        ASSERT_EQ(image.height, 3);
+        ASSERT_EQ(image.leftOffset, 1);
+        ASSERT_EQ(image.topOffset, 2);
+        std::vector<uint32_t> expected = {0xFF0A0A0Au, 0, 0xFF141414u, 0, 0, 0xFF1E1E1Eu};
+        ASSERT_EQ(image.pixels, expected);
+
+        //Truncated column data is rejected
+        ASSERT_FALSE(decodePatch(patch.data(), patch.size() - 3, pal, 0, 0, &image));
+}
+
+TEST(LibTextureTests, compositorTest1){
+        //Gray-ramp palette, one 2x2 patch and two textures placing it differently
+        TestLump playpal{"PLAYPAL", std::vector<char>(768)};
+        for (int i = 0; i < 768; i++) playpal.bytes[i] = static_cast<char>(i / 3);
+
+        TestLump pnames{"PNAMES", {1, 0, 0, 0}};
+        putName(pnames.bytes, "wall");
+
+        TestLump wall{"WALL", {}};
+        putShort(wall.bytes, 2); putShort(wall.bytes, 2); putShort(wall.bytes, 0); putShort(wall.bytes, 0);
+        uint32_t col0 = 16, col1 = 16 + 7;
+        wall.bytes.insert(wall.bytes.end(), (char*)&col0, (char*)&col0 + 4);
+        wall.bytes.insert(wall.bytes.end(), (char*)&col1, (char*)&col1 + 4);
+        for (int b : {0, 2, 0, 10, 20, 0, 0xFF}) wall.bytes.push_back(static_cast<char>(b));
+        for (int b : {0, 2, 0, 30, 40, 0, 0xFF}) wall.bytes.push_back(static_cast<char>(b));
+
+        TestLump texture1{"TEXTURE1", {2, 0, 0, 0, 12, 0, 0, 0, 44, 0, 0, 0}};
+        for (auto placement : {std::make_pair(std::string("BRICK"), 1), std::make_pair(std::string("BRICK2"), -1)}) {
+                putName(texture1.bytes, placement.first);
+                for (int v : {0, 0, 4, 2, 0, 0, 1}) putShort(texture1.bytes, v);
+                for (int v : {placement.second, 0, 0, 1, 0}) putShort(texture1.bytes, v);
+        }
+
+        std::string wad_path = writeTestWad("./testfiles/texture_copy.wad", {playpal, pnames, texture1, wall});
+        Wad* testWad = Wad::loadWad(wad_path);
+        ASSERT_NE(testWad, nullptr);
+
+        //Budget fits one 4x2 texture (32 bytes) but not two
+        TextureCompositor textures(testWad, 40);
+        ASSERT_EQ(textures.textureCount(), 2);
+        TextureDef def;
+        ASSERT_TRUE(textures.definition("brick", &def));
+        ASSERT_EQ(def.width, 4);
+        ASSERT_EQ(def.height, 2);
+        ASSERT_FALSE(textures.definition("NOPE", &def));
+        ASSERT_EQ(textures.get("NOPE"), nullptr);
+
+        auto brick = textures.get("BRICK");
+        ASSERT_NE(brick, nullptr);
+        std::vector<uint32_t> expected = {0, 0xFF0A0A0Au, 0xFF1E1E1Eu, 0,
+                                          0, 0xFF141414u, 0xFF282828u, 0};
+        ASSERT_EQ(brick->pixels, expected);
+
+        ASSERT_EQ(textures.get("brick"), brick);
+        ASSERT_EQ(textures.stats().hits, 1);
+
+        auto brick2 = textures.get("BRICK2");
+        ASSERT_NE(brick2, nullptr);
+        ASSERT_EQ(brick2->pixels[0], 0xFF1E1E1Eu);
+        ASSERT_EQ(brick2->pixels[1], 0u);
+        ASSERT_EQ(textures.stats().evictions, 1);
+        ASSERT_EQ(textures.stats().entries, 1);
+        ASSERT_EQ(textures.stats().bytes, 32);
+
+        //The evicted texture is rebuilt; a write to the Wad invalidates the rest
+        ASSERT_NE(textures.get("BRICK"), brick);
+        ASSERT_EQ(textures.stats().misses, 4);
+        testWad->createFile("/NEWLUMP");
+        ASSERT_NE(textures.get("BRICK"), nullptr);
+        ASSERT_EQ(textures.stats().misses, 5);
+        ASSERT_EQ(textures.stats().hits, 1);
+
+        delete testWad;
+        remove(wad_path.c_str());
+}
+
+TEST(LibConvertTests, encoderTest1){
+        TestLump playpal{"PLAYPAL", std::vector<char>(768)};
+        for (int i = 0; i < 768; i++) playpal.bytes[i] = static_cast<char>(i / 3);
+
+        //Same 2x2 patch as the texture test
+        TestLump wall{"WALL", {}};
+        putShort(wall.bytes, 2); putShort(wall.bytes, 2); putShort(wall.bytes, 0); putShort(wall.bytes, 0);
+        uint32_t col0 = 16, col1 = 16 + 7;
+        wall.bytes.insert(wall.bytes.end(), (char*)&col0, (char*)&col0 + 4);
+        wall.bytes.insert(wall.bytes.end(), (char*)&col1, (char*)&col1 + 4);
+        for (int b : {0, 2, 0, 10, 20, 0, 0xFF}) wall.bytes.push_back(static_cast<char>(b));
+        for (int b : {0, 2, 0, 30, 40, 0, 0xFF}) wall.bytes.push_back(static_cast<char>(b));
+
+        TestLump flat{"FLAT1", std::vector<char>(4096, 7)};
+
+        //Format 3, 11025 Hz, 40 samples of which 16 at each end are padding
+        TestLump sound{"DSPISTOL", {}};
+        for (int v : {3, 11025, 40, 0}) putShort(sound.bytes, v);
+        for (int i = 0; i < 40; i++) sound.bytes.push_back(static_cast<char>(i));
+
+        //Program 5, note 60 at velocity 100, 10 ticks later released, end
+        TestLump music{"D_E1M1", {'M', 'U', 'S', 0x1a}};
+        for (int v : {10, 16, 1, 0, 0, 0}) putShort(music.bytes, v);
+        for (int b : {0x40, 0x00, 0x05, 0x90, 0xBC, 0x64, 0x0A, 0x00, 0x3C, 0x60})
+                music.bytes.push_back(static_cast<char>(b));
+
+        std::string wad_path = writeTestWad("./testfiles/convert_copy.wad",
+                {playpal, wall, {"F_START", {}}, flat, {"F_END", {}}, sound, music});
+        Wad* testWad = Wad::loadWad(wad_path);
+        ASSERT_NE(testWad, nullptr);
+        Palette pal;
+        ASSERT_TRUE(pal.load(testWad));
+
+        ASSERT_EQ(LumpEncoder::detect(testWad, "/WALL", pal), LumpEncoder::Png);
+        ASSERT_EQ(LumpEncoder::detect(testWad, "/F/FLAT1", pal), LumpEncoder::Png);
+        ASSERT_EQ(LumpEncoder::detect(testWad, "/DSPISTOL", pal), LumpEncoder::Wav);
+        ASSERT_EQ(LumpEncoder::detect(testWad, "/D_E1M1", pal), LumpEncoder::Midi);
+        ASSERT_EQ(LumpEncoder::detect(testWad, "/PLAYPAL", pal), LumpEncoder::None);
+        ASSERT_EQ(LumpEncoder::detect(testWad, "/WALL", Palette()), LumpEncoder::None);
+        ASSERT_EQ(LumpEncoder::create(testWad, "/PLAYPAL", pal), nullptr);
+
+        //WAV: header plus the 8 unpadded samples
+        LumpEncoder *wav = LumpEncoder::create(testWad, "/DSPISTOL", pal);
+        ASSERT_NE(wav, nullptr);
+        ASSERT_EQ(wav->size(), 52);
+        char out[256];
+        ASSERT_EQ(wav->produce(out, sizeof(out)), 52);
+        ASSERT_EQ(memcmp(out, "RIFF", 4), 0);
+        ASSERT_EQ(*(uint32_t*)(out + 24), 11025);
+        ASSERT_EQ(*(uint32_t*)(out + 40), 8);
+        ASSERT_EQ(out[44], 16);
+        ASSERT_EQ(wav->produce(out, sizeof(out)), 0);
+        delete wav;
+
+        //MIDI: one track, tempo then the converted events
+        LumpEncoder *midi = LumpEncoder::create(testWad, "/D_E1M1", pal);
+        ASSERT_NE(midi, nullptr);
+        ASSERT_EQ(midi->size(), 44);
+        ASSERT_EQ(midi->produce(out, sizeof(out)), 44);
+        std::vector<unsigned char> track(out + 22, out + 44);
+        std::vector<unsigned char> expectedTrack = {0x00, 0xFF, 0x51, 0x03, 0x07, 0xA1, 0x20,
+                                                    0x00, 0xC0, 0x05, 0x00, 0x90, 0x3C, 0x64,
+                                                    0x0A, 0x80, 0x3C, 0x00, 0x00, 0xFF, 0x2F, 0x00};
+        ASSERT_EQ(track, expectedTrack);
+        ASSERT_EQ(*(uint32_t*)(out + 18), 22u << 24);
+        delete midi;
+
+        //PNG: produced in small reads, the stream matches the promised size
+        LumpEncoder *png = LumpEncoder::create(testWad, "/WALL", pal);
+        ASSERT_NE(png, nullptr);
+        std::vector<char> bytes;
+        int r;
+        while ((r = png->produce(out, 7)) > 0) bytes.insert(bytes.end(), out, out + r);
+        ASSERT_EQ(r, 0);
+        ASSERT_TRUE(png->done());
+        ASSERT_EQ(bytes.size(), png->size());
+        ASSERT_EQ(memcmp(bytes.data(), "\x89PNG\r\n\x1a\n", 8), 0);
+        ASSERT_EQ(memcmp(bytes.data() + bytes.size() - 8, "IEND", 4), 0);
+        delete png;
+
+        delete testWad;
+        remove(wad_path.c_str());
+}
+
+TEST(LibConvertTests, batchTest1){
+        //Lumps much larger than the reader's window
+        TestLump sound{"DSBIG", {}};
+        for (int v : {3, 22050, 50000, 0}) putShort(sound.bytes, v);
+        for (int i = 0; i < 50000; i++) sound.bytes.push_back(static_cast<char>(i * 13));
+
+        //3000 notes, each played then released one tick later
+        TestLump music{"D_LONG", {'M', 'U', 'S', 0x1a}};
+        for (int v : {0, 16, 1, 0, 0, 0}) putShort(music.bytes, v);
+        for (int i = 0; i < 3000; i++)
+                for (int b : {0x90, 0x80 | (i % 100), 0x40, 0x01, 0x00, i % 100})
+                        music.bytes.push_back(static_cast<char>(b));
+        music.bytes.push_back(0x60);
+        uint16_t scoreLength = music.bytes.size() - 16;
+        memcpy(music.bytes.data() + 4, &scoreLength, 2);
+
+        //Event type 7 does not exist
+        TestLump broken{"D_BAD", {'M', 'U', 'S', 0x1a}};
+        for (int v : {1, 16, 1, 0, 0, 0}) putShort(broken.bytes, v);
+        broken.bytes.push_back(0x70);
+
+        std::string wad_path = writeTestWad("./testfiles/batch_copy.wad", {sound, music, broken});
+        Wad* testWad = Wad::loadWad(wad_path);
+        ASSERT_NE(testWad, nullptr);
+        Palette pal;
+
+        //Reader: byte and block reads agree across window boundaries
+        LumpReader reader(testWad, testWad->open("/DSBIG"));
+        ASSERT_EQ(reader.size(), sound.bytes.size());
+        ASSERT_TRUE(reader.seek(LumpReader::Window - 2));
+        char chunk[8];
+        ASSERT_EQ(reader.read(chunk, 8), 8);
+        ASSERT_EQ(memcmp(chunk, sound.bytes.data() + LumpReader::Window - 2, 8), 0);
+        ASSERT_EQ(reader.get(), static_cast<uint8_t>(sound.bytes[LumpReader::Window + 6]));
+        ASSERT_TRUE(reader.seek(sound.bytes.size()));
+        ASSERT_EQ(reader.get(), -1);
+        ASSERT_FALSE(reader.failed());
+
+        std::vector<ConvertJob> jobs = {{"/DSBIG", "./testfiles/batch_big.wav", LumpEncoder::None, 0},
+                                        {"/D_LONG", "./testfiles/batch_long.mid", LumpEncoder::None, 0},
+                                        {"/D_BAD", "", LumpEncoder::None, 0},
+                                        {"/D_LONG", "", LumpEncoder::None, 0}};
+        ASSERT_EQ(convertLumps(testWad, jobs, pal, 3), 3);
+        ASSERT_EQ(jobs[0].format, LumpEncoder::Wav);
+        ASSERT_EQ(jobs[0].bytes, 44 + 50000 - 32);
+        ASSERT_EQ(jobs[1].format, LumpEncoder::Midi);
+        ASSERT_EQ(jobs[2].bytes, -1);
+        ASSERT_EQ(jobs[3].bytes, jobs[1].bytes);
+
+        //Samples come through untouched, padding dropped
+        std::ifstream wav("./testfiles/batch_big.wav", std::ios::binary);
+        std::vector<char> wavBytes((std::istreambuf_iterator<char>(wav)), std::istreambuf_iterator<char>());
+        ASSERT_EQ(wavBytes.size(), jobs[0].bytes);
+        ASSERT_TRUE(std::equal(wavBytes.begin() + 44, wavBytes.end(), sound.bytes.begin() + 8 + 16));
+
+        //Every note becomes on + off: 4 bytes each plus tempo and end of track
+        std::ifstream mid("./testfiles/batch_long.mid", std::ios::binary);
+        std::vector<char> midBytes((std::istreambuf_iterator<char>(mid)), std::istreambuf_iterator<char>());
+        ASSERT_EQ(midBytes.size(), jobs[1].bytes);
+        ASSERT_EQ(midBytes.size(), 14 + 8 + 7 + 3000 * 8 + 4);
+        ASSERT_EQ(memcmp(midBytes.data() + midBytes.size() - 4, "\x00\xFF\x2F\x00", 4), 0);
+
+        delete testWad;
+        remove("./testfiles/batch_big.wav");
+        remove("./testfiles/batch_long.mid");
+        remove(wad_path.c_str());
+}
+
 TEST(LibFunctionalityTests, bigTest){
         std::string wad_path = setupWorkspace();
         Wad* testWad = Wad::loadWad(wad_path);
@@ -1173,6 +3142,54 @@ TEST(LibFunctionalityTests, bigTest){
         delete testWad;
 }
 
+TEST(LibReadTests, readvTest1){
+        std::string wad_path = setupWorkspace();
+        Wad* testWad = Wad::loadWad(wad_path);
+
+        //Batch-reading every lump of the map directory plus two bad requests
+        std::vector<std::string> entries;
+        ASSERT_EQ(testWad->getDirectory("/E1M0", &entries), 10);
+
+        std::vector<std::vector<char>> buffers(entries.size() + 2, std::vector<char>(64, 0));
+        std::vector<Wad::ReadRequest> requests;
+        for (size_t i = 0; i < entries.size(); i++)
+                requests.push_back({"/E1M0/" + entries[i], buffers[i].data(), 64, 0, 0});
+        requests.push_back({"/E1M0/missing", buffers[10].data(), 64, 0, 0});
+        requests.push_back({"/E1M0/01.txt", buffers[11].data(), 64, 100, 0});
+
+        ASSERT_EQ(testWad->readv(requests), 11);
+        ASSERT_EQ(requests[10].result, -1);
+        ASSERT_EQ(requests[11].result, 0);
+
+        for (size_t i = 0; i < entries.size(); i++) {
+                char expected[64];
+                int ret = testWad->getContents("/E1M0/" + entries[i], expected, 64);
+                ASSERT_EQ(requests[i].result, ret);
+                ASSERT_EQ(memcmp(buffers[i].data(), expected, ret), 0);
+        }
+
+        delete testWad;
+}
+
+TEST(LumpNameTests, packedNames){
+        //Decoding trims at the first NUL and drops trailing spaces
+        const char raw1[8] = {'F','1','_','S','T','A','R','T'};
+        const char raw2[8] = {'P','L','A','Y','P','A','L','\0'};
+        const char raw3[8] = {'A','B',' ',' ','\0','x','y','z'};
+        ASSERT_EQ(LumpName::fromBytes(raw1).str(), "F1_START");
+        ASSERT_EQ(LumpName::fromBytes(raw2).str(), "PLAYPAL");
+        ASSERT_EQ(LumpName::fromBytes(raw3).str(), "AB");
+        ASSERT_EQ(LumpName::fromBytes(raw3).size(), 2);
+
+        //Equality, suffixes and case folding
+        LumpName name;
+        ASSERT_TRUE(LumpName::fromString("cake.jpg", &name));
+        ASSERT_FALSE(LumpName::fromString("toolongname", &name));
+        ASSERT_EQ(name.upper(), LumpName::literal("CAKE.JPG"));
+        ASSERT_TRUE(LumpName::fromBytes(raw1).endsWith(LumpName::literal("_START")));
+        ASSERT_EQ(LumpName::literal("F1").append(LumpName::literal("_END")).str(), "F1_END");
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
 
@@ -0,0 +1,191 @@
+#include "Wad.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+// CLOCK-Pro over lump sizes. Resident lumps are cold or hot, each kind on
+// its own clock. The cold hand promotes a cold lump read since it last
+// passed and evicts one that was not, leaving a non-resident test entry;
+// the hot hand demotes unread hot lumps once hot outgrows its share. A
+// lump read again while still under test has a shorter reuse distance
+// than the cold lumps, so it comes back hot and the cold share grows;
+// test entries that expire unread shrink it. A one-pass scan only ever
+// cycles through cold.
+
+Wad::CacheStats Wad::cacheStats() const {
+    lock_guard<mutex> guard(cacheLock);
+    return stats;
+}
+
+vector<Wad::CacheEntry> Wad::cacheEntries() const {
+    lock_guard<mutex> guard(cacheLock);
+    vector<CacheEntry> entries;
+    for (const list<Node*> *resident : {&coldClock, &hotClock, &pinnedLumps}) {
+        for (const Node* node : *resident)
+            entries.push_back({reinterpret_cast<uintptr_t>(node), node->length, node->hits,
+                               node->cache == CacheHot, node->cache == CachePinned});
+    }
+    return entries;
+}
+
+bool Wad::readCached(Node* node, char *buffer, int64_t length, int64_t offset) {
+    {
+        lock_guard<mutex> guard(cacheLock);
+        if (isResident(node)) {
+            if (node->cache != CacheNone) {
+                node->referenced = true;
+                node->hits++;
+                stats.hits++;
+            }
+            memcpy(buffer, node->data.data() + offset, static_cast<size_t>(length));
+            return true;
+        }
+        stats.misses++;
+    }
+
+    // The file is read without the lock; whoever gets the lump in first keeps it
+    vector<char> bytes;
+    if (node->length > cacheBytes / 4 || !fetchLump(node, &bytes)) return false;
+    memcpy(buffer, bytes.data() + offset, static_cast<size_t>(length));
+
+    lock_guard<mutex> guard(cacheLock);
+    if (!isResident(node)) admit(node, &bytes);
+    return true;
+}
+
+bool Wad::holdResident(Node* node) {
+    {
+        lock_guard<mutex> guard(cacheLock);
+        if (isResident(node)) {
+            if (node->cache == CacheCold || node->cache == CacheHot) {
+                detach(node);
+                attach(node, CachePinned);
+            }
+            return true;
+        }
+    }
+
+    vector<char> bytes;
+    if (!fetchLump(node, &bytes)) return false;
+
+    lock_guard<mutex> guard(cacheLock);
+    if (isResident(node)) {
+        if (node->cache == CacheCold || node->cache == CacheHot) {
+            detach(node);
+            attach(node, CachePinned);
+        }
+        return true;
+    }
+    detach(node); // a test entry
+    node->data.swap(bytes);
+    attach(node, CachePinned);
+    return true;
+}
+
+void Wad::forget(Node* node) {
+    lock_guard<mutex> guard(cacheLock);
+    detach(node);
+}
+
+void Wad::admit(Node* node, vector<char> *bytes) {
+    uint64_t margin = cacheBytes / 16;
+    uint8_t state = CacheCold;
+    if (find(pinnedNames.begin(), pinnedNames.end(), node->name.upper().bits) != pinnedNames.end()) {
+        state = CachePinned;
+    } else if (node->cache == CacheTest) {
+        state = CacheHot;
+        coldTarget = min(coldTarget + node->length, cacheBytes - margin);
+    }
+    detach(node);
+    if (state != CachePinned) makeRoom(node->length);
+    node->data.swap(*bytes);
+    node->referenced = false;
+    attach(node, state);
+}
+
+void Wad::attach(Node* node, uint8_t state) {
+    node->cache = state;
+    switch (state) {
+    case CacheCold:
+        node->slot = coldClock.insert(coldClock.end(), node);
+        break;
+    case CacheHot:
+        node->slot = hotClock.insert(hotClock.end(), node);
+        stats.hotBytes += node->length;
+        break;
+    case CacheTest:
+        node->slot = testQueue.insert(testQueue.end(), node);
+        testBytes += node->length;
+        return;
+    case CachePinned:
+        node->slot = pinnedLumps.insert(pinnedLumps.end(), node);
+        stats.pinnedBytes += node->length;
+        break;
+    default:
+        return;
+    }
+    stats.bytes += node->length;
+}
+
+void Wad::detach(Node* node) {
+    switch (node->cache) {
+    case CacheCold:
+        coldClock.erase(node->slot);
+        break;
+    case CacheHot:
+        hotClock.erase(node->slot);
+        stats.hotBytes -= node->length;
+        break;
+    case CacheTest:
+        testQueue.erase(node->slot);
+        testBytes -= node->length;
+        node->cache = CacheNone;
+        return;
+    case CachePinned:
+        pinnedLumps.erase(node->slot);
+        stats.pinnedBytes -= node->length;
+        break;
+    default:
+        return;
+    }
+    stats.bytes -= node->length;
+    node->cache = CacheNone;
+}
+
+void Wad::makeRoom(uint64_t bytes) {
+    uint64_t margin = cacheBytes / 16;
+    while (stats.bytes + bytes > cacheBytes && !(coldClock.empty() && hotClock.empty())) {
+        bool hotOver = stats.hotBytes + coldTarget > cacheBytes;
+        if (!hotClock.empty() && (hotOver || coldClock.empty())) {
+            // hot hand
+            Node* node = hotClock.front();
+            if (node->referenced) {
+                node->referenced = false;
+                hotClock.splice(hotClock.end(), hotClock, node->slot);
+            } else {
+                detach(node);
+                attach(node, CacheCold);
+            }
+            continue;
+        }
+
+        // cold hand
+        Node* node = coldClock.front();
+        detach(node);
+        if (node->referenced) {
+            node->referenced = false;
+            attach(node, CacheHot);
+            continue;
+        }
+        vector<char>().swap(node->data);
+        stats.evictions++;
+        attach(node, CacheTest);
+        // tests are kept for about as many bytes as the cache holds
+        while (testBytes > cacheBytes) {
+            Node* expired = testQueue.front();
+            coldTarget = max(coldTarget > expired->length ? coldTarget - expired->length : 0, margin);
+            detach(expired);
+        }
+    }
+}
@@ -0,0 +1,693 @@
+#include "Convert.h"
+#include "Wad.h"
+#include "MapView.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <system_error>
+#include <cstring>
+#include <climits>
+
+using namespace std;
+
+static uint16_t readShort(const char *p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t readInt(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static void putBig32(vector<char> &out, uint32_t v) {
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back(static_cast<char>((v >> shift) & 0xFF));
+}
+
+static void putLittle(vector<char> &out, uint32_t v, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        out.push_back(static_cast<char>((v >> (8 * i)) & 0xFF));
+}
+
+static void putBytes(vector<char> &out, const char *bytes, size_t n) {
+    out.insert(out.end(), bytes, bytes + n);
+}
+
+// LumpEncoder
+
+int LumpEncoder::produce(char *out, size_t max) {
+    if (max > INT_MAX) max = INT_MAX;
+
+    size_t copied = 0;
+    while (copied < max && emitted < total) {
+        if (pendingPos == pending.size()) {
+            pending.clear();
+            pendingPos = 0;
+            if (!refill(pending) || pending.empty()) return -1;
+        }
+        size_t n = min(max - copied, pending.size() - pendingPos);
+        n = min(n, total - emitted);
+        memcpy(out + copied, pending.data() + pendingPos, n);
+        pendingPos += n;
+        emitted += n;
+        copied += n;
+    }
+    return static_cast<int>(copied);
+}
+
+// LumpReader
+
+LumpReader::LumpReader(Wad *wad, uint64_t handle)
+    : wad(wad), handle(handle), length(0), pos(0), next(0), filled(0), error(false) {
+    int64_t n = wad ? wad->size(handle) : -1;
+    if (n < 0) error = true;
+    else length = static_cast<size_t>(n);
+}
+
+bool LumpReader::seek(size_t offset) {
+    if (offset > length) return false;
+    // stay inside the current window when possible
+    size_t windowStart = pos - next;
+    if (offset >= windowStart && offset <= windowStart + filled) {
+        next = offset - windowStart;
+    } else {
+        next = 0;
+        filled = 0;
+    }
+    pos = offset;
+    return true;
+}
+
+bool LumpReader::fill() {
+    if (error || pos >= length) return false;
+    int64_t n = wad->read(handle, window, static_cast<int64_t>(min<size_t>(Window, length - pos)),
+                          static_cast<int64_t>(pos));
+    if (n <= 0) {
+        error = true;
+        return false;
+    }
+    next = 0;
+    filled = static_cast<size_t>(n);
+    return true;
+}
+
+size_t LumpReader::read(char *out, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        if (next == filled && !fill()) break;
+        size_t k = min(n - done, filled - next);
+        memcpy(out + done, window + next, k);
+        next += k;
+        pos += k;
+        done += k;
+    }
+    return done;
+}
+
+// PNG: 8-bit RGBA, filter 0, stored (uncompressed) deflate blocks. Stored
+// blocks are what makes the size known up front and every byte cheap to
+// produce; viewers don't care.
+
+static const uint32_t* crcTable() {
+    static uint32_t table[256];
+    static bool built = [] {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+        return true;
+    }();
+    (void) built;
+    return table;
+}
+
+static uint32_t crc32Update(uint32_t crc, const char *bytes, size_t n) {
+    const uint32_t *table = crcTable();
+    crc = ~crc;
+    for (size_t i = 0; i < n; i++)
+        crc = table[(crc ^ static_cast<uint8_t>(bytes[i])) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void putChunk(vector<char> &out, const char type[4], const vector<char> &data) {
+    putBig32(out, static_cast<uint32_t>(data.size()));
+    size_t start = out.size();
+    putBytes(out, type, 4);
+    putBytes(out, data.data(), data.size());
+    putBig32(out, crc32Update(0, out.data() + start, out.size() - start));
+}
+
+class PngEncoder : public LumpEncoder {
+
+public:
+    enum { MaxStoredBlock = 65535 };
+
+    static size_t encodedSize(int width, int height) {
+        size_t raw = static_cast<size_t>(height) * (1 + 4 * static_cast<size_t>(width));
+        size_t blocks = max<size_t>(1, (raw + MaxStoredBlock - 1) / MaxStoredBlock);
+        size_t idat = 2 + raw + 5 * blocks + 4;
+        return 8 + 25 + (12 + idat) + 12;
+    }
+
+    PngEncoder(vector<char> &source, bool flat, int width, int height, const Palette &pal)
+        : LumpEncoder(Png, encodedSize(width, height)), flat(flat), width(width), height(height),
+          pal(pal), stage(Header), row(0), crc(0), adlerA(1), adlerB(0), blockLeft(0) {
+        this->source.swap(source);
+        rawLeft = static_cast<size_t>(height) * (1 + 4 * static_cast<size_t>(width));
+    }
+
+protected:
+    bool refill(vector<char> &pending) override {
+        switch (stage) {
+        case Header: {
+            bool ok = flat ? decodeFlat(source.data(), source.size(), pal, 0, 0, &image)
+                           : decodePatch(source.data(), source.size(), pal, 0, 0, &image);
+            if (!ok || image.width != width || image.height != height) return false;
+            vector<char>().swap(source);
+
+            putBytes(pending, "\x89PNG\r\n\x1a\n", 8);
+            vector<char> ihdr;
+            putBig32(ihdr, static_cast<uint32_t>(width));
+            putBig32(ihdr, static_cast<uint32_t>(height));
+            putBytes(ihdr, "\x08\x06\x00\x00\x00", 5); // 8-bit RGBA, no interlace
+            putChunk(pending, "IHDR", ihdr);
+
+            putBig32(pending, static_cast<uint32_t>(size() - 8 - 25 - 12 - 12));
+            putBytes(pending, "IDAT", 4);
+            crc = crc32Update(0, "IDAT", 4);
+            idat(pending, "\x78\x01", 2);
+            stage = Rows;
+            return true;
+        }
+        case Rows: {
+            scanline.resize(1 + 4 * static_cast<size_t>(width));
+            scanline[0] = 0; // filter: none
+            const uint32_t *px = image.pixels.data() + static_cast<size_t>(row) * width;
+            for (int x = 0; x < width; x++) {
+                scanline[1 + 4 * x] = static_cast<char>(px[x] & 0xFF);
+                scanline[2 + 4 * x] = static_cast<char>((px[x] >> 8) & 0xFF);
+                scanline[3 + 4 * x] = static_cast<char>((px[x] >> 16) & 0xFF);
+                scanline[4 + 4 * x] = static_cast<char>(px[x] >> 24);
+            }
+            raw(pending, scanline.data(), scanline.size());
+            if (++row == height) stage = Trailer;
+            return true;
+        }
+        case Trailer: {
+            char adler[4];
+            uint32_t sum = (adlerB % 65521) << 16 | (adlerA % 65521);
+            for (int i = 0; i < 4; i++) adler[i] = static_cast<char>(sum >> (24 - 8 * i));
+            idat(pending, adler, 4);
+            putBig32(pending, crc);
+            putChunk(pending, "IEND", vector<char>());
+            stage = Finished;
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+
+private:
+    enum Stage { Header, Rows, Trailer, Finished };
+
+    // Bytes inside the IDAT chunk
+    void idat(vector<char> &pending, const char *bytes, size_t n) {
+        putBytes(pending, bytes, n);
+        crc = crc32Update(crc, bytes, n);
+    }
+
+    // Uncompressed image bytes, split into stored deflate blocks
+    void raw(vector<char> &pending, const char *bytes, size_t n) {
+        while (n > 0) {
+            if (blockLeft == 0) {
+                blockLeft = min<size_t>(rawLeft, MaxStoredBlock);
+                uint16_t len = static_cast<uint16_t>(blockLeft);
+                char header[5] = {static_cast<char>(blockLeft == rawLeft ? 1 : 0),
+                                  static_cast<char>(len & 0xFF), static_cast<char>(len >> 8),
+                                  static_cast<char>(~len & 0xFF), static_cast<char>((~len >> 8) & 0xFF)};
+                idat(pending, header, 5);
+            }
+            size_t k = min(n, blockLeft);
+            idat(pending, bytes, k);
+            for (size_t i = 0; i < k; i++) {
+                adlerA += static_cast<uint8_t>(bytes[i]);
+                adlerB += adlerA;
+                if ((i & 4095) == 4095) { adlerA %= 65521; adlerB %= 65521; }
+            }
+            adlerA %= 65521;
+            adlerB %= 65521;
+            bytes += k;
+            n -= k;
+            blockLeft -= k;
+            rawLeft -= k;
+        }
+    }
+
+    vector<char> source;
+    bool flat;
+    int width;
+    int height;
+    const Palette &pal;
+
+    Stage stage;
+    RgbaImage image;
+    vector<char> scanline;
+    int row;
+    uint32_t crc;
+    uint32_t adlerA;
+    uint32_t adlerB;
+    size_t rawLeft;
+    size_t blockLeft;
+};
+
+// WAV: DMX sound is already 8-bit unsigned mono PCM behind an 8-byte header
+// (format 3, sample rate, sample count). The 16 padding samples DMX keeps at
+// each end are dropped.
+
+class WavEncoder : public LumpEncoder {
+
+public:
+    enum { HeaderSize = 44, Chunk = 16 * 1024 };
+
+    WavEncoder(Wad *wad, uint64_t handle, size_t first, size_t count, uint32_t rate)
+        : LumpEncoder(Wav, HeaderSize + count), source(wad, handle), left(count), rate(rate), header(true) {
+        source.seek(first);
+    }
+
+protected:
+    bool refill(vector<char> &pending) override {
+        if (header) {
+            uint32_t samples = static_cast<uint32_t>(left);
+            putBytes(pending, "RIFF", 4);
+            putLittle(pending, 36 + samples, 4);
+            putBytes(pending, "WAVEfmt ", 8);
+            putLittle(pending, 16, 4);
+            putLittle(pending, 1, 2);       // PCM
+            putLittle(pending, 1, 2);       // mono
+            putLittle(pending, rate, 4);
+            putLittle(pending, rate, 4);    // byte rate
+            putLittle(pending, 1, 2);       // block align
+            putLittle(pending, 8, 2);       // bits per sample
+            putBytes(pending, "data", 4);
+            putLittle(pending, samples, 4);
+            header = false;
+            return true;
+        }
+        size_t n = min<size_t>(Chunk, left);
+        pending.resize(n);
+        if (source.read(pending.data(), n) != n) return false;
+        left -= n;
+        return n > 0;
+    }
+
+private:
+    LumpReader source;
+    size_t left;
+    uint32_t rate;
+    bool header;
+};
+
+// MIDI: MUS events map one to one onto MIDI channel messages. MUS ticks at
+// 140 Hz, which is 70 ticks per quarter note at the default 120 BPM. The
+// track length has to precede the track, so create() runs the conversion
+// once just to measure it; the second run streams. Both runs read the score
+// a byte at a time through a LumpReader.
+
+class MusConverter {
+
+public:
+    MusConverter(Wad *wad, uint64_t handle) : finished(false), source(wad, handle) {}
+
+    bool start() {
+        char header[8];
+        if (source.size() < 16 || !source.seek(0) || source.read(header, 8) != 8) return false;
+        if (memcmp(header, "MUS\x1a", 4) != 0) return false;
+        size_t scoreLength = readShort(header + 4);
+        size_t scoreStart = readShort(header + 6);
+        if (!source.seek(scoreStart) || scoreStart >= source.size()) return false;
+
+        end = min(source.size(), scoreStart + scoreLength);
+        delay = 0;
+        finished = false;
+        nextChannel = 0;
+        for (int i = 0; i < 16; i++) {
+            channels[i] = -1;
+            velocity[i] = 127;
+        }
+        return true;
+    }
+
+    bool finished;
+    bool failed() const { return source.failed(); }
+
+    // Converts the next MUS event; false if the score is malformed
+    bool step(vector<char> &out) {
+        if (source.tell() >= end) return endTrack(out); // no score-end event: stop here
+
+        uint8_t event = byte();
+        int type = (event >> 4) & 7;
+        int channel = midiChannel(event & 0x0F);
+
+        switch (type) {
+        case 0: // release note
+            if (source.tell() >= end) return false;
+            message(out, 0x80 | channel, byte() & 0x7F, 0);
+            break;
+        case 1: { // play note
+            if (source.tell() >= end) return false;
+            uint8_t key = byte();
+            if (key & 0x80) {
+                if (source.tell() >= end) return false;
+                velocity[channel] = byte() & 0x7F;
+            }
+            message(out, 0x90 | channel, key & 0x7F, velocity[channel]);
+            break;
+        }
+        case 2: { // pitch wheel, 8-bit -> 14-bit
+            if (source.tell() >= end) return false;
+            int wheel = byte() * 64;
+            message(out, 0xE0 | channel, wheel & 0x7F, (wheel >> 7) & 0x7F);
+            break;
+        }
+        case 3: { // system event: valueless controller
+            if (source.tell() >= end) return false;
+            uint8_t controller = byte();
+            if (controller < 10 || controller > 14) return false;
+            message(out, 0xB0 | channel, controllerMap[controller], 0);
+            break;
+        }
+        case 4: { // controller; 0 is a program change
+            if (source.tell() + 2 > end) return false;
+            uint8_t controller = byte();
+            uint8_t value = byte();
+            if (value > 127) value = 127;
+            if (controller == 0) {
+                writeDelta(out);
+                out.push_back(static_cast<char>(0xC0 | channel));
+                out.push_back(static_cast<char>(value));
+            } else if (controller < 10) {
+                message(out, 0xB0 | channel, controllerMap[controller], value);
+            } else {
+                return false;
+            }
+            break;
+        }
+        case 5: // end of measure
+            break;
+        case 6: // score end
+            return endTrack(out);
+        default:
+            return false;
+        }
+
+        if (event & 0x80) {
+            uint32_t time = 0;
+            uint8_t b;
+            do {
+                if (source.tell() >= end) return false;
+                b = byte();
+                time = time * 128 + (b & 0x7F);
+            } while (b & 0x80);
+            delay += time;
+        }
+        return true;
+    }
+
+private:
+    static const uint8_t controllerMap[15];
+
+    uint8_t byte() { return static_cast<uint8_t>(source.get()); } // callers check `end`
+
+    // MUS 15 is percussion (MIDI 9); the rest are assigned in order of use
+    int midiChannel(int mus) {
+        if (mus == 15) return 9;
+        if (channels[mus] < 0) {
+            channels[mus] = nextChannel++;
+            if (channels[mus] == 9) channels[mus] = nextChannel++;
+        }
+        return channels[mus] & 0x0F;
+    }
+
+    void writeDelta(vector<char> &out) {
+        char bytes[5];
+        int n = 0;
+        uint32_t v = delay;
+        bytes[n++] = static_cast<char>(v & 0x7F);
+        while (v >>= 7) bytes[n++] = static_cast<char>((v & 0x7F) | 0x80);
+        while (n > 0) out.push_back(bytes[--n]);
+        delay = 0;
+    }
+
+    void message(vector<char> &out, int status, int a, int b) {
+        writeDelta(out);
+        out.push_back(static_cast<char>(status));
+        out.push_back(static_cast<char>(a));
+        out.push_back(static_cast<char>(b));
+    }
+
+    bool endTrack(vector<char> &out) {
+        writeDelta(out);
+        putBytes(out, "\xFF\x2F\x00", 3);
+        finished = true;
+        return true;
+    }
+
+    LumpReader source;
+    size_t end;
+    uint32_t delay;
+    int channels[16];
+    int nextChannel;
+    uint8_t velocity[16];
+};
+
+const uint8_t MusConverter::controllerMap[15] = {
+    0x00, 0x00, 0x01, 0x07, 0x0A, 0x0B, 0x5B, 0x5D, 0x40, 0x43, // 0-9
+    0x78, 0x7B, 0x7E, 0x7F, 0x79                                // 10-14
+};
+
+static const char midiTempo[] = "\x00\xFF\x51\x03\x07\xA1\x20"; // 500000 us/quarter
+
+class MidiEncoder : public LumpEncoder {
+
+public:
+    MidiEncoder(Wad *wad, uint64_t handle, size_t trackLength)
+        : LumpEncoder(Midi, 14 + 8 + trackLength), converter(wad, handle),
+          trackLength(trackLength), header(true) {}
+
+    // Runs the conversion without keeping the output; 0 if malformed
+    static size_t measure(Wad *wad, uint64_t handle) {
+        MusConverter converter(wad, handle);
+        if (!converter.start()) return 0;
+
+        size_t length = sizeof(midiTempo) - 1;
+        vector<char> scratch;
+        while (!converter.finished) {
+            scratch.clear();
+            if (!converter.step(scratch) || converter.failed()) return 0;
+            length += scratch.size();
+        }
+        return length;
+    }
+
+protected:
+    bool refill(vector<char> &pending) override {
+        if (header) {
+            putBytes(pending, "MThd", 4);
+            putBig32(pending, 6);
+            putBytes(pending, "\x00\x00\x00\x01\x00\x46", 6); // format 0, 1 track, 70 ppqn
+            putBytes(pending, "MTrk", 4);
+            putBig32(pending, static_cast<uint32_t>(trackLength));
+            putBytes(pending, midiTempo, sizeof(midiTempo) - 1);
+            header = false;
+            return converter.start();
+        }
+        // Batch a few events per refill; a single one is only a few bytes
+        while (!converter.finished && pending.size() < 4096)
+            if (!converter.step(pending)) return false;
+        return !converter.failed();
+    }
+
+private:
+    MusConverter converter;
+    size_t trackLength;
+    bool header;
+};
+
+// Detection
+
+static bool inFlatNamespace(const string &path) {
+    size_t start = 0;
+    size_t last = path.find_last_of('/');
+    if (last == string::npos) return false;
+    while (start < last) {
+        size_t slash = path.find('/', start);
+        if (slash == string::npos || slash > last) slash = last;
+        LumpName part;
+        if (slash > start && LumpName::fromString(path.substr(start, slash - start), &part)) {
+            part = part.upper();
+            if (part == LumpName::literal("F") || part == LumpName::literal("FF")) return true;
+        }
+        start = slash + 1;
+    }
+    return false;
+}
+
+static bool isMapLump(LumpName name) {
+    for (int i = 0; i < MapView::LumpCount; i++)
+        if (name == MapView::lumpName(static_cast<MapView::Lump>(i))) return true;
+    return false;
+}
+
+// Header plus column table: every column must start inside the lump
+static bool looksLikePatch(Wad *wad, Wad::LumpHandle handle, int64_t length) {
+    char header[8];
+    if (length < 8 || wad->read(handle, header, 8) != 8) return false;
+    int width, height;
+    if (!patchSize(header, static_cast<size_t>(length), &width, &height)) return false;
+
+    vector<char> columns(4 * static_cast<size_t>(width));
+    int64_t columnBytes = static_cast<int64_t>(columns.size());
+    if (wad->read(handle, columns.data(), columnBytes, 8) != columnBytes) return false;
+    for (int i = 0; i < width; i++) {
+        uint32_t offset = readInt(columns.data() + 4 * i);
+        if (offset < 8 + columns.size() || offset >= static_cast<uint64_t>(length)) return false;
+    }
+    return true;
+}
+
+LumpEncoder::Format LumpEncoder::detect(Wad *wad, const string &path, const Palette &pal) {
+    if (!wad) return None;
+    Wad::LumpHandle handle = wad->open(path);
+    if (handle == Wad::InvalidHandle) return None;
+
+    LumpName name;
+    if (!LumpName::fromString(path.substr(path.find_last_of('/') + 1), &name)) return None;
+    name = name.upper();
+    int64_t length = wad->size(handle);
+
+    char header[8];
+    int64_t got = wad->read(handle, header, 8);
+
+    if (name.size() > 2 && name.at(0) == 'D' && name.at(1) == '_') {
+        if (got >= 4 && memcmp(header, "MUS\x1a", 4) == 0) return Midi;
+    } else if (name.size() > 2 && name.at(0) == 'D' && name.at(1) == 'S') {
+        if (got == 8 && readShort(header) == 3) return Wav;
+    }
+
+    if (!pal.loaded() || isMapLump(name)) return None;
+    if (inFlatNamespace(path))
+        return length >= 64 && length % 64 == 0 ? Png : None;
+    return looksLikePatch(wad, handle, length) ? Png : None;
+}
+
+const char* LumpEncoder::extension(Format format) {
+    switch (format) {
+    case Png:  return ".png";
+    case Wav:  return ".wav";
+    case Midi: return ".mid";
+    default:   return "";
+    }
+}
+
+LumpEncoder* LumpEncoder::create(Wad *wad, const string &path, const Palette &pal) {
+    Format format = detect(wad, path, pal);
+    if (format == None) return nullptr;
+    Wad::LumpHandle handle = wad->open(path);
+
+    switch (format) {
+    case Png: {
+        vector<char> source;
+        if (!wad->readAll(handle, &source)) return nullptr;
+        bool flat = inFlatNamespace(path);
+        int width = 64, height = static_cast<int>(source.size() / 64);
+        if (!flat && !patchSize(source.data(), source.size(), &width, &height)) return nullptr;
+        return new PngEncoder(source, flat, width, height, pal);
+    }
+    case Wav: {
+        char header[8];
+        if (wad->read(handle, header, 8) != 8) return nullptr;
+        uint32_t rate = readShort(header + 2);
+        size_t count = min<size_t>(readInt(header + 4), static_cast<size_t>(wad->size(handle)) - 8);
+        size_t first = 8;
+        if (count >= 32) {
+            first += 16;
+            count -= 32;
+        }
+        return new WavEncoder(wad, handle, first, count, rate);
+    }
+    case Midi: {
+        size_t trackLength = MidiEncoder::measure(wad, handle);
+        if (trackLength == 0) return nullptr;
+        return new MidiEncoder(wad, handle, trackLength);
+    }
+    default:
+        return nullptr;
+    }
+}
+
+// Batch conversion
+
+static bool convertOne(Wad *wad, ConvertJob &job, const Palette &pal, char *buffer, size_t bufferSize) {
+    LumpEncoder *encoder = LumpEncoder::create(wad, job.path, pal);
+    if (!encoder) return false;
+    job.format = encoder->format();
+
+    int fd = -1;
+    if (!job.outputPath.empty()) {
+        fd = ::open(job.outputPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            delete encoder;
+            return false;
+        }
+    }
+
+    bool ok = true;
+    int r;
+    while (ok && (r = encoder->produce(buffer, bufferSize)) != 0) {
+        if (r < 0) ok = false;
+        else if (fd >= 0 && ::write(fd, buffer, static_cast<size_t>(r)) != r) ok = false;
+    }
+    if (ok) job.bytes = static_cast<int64_t>(encoder->size());
+
+    if (fd >= 0) ::close(fd);
+    delete encoder;
+    return ok;
+}
+
+int convertLumps(Wad *wad, vector<ConvertJob> &jobs, const Palette &pal, unsigned threads) {
+    if (!wad) return 0;
+    if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+    threads = static_cast<unsigned>(min<size_t>(threads, jobs.size()));
+
+    atomic<size_t> nextJob(0);
+    atomic<int> succeeded(0);
+    auto worker = [&]() {
+        vector<char> buffer(64 * 1024);
+        size_t i;
+        while ((i = nextJob.fetch_add(1)) < jobs.size()) {
+            jobs[i].format = LumpEncoder::None;
+            jobs[i].bytes = -1;
+            if (convertOne(wad, jobs[i], pal, buffer.data(), buffer.size())) succeeded++;
+        }
+    };
+
+    // the calling thread is one of the workers
+    vector<thread> pool;
+    try {
+        for (unsigned t = 1; t < threads; t++)
+            pool.emplace_back(worker);
+    } catch (const system_error &) {
+        // fewer workers; the jobs they would have taken are still shared
+    }
+    worker();
+    for (thread &t : pool)
+        t.join();
+    return succeeded;
+}
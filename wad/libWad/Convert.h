@@ -0,0 +1,106 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "LumpName.h"
+#include "Image.h"
+
+using namespace std;
+
+class Wad;
+
+// Sequential reader over one lump through a Wad handle. Only one window of
+// the lump is buffered, so memory stays constant whatever the lump's size.
+class LumpReader {
+
+public:
+    enum { Window = 4096 };
+
+    LumpReader(Wad *wad, uint64_t handle); // handle: a Wad::LumpHandle
+
+    size_t size() const { return length; }
+    size_t tell() const { return pos; }
+    bool seek(size_t offset);          // false past the end
+    bool failed() const { return error; }
+
+    int get() {                        // next byte, -1 at the end or on error
+        if (next == filled && !fill()) return -1;
+        pos++;
+        return static_cast<uint8_t>(window[next++]);
+    }
+    size_t read(char *out, size_t n);  // fewer than n only at the end or on error
+
+private:
+    bool fill();
+
+    Wad *wad;
+    uint64_t handle;
+    size_t length;
+    size_t pos;          // offset of window[next]
+    char window[Window];
+    size_t next;
+    size_t filled;
+    bool error;
+};
+
+// Streams a lump re-encoded in a format ordinary tools understand:
+// graphics -> PNG, DMX digital sound (DS*) -> WAV, MUS music (D_*) -> MIDI.
+// The exact encoded size is known as soon as the encoder exists; the bytes
+// themselves are produced piece by piece, so a reader can consume the start
+// of a large file before the rest has been encoded.
+class LumpEncoder {
+
+public:
+    enum Format { None, Png, Wav, Midi };
+
+    // Picks a format from the lump's name, namespace and first bytes; Png
+    // is only offered when `pal` is loaded
+    static Format detect(Wad *wad, const string &path, const Palette &pal);
+    static const char* extension(Format format); // ".png", ".wav", ".mid"; "" for None
+
+    // nullptr if the lump is missing or not convertible. `pal` and `wad` must
+    // outlive the encoder. Sounds and music are read through a LumpReader a
+    // window at a time; graphics are decoded whole on the first produce().
+    static LumpEncoder* create(Wad *wad, const string &path, const Palette &pal);
+
+    virtual ~LumpEncoder() {}
+
+    Format format() const { return kind; }
+    size_t size() const { return total; }          // encoded bytes, exact
+    size_t produced() const { return emitted; }
+    bool done() const { return emitted == total; }
+
+    // Copies up to `max` of the next encoded bytes into `out`. Returns the
+    // number copied, 0 once everything has been produced, -1 if the source
+    // turned out to be malformed part way through.
+    int produce(char *out, size_t max);
+
+protected:
+    LumpEncoder(Format format, size_t size) : kind(format), total(size), emitted(0), pendingPos(0) {}
+
+    // Appends the next piece of output to `pending`; false on error
+    virtual bool refill(vector<char> &pending) = 0;
+
+private:
+    Format kind;
+    size_t total;
+    size_t emitted;
+    vector<char> pending;
+    size_t pendingPos;
+};
+
+// One lump to convert in a batch
+struct ConvertJob {
+    string path;
+    string outputPath;          // written here; "" only measures the conversion
+    LumpEncoder::Format format; // set by convertLumps()
+    int64_t bytes;              // encoded size, -1 if the lump failed
+};
+
+// Converts every job on `threads` workers (0 = one per core). Each worker
+// streams through a fixed-size buffer, so memory does not grow with the
+// lumps. Returns the number of jobs that succeeded.
+int convertLumps(Wad *wad, vector<ConvertJob> &jobs, const Palette &pal, unsigned threads = 0);
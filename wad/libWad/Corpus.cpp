@@ -0,0 +1,501 @@
+#include "Corpus.h"
+#include "Wad.h"
+#include "Digest.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <system_error>
+#include <unordered_map>
+#include <cstring>
+#include <cstdio>
+#include <climits>
+
+using namespace std;
+
+// Index layout: a header, one record per file, the keys of each kind in
+// turn (sorted), the postings the keys point into, the distinct `where`
+// names the postings refer to by number, then the file paths. Every
+// section is a whole number of 8-byte words, so the records can be used
+// where the file is mapped.
+static const char CorpusMagic[4] = {'W', 'C', 'R', 'P'};
+static const uint32_t CorpusVersion = 1;
+
+struct CorpusHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t fileCount;
+    uint32_t whereCount;
+    uint32_t keyCount[CorpusIndex::KindCount];
+    uint32_t pathBytes;
+    uint64_t postingCount;
+};
+
+struct CorpusFile {
+    uint64_t digest;         // XXH64 of the whole file
+    uint64_t size;
+    int64_t mtime;           // nanoseconds
+    uint32_t pathOffset;
+    uint32_t pathLength;
+};
+
+struct CorpusKey {
+    uint64_t key;
+    uint32_t first;          // into the postings
+    uint32_t count;
+};
+
+struct CorpusPosting {
+    uint32_t file;
+    uint32_t where;          // into the where names
+};
+
+static_assert(sizeof(CorpusHeader) == 40, "corpus header layout");
+static_assert(sizeof(CorpusFile) == 32, "corpus file layout");
+static_assert(sizeof(CorpusKey) == 16, "corpus key layout");
+static_assert(sizeof(CorpusPosting) == 8, "corpus posting layout");
+
+// HEXEN's THINGS records; DOOM's are MapThing
+#pragma pack(push, 1)
+struct HexenThing {
+    int16_t tid;
+    int16_t x;
+    int16_t y;
+    int16_t height;
+    int16_t angle;
+    int16_t type;
+    int16_t flags;
+    uint8_t special;
+    uint8_t args[5];
+};
+#pragma pack(pop)
+static_assert(sizeof(HexenThing) == 20, "HEXEN THINGS record");
+
+const size_t TextProbe = 512;          // bytes looked at to tell text from binary
+const uint64_t MaxTextLump = 16 << 20; // larger text lumps are not tokenized
+
+// Section offsets of an index image, checked against its size
+struct CorpusLayout {
+    const CorpusHeader *header;
+    const CorpusFile *files;
+    const CorpusKey *keys;   // kinds in turn
+    const CorpusPosting *postings;
+    const uint64_t *wheres;
+    const char *paths;
+    size_t keyCount;
+};
+
+static bool layoutOf(const char *image, size_t size, CorpusLayout *out) {
+    if (size < sizeof(CorpusHeader)) return false;
+    const CorpusHeader *h = reinterpret_cast<const CorpusHeader*>(image);
+    if (memcmp(h->magic, CorpusMagic, 4) != 0 || h->version != CorpusVersion) return false;
+
+    size_t keys = 0;
+    for (uint32_t count : h->keyCount) keys += count;
+    uint64_t expected = sizeof(CorpusHeader) + static_cast<uint64_t>(h->fileCount) * sizeof(CorpusFile) +
+                        keys * sizeof(CorpusKey) + h->postingCount * sizeof(CorpusPosting) +
+                        static_cast<uint64_t>(h->whereCount) * 8 + h->pathBytes;
+    if (h->postingCount > UINT32_MAX || expected != size) return false;
+
+    out->header = h;
+    out->files = reinterpret_cast<const CorpusFile*>(image + sizeof(CorpusHeader));
+    out->keys = reinterpret_cast<const CorpusKey*>(out->files + h->fileCount);
+    out->postings = reinterpret_cast<const CorpusPosting*>(out->keys + keys);
+    out->wheres = reinterpret_cast<const uint64_t*>(out->postings + h->postingCount);
+    out->paths = reinterpret_cast<const char*>(out->wheres + h->whereCount);
+    out->keyCount = keys;
+    return true;
+}
+
+// Opening and queries
+
+CorpusIndex::CorpusIndex() : image(nullptr), size(0) {
+}
+
+CorpusIndex::~CorpusIndex() {
+    if (image) munmap(const_cast<char*>(image), size);
+}
+
+CorpusIndex* CorpusIndex::open(const string &indexPath) {
+    int fd = ::open(indexPath.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    void *mapped = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        mapped = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) return nullptr;
+
+    CorpusIndex *index = new CorpusIndex();
+    index->image = static_cast<const char*>(mapped);
+    index->size = static_cast<size_t>(st.st_size);
+    CorpusLayout layout;
+    if (!layoutOf(index->image, index->size, &layout)) {
+        delete index;
+        return nullptr;
+    }
+    return index;
+}
+
+vector<CorpusIndex::Hit> CorpusIndex::find(Kind kind, uint64_t key) const {
+    vector<Hit> hits;
+    CorpusLayout l;
+    if (kind < 0 || kind >= KindCount || !layoutOf(image, size, &l)) return hits;
+
+    const CorpusKey *begin = l.keys;
+    for (int k = 0; k < kind; k++) begin += l.header->keyCount[k];
+    const CorpusKey *end = begin + l.header->keyCount[kind];
+    const CorpusKey *found = lower_bound(begin, end, key, [](const CorpusKey &k, uint64_t v) { return k.key < v; });
+    if (found == end || found->key != key ||
+        static_cast<uint64_t>(found->first) + found->count > l.header->postingCount)
+        return hits;
+
+    hits.reserve(found->count);
+    for (uint32_t i = 0; i < found->count; i++) {
+        const CorpusPosting &p = l.postings[found->first + i];
+        if (p.file < l.header->fileCount && p.where < l.header->whereCount)
+            hits.push_back({p.file, LumpName(l.wheres[p.where])});
+    }
+    return hits;
+}
+
+vector<CorpusIndex::Hit> CorpusIndex::findName(const string &name) const {
+    LumpName key;
+    if (!LumpName::fromString(name, &key)) return {};
+    return find(Name, key.upper().bits);
+}
+
+vector<CorpusIndex::Hit> CorpusIndex::findWord(const string &word) const {
+    return find(Word, wordKey(word));
+}
+
+uint32_t CorpusIndex::fileCount() const {
+    return reinterpret_cast<const CorpusHeader*>(image)->fileCount;
+}
+
+string CorpusIndex::path(uint32_t file) const {
+    CorpusLayout l;
+    if (!layoutOf(image, size, &l) || file >= l.header->fileCount) return "";
+    const CorpusFile &f = l.files[file];
+    if (static_cast<uint64_t>(f.pathOffset) + f.pathLength > l.header->pathBytes) return "";
+    return string(l.paths + f.pathOffset, f.pathLength);
+}
+
+uint64_t CorpusIndex::wordKey(const string &word) {
+    char folded[64];         // the common case, without an allocation
+    string longer;
+    char *bytes = folded;
+    if (word.size() > sizeof(folded)) {
+        longer.resize(word.size());
+        bytes = &longer[0];
+    }
+    for (size_t i = 0; i < word.size(); i++) {
+        char c = word[i];
+        bytes[i] = c >= 'A' && c <= 'Z' ? static_cast<char>(c | 0x20) : c;
+    }
+    return xxh64(bytes, word.size());
+}
+
+// Indexing
+
+namespace {
+
+struct Entry {
+    uint64_t key;
+    uint64_t where;          // LumpName bits
+    uint32_t file;
+    uint8_t kind;
+
+    bool operator<(const Entry &o) const {
+        if (kind != o.kind) return kind < o.kind;
+        if (key != o.key) return key < o.key;
+        if (file != o.file) return file < o.file;
+        return where < o.where;
+    }
+    bool operator==(const Entry &o) const {
+        return kind == o.kind && key == o.key && file == o.file && where == o.where;
+    }
+};
+
+// One file of the new index while it is being looked at
+struct Source {
+    bool ok = false;
+    uint64_t digest = 0;
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    int64_t reuse = -1;      // old file whose postings it keeps
+    vector<Entry> entries;   // when read; file is filled in later
+};
+
+}
+
+static bool statPath(const string &path, uint64_t *size, int64_t *mtime) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return false;
+    *size = static_cast<uint64_t>(st.st_size);
+    *mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+static bool digestFile(const string &path, uint64_t size, uint64_t *digest) {
+    if (size == 0) {
+        *digest = xxh64(nullptr, 0);
+        return true;
+    }
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) return false;
+    *digest = xxh64(mapped, size);
+    munmap(mapped, size);
+    return true;
+}
+
+static bool looksLikeText(const char *bytes, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = static_cast<unsigned char>(bytes[i]);
+        if (c < 0x20 && c != '\t' && c != '\n' && c != '\r') return false;
+    }
+    return length > 0;
+}
+
+// Each distinct word once per lump
+static void addWords(const vector<char> &text, LumpName lump, vector<Entry> *entries) {
+    auto wordChar = [](char c) { return isalnum(static_cast<unsigned char>(c)) || c == '_'; };
+    vector<uint64_t> keys;
+    string word;
+    size_t i = 0;
+    while (i < text.size()) {
+        while (i < text.size() && !wordChar(text[i])) i++;
+        size_t start = i;
+        while (i < text.size() && wordChar(text[i])) i++;
+        if (i - start < 2) continue;
+        word.assign(text.data() + start, i - start);
+        keys.push_back(CorpusIndex::wordKey(word));
+    }
+    sort(keys.begin(), keys.end());
+    keys.erase(unique(keys.begin(), keys.end()), keys.end());
+    for (uint64_t key : keys) entries->push_back({key, lump.bits, 0, CorpusIndex::Word});
+}
+
+// Loads the file read-only and lazily, so only the lumps asked for are read
+static bool indexWad(const string &path, vector<Entry> *entries) {
+    Wad::LoadOptions options;
+    options.lazy = true;
+    options.readOnly = true;
+    options.prefetch = false; // a map's other lumps are never read
+    unique_ptr<Wad> wad(Wad::loadWad(path, options));
+    if (!wad || (wad->getMagic() != "IWAD" && wad->getMagic() != "PWAD")) return false;
+    GameFormat format = wad->getFormat();
+
+    vector<char> bytes;
+    auto walk = [&](auto &self, const string &dir, LumpName dirName) -> void {
+        vector<string> names;
+        if (wad->getDirectory(dir, &names) < 0) return;
+        for (const string &name : names) {
+            string child = (dir == "/" ? dir : dir + "/") + name;
+            LumpName lump;
+            if (!LumpName::fromString(name, &lump)) continue;
+
+            if (wad->isDirectory(child)) {
+                if (classifyLump(format, lump) & LumpClass::MapMarker) {
+                    bool hexen = format == GameFormat::Hexen;
+                    if (wad->readAll(wad->open(child + "/THINGS"), &bytes)) {
+                        if (hexen) {
+                            for (const HexenThing &t : RecordSpan<HexenThing>(bytes.data(), bytes.size()))
+                                entries->push_back({static_cast<uint16_t>(t.type), lump.bits, 0, CorpusIndex::Thing});
+                        } else {
+                            for (const MapThing &t : RecordSpan<MapThing>(bytes.data(), bytes.size()))
+                                entries->push_back({static_cast<uint16_t>(t.type), lump.bits, 0, CorpusIndex::Thing});
+                        }
+                    }
+                }
+                self(self, child, lump);
+                continue;
+            }
+
+            entries->push_back({lump.upper().bits, dirName.bits, 0, CorpusIndex::Name});
+
+            Wad::LumpHandle handle = wad->open(child);
+            int64_t size = wad->size(handle);
+            if (size <= 0 || static_cast<uint64_t>(size) > MaxTextLump) continue;
+            char probe[TextProbe];
+            int64_t got = wad->read(handle, probe, min<int64_t>(size, TextProbe));
+            if (got <= 0 || !looksLikeText(probe, static_cast<size_t>(got))) continue;
+            if (wad->readAll(handle, &bytes)) addWords(bytes, lump, entries);
+        }
+    };
+    walk(walk, "/", LumpName());
+
+    sort(entries->begin(), entries->end());
+    entries->erase(unique(entries->begin(), entries->end()), entries->end());
+    return true;
+}
+
+bool CorpusIndex::update(const string &indexPath, const vector<string> &files, unsigned threads,
+                         UpdateStats *stats) {
+    UpdateStats counts = {0, 0, 0, 0};
+    unique_ptr<CorpusIndex> old(open(indexPath));
+    CorpusLayout before;
+    bool hasOld = old && layoutOf(old->image, old->size, &before);
+    uint32_t oldCount = hasOld ? before.header->fileCount : 0;
+
+    // A file changed in the same clock tick as the old index was written may
+    // still show the size and mtime it recorded, so those are trusted only
+    // for files older than the index
+    uint64_t indexSize = 0;
+    int64_t indexTime = INT64_MIN;
+    if (hasOld) statPath(indexPath, &indexSize, &indexTime);
+
+    unordered_map<string, uint32_t> oldByPath;
+    unordered_map<uint64_t, uint32_t> oldByDigest;
+    for (uint32_t f = 0; f < oldCount; f++) {
+        oldByPath.emplace(old->path(f), f);
+        oldByDigest.emplace(before.files[f].digest, f);
+    }
+
+    // Each file: unchanged by size and mtime, else by digest, else read
+    vector<Source> sources(files.size());
+    atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i; (i = next++) < files.size();) {
+            Source &s = sources[i];
+            if (!statPath(files[i], &s.size, &s.mtime)) continue;
+            auto same = oldByPath.find(files[i]);
+            if (same != oldByPath.end() && before.files[same->second].size == s.size &&
+                before.files[same->second].mtime == s.mtime && s.mtime < indexTime) {
+                s.digest = before.files[same->second].digest;
+                s.reuse = same->second;
+                s.ok = true;
+                continue;
+            }
+            if (!digestFile(files[i], s.size, &s.digest)) continue;
+            auto moved = oldByDigest.find(s.digest);
+            if (moved != oldByDigest.end()) {
+                s.reuse = moved->second;
+                s.ok = true;
+                continue;
+            }
+            s.ok = indexWad(files[i], &s.entries);
+        }
+    };
+    if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+    vector<thread> pool;
+    try {
+        for (unsigned t = 1; t < threads && t < files.size(); t++) pool.emplace_back(worker);
+    } catch (const system_error &) {
+        // fewer workers; this thread indexes whatever files they leave
+    }
+    worker();
+    for (thread &t : pool) t.join();
+
+    // New file numbers, and the new files each old file's postings go to
+    vector<uint32_t> number(files.size(), UINT32_MAX);
+    vector<vector<uint32_t>> reusedBy(oldCount);
+    uint32_t fileCount = 0;
+    unordered_map<string, bool> listed;
+    for (size_t i = 0; i < files.size(); i++) {
+        listed[files[i]] = true;
+        if (!sources[i].ok) {
+            counts.failed++;
+            continue;
+        }
+        number[i] = fileCount++;
+        if (sources[i].reuse >= 0) {
+            reusedBy[sources[i].reuse].push_back(number[i]);
+            counts.kept++;
+        } else {
+            counts.indexed++;
+        }
+    }
+    for (uint32_t f = 0; f < oldCount; f++)
+        if (!listed.count(old->path(f))) counts.removed++;
+
+    vector<Entry> entries;
+    for (size_t i = 0; i < files.size(); i++) {
+        for (Entry e : sources[i].entries) {
+            e.file = number[i];
+            entries.push_back(e);
+        }
+        vector<Entry>().swap(sources[i].entries);
+    }
+    if (hasOld) {
+        const CorpusKey *key = before.keys;
+        for (uint8_t kind = 0; kind < KindCount; kind++) {
+            for (uint32_t k = 0; k < before.header->keyCount[kind]; k++, key++) {
+                if (static_cast<uint64_t>(key->first) + key->count > before.header->postingCount) continue;
+                for (uint32_t p = key->first; p < key->first + key->count; p++) {
+                    const CorpusPosting &posting = before.postings[p];
+                    if (posting.file >= oldCount || posting.where >= before.header->whereCount) continue;
+                    for (uint32_t file : reusedBy[posting.file])
+                        entries.push_back({key->key, before.wheres[posting.where], file, kind});
+                }
+            }
+        }
+    }
+    sort(entries.begin(), entries.end());
+    entries.erase(unique(entries.begin(), entries.end()), entries.end());
+    if (entries.size() > UINT32_MAX) return false;
+
+    // Where names, numbered in sorted order
+    vector<uint64_t> wheres;
+    for (const Entry &e : entries) wheres.push_back(e.where);
+    sort(wheres.begin(), wheres.end());
+    wheres.erase(unique(wheres.begin(), wheres.end()), wheres.end());
+
+    CorpusHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CorpusMagic, 4);
+    header.version = CorpusVersion;
+    header.fileCount = fileCount;
+    header.whereCount = static_cast<uint32_t>(wheres.size());
+    header.postingCount = entries.size();
+
+    vector<CorpusFile> records;
+    string paths;
+    for (size_t i = 0; i < files.size(); i++) {
+        if (number[i] == UINT32_MAX) continue;
+        records.push_back({sources[i].digest, sources[i].size, sources[i].mtime,
+                           static_cast<uint32_t>(paths.size()), static_cast<uint32_t>(files[i].size())});
+        paths += files[i];
+    }
+    paths.resize((paths.size() + 7) & ~size_t(7), '\0'); // the image stays a whole number of words
+    header.pathBytes = static_cast<uint32_t>(paths.size());
+
+    vector<CorpusKey> keys;
+    vector<CorpusPosting> postings;
+    postings.reserve(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+        const Entry &e = entries[i];
+        if (i == 0 || e.kind != entries[i - 1].kind || e.key != entries[i - 1].key) {
+            keys.push_back({e.key, static_cast<uint32_t>(i), 0});
+            header.keyCount[e.kind]++;
+        }
+        keys.back().count++;
+        uint32_t where = static_cast<uint32_t>(lower_bound(wheres.begin(), wheres.end(), e.where) - wheres.begin());
+        postings.push_back({e.file, where});
+    }
+
+    // written aside and renamed, so an open index keeps what it mapped
+    string tempPath = indexPath + ".tmp";
+    FILE *out = fopen(tempPath.c_str(), "wb");
+    if (!out) return false;
+    bool written = fwrite(&header, sizeof(header), 1, out) == 1 &&
+                   fwrite(records.data(), sizeof(CorpusFile), records.size(), out) == records.size() &&
+                   fwrite(keys.data(), sizeof(CorpusKey), keys.size(), out) == keys.size() &&
+                   fwrite(postings.data(), sizeof(CorpusPosting), postings.size(), out) == postings.size() &&
+                   fwrite(wheres.data(), 8, wheres.size(), out) == wheres.size() &&
+                   fwrite(paths.data(), 1, paths.size(), out) == paths.size();
+    written = fclose(out) == 0 && written;
+    if (!written || rename(tempPath.c_str(), indexPath.c_str()) != 0) {
+        unlink(tempPath.c_str());
+        return false;
+    }
+    if (stats) *stats = counts;
+    return true;
+}
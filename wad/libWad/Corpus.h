@@ -0,0 +1,70 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "LumpName.h"
+
+using namespace std;
+
+// Inverted index over a corpus of WAD files, kept in one file that queries
+// map read-only. Three kinds of key, each with the files it occurs in and
+// where:
+//   Name   a lump's 8-byte name, upper-cased  -> the directory holding it
+//                                                ("" at the root)
+//   Word   a word of a text lump, lower-cased -> the text lump
+//   Thing  a THINGS type number               -> the map
+// Words are letters, digits and '_'; a lump counts as text when its first
+// bytes are printable. Keys are sorted per kind, so a lookup is a binary
+// search and a copy of its postings.
+class CorpusIndex {
+
+public:
+    enum Kind { Name, Word, Thing, KindCount };
+
+    struct Hit {
+        uint32_t file;       // see path()
+        LumpName where;
+    };
+
+    // Rewrites the index at indexPath to cover exactly `files`. A file keeps
+    // its postings unread when its path, size and mtime match the old index
+    // (and it is older than the index), or else its XXH64 matches any old
+    // entry; the rest are loaded read-only and lazily, on `threads` workers
+    // (0 = one per core), reading only their text lumps and THINGS. Files
+    // that do not load as WADs are left out. The new index is written aside
+    // and renamed over the old one, so open indexes keep their snapshot.
+    // False if it cannot be written.
+    struct UpdateStats {
+        unsigned kept;       // postings reused
+        unsigned indexed;    // loaded and read
+        unsigned removed;    // in the old index but not in files
+        unsigned failed;     // not WADs
+    };
+    static bool update(const string &indexPath, const vector<string> &files, unsigned threads = 0,
+                       UpdateStats *stats = nullptr);
+
+    static CorpusIndex* open(const string &indexPath); // nullptr if missing or damaged
+    ~CorpusIndex();
+
+    // Hits in file order; names and words are folded as they were indexed
+    vector<Hit> find(Kind kind, uint64_t key) const;
+    vector<Hit> findName(const string &name) const;
+    vector<Hit> findWord(const string &word) const;
+    vector<Hit> findThing(uint16_t type) const { return find(Thing, type); }
+
+    uint32_t fileCount() const;
+    string path(uint32_t file) const;
+
+    static uint64_t wordKey(const string &word);
+
+private:
+    CorpusIndex();
+    CorpusIndex(const CorpusIndex &) = delete;
+    CorpusIndex &operator=(const CorpusIndex &) = delete;
+
+    const char *image;       // the mapped file
+    size_t size;
+};
@@ -0,0 +1,494 @@
+#include "Digest.h"
+#include "WadHeader.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <nmmintrin.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <system_error>
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+
+// CRC32C
+
+static const uint32_t CrcPoly = 0x82F63B78u; // reflected Castagnoli polynomial
+
+// GF(2) 32x32 matrices as zlib's crc32_combine() uses them: mat[n] is the
+// image of bit n
+static uint32_t gf2Times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, mat++)
+        if (vec & 1) sum ^= *mat;
+    return sum;
+}
+
+static void gf2Square(uint32_t *square, const uint32_t *mat) {
+    for (int n = 0; n < 32; n++)
+        square[n] = gf2Times(mat, mat[n]);
+}
+
+// The operator that feeds `length` zero bytes through a raw CRC register
+static void zerosOperator(size_t length, uint32_t op[32]) {
+    uint32_t odd[32], even[32];
+    odd[0] = CrcPoly;                 // one zero bit
+    for (int n = 1; n < 32; n++)
+        odd[n] = 1u << (n - 1);
+    gf2Square(even, odd);             // two bits
+    gf2Square(odd, even);             // four bits
+
+    for (int n = 0; n < 32; n++)
+        op[n] = 1u << n;
+    while (length) {
+        gf2Square(even, odd);         // one byte, then 4, 16, ...
+        if (length & 1)
+            for (int n = 0; n < 32; n++) op[n] = gf2Times(even, op[n]);
+        length >>= 1;
+        if (!length) break;
+        gf2Square(odd, even);         // 2, 8, 32, ... bytes
+        if (length & 1)
+            for (int n = 0; n < 32; n++) op[n] = gf2Times(odd, op[n]);
+        length >>= 1;
+    }
+}
+
+uint32_t crc32cCombine(uint32_t crcA, uint32_t crcB, size_t lengthB) {
+    if (lengthB == 0) return crcA;
+    uint32_t op[32];
+    zerosOperator(lengthB, op);
+    return gf2Times(op, crcA) ^ crcB;
+}
+
+namespace {
+
+// Byte table for the scalar loop
+struct CrcTable {
+    uint32_t entry[256];
+
+    CrcTable() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? (c >> 1) ^ CrcPoly : c >> 1;
+            entry[i] = c;
+        }
+    }
+};
+
+// The zeros operator for one stripe, spread over four byte tables so
+// shifting a register past a stripe costs four lookups
+struct StripeShift {
+    enum { Stripe = 4096 };
+    uint32_t table[4][256];
+
+    StripeShift() {
+        uint32_t op[32];
+        zerosOperator(Stripe, op);
+        for (int k = 0; k < 4; k++)
+            for (uint32_t b = 0; b < 256; b++)
+                table[k][b] = gf2Times(op, b << (8 * k));
+    }
+
+    uint32_t operator()(uint32_t c) const {
+        return table[0][c & 0xFF] ^ table[1][(c >> 8) & 0xFF] ^
+               table[2][(c >> 16) & 0xFF] ^ table[3][c >> 24];
+    }
+};
+
+}
+
+static uint32_t crcScalar(const uint8_t *p, size_t n, uint32_t crc) {
+    static const CrcTable table;
+    uint32_t c = ~crc;
+    while (n--)
+        c = table.entry[(c ^ *p++) & 0xFF] ^ (c >> 8);
+    return ~c;
+}
+
+// The crc32 instruction has a latency of three cycles but issues one per
+// cycle, so long inputs run three independent stripes at once and join them
+__attribute__((target("sse4.2")))
+static uint32_t crcSse42(const uint8_t *p, size_t n, uint32_t crc) {
+    static const StripeShift shift;
+    const size_t Stripe = StripeShift::Stripe;
+    uint64_t c0 = static_cast<uint32_t>(~crc);
+
+    while (n && (reinterpret_cast<uintptr_t>(p) & 7)) {
+        c0 = _mm_crc32_u8(static_cast<uint32_t>(c0), *p++);
+        n--;
+    }
+    while (n >= 3 * Stripe) {
+        uint64_t c1 = 0, c2 = 0;
+        for (size_t i = 0; i < Stripe; i += 8) {
+            uint64_t a, b, c;
+            memcpy(&a, p + i, 8);
+            memcpy(&b, p + Stripe + i, 8);
+            memcpy(&c, p + 2 * Stripe + i, 8);
+            c0 = _mm_crc32_u64(c0, a);
+            c1 = _mm_crc32_u64(c1, b);
+            c2 = _mm_crc32_u64(c2, c);
+        }
+        c0 = shift(shift(static_cast<uint32_t>(c0)) ^ static_cast<uint32_t>(c1)) ^ static_cast<uint32_t>(c2);
+        p += 3 * Stripe;
+        n -= 3 * Stripe;
+    }
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c0 = _mm_crc32_u64(c0, v);
+    }
+    while (n--)
+        c0 = _mm_crc32_u8(static_cast<uint32_t>(c0), *p++);
+    return ~static_cast<uint32_t>(c0);
+}
+
+bool crc32cKernelSupported(CrcKernel kernel) {
+    switch (kernel) {
+    case CrcKernel::Sse42: return __builtin_cpu_supports("sse4.2");
+    default:               return true;
+    }
+}
+
+uint32_t crc32c(const void *data, size_t length, uint32_t crc, CrcKernel kernel) {
+    static const bool sse42 = __builtin_cpu_supports("sse4.2");
+    const uint8_t *p = static_cast<const uint8_t*>(data);
+    if (kernel != CrcKernel::Scalar && sse42) return crcSse42(p, length, crc);
+    return crcScalar(p, length, crc);
+}
+
+// XXH64
+
+static const uint64_t Prime1 = 11400714785074694791ULL;
+static const uint64_t Prime2 = 14029467366897019727ULL;
+static const uint64_t Prime3 = 1609587929392839161ULL;
+static const uint64_t Prime4 = 9650029242287828579ULL;
+static const uint64_t Prime5 = 2870177450012600261ULL;
+
+static uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t load64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static uint64_t xxRound(uint64_t acc, uint64_t input) {
+    acc += input * Prime2;
+    return rotl(acc, 31) * Prime1;
+}
+
+static uint64_t xxMerge(uint64_t acc, uint64_t lane) {
+    acc ^= xxRound(0, lane);
+    return acc * Prime1 + Prime4;
+}
+
+Xxh64::Xxh64(uint64_t seed)
+    : seed(seed), lanes{seed + Prime1 + Prime2, seed + Prime2, seed, seed - Prime1},
+      total(0), buffered(0) {
+}
+
+void Xxh64::update(const void *data, size_t length) {
+    const uint8_t *p = static_cast<const uint8_t*>(data);
+    total += length;
+
+    if (buffered) {
+        size_t take = min(length, sizeof(buffer) - buffered);
+        memcpy(buffer + buffered, p, take);
+        buffered += take;
+        p += take;
+        length -= take;
+        if (buffered < sizeof(buffer)) return;
+        for (int i = 0; i < 4; i++)
+            lanes[i] = xxRound(lanes[i], load64(buffer + 8 * i));
+        buffered = 0;
+    }
+
+    // the four lanes are independent, which keeps the multipliers busy
+    uint64_t v1 = lanes[0], v2 = lanes[1], v3 = lanes[2], v4 = lanes[3];
+    for (; length >= 32; p += 32, length -= 32) {
+        v1 = xxRound(v1, load64(p));
+        v2 = xxRound(v2, load64(p + 8));
+        v3 = xxRound(v3, load64(p + 16));
+        v4 = xxRound(v4, load64(p + 24));
+    }
+    lanes[0] = v1;
+    lanes[1] = v2;
+    lanes[2] = v3;
+    lanes[3] = v4;
+
+    memcpy(buffer, p, length);
+    buffered = length;
+}
+
+uint64_t Xxh64::digest() const {
+    uint64_t h;
+    if (total >= 32) {
+        h = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18);
+        for (uint64_t lane : lanes)
+            h = xxMerge(h, lane);
+    } else {
+        h = seed + Prime5;
+    }
+    h += total;
+
+    const uint8_t *p = buffer;
+    size_t n = buffered;
+    for (; n >= 8; p += 8, n -= 8) {
+        h ^= xxRound(0, load64(p));
+        h = rotl(h, 27) * Prime1 + Prime4;
+    }
+    if (n >= 4) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        h ^= v * Prime1;
+        h = rotl(h, 23) * Prime2 + Prime3;
+        p += 4;
+        n -= 4;
+    }
+    while (n--) {
+        h ^= *p++ * Prime5;
+        h = rotl(h, 11) * Prime1;
+    }
+
+    h ^= h >> 33;
+    h *= Prime2;
+    h ^= h >> 29;
+    h *= Prime3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t xxh64(const void *data, size_t length, uint64_t seed) {
+    Xxh64 state(seed);
+    state.update(data, length);
+    return state.digest();
+}
+
+// WAD digests
+
+static const size_t ReadChunk = 1 << 20;   // per-worker read buffer
+static const size_t FilePiece = 4 << 20;   // file CRC32C is taken in pieces this big
+
+// Feeds [offset, offset + length) of the file to `consume` a chunk at a time
+template <typename Consume>
+static bool readRange(int fd, uint64_t offset, uint64_t length, vector<char> &buffer, Consume consume) {
+    while (length) {
+        size_t want = static_cast<size_t>(min<uint64_t>(length, buffer.size()));
+        ssize_t r = pread(fd, buffer.data(), want, static_cast<off_t>(offset));
+        if (r <= 0) return false;
+        consume(buffer.data(), static_cast<size_t>(r));
+        offset += r;
+        length -= r;
+    }
+    return true;
+}
+
+bool digestWad(const string &path, WadDigest *out, unsigned threads) {
+    if (!out) return false;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    WadHeader header;
+    if (fstat(fd, &st) != 0 || readWadHeader(fd, &header) != WadHeaderStatus::Ok) {
+        close(fd);
+        return false;
+    }
+    WadDigest digest;
+    digest.fileSize = static_cast<uint64_t>(st.st_size);
+    digest.mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+
+    if (!wadTableFits(header, digest.fileSize)) {
+        close(fd);
+        return false;
+    }
+    size_t count = static_cast<size_t>(header.count);
+    vector<char> table(count * header.entrySize);
+    if (!table.empty() && pread(fd, table.data(), table.size(), static_cast<off_t>(header.tableOffset)) !=
+                          static_cast<ssize_t>(table.size())) {
+        close(fd);
+        return false;
+    }
+
+    Xxh64 empty;
+    digest.lumps.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        LumpDigest &lump = digest.lumps[i];
+        readWadEntry(header, table.data() + i * header.entrySize, &lump.offset, &lump.length, &lump.name);
+        lump.crc32c = 0;
+        lump.xxh64 = empty.digest();
+        if (lump.length && (lump.offset > digest.fileSize || lump.length > digest.fileSize - lump.offset)) {
+            close(fd);
+            return false;
+        }
+    }
+
+    // Tasks: the file's XXH64 first since it is the longest, then the file
+    // CRC32C pieces, then the lumps largest first
+    vector<size_t> lumpOrder;
+    for (size_t i = 0; i < count; i++)
+        if (digest.lumps[i].length) lumpOrder.push_back(i);
+    stable_sort(lumpOrder.begin(), lumpOrder.end(), [&](size_t a, size_t b) {
+        return digest.lumps[a].length > digest.lumps[b].length;
+    });
+    size_t pieces = static_cast<size_t>((digest.fileSize + FilePiece - 1) / FilePiece);
+    vector<uint32_t> pieceCrc(pieces, 0);
+    size_t tasks = 1 + pieces + lumpOrder.size();
+
+    atomic<size_t> next(0);
+    atomic<bool> failed(false);
+    auto worker = [&]() {
+        vector<char> buffer(ReadChunk);
+        for (size_t t; (t = next++) < tasks && !failed;) {
+            bool ok;
+            if (t == 0) {
+                Xxh64 state;
+                ok = readRange(fd, 0, digest.fileSize, buffer, [&](const char *p, size_t n) { state.update(p, n); });
+                digest.xxh64 = state.digest();
+            } else if (t <= pieces) {
+                uint64_t start = (t - 1) * static_cast<uint64_t>(FilePiece);
+                uint32_t crc = 0;
+                ok = readRange(fd, start, min<uint64_t>(FilePiece, digest.fileSize - start), buffer,
+                               [&](const char *p, size_t n) { crc = crc32c(p, n, crc); });
+                pieceCrc[t - 1] = crc;
+            } else {
+                LumpDigest &lump = digest.lumps[lumpOrder[t - 1 - pieces]];
+                Xxh64 state;
+                uint32_t crc = 0;
+                ok = readRange(fd, lump.offset, lump.length, buffer, [&](const char *p, size_t n) {
+                    crc = crc32c(p, n, crc);
+                    state.update(p, n);
+                });
+                lump.crc32c = crc;
+                lump.xxh64 = state.digest();
+            }
+            if (!ok) failed = true;
+        }
+    };
+    if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+    threads = static_cast<unsigned>(min<size_t>(threads, tasks));
+    vector<thread> pool;
+    try {
+        for (unsigned t = 1; t < threads; t++)
+            pool.emplace_back(worker);
+    } catch (const system_error &) {
+        // fewer workers; this thread hashes whatever pieces they leave
+    }
+    worker();
+    for (thread &t : pool)
+        t.join();
+    close(fd);
+    if (failed) return false;
+
+    digest.crc32c = 0;
+    for (size_t k = 0; k < pieces; k++)
+        digest.crc32c = crc32cCombine(digest.crc32c, pieceCrc[k],
+                                      min<uint64_t>(FilePiece, digest.fileSize - k * static_cast<uint64_t>(FilePiece)));
+    *out = move(digest);
+    return true;
+}
+
+string formatManifest(const WadDigest &digest) {
+    string text = "WADDIGEST 1\n";
+    char line[128];
+    snprintf(line, sizeof(line), "file %llu %lld %08x %016llx\n",
+             static_cast<unsigned long long>(digest.fileSize), static_cast<long long>(digest.mtime),
+             digest.crc32c, static_cast<unsigned long long>(digest.xxh64));
+    text += line;
+    for (size_t i = 0; i < digest.lumps.size(); i++) {
+        const LumpDigest &lump = digest.lumps[i];
+        snprintf(line, sizeof(line), "%zu %llu %llu %08x %016llx ", i, static_cast<unsigned long long>(lump.offset),
+                 static_cast<unsigned long long>(lump.length), lump.crc32c,
+                 static_cast<unsigned long long>(lump.xxh64));
+        text += line;
+        text += lump.name.str();
+        text += '\n';
+    }
+    return text;
+}
+
+bool parseManifest(const string &text, WadDigest *out) {
+    if (!out) return false;
+    WadDigest digest;
+    size_t pos = 0;
+    auto nextLine = [&](string *line) {
+        if (pos >= text.size()) return false;
+        size_t end = text.find('\n', pos);
+        if (end == string::npos) return false; // every line is terminated
+        *line = text.substr(pos, end - pos);
+        pos = end + 1;
+        return true;
+    };
+
+    string line;
+    if (!nextLine(&line) || line != "WADDIGEST 1") return false;
+    unsigned long long size, xxh;
+    long long mtime;
+    unsigned crc;
+    if (!nextLine(&line) || sscanf(line.c_str(), "file %llu %lld %x %llx", &size, &mtime, &crc, &xxh) != 4)
+        return false;
+    digest.fileSize = size;
+    digest.mtime = mtime;
+    digest.crc32c = crc;
+    digest.xxh64 = xxh;
+
+    while (nextLine(&line)) {
+        size_t index;
+        unsigned long long offset, length;
+        int nameAt = -1;
+        if (sscanf(line.c_str(), "%zu %llu %llu %x %llx %n", &index, &offset, &length, &crc, &xxh, &nameAt) != 5 ||
+            nameAt < 0 || index != digest.lumps.size())
+            return false;
+        LumpDigest lump;
+        if (!LumpName::fromString(line.substr(nameAt), &lump.name)) return false;
+        lump.offset = offset;
+        lump.length = length;
+        lump.crc32c = crc;
+        lump.xxh64 = xxh;
+        digest.lumps.push_back(lump);
+    }
+    *out = move(digest);
+    return true;
+}
+
+bool digestWadCached(const string &path, WadDigest *out, unsigned threads) {
+    if (!out) return false;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return false;
+    int64_t mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+
+    string cachePath = path + ".digest";
+    int fd = ::open(cachePath.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        string text;
+        char chunk[65536];
+        ssize_t r;
+        while ((r = ::read(fd, chunk, sizeof(chunk))) > 0)
+            text.append(chunk, static_cast<size_t>(r));
+        close(fd);
+
+        WadDigest cached;
+        if (parseManifest(text, &cached) && cached.fileSize == static_cast<uint64_t>(st.st_size) &&
+            cached.mtime == mtime) {
+            *out = move(cached);
+            return true;
+        }
+    }
+
+    if (!digestWad(path, out, threads)) return false;
+
+    // written aside and renamed, so a reader never sees half a cache
+    string text = formatManifest(*out);
+    string tempPath = cachePath + ".tmp";
+    fd = ::open(tempPath.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    if (fd < 0) return true;
+    bool written = ::write(fd, text.data(), text.size()) == static_cast<ssize_t>(text.size());
+    close(fd);
+    if (!written || rename(tempPath.c_str(), cachePath.c_str()) != 0) unlink(tempPath.c_str());
+    return true;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "LumpName.h"
+
+using namespace std;
+
+// CRC32C (Castagnoli). Best uses the SSE4.2 crc32 instruction when the CPU
+// has it and a table otherwise; unsupported kernels fall back to Scalar.
+// Pass the previous result as `crc` to continue a running checksum.
+enum class CrcKernel { Best, Scalar, Sse42 };
+
+bool crc32cKernelSupported(CrcKernel kernel);
+uint32_t crc32c(const void *data, size_t length, uint32_t crc = 0, CrcKernel kernel = CrcKernel::Best);
+
+// CRC32C of A followed by B, from the CRCs of A and B and B's length, so
+// pieces checksummed in parallel can be joined
+uint32_t crc32cCombine(uint32_t crcA, uint32_t crcB, size_t lengthB);
+
+// XXH64, one shot or fed piece by piece
+uint64_t xxh64(const void *data, size_t length, uint64_t seed = 0);
+
+class Xxh64 {
+
+public:
+    explicit Xxh64(uint64_t seed = 0);
+
+    void update(const void *data, size_t length);
+    uint64_t digest() const;
+
+private:
+    uint64_t seed;
+    uint64_t lanes[4];
+    uint64_t total;
+    uint8_t buffer[32];
+    size_t buffered;
+};
+
+struct LumpDigest {
+    LumpName name;
+    uint64_t offset;         // 64-bit for extended ("WADX") files
+    uint64_t length;
+    uint32_t crc32c;
+    uint64_t xxh64;
+};
+
+// Digests of a whole WAD file and of each lump, in directory order.
+// fileSize and mtime (nanoseconds) identify the file they were taken from.
+struct WadDigest {
+    uint64_t fileSize;
+    int64_t mtime;
+    uint32_t crc32c;
+    uint64_t xxh64;
+    vector<LumpDigest> lumps;
+};
+
+// Reads the file directly, without loading a Wad: lumps are digested as
+// independent tasks on `threads` workers (0 = one per core), the file's
+// CRC32C as fixed-size pieces joined with crc32cCombine(), and the file's
+// XXH64 as one more task alongside them. Classic and extended headers are
+// read (see WadHeader.h). False if the file or its directory cannot be
+// read, it is a WADZ container, or a lump lies past the end of the file.
+bool digestWad(const string &path, WadDigest *out, unsigned threads = 0);
+
+// As digestWad(), but reuses the manifest cached beside the WAD
+// (path + ".digest") while the file's size and mtime still match it, and
+// (re)writes that cache otherwise. A cache that cannot be written is not
+// an error.
+bool digestWadCached(const string &path, WadDigest *out, unsigned threads = 0);
+
+// Text manifest: a header line, a "file" line, then one line per lump:
+// index, offset, length, crc32c, xxh64, name
+string formatManifest(const WadDigest &digest);
+bool parseManifest(const string &text, WadDigest *out);
@@ -0,0 +1,239 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "LumpName.h"
+
+using namespace std;
+
+// Lump classification per game. A format is a policy type of constexpr
+// tables; FormatRules<Format> turns one into the classifier the loader
+// runs on every descriptor, integer compares on packed names only. Code
+// that walks a whole directory instantiates itself per format through
+// withFormat(), so each game pays only for its own rules.
+enum class GameFormat : uint8_t {
+    Auto,       // LoadOptions: detectFormat() picks one
+    Doom,       // E#M# maps; Heretic's are laid out the same way, so it loads as DOOM
+    Doom2,      // MAP## maps
+    Hexen       // MAP## maps with a BEHAVIOR lump and wider records
+};
+
+// Classification bits
+namespace LumpClass {
+enum : uint8_t {
+    NamespaceStart = 1 << 0,  // name ends in _START
+    NamespaceEnd   = 1 << 1,  // name ends in _END
+    MapMarker      = 1 << 2   // the format's map marker
+};
+}
+
+struct DoomFormat {
+    static constexpr bool episodic = true;      // E#M#
+    static constexpr bool doomRecords = true;   // MapView's record layouts apply
+    static constexpr array<LumpName, 10> mapLumps = {
+        LumpName::literal("THINGS"), LumpName::literal("LINEDEFS"), LumpName::literal("SIDEDEFS"),
+        LumpName::literal("VERTEXES"), LumpName::literal("SEGS"), LumpName::literal("SSECTORS"),
+        LumpName::literal("NODES"), LumpName::literal("SECTORS"), LumpName::literal("REJECT"),
+        LumpName::literal("BLOCKMAP")
+    };
+};
+
+struct Doom2Format : DoomFormat {
+    static constexpr bool episodic = false;     // MAP##
+};
+
+struct HexenFormat : Doom2Format {
+    static constexpr bool doomRecords = false;
+    static constexpr array<LumpName, 11> mapLumps = {
+        LumpName::literal("THINGS"), LumpName::literal("LINEDEFS"), LumpName::literal("SIDEDEFS"),
+        LumpName::literal("VERTEXES"), LumpName::literal("SEGS"), LumpName::literal("SSECTORS"),
+        LumpName::literal("NODES"), LumpName::literal("SECTORS"), LumpName::literal("REJECT"),
+        LumpName::literal("BLOCKMAP"), LumpName::literal("BEHAVIOR")
+    };
+};
+
+// _START/_END namespaces, the same in every format
+struct NamespaceRules {
+    static constexpr LumpName startSuffix = LumpName::literal("_START");
+    static constexpr LumpName endSuffix = LumpName::literal("_END");
+
+    // the suffix must leave a non-empty prefix
+    static constexpr uint8_t classify(LumpName name) {
+        size_t n = name.size();
+        if (n > 6 && name.endsWith(startSuffix)) return LumpClass::NamespaceStart;
+        if (n > 4 && name.endsWith(endSuffix)) return LumpClass::NamespaceEnd;
+        return 0;
+    }
+
+    // name without its _START or _END
+    static constexpr LumpName clean(LumpName name) {
+        uint8_t flags = classify(name);
+        if (flags & LumpClass::NamespaceStart) return name.prefix(name.size() - 6);
+        if (flags & LumpClass::NamespaceEnd) return name.prefix(name.size() - 4);
+        return name;
+    }
+
+    // PWADs open FF_START, PP_START or SS_START inside the IWAD's F, P and
+    // S namespaces and often close them with the IWAD's F_END, P_END, S_END
+    static constexpr LumpName canonical(LumpName base) {
+        const uint64_t doubled[] = {LumpName::literal("FF").bits, LumpName::literal("PP").bits,
+                                    LumpName::literal("SS").bits};
+        for (uint64_t d : doubled)
+            if (base.bits == d) return LumpName(d & 0xFF);
+        return base;
+    }
+
+    static constexpr bool closes(LumpName endBase, LumpName openBase) {
+        return endBase == openBase || canonical(endBase) == canonical(openBase);
+    }
+};
+
+template <typename Format>
+struct FormatRules {
+    static constexpr bool doomRecords = Format::doomRecords;
+    static constexpr size_t mapLumpCount = Format::mapLumps.size();
+
+    static constexpr bool isMapMarker(LumpName name) {
+        if constexpr (Format::episodic) {
+            // E#M#: exactly four bytes, 'E' and 'M' in place, digits in between
+            if (name.bits & ~0xFFFFFFFFULL) return false;
+            if ((name.bits & 0x00FF00FFULL) != (('M' << 16) | 'E')) return false;
+            unsigned episode = static_cast<unsigned char>(name.at(1)) - '0';
+            unsigned map = static_cast<unsigned char>(name.at(3)) - '0';
+            return episode < 10 && map < 10;
+        } else {
+            // MAP##: exactly five bytes, digits after "MAP"
+            if (name.bits & ~0xFFFFFFFFFFULL) return false;
+            if ((name.bits & 0xFFFFFFULL) != LumpName::literal("MAP").bits) return false;
+            unsigned tens = static_cast<unsigned char>(name.at(3)) - '0';
+            unsigned ones = static_cast<unsigned char>(name.at(4)) - '0';
+            return tens < 10 && ones < 10;
+        }
+    }
+
+    static constexpr uint8_t classify(LumpName name) {
+        uint8_t flags = NamespaceRules::classify(name);
+        if (flags) return flags;
+        return isMapMarker(name) ? LumpClass::MapMarker : 0;
+    }
+
+    // position in Format::mapLumps, -1 if name is not a map lump
+    static constexpr int mapLumpIndex(LumpName name) {
+        for (size_t i = 0; i < Format::mapLumps.size(); i++)
+            if (Format::mapLumps[i] == name) return static_cast<int>(i);
+        return -1;
+    }
+};
+
+static_assert(FormatRules<DoomFormat>::classify(LumpName::literal("E1M1")) == LumpClass::MapMarker, "E#M#");
+static_assert(FormatRules<DoomFormat>::classify(LumpName::literal("MAP01")) == 0, "MAP## is a lump in DOOM");
+static_assert(FormatRules<Doom2Format>::classify(LumpName::literal("MAP01")) == LumpClass::MapMarker, "MAP##");
+static_assert(FormatRules<Doom2Format>::classify(LumpName::literal("E1M1")) == 0, "E#M# is a lump in DOOM II");
+static_assert(FormatRules<HexenFormat>::mapLumpIndex(LumpName::literal("BEHAVIOR")) == 10, "BEHAVIOR");
+static_assert(FormatRules<DoomFormat>::mapLumpIndex(LumpName::literal("BEHAVIOR")) < 0, "no BEHAVIOR in DOOM");
+static_assert(NamespaceRules::classify(LumpName::literal("FF_START")) == LumpClass::NamespaceStart, "FF_START");
+static_assert(NamespaceRules::closes(LumpName::literal("F"), LumpName::literal("FF")), "F_END closes FF_START");
+
+// Calls visit(FormatRules<...>()) for the rules of `format`; Auto is DOOM
+template <typename Visit>
+auto withFormat(GameFormat format, Visit visit) {
+    switch (format) {
+    case GameFormat::Doom2: return visit(FormatRules<Doom2Format>());
+    case GameFormat::Hexen: return visit(FormatRules<HexenFormat>());
+    default:                return visit(FormatRules<DoomFormat>());
+    }
+}
+
+inline uint8_t classifyLump(GameFormat format, LumpName name) {
+    return withFormat(format, [&](auto rules) { return decltype(rules)::classify(name); });
+}
+
+// From a directory's names (nameAt(i) for i < count): the first map marker
+// decides, E#M# for DOOM, MAP## for DOOM II, or Hexen when a BEHAVIOR lump
+// follows it among its map lumps. Stops at the first marker, a few entries
+// into an IWAD. A WAD with no maps gets DOOM, whose rules then only matter
+// for namespaces.
+template <typename NameAt>
+GameFormat detectFormat(size_t count, NameAt nameAt) {
+    for (size_t i = 0; i < count; i++) {
+        LumpName name = nameAt(i);
+        if (FormatRules<DoomFormat>::isMapMarker(name)) return GameFormat::Doom;
+        if (!FormatRules<Doom2Format>::isMapMarker(name)) continue;
+        for (size_t j = i + 1; j < count && j <= i + HexenFormat::mapLumps.size(); j++) {
+            LumpName lump = nameAt(j);
+            if (lump == LumpName::literal("BEHAVIOR")) return GameFormat::Hexen;
+            if (FormatRules<HexenFormat>::mapLumpIndex(lump) < 0) break;
+        }
+        return GameFormat::Doom2;
+    }
+    return GameFormat::Doom;
+}
+
+// The directories buildTree() makes of a directory table, for code that
+// needs the same shape without building nodes (diff() matches lumps by
+// path). at(i) gives entry i's name, offset and length; place(what, i,
+// flags) is told, in order, of every directory entry i closes (Close), then
+// whether i opens a directory (Directory: a namespace start, or a map marker
+// whose lumps follow it), closes a namespace (End) or is a File.
+enum class Placed { Directory, File, Close, End };
+
+template <typename Rules, typename At, typename Place>
+void placeLumps(size_t count, At at, Place place) {
+    struct Open {
+        LumpName base;
+        bool map;
+        bool lastIsFile;
+        uint64_t lastEnd;
+    };
+    vector<Open> stack; // below the root
+
+    for (size_t i = 0; i < count; i++) {
+        const auto &d = at(i);
+        uint8_t flags = Rules::classify(d.name);
+
+        // a map ends at a namespace start or at a lump not right after its last
+        while (!stack.empty() && stack.back().map) {
+            const Open &top = stack.back();
+            if (!(flags & LumpClass::NamespaceStart) && !(top.lastIsFile && d.offset != top.lastEnd)) break;
+            stack.pop_back();
+            place(Placed::Close, i, flags);
+        }
+
+        // an _END unwinds to the matching _START, or to the root
+        if (flags & LumpClass::NamespaceEnd) {
+            LumpName target = NamespaceRules::clean(d.name);
+            while (!stack.empty()) {
+                LumpName base = stack.back().base;
+                stack.pop_back();
+                place(Placed::Close, i, flags);
+                if (NamespaceRules::closes(target, base)) break;
+            }
+            place(Placed::End, i, flags);
+            continue;
+        }
+
+        bool directory = flags & LumpClass::NamespaceStart;
+        if (!directory && (flags & LumpClass::MapMarker)) {
+            directory = i + 1 >= count || d.length == 0;
+            if (!directory) {
+                const auto &next = at(i + 1);
+                directory = (Rules::classify(next.name) & LumpClass::NamespaceStart) ||
+                            next.offset != d.offset + d.length;
+            }
+        }
+        if (directory) {
+            if (!stack.empty()) stack.back().lastIsFile = false;
+            stack.push_back({NamespaceRules::clean(d.name), (flags & LumpClass::MapMarker) != 0, false, 0});
+            place(Placed::Directory, i, flags);
+        } else {
+            if (!stack.empty()) {
+                stack.back().lastIsFile = true;
+                stack.back().lastEnd = d.offset + d.length;
+            }
+            place(Placed::File, i, flags);
+        }
+    }
+}
@@ -0,0 +1,361 @@
+#include "Image.h"
+#include "Wad.h"
+#include <immintrin.h>
+#include <cstring>
+
+using namespace std;
+
+static bool readLump(Wad *wad, const string &path, vector<char> *out) {
+    return wad && wad->readAll(wad->open(path), out);
+}
+
+// Palette
+
+Palette::Palette() {
+    for (atomic<PaletteTable*> &t : tables)
+        t.store(nullptr, memory_order_relaxed);
+}
+
+Palette::~Palette() {
+    clearTables();
+}
+
+void Palette::clearTables() {
+    for (atomic<PaletteTable*> &t : tables)
+        delete t.exchange(nullptr, memory_order_acq_rel);
+}
+
+bool Palette::load(Wad *wad) {
+    vector<char> pal, map;
+    if (!readLump(wad, "/PLAYPAL", &pal)) return false;
+    readLump(wad, "/COLORMAP", &map); // optional
+    return load(pal.data(), pal.size(), map.data(), map.size());
+}
+
+bool Palette::load(const char *pal, size_t palLength, const char *map, size_t mapLength) {
+    if (!pal || palLength < 768) return false;
+
+    clearTables();
+
+    // Keep whole palettes/maps only; missing ones fall back to the first
+    size_t palettes = min<size_t>(palLength / 768, PaletteCount);
+    playpal.assign(pal, pal + palettes * 768);
+
+    size_t maps = map ? min<size_t>(mapLength / 256, LightLevels) : 0;
+    colormap.assign(map ? map : pal, (map ? map : pal) + maps * 256);
+    return true;
+}
+
+bool Palette::table(int palette, int light, uint32_t out[256]) const {
+    if (!loaded()) return false;
+    if (palette < 0 || palette >= PaletteCount || light < 0 || light >= LightLevels)
+        return false;
+
+    size_t palettes = playpal.size() / 768;
+    const uint8_t *rgb = playpal.data() + (static_cast<size_t>(palette) < palettes ? palette : 0) * 768;
+
+    size_t maps = colormap.size() / 256;
+    const uint8_t *light8 = static_cast<size_t>(light) < maps ? colormap.data() + light * 256 : nullptr;
+
+    for (int i = 0; i < 256; i++) {
+        int c = light8 ? light8[i] : i;
+        out[i] = static_cast<uint32_t>(rgb[c * 3]) |
+                 static_cast<uint32_t>(rgb[c * 3 + 1]) << 8 |
+                 static_cast<uint32_t>(rgb[c * 3 + 2]) << 16 |
+                 0xFF000000u;
+    }
+    return true;
+}
+
+const PaletteTable* Palette::lookupTable(int palette, int light) const {
+    uint32_t entries[256];
+    if (!table(palette, light, entries)) return nullptr;
+
+    // Threads that race here each build one; the first stored is kept
+    atomic<PaletteTable*> &slot = tables[palette * LightLevels + light];
+    PaletteTable *built = slot.load(memory_order_acquire);
+    if (built) return built;
+    PaletteTable *made = new PaletteTable(entries);
+    if (slot.compare_exchange_strong(built, made, memory_order_acq_rel)) return made;
+    delete made;
+    return built;
+}
+
+// Lookup kernels
+//
+// The SIMD kernels never gather: the 256-entry table is split into four byte
+// planes (R, G, B, A) of sixteen 16-byte rows. Each block of pixels is
+// looked up with a PSHUFB per row on the low nibble, kept where the high
+// nibble selects that row, and the four planes are interleaved back to RGBA.
+// Only rows that occur in the block are visited; DOOM graphics tend to stay
+// within one or two 16-colour ramps per block, and blocks spread over more
+// rows than that are cheaper as plain table loads.
+static const int MaxShuffleRows = 3;
+
+static void lookupScalar(const uint8_t *idx, size_t count, const uint32_t table[256], uint32_t *out) {
+    for (size_t i = 0; i < count; i++)
+        out[i] = table[idx[i]];
+}
+
+PaletteTable::PaletteTable(const uint32_t table[256]) {
+    memcpy(entries, table, sizeof(entries));
+    for (int i = 0; i < 256; i++)
+        for (int p = 0; p < 4; p++)
+            planes[i >> 4][p][i & 15] = static_cast<uint8_t>(table[i] >> (8 * p));
+}
+
+// Bit h set when some byte of the (already nibble-sized) vector equals h
+static unsigned presentRows(const uint8_t *his, size_t n) {
+    unsigned present = 0;
+    for (size_t k = 0; k < n; k++)
+        present |= 1u << his[k];
+    return present;
+}
+
+__attribute__((target("ssse3")))
+static void lookupSsse3(const uint8_t *idx, size_t count, const PaletteTable &lookup, uint32_t *out) {
+    const uint32_t *table = lookup.entries;
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(idx + i));
+        __m128i lo = _mm_and_si128(v, nibble);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+
+        alignas(16) uint8_t his[16];
+        _mm_store_si128(reinterpret_cast<__m128i*>(his), hi);
+        unsigned present = presentRows(his, 16);
+        if (__builtin_popcount(present) > MaxShuffleRows) {
+            lookupScalar(idx + i, 16, table, out + i);
+            continue;
+        }
+
+        __m128i plane[4] = {_mm_setzero_si128(), _mm_setzero_si128(),
+                            _mm_setzero_si128(), _mm_setzero_si128()};
+        while (present) {
+            int h = __builtin_ctz(present);
+            present &= present - 1;
+            __m128i sel = _mm_cmpeq_epi8(hi, _mm_set1_epi8(static_cast<char>(h)));
+            for (int p = 0; p < 4; p++) {
+                __m128i row = _mm_load_si128(reinterpret_cast<const __m128i*>(lookup.planes[h][p]));
+                plane[p] = _mm_or_si128(plane[p], _mm_and_si128(sel, _mm_shuffle_epi8(row, lo)));
+            }
+        }
+
+        __m128i rgLo = _mm_unpacklo_epi8(plane[0], plane[1]);
+        __m128i rgHi = _mm_unpackhi_epi8(plane[0], plane[1]);
+        __m128i baLo = _mm_unpacklo_epi8(plane[2], plane[3]);
+        __m128i baHi = _mm_unpackhi_epi8(plane[2], plane[3]);
+        __m128i *dst = reinterpret_cast<__m128i*>(out + i);
+        _mm_storeu_si128(dst + 0, _mm_unpacklo_epi16(rgLo, baLo));
+        _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(rgLo, baLo));
+        _mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(rgHi, baHi));
+        _mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(rgHi, baHi));
+    }
+    lookupScalar(idx + i, count - i, table, out + i);
+}
+
+__attribute__((target("avx2")))
+static void lookupAvx2(const uint8_t *idx, size_t count, const PaletteTable &lookup, uint32_t *out) {
+    const uint32_t *table = lookup.entries;
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+
+    // PSHUFB works per 128-bit lane, so each row goes in both lanes
+    __m256i rows[16][4];
+    for (int h = 0; h < 16; h++)
+        for (int p = 0; p < 4; p++)
+            rows[h][p] = _mm256_broadcastsi128_si256(
+                _mm_load_si128(reinterpret_cast<const __m128i*>(lookup.planes[h][p])));
+
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(idx + i));
+        __m256i lo = _mm256_and_si256(v, nibble);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+
+        alignas(32) uint8_t his[32];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(his), hi);
+        unsigned present = presentRows(his, 32);
+        if (__builtin_popcount(present) > MaxShuffleRows) {
+            lookupScalar(idx + i, 32, table, out + i);
+            continue;
+        }
+
+        __m256i plane[4] = {_mm256_setzero_si256(), _mm256_setzero_si256(),
+                            _mm256_setzero_si256(), _mm256_setzero_si256()};
+        while (present) {
+            int h = __builtin_ctz(present);
+            present &= present - 1;
+            __m256i sel = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(static_cast<char>(h)));
+            for (int p = 0; p < 4; p++)
+                plane[p] = _mm256_or_si256(plane[p], _mm256_and_si256(sel, _mm256_shuffle_epi8(rows[h][p], lo)));
+        }
+
+        // Unpacks stay within lanes: q0 holds pixels 0-3 and 16-19, etc.
+        __m256i rgLo = _mm256_unpacklo_epi8(plane[0], plane[1]);
+        __m256i rgHi = _mm256_unpackhi_epi8(plane[0], plane[1]);
+        __m256i baLo = _mm256_unpacklo_epi8(plane[2], plane[3]);
+        __m256i baHi = _mm256_unpackhi_epi8(plane[2], plane[3]);
+        __m256i q0 = _mm256_unpacklo_epi16(rgLo, baLo);
+        __m256i q1 = _mm256_unpackhi_epi16(rgLo, baLo);
+        __m256i q2 = _mm256_unpacklo_epi16(rgHi, baHi);
+        __m256i q3 = _mm256_unpackhi_epi16(rgHi, baHi);
+
+        __m256i *dst = reinterpret_cast<__m256i*>(out + i);
+        _mm256_storeu_si256(dst + 0, _mm256_permute2x128_si256(q0, q1, 0x20));
+        _mm256_storeu_si256(dst + 1, _mm256_permute2x128_si256(q2, q3, 0x20));
+        _mm256_storeu_si256(dst + 2, _mm256_permute2x128_si256(q0, q1, 0x31));
+        _mm256_storeu_si256(dst + 3, _mm256_permute2x128_si256(q2, q3, 0x31));
+    }
+    lookupScalar(idx + i, count - i, table, out + i);
+}
+
+bool paletteKernelSupported(PaletteKernel kernel) {
+    switch (kernel) {
+    case PaletteKernel::Avx2:  return __builtin_cpu_supports("avx2");
+    case PaletteKernel::Ssse3: return __builtin_cpu_supports("ssse3");
+    default:                   return true;
+    }
+}
+
+void paletteLookup(const uint8_t *indices, size_t count, const PaletteTable &table,
+                   uint32_t *out, PaletteKernel kernel) {
+    if (kernel == PaletteKernel::Best) {
+        if (paletteKernelSupported(PaletteKernel::Avx2)) kernel = PaletteKernel::Avx2;
+        else if (paletteKernelSupported(PaletteKernel::Ssse3)) kernel = PaletteKernel::Ssse3;
+        else kernel = PaletteKernel::Scalar;
+    }
+    if (!paletteKernelSupported(kernel))
+        kernel = PaletteKernel::Scalar;
+
+    switch (kernel) {
+    case PaletteKernel::Avx2:  lookupAvx2(indices, count, table, out); break;
+    case PaletteKernel::Ssse3: lookupSsse3(indices, count, table, out); break;
+    default:                   lookupScalar(indices, count, table.entries, out); break;
+    }
+}
+
+void paletteLookup(const uint8_t *indices, size_t count, const uint32_t table[256],
+                   uint32_t *out, PaletteKernel kernel) {
+    paletteLookup(indices, count, PaletteTable(table), out, kernel);
+}
+
+// Decoders
+
+bool decodeFlat(const char *data, size_t length, const Palette &pal,
+                int palette, int light, RgbaImage *out) {
+    if (!data || !out || length < 64) return false;
+
+    const PaletteTable *table = pal.lookupTable(palette, light);
+    if (!table) return false;
+
+    out->width = 64;
+    out->height = static_cast<int>(length / 64);
+    out->leftOffset = 0;
+    out->topOffset = 0;
+    out->pixels.resize(static_cast<size_t>(out->width) * out->height);
+    paletteLookup(reinterpret_cast<const uint8_t*>(data), out->pixels.size(), *table, out->pixels.data());
+    return true;
+}
+
+bool patchSize(const char *data, size_t length, int *width, int *height) {
+    if (!data || length < 8) return false;
+
+    int16_t header[2];
+    memcpy(header, data, sizeof(header));
+    if (header[0] <= 0 || header[1] <= 0 || header[0] > 4096 || header[1] > 4096) return false;
+    if (8 + 4 * static_cast<size_t>(header[0]) > length) return false;
+
+    *width = header[0];
+    *height = header[1];
+    return true;
+}
+
+bool drawPatch(const char *data, size_t length, int originX, int originY,
+               uint8_t *indices, uint32_t *opaque, int width, int height) {
+    int patchWidth, patchHeight;
+    if (!patchSize(data, length, &patchWidth, &patchHeight)) return false;
+
+    const uint8_t *bytes = reinterpret_cast<const uint8_t*>(data);
+    for (int col = 0; col < patchWidth; col++) {
+        int x = originX + col;
+        if (x < 0) continue;
+        if (x >= width) break;
+
+        uint32_t p;
+        memcpy(&p, data + 8 + 4 * col, 4);
+
+        int lastTop = -1;
+        while (true) {
+            if (p >= length) return false;
+            uint8_t delta = bytes[p];
+            if (delta == 0xFF) break;
+            if (p + 3 > length) return false;
+            int postLength = bytes[p + 1];
+            if (p + 4 + postLength > length) return false;
+
+            // tall patches: a delta not below the last post is relative to it
+            int top = (lastTop >= 0 && delta <= lastTop) ? lastTop + delta : delta;
+            lastTop = top;
+
+            for (int k = 0; k < postLength; k++) {
+                int y = originY + top + k;
+                if (y < 0) continue;
+                if (y >= height) break;
+                indices[static_cast<size_t>(y) * width + x] = bytes[p + 3 + k];
+                opaque[static_cast<size_t>(y) * width + x] = 0xFFFFFFFFu;
+            }
+            p += static_cast<uint32_t>(postLength) + 4;
+        }
+    }
+    return true;
+}
+
+bool finishIndexed(const uint8_t *indices, const uint32_t *opaque, const Palette &pal,
+                   int palette, int light, RgbaImage *out) {
+    const PaletteTable *table = pal.lookupTable(palette, light);
+    if (!table) return false;
+
+    size_t pixelCount = static_cast<size_t>(out->width) * out->height;
+    out->pixels.resize(pixelCount);
+    paletteLookup(indices, pixelCount, *table, out->pixels.data());
+    for (size_t i = 0; i < pixelCount; i++)
+        out->pixels[i] &= opaque[i];
+    return true;
+}
+
+bool decodePatch(const char *data, size_t length, const Palette &pal,
+                 int palette, int light, RgbaImage *out) {
+    int width, height;
+    if (!out || !patchSize(data, length, &width, &height)) return false;
+    if (!pal.loaded()) return false;
+
+    size_t pixelCount = static_cast<size_t>(width) * height;
+    vector<uint8_t> indices(pixelCount, 0);
+    vector<uint32_t> opaque(pixelCount, 0); // all-ones where a post covers the pixel
+    if (!drawPatch(data, length, 0, 0, indices.data(), opaque.data(), width, height))
+        return false;
+
+    int16_t offsets[2];
+    memcpy(offsets, data + 4, sizeof(offsets));
+    out->width = width;
+    out->height = height;
+    out->leftOffset = offsets[0];
+    out->topOffset = offsets[1];
+    return finishIndexed(indices.data(), opaque.data(), pal, palette, light, out);
+}
+
+bool decodeFlat(Wad *wad, const string &path, const Palette &pal,
+                int palette, int light, RgbaImage *out) {
+    vector<char> bytes;
+    if (!readLump(wad, path, &bytes)) return false;
+    return decodeFlat(bytes.data(), bytes.size(), pal, palette, light, out);
+}
+
+bool decodePatch(Wad *wad, const string &path, const Palette &pal,
+                 int palette, int light, RgbaImage *out) {
+    vector<char> bytes;
+    if (!readLump(wad, path, &bytes)) return false;
+    return decodePatch(bytes.data(), bytes.size(), pal, palette, light, out);
+}
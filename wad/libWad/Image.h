@@ -0,0 +1,102 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+class Wad;
+
+// A decoded graphic. Pixels are RGBA8, row-major, one uint32_t each with
+// R in the lowest byte; transparent patch pixels have alpha 0.
+struct RgbaImage {
+    int width;
+    int height;
+    int leftOffset;      // patch origin, 0 for flats
+    int topOffset;
+    vector<uint32_t> pixels;
+
+    RgbaImage() : width(0), height(0), leftOffset(0), topOffset(0) {}
+};
+
+// A 256-entry RGBA table as paletteLookup() uses it: the entries, and the
+// same split into byte planes for the SIMD kernels
+struct PaletteTable {
+    uint32_t entries[256];
+    alignas(32) uint8_t planes[16][4][16];  // high nibble, plane, low nibble
+
+    explicit PaletteTable(const uint32_t table[256]);
+};
+
+// PLAYPAL (14 palettes of 256 RGB triples) and COLORMAP (34 light maps of
+// 256 palette indices), combined on demand into 256-entry RGBA tables.
+class Palette {
+
+public:
+    enum { PaletteCount = 14, LightLevels = 34 };
+
+    Palette();
+    ~Palette();
+    Palette(const Palette &) = delete;
+    Palette &operator=(const Palette &) = delete;
+
+    // Reads /PLAYPAL and /COLORMAP; COLORMAP is optional (identity mapping)
+    bool load(Wad *wad);
+    bool load(const char *playpal, size_t playpalLength,
+              const char *colormap, size_t colormapLength);
+
+    bool loaded() const { return !playpal.empty(); }
+
+    // Light 0 is full brightness, 32 the invulnerability map, 33 black
+    bool table(int palette, int light, uint32_t out[256]) const;
+
+    // The same as a PaletteTable, built on first use and kept until the
+    // next load(); safe to call from several threads. nullptr if table() fails
+    const PaletteTable* lookupTable(int palette, int light) const;
+
+private:
+    void clearTables();
+
+    vector<uint8_t> playpal;
+    vector<uint8_t> colormap;
+    mutable atomic<PaletteTable*> tables[PaletteCount * LightLevels];
+};
+
+// Indexed -> RGBA conversion. All kernels produce identical output; Best
+// picks AVX2, then SSSE3, then the scalar loop at runtime, and unsupported
+// kernels fall back to Scalar.
+enum class PaletteKernel { Best, Scalar, Ssse3, Avx2 };
+
+bool paletteKernelSupported(PaletteKernel kernel);
+void paletteLookup(const uint8_t *indices, size_t count, const PaletteTable &table,
+                   uint32_t *out, PaletteKernel kernel = PaletteKernel::Best);
+// Builds the planes for this call alone; prefer a kept PaletteTable
+void paletteLookup(const uint8_t *indices, size_t count, const uint32_t table[256],
+                   uint32_t *out, PaletteKernel kernel = PaletteKernel::Best);
+
+// Flats are raw 64-wide index arrays (4096 bytes for DOOM)
+bool decodeFlat(const char *data, size_t length, const Palette &pal,
+                int palette, int light, RgbaImage *out);
+
+// Patches/sprites: column-based posts with transparent gaps
+bool decodePatch(const char *data, size_t length, const Palette &pal,
+                 int palette, int light, RgbaImage *out);
+
+// Building blocks for composing several patches on one canvas: drawPatch()
+// writes a patch's palette indices at (originX, originY), clipped, and marks
+// the covered pixels in `opaque` with all-ones; finishIndexed() converts the
+// canvas (out->width x out->height) to RGBA.
+bool patchSize(const char *data, size_t length, int *width, int *height);
+bool drawPatch(const char *data, size_t length, int originX, int originY,
+               uint8_t *indices, uint32_t *opaque, int width, int height);
+bool finishIndexed(const uint8_t *indices, const uint32_t *opaque, const Palette &pal,
+                   int palette, int light, RgbaImage *out);
+
+// Convenience wrappers that read the lump through the Wad
+bool decodeFlat(Wad *wad, const string &path, const Palette &pal,
+                int palette, int light, RgbaImage *out);
+bool decodePatch(Wad *wad, const string &path, const Palette &pal,
+                 int palette, int light, RgbaImage *out);
@@ -0,0 +1,245 @@
+#include "Wad.h"
+#include "Digest.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <climits>
+#include <cstring>
+#include <cstdio>
+#include <string_view>
+
+using namespace std;
+
+// Image layout: a header, one record per node in creation order (which is
+// also pre-order, so appending each node to its parent restores the child
+// order), then the node paths. Records refer to each other by index, so the
+// image is position independent; loading it turns indices back into
+// pointers instead of rerunning buildTree()'s heuristics.
+static const char IndexMagic[4] = {'W', 'I', 'D', 'X'};
+static const uint32_t IndexVersion = 4;  // 64-bit offsets and lengths, game format (Heretic dropped)
+static const uint32_t NoIndex = UINT32_MAX;
+
+struct IndexHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t fileSize;
+    int64_t mtime;           // nanoseconds
+    uint32_t directoryCrc;
+    uint32_t nodeCount;
+    uint32_t descriptorCount;
+    uint32_t pathBytes;
+    uint32_t bodyCrc;        // CRC32C of everything after the header
+    uint32_t format;         // GameFormat the tree was built under
+};
+
+struct IndexNode {
+    uint64_t name;
+    uint32_t parent;         // NoIndex for the root
+    uint32_t descriptor;     // whose queued read the lump adopts; NoIndex for none
+    uint64_t offset;
+    uint64_t length;
+    uint32_t block;
+    uint32_t pathOffset;
+    uint32_t pathLength;
+    uint8_t isDirectory;
+    uint8_t flags;           // Node::flags
+    uint8_t padding[2];
+};
+
+static_assert(sizeof(IndexHeader) == 48, "index header layout");
+static_assert(sizeof(IndexNode) == 48, "index record layout");
+
+static bool statFile(int fd, uint64_t *size, int64_t *mtime) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return false;
+    *size = static_cast<uint64_t>(st.st_size);
+    *mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+// An image whose structure holds together: header, sizes, body checksum,
+// parents that precede their children. Whether it belongs to the WAD at
+// hand is the caller's check.
+static bool checkImage(const char *image, size_t size, IndexHeader *header) {
+    if (size < sizeof(IndexHeader)) return false;
+    memcpy(header, image, sizeof(IndexHeader));
+    if (memcmp(header->magic, IndexMagic, 4) != 0 || header->version != IndexVersion ||
+        header->nodeCount == 0 ||
+        size != sizeof(IndexHeader) + static_cast<size_t>(header->nodeCount) * sizeof(IndexNode) +
+                header->pathBytes ||
+        crc32c(image + sizeof(IndexHeader), size - sizeof(IndexHeader)) != header->bodyCrc)
+        return false;
+
+    const IndexNode *records = reinterpret_cast<const IndexNode*>(image + sizeof(IndexHeader));
+    for (uint32_t i = 0; i < header->nodeCount; i++) {
+        const IndexNode &r = records[i];
+        bool linked = i == 0 ? r.parent == NoIndex && r.isDirectory
+                             : r.parent < i && records[r.parent].isDirectory;
+        if (!linked || static_cast<uint64_t>(r.pathOffset) + r.pathLength > header->pathBytes ||
+            (r.descriptor != NoIndex && r.descriptor >= header->descriptorCount))
+            return false;
+    }
+    return true;
+}
+
+bool Wad::loadIndex() {
+    uint64_t fileSize;
+    int64_t mtime;
+    if (!statFile(fileDescriptor, &fileSize, &mtime)) return false;
+
+    int fd = ::open((wadPath + ".index").c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(IndexHeader)) {
+        close(fd);
+        return false;
+    }
+    size_t imageSize = static_cast<size_t>(st.st_size);
+    void *map = mmap(nullptr, imageSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    const char *image = static_cast<const char*>(map);
+    IndexHeader header;
+    memcpy(&header, image, sizeof(header));
+    bool valid = header.fileSize == fileSize && header.mtime == mtime &&
+                 header.directoryCrc == directoryCrc && header.descriptorCount == descriptors.size() &&
+                 buildFromImage(image, imageSize);
+    munmap(map, imageSize);
+    return valid;
+}
+
+// The tree an image describes: indices become pointers, and lumps adopt the
+// buffers their queued reads are filling. False, building nothing, if the
+// image does not hold together.
+bool Wad::buildFromImage(const char *image, size_t size) {
+    IndexHeader header;
+    if (!checkImage(image, size, &header)) return false;
+    GameFormat built = static_cast<GameFormat>(header.format);
+    if (built == GameFormat::Auto || header.format > static_cast<uint32_t>(GameFormat::Hexen) ||
+        (format != GameFormat::Auto && format != built))
+        return false;
+    format = built;
+    const IndexNode *records = reinterpret_cast<const IndexNode*>(image + sizeof(IndexHeader));
+    const char *paths = image + sizeof(IndexHeader) + static_cast<size_t>(header.nodeCount) * sizeof(IndexNode);
+
+    vector<Node*> nodes(header.nodeCount);
+    pathMap.clear();
+    pathMap.reserve(header.nodeCount);
+    nameIndex.clear();
+    for (uint32_t i = 0; i < header.nodeCount; i++) {
+        const IndexNode &r = records[i];
+        Node* node = new Node(LumpName(r.name), r.isDirectory != 0, r.flags);
+        node->offset = r.offset;
+        node->length = r.length;
+        node->block = r.block;
+        if (i > 0) {
+            node->parent = nodes[r.parent];
+            node->parent->children.push_back(node);
+        }
+        if (r.descriptor != NoIndex && r.descriptor < lumpBuffers.size()) {
+            node->data.swap(lumpBuffers[r.descriptor]);
+            lumpOwners[r.descriptor] = node;
+        }
+        if (!node->isDirectory) indexName(node);
+        if (r.pathLength) pathMap.set(paths + r.pathOffset, r.pathLength, node);
+        nodes[i] = node;
+    }
+    root = nodes[0];
+    return true;
+}
+
+string Wad::treeImage() const {
+    IndexHeader header = {};
+    memcpy(header.magic, IndexMagic, 4);
+    header.version = IndexVersion;
+    header.directoryCrc = directoryCrc;
+    header.descriptorCount = static_cast<uint32_t>(descriptors.size());
+    header.format = static_cast<uint32_t>(format);
+    if (!root || !statFile(fileDescriptor, &header.fileSize, &header.mtime)) return string();
+
+    // pathMap keeps the last node given each path, which is what gets stored
+    unordered_map<const Node*, string_view> pathOf;
+    pathMap.forEach([&](const char *path, size_t length, const Node* node) {
+        pathOf[node] = string_view(path, length);
+    });
+    unordered_map<const Node*, uint32_t> descriptorOf;
+    for (size_t i = 0; i < lumpOwners.size(); i++)
+        if (lumpOwners[i]) descriptorOf[lumpOwners[i]] = static_cast<uint32_t>(i);
+
+    vector<IndexNode> records;
+    string paths;
+    vector<pair<const Node*, uint32_t>> stack = {{root, NoIndex}};
+    while (!stack.empty()) {
+        const Node* node = stack.back().first;
+        uint32_t parent = stack.back().second;
+        stack.pop_back();
+
+        IndexNode r = {};
+        r.name = node->name.bits;
+        r.parent = parent;
+        auto d = descriptorOf.find(node);
+        r.descriptor = d == descriptorOf.end() ? NoIndex : d->second;
+        r.offset = node->offset;
+        r.length = node->length;
+        r.block = node->block;
+        r.isDirectory = node->isDirectory;
+        r.flags = node->flags;
+        // a node a later one took the path from is stored with none
+        auto p = pathOf.find(node);
+        r.pathOffset = static_cast<uint32_t>(paths.size());
+        if (p != pathOf.end()) {
+            paths += p->second;
+            r.pathLength = static_cast<uint32_t>(p->second.size());
+        }
+        uint32_t self = static_cast<uint32_t>(records.size());
+        records.push_back(r);
+
+        for (auto c = node->children.rbegin(); c != node->children.rend(); ++c)
+            stack.push_back({*c, self});
+    }
+
+    header.nodeCount = static_cast<uint32_t>(records.size());
+    header.pathBytes = static_cast<uint32_t>(paths.size());
+    header.bodyCrc = crc32c(paths.data(), paths.size(),
+                            crc32c(records.data(), records.size() * sizeof(IndexNode)));
+
+    string image(reinterpret_cast<const char*>(&header), sizeof(header));
+    image.append(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(IndexNode));
+    image += paths;
+    return image;
+}
+
+void Wad::saveIndex() const {
+    string image = treeImage();
+    if (image.empty()) return;
+
+    // written aside and renamed, so a reader never maps half an image
+    string cachePath = wadPath + ".index";
+    string tempPath = cachePath + ".tmp";
+    int fd = ::open(tempPath.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    if (fd < 0) return;
+    bool written = ::write(fd, image.data(), image.size()) == static_cast<ssize_t>(image.size());
+    close(fd);
+    if (!written || rename(tempPath.c_str(), cachePath.c_str()) != 0) unlink(tempPath.c_str());
+}
+
+void Wad::touchIndex() const {
+    // the save truncated and rewrote the same inode
+    uint64_t fileSize;
+    int64_t mtime;
+    if (!statFile(fileDescriptor, &fileSize, &mtime)) return;
+
+    int fd = ::open((wadPath + ".index").c_str(), O_RDWR);
+    if (fd < 0) return;
+    IndexHeader header;
+    if (pread(fd, &header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header)) &&
+        memcmp(header.magic, IndexMagic, 4) == 0 && header.directoryCrc == directoryCrc) {
+        header.fileSize = fileSize;
+        header.mtime = mtime;
+        if (pwrite(fd, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header)))
+            unlink((wadPath + ".index").c_str());
+    }
+    close(fd);
+}
@@ -0,0 +1,226 @@
+#include "IoEngine.h"
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <algorithm>
+
+using namespace std;
+
+// Finishes whatever part of a request is left with plain pread/pwrite
+static void completeSync(IoRequest *req, size_t done) {
+    char *buf = static_cast<char*>(req->buffer);
+    while (done < req->length) {
+        ssize_t r = req->write
+            ? pwrite(req->fd, buf + done, req->length - done, req->offset + static_cast<off_t>(done))
+            : pread(req->fd, buf + done, req->length - done, req->offset + static_cast<off_t>(done));
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            req->result = -errno;
+            return;
+        }
+        if (r == 0) break; // EOF
+        done += static_cast<size_t>(r);
+    }
+    req->result = static_cast<ssize_t>(done);
+}
+
+// POSIX fallback: every request completes inside submit()
+class PosixIoEngine : public IoEngine {
+
+public:
+    void submit(IoRequest *request) override { completeSync(request, 0); }
+    void wait() override {}
+    Kind kind() const override { return Posix; }
+};
+
+// io_uring engine driven through the raw syscalls, so there is no liburing
+// dependency. Up to `entries` requests are kept in flight at once. An SQE's
+// length is 32 bits, so a request moves at most MaxTransfer bytes through
+// the ring and the rest is finished like a short transfer.
+class UringIoEngine : public IoEngine {
+
+    static constexpr size_t MaxTransfer = size_t(1) << 30;
+
+public:
+    UringIoEngine()
+        : ringFd(-1), entries(0), sqRing(nullptr), cqRing(nullptr), sqes(nullptr),
+          sqRingSize(0), cqRingSize(0), sqesSize(0), queued(0), inflight(0) {}
+
+    ~UringIoEngine() override {
+        if (ringFd >= 0) wait();
+        if (sqes) munmap(sqes, sqesSize);
+        if (cqRing && cqRing != sqRing) munmap(cqRing, cqRingSize);
+        if (sqRing) munmap(sqRing, sqRingSize);
+        if (ringFd >= 0) close(ringFd);
+    }
+
+    bool init(unsigned depth) {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        ringFd = static_cast<int>(syscall(__NR_io_uring_setup, depth, &p));
+        if (ringFd < 0 || !supportsReadWrite()) return false;
+        entries = p.sq_entries;
+
+        sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single && cqRingSize > sqRingSize) sqRingSize = cqRingSize;
+
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) { sqRing = nullptr; return false; }
+
+        if (single) {
+            cqRing = sqRing;
+        } else {
+            cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ringFd, IORING_OFF_CQ_RING);
+            if (cqRing == MAP_FAILED) { cqRing = nullptr; return false; }
+        }
+
+        sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+        void *s = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ringFd, IORING_OFF_SQES);
+        if (s == MAP_FAILED) return false;
+        sqes = static_cast<io_uring_sqe*>(s);
+
+        char *sq = static_cast<char*>(sqRing);
+        sqHead  = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+        sqTail  = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sqMask  = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+
+        char *cq = static_cast<char*>(cqRing);
+        cqHead = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cqMask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes   = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+        return true;
+    }
+
+    void submit(IoRequest *request) override {
+        // Ring full: hand the queue to the kernel until one is retired. The
+        // next slot must not be reused while the kernel may still read it,
+        // so a queue it keeps refusing is run synchronously instead.
+        while (inflight + queued >= entries) {
+            if (!enter(1) && queued > 0) failQueued();
+        }
+
+        unsigned tail = *sqTail;
+        unsigned idx = tail & *sqMask;
+        io_uring_sqe *sqe = &sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = request->fd;
+        sqe->addr = reinterpret_cast<uint64_t>(request->buffer);
+        sqe->len = static_cast<unsigned>(min(request->length, MaxTransfer));
+        sqe->off = static_cast<uint64_t>(request->offset);
+        sqe->user_data = reinterpret_cast<uint64_t>(request);
+        sqArray[idx] = idx;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        queued++;
+    }
+
+    void wait() override {
+        while (queued > 0 || inflight > 0) {
+            if (!enter(inflight + queued) && queued > 0) failQueued();
+        }
+    }
+
+    Kind kind() const override { return Uring; }
+
+private:
+    // IORING_OP_READ and IORING_OP_WRITE came with the probe in Linux 5.6;
+    // an older kernel sets the ring up and then fails every request
+    bool supportsReadWrite() {
+        const unsigned ops = IORING_OP_WRITE + 1;
+        uint64_t raw[(sizeof(io_uring_probe) + ops * sizeof(io_uring_probe_op)) / sizeof(uint64_t) + 1];
+        memset(raw, 0, sizeof(raw));
+        io_uring_probe *probe = reinterpret_cast<io_uring_probe*>(raw);
+        if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, ops) < 0) return false;
+        for (unsigned op : {IORING_OP_READ, IORING_OP_WRITE}) {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+        }
+        return true;
+    }
+
+    // Submits everything queued and blocks for at least minComplete
+    // completions. False if the kernel was busy (EAGAIN, EBUSY) and took none.
+    bool enter(unsigned minComplete) {
+        unsigned toSubmit = queued;
+        long r = syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete,
+                         IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (r >= 0) {
+            queued -= static_cast<unsigned>(r);
+            inflight += static_cast<unsigned>(r);
+        } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            failQueued();
+        }
+        bool busy = r < 0 && (errno == EAGAIN || errno == EBUSY);
+        reap();
+        return !busy;
+    }
+
+    void reap() {
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            const io_uring_cqe &cqe = cqes[head & *cqMask];
+            IoRequest *req = reinterpret_cast<IoRequest*>(cqe.user_data);
+            if (cqe.res == -EINVAL) {
+                completeSync(req, 0);  // an opcode or flag this kernel refuses
+            } else if (cqe.res < 0) {
+                req->result = cqe.res;
+            } else if (static_cast<size_t>(cqe.res) < req->length) {
+                completeSync(req, static_cast<size_t>(cqe.res)); // short transfer, or capped
+            } else {
+                req->result = cqe.res;
+            }
+            head++;
+            inflight--;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    // The kernel refused the queue outright: run it synchronously instead
+    void failQueued() {
+        unsigned tail = *sqTail;
+        for (unsigned t = tail - queued; t != tail; t++) {
+            io_uring_sqe *sqe = &sqes[t & *sqMask];
+            completeSync(reinterpret_cast<IoRequest*>(sqe->user_data), 0);
+        }
+        // rewind the tail so the kernel never sees these entries
+        __atomic_store_n(sqTail, tail - queued, __ATOMIC_RELEASE);
+        queued = 0;
+    }
+
+    int ringFd;
+    unsigned entries;
+    void *sqRing;
+    void *cqRing;
+    io_uring_sqe *sqes;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    size_t sqesSize;
+
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    io_uring_cqe *cqes;
+
+    unsigned queued;     // in the SQ ring, not yet handed to the kernel
+    unsigned inflight;   // handed to the kernel, completion not reaped
+};
+
+IoEngine* IoEngine::create(Kind kind) {
+    if (kind != Posix) {
+        UringIoEngine *uring = new UringIoEngine();
+        if (uring->init(64)) return uring;
+        delete uring;
+    }
+    return new PosixIoEngine();
+}
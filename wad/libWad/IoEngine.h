@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <sys/types.h>
+
+// One positional read or write handed to an IoEngine. The caller owns the
+// request and its buffer; both must stay alive until wait() returns.
+struct IoRequest {
+    int fd;
+    bool write;
+    void *buffer;
+    size_t length;
+    off_t offset;
+    ssize_t result;      // bytes transferred, or -errno; valid after wait()
+};
+
+// Pluggable I/O backend for loading and saving WADs. Requests may complete
+// in any order and at any point between submit() and wait().
+class IoEngine {
+
+public:
+    enum Kind {
+        Auto,            // io_uring when the kernel allows it, else Posix
+        Posix,           // synchronous pread/pwrite
+        Uring            // io_uring, many requests in flight
+    };
+
+    // Never returns null: Uring falls back to Posix if the ring can't be set up
+    static IoEngine* create(Kind kind = Auto);
+    virtual ~IoEngine() {}
+
+    virtual void submit(IoRequest *request) = 0;
+    virtual void wait() = 0;  // blocks until every submitted request completed
+
+    virtual Kind kind() const = 0;
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+using namespace std;
+
+// An 8-byte WAD lump name packed little-endian into one 64-bit word.
+// Bytes past the end of the name are always zero, so two names are equal
+// exactly when their words are equal and no lookup ever allocates.
+struct LumpName {
+    uint64_t bits;
+
+    constexpr LumpName() : bits(0) {}
+    constexpr explicit LumpName(uint64_t b) : bits(b) {}
+
+    // Compile-time construction for marker tables: LumpName::literal("_START")
+    static constexpr LumpName literal(const char *s) {
+        uint64_t b = 0;
+        for (int i = 0; i < 8 && s[i] != '\0'; ++i)
+            b |= static_cast<uint64_t>(static_cast<unsigned char>(s[i])) << (8 * i);
+        return LumpName(b);
+    }
+
+    // Decodes the raw 8-byte directory field: cut at the first NUL, then drop
+    // trailing spaces. Done with SWAR byte masks instead of a byte loop.
+    static LumpName fromBytes(const char *raw) {
+        uint64_t w;
+        memcpy(&w, raw, 8);
+
+        // everything from the first NUL upwards is padding
+        uint64_t nul = zeroBytes(w);
+        if (nul) w &= lowBytesMask(static_cast<size_t>(__builtin_ctzll(nul) >> 3));
+
+        // trailing spaces (and the zeroed tail) are padding too
+        uint64_t used = ~(zeroBytes(w) | zeroBytes(w ^ 0x2020202020202020ULL)) & 0x8080808080808080ULL;
+        if (!used) return LumpName();
+        return LumpName(w & lowBytesMask(static_cast<size_t>((63 - __builtin_clzll(used)) >> 3) + 1));
+    }
+
+    // Returns false (and leaves out untouched) if s does not fit in 8 bytes
+    static bool fromString(const string &s, LumpName *out) {
+        if (s.size() > 8 || memchr(s.data(), '\0', s.size())) return false;
+        uint64_t b = 0;
+        memcpy(&b, s.data(), s.size());
+        *out = LumpName(b);
+        return true;
+    }
+
+    constexpr size_t size() const {
+        return bits ? static_cast<size_t>((63 - __builtin_clzll(bits)) >> 3) + 1 : 0;
+    }
+    constexpr bool empty() const { return bits == 0; }
+
+    string str() const {
+        char buf[8];
+        memcpy(buf, &bits, 8);
+        return string(buf, size());
+    }
+
+    // Writes the zero-padded on-disk form
+    void toBytes(char out[8]) const { memcpy(out, &bits, 8); }
+
+    constexpr char at(size_t i) const { return static_cast<char>(bits >> (8 * i)); }
+
+    // ASCII upper-casing of all 8 bytes at once, no per-byte branches
+    LumpName upper() const {
+        const uint64_t hi = 0x8080808080808080ULL;
+        uint64_t low7 = bits & ~hi;
+        uint64_t geA = low7 + 0x0101010101010101ULL * (0x80 - 'a');
+        uint64_t gtZ = low7 + 0x0101010101010101ULL * (0x80 - 'z' - 1);
+        uint64_t lower = (geA ^ gtZ) & ~bits & hi; // 0x80 where 'a' <= byte <= 'z'
+        return LumpName(bits ^ (lower >> 2));
+    }
+
+    constexpr bool endsWith(LumpName suffix) const {
+        size_t n = size(), k = suffix.size();
+        if (k == 0 || n < k) return false;
+        return (bits >> (8 * (n - k))) == suffix.bits;
+    }
+
+    constexpr LumpName prefix(size_t n) const { return LumpName(bits & lowBytesMask(n)); }
+
+    // Concatenation, truncated to 8 bytes
+    LumpName append(LumpName suffix) const {
+        size_t n = size();
+        if (n >= 8) return *this;
+        return LumpName(bits | (suffix.bits << (8 * n)));
+    }
+
+    constexpr bool operator==(LumpName o) const { return bits == o.bits; }
+    constexpr bool operator!=(LumpName o) const { return bits != o.bits; }
+    constexpr bool operator<(LumpName o) const { return bits < o.bits; }
+
+private:
+    // 0x80 in every byte of w that is exactly zero, 0 elsewhere
+    static uint64_t zeroBytes(uint64_t w) {
+        const uint64_t low7 = 0x7f7f7f7f7f7f7f7fULL;
+        return ~(((w & low7) + low7) | w | low7);
+    }
+
+    static constexpr uint64_t lowBytesMask(size_t n) {
+        return n >= 8 ? ~0ULL : ((1ULL << (8 * n)) - 1);
+    }
+};
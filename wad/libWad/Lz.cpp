@@ -0,0 +1,114 @@
+#include "Lz.h"
+#include <cstdint>
+#include <cstring>
+
+using namespace std;
+
+static const size_t MinMatch = 4;
+static const size_t TailLiterals = 8;  // matches stop short of the end
+static const int HashBits = 13;
+
+static uint32_t load32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HashBits);
+}
+
+// Lengths past the nibble continue in bytes of 255 and a final remainder
+static char *putLength(char *out, size_t extra) {
+    for (; extra >= 255; extra -= 255) *out++ = static_cast<char>(255);
+    *out++ = static_cast<char>(extra);
+    return out;
+}
+
+static char *putSequence(char *out, const char *literals, size_t literalLength, size_t offset, size_t matchLength) {
+    size_t matchCode = matchLength ? matchLength - MinMatch : 0;
+    *out++ = static_cast<char>((literalLength < 15 ? literalLength : 15) << 4 | (matchCode < 15 ? matchCode : 15));
+    if (literalLength >= 15) out = putLength(out, literalLength - 15);
+    memcpy(out, literals, literalLength);
+    out += literalLength;
+    if (!matchLength) return out;
+
+    *out++ = static_cast<char>(offset & 0xFF);
+    *out++ = static_cast<char>(offset >> 8);
+    if (matchCode >= 15) out = putLength(out, matchCode - 15);
+    return out;
+}
+
+size_t lzBound(size_t length) {
+    return length + length / 255 + 16;
+}
+
+size_t lzCompress(const char *in, size_t length, char *out) {
+    char *start = out;
+    size_t anchor = 0;
+    if (length > TailLiterals + MinMatch) {
+        uint32_t table[1 << HashBits] = {}; // position + 1, 0 = empty
+        size_t limit = length - TailLiterals;
+        size_t pos = 0;
+        while (pos + MinMatch <= limit) {
+            uint32_t seq = load32(in + pos);
+            uint32_t h = hash4(seq);
+            size_t candidate = table[h];
+            table[h] = static_cast<uint32_t>(pos + 1);
+            if (!candidate || pos - (candidate - 1) > 0xFFFF || load32(in + candidate - 1) != seq) {
+                pos += 1 + ((pos - anchor) >> 6); // strides through data that will not compress
+                continue;
+            }
+
+            size_t from = candidate - 1, match = MinMatch;
+            while (pos + match < limit && in[from + match] == in[pos + match]) match++;
+            out = putSequence(out, in + anchor, pos - anchor, pos - from, match);
+            pos += match;
+            anchor = pos;
+        }
+    }
+    out = putSequence(out, in + anchor, length - anchor, 0, 0);
+    return static_cast<size_t>(out - start);
+}
+
+bool lzDecompress(const char *in, size_t length, char *out, size_t outLength) {
+    const uint8_t *ip = reinterpret_cast<const uint8_t*>(in), *end = ip + length;
+    size_t op = 0;
+
+    auto getLength = [&](size_t *n) {
+        uint8_t b;
+        do {
+            if (ip == end) return false;
+            b = *ip++;
+            *n += b;
+        } while (b == 255);
+        return true;
+    };
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !getLength(&literals)) return false;
+        if (literals > static_cast<size_t>(end - ip) || literals > outLength - op) return false;
+        memcpy(out + op, ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == end) break; // the closing literals-only sequence
+
+        if (end - ip < 2) return false;
+        size_t offset = ip[0] | static_cast<size_t>(ip[1]) << 8;
+        ip += 2;
+        size_t match = token & 15;
+        if (match == 15 && !getLength(&match)) return false;
+        match += MinMatch;
+        if (offset == 0 || offset > op || match > outLength - op) return false;
+
+        if (offset >= match) {
+            memcpy(out + op, out + op - offset, match);
+        } else {
+            for (size_t i = 0; i < match; i++) out[op + i] = out[op + i - offset]; // overlapping run
+        }
+        op += match;
+    }
+    return op == outLength;
+}
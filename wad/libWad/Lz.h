@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+
+using namespace std;
+
+// Byte-oriented LZ77 in the style of LZ4: each sequence is a token (literal
+// and match length nibbles), the literals, a 16-bit match offset and any
+// length extension bytes; the last sequence is literals only. Meant for
+// blocks of at most 64 KiB, where it decodes at memory speed.
+
+// Worst-case compressed size of `length` bytes
+size_t lzBound(size_t length);
+
+// Compresses into `out` (room for lzBound(length) bytes); returns the size
+size_t lzCompress(const char *in, size_t length, char *out);
+
+// False unless `in` decodes to exactly `outLength` bytes
+bool lzDecompress(const char *in, size_t length, char *out, size_t outLength);
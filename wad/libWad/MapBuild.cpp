@@ -0,0 +1,862 @@
+#include "MapBuild.h"
+#include "Wad.h"
+#include <immintrin.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <system_error>
+#include <unordered_map>
+#include <cmath>
+#include <cstring>
+
+using namespace std;
+
+// Block grid shared by the BLOCKMAP builder and the REJECT sight tests:
+// `lines` holds each block's line ids back to back, block b's run being
+// lines[start[b] .. start[b + 1]).
+
+namespace {
+
+struct Segment {
+    double x1, y1, x2, y2;
+};
+
+struct Grid {
+    enum { BlockSize = 128 };
+
+    int originX;
+    int originY;
+    int columns;
+    int rows;
+    vector<uint32_t> start;
+    vector<uint32_t> lines;
+};
+
+}
+
+static bool gridBounds(const RecordSpan<MapVertex> &vertexes, Grid *grid) {
+    if (vertexes.empty()) return false;
+
+    int minX = vertexes[0].x, maxX = minX, minY = vertexes[0].y, maxY = minY;
+    for (const MapVertex &v : vertexes) {
+        minX = min<int>(minX, v.x);
+        maxX = max<int>(maxX, v.x);
+        minY = min<int>(minY, v.y);
+        maxY = max<int>(maxY, v.y);
+    }
+    grid->originX = minX - 8;
+    grid->originY = minY - 8;
+    grid->columns = ((maxX - grid->originX) >> 7) + 1;
+    grid->rows = ((maxY - grid->originY) >> 7) + 1;
+    return true;
+}
+
+// Calls visit(block) for every block the segment touches, column by column;
+// stops early when visit returns false
+template <typename Visit>
+static bool forEachBlock(const Grid &grid, const Segment &s, Visit visit) {
+    double ax = s.x1 - grid.originX, ay = s.y1 - grid.originY;
+    double bx = s.x2 - grid.originX, by = s.y2 - grid.originY;
+    if (ax > bx) {
+        swap(ax, bx);
+        swap(ay, by);
+    }
+
+    int c0 = max(0, static_cast<int>(floor(ax / Grid::BlockSize)));
+    int c1 = min(grid.columns - 1, static_cast<int>(floor(bx / Grid::BlockSize)));
+    for (int c = c0; c <= c1; c++) {
+        double yl = ay, yr = by;
+        if (bx > ax) {
+            double xl = max(ax, static_cast<double>(c * Grid::BlockSize));
+            double xr = min(bx, static_cast<double>((c + 1) * Grid::BlockSize));
+            yl = ay + (by - ay) * (xl - ax) / (bx - ax);
+            yr = ay + (by - ay) * (xr - ax) / (bx - ax);
+        }
+        int r0 = max(0, static_cast<int>(floor(min(yl, yr) / Grid::BlockSize)));
+        int r1 = min(grid.rows - 1, static_cast<int>(floor(max(yl, yr) / Grid::BlockSize)));
+        for (int r = r0; r <= r1; r++)
+            if (!visit(static_cast<uint32_t>(r * grid.columns + c))) return false;
+    }
+    return true;
+}
+
+// Bins segments into the grid: one pass collecting (block, id) pairs in id
+// order, then a counting sort by block, which keeps each run sorted by id
+static void binSegments(Grid *grid, const vector<Segment> &segments, const vector<uint32_t> &ids) {
+    size_t blocks = static_cast<size_t>(grid->columns) * grid->rows;
+    vector<uint64_t> pairs;
+    pairs.reserve(segments.size() * 2);
+    for (size_t i = 0; i < segments.size(); i++) {
+        forEachBlock(*grid, segments[i], [&](uint32_t block) {
+            pairs.push_back(static_cast<uint64_t>(block) << 32 | ids[i]);
+            return true;
+        });
+    }
+
+    grid->start.assign(blocks + 1, 0);
+    for (uint64_t p : pairs)
+        grid->start[(p >> 32) + 1]++;
+    for (size_t b = 0; b < blocks; b++)
+        grid->start[b + 1] += grid->start[b];
+
+    vector<uint32_t> fill(grid->start.begin(), grid->start.end() - 1);
+    grid->lines.resize(pairs.size());
+    for (uint64_t p : pairs)
+        grid->lines[fill[p >> 32]++] = static_cast<uint32_t>(p);
+}
+
+static Segment lineSegment(const MapView &map, const MapLinedef &line) {
+    const MapVertex &a = map.vertexes()[line.v1];
+    const MapVertex &b = map.vertexes()[line.v2];
+    return Segment{static_cast<double>(a.x), static_cast<double>(a.y),
+                   static_cast<double>(b.x), static_cast<double>(b.y)};
+}
+
+static bool validLines(const MapView &map) {
+    size_t vertexCount = map.vertexes().size();
+    for (const MapLinedef &line : map.linedefs())
+        if (line.v1 >= vertexCount || line.v2 >= vertexCount) return false;
+    return !map.linedefs().empty();
+}
+
+// BLOCKMAP
+
+bool buildBlockmap(const MapView &map, vector<char> *out) {
+    if (!out || !validLines(map)) return false;
+
+    Grid grid;
+    if (!gridBounds(map.vertexes(), &grid)) return false;
+
+    vector<Segment> segments;
+    vector<uint32_t> ids;
+    for (size_t i = 0; i < map.linedefs().size(); i++) {
+        segments.push_back(lineSegment(map, map.linedefs()[i]));
+        ids.push_back(static_cast<uint32_t>(i));
+    }
+    binSegments(&grid, segments, ids);
+
+    // header, offset table, the shared empty list, then one list per
+    // non-empty block: 0, line ids..., -1
+    size_t blocks = static_cast<size_t>(grid.columns) * grid.rows;
+    size_t emptyList = 4 + blocks;
+    vector<uint16_t> words;
+    words.reserve(emptyList + 2 + blocks + grid.lines.size() + 2 * blocks);
+    words.push_back(static_cast<uint16_t>(grid.originX));
+    words.push_back(static_cast<uint16_t>(grid.originY));
+    words.push_back(static_cast<uint16_t>(grid.columns));
+    words.push_back(static_cast<uint16_t>(grid.rows));
+    words.resize(emptyList);
+    words.push_back(0);
+    words.push_back(0xFFFF);
+
+    for (size_t b = 0; b < blocks; b++) {
+        if (grid.start[b] == grid.start[b + 1]) {
+            words[4 + b] = static_cast<uint16_t>(emptyList);
+            continue;
+        }
+        if (words.size() > 0xFFFF) return false;
+        words[4 + b] = static_cast<uint16_t>(words.size());
+        words.push_back(0);
+        for (uint32_t i = grid.start[b]; i < grid.start[b + 1]; i++)
+            words.push_back(static_cast<uint16_t>(grid.lines[i]));
+        words.push_back(0xFFFF);
+    }
+
+    out->resize(words.size() * 2);
+    memcpy(out->data(), words.data(), out->size());
+    return true;
+}
+
+// REJECT
+
+static double cross(double ax, double ay, double bx, double by, double cx, double cy) {
+    return (bx - ax) * (cy - ay) - (by - ay) * (cx - ax);
+}
+
+static bool within(double a, double b, double v) {
+    return min(a, b) <= v && v <= max(a, b);
+}
+
+// How a sight line meets a one-sided line. Crossing it, running along it
+// or ending on it blocks; passing through one of its ends is a Corner,
+// decided by the lines on either side (see SightTracer)
+enum class Contact { None, Blocked, Corner };
+
+static Contact contact(const Segment &sight, const Segment &wall, double *cornerX, double *cornerY, int *side) {
+    double d1 = cross(sight.x1, sight.y1, sight.x2, sight.y2, wall.x1, wall.y1);
+    double d2 = cross(sight.x1, sight.y1, sight.x2, sight.y2, wall.x2, wall.y2);
+    double d3 = cross(wall.x1, wall.y1, wall.x2, wall.y2, sight.x1, sight.y1);
+    double d4 = cross(wall.x1, wall.y1, wall.x2, wall.y2, sight.x2, sight.y2);
+    if (((d1 > 0 && d2 < 0) || (d1 < 0 && d2 > 0)) && ((d3 > 0 && d4 < 0) || (d3 < 0 && d4 > 0)))
+        return Contact::Blocked;
+
+    if (d1 == 0 && d2 == 0) {
+        // collinear: blocked only where they overlap for some length
+        bool useX = sight.x1 != sight.x2;
+        double s1 = useX ? sight.x1 : sight.y1, s2 = useX ? sight.x2 : sight.y2;
+        double w1 = useX ? wall.x1 : wall.y1, w2 = useX ? wall.x2 : wall.y2;
+        return min(max(s1, s2), max(w1, w2)) > max(min(s1, s2), min(w1, w2)) ? Contact::Blocked : Contact::None;
+    }
+    if (d1 == 0 && within(sight.x1, sight.x2, wall.x1) && within(sight.y1, sight.y2, wall.y1)) {
+        *cornerX = wall.x1;
+        *cornerY = wall.y1;
+        *side = d2 > 0 ? 1 : -1;
+        return Contact::Corner;
+    }
+    if (d2 == 0 && within(sight.x1, sight.x2, wall.x2) && within(sight.y1, sight.y2, wall.y2)) {
+        *cornerX = wall.x2;
+        *cornerY = wall.y2;
+        *side = d1 > 0 ? 1 : -1;
+        return Contact::Corner;
+    }
+    if (d3 == 0 && within(wall.x1, wall.x2, sight.x1) && within(wall.y1, wall.y2, sight.y1)) return Contact::Blocked;
+    if (d4 == 0 && within(wall.x1, wall.x2, sight.x2) && within(wall.y1, wall.y2, sight.y2)) return Contact::Blocked;
+    return Contact::None;
+}
+
+namespace {
+
+struct Point {
+    double x, y;
+};
+
+// Per-worker sight tracing state: `stamp` makes a line that spans several
+// blocks get tested once per trace. A sight line that only grazes the end
+// of a one-sided line is clear unless one-sided lines meeting there lie on
+// both sides of it, that is, it slips through a joint in a wall.
+struct SightTracer {
+    struct Corner {
+        double x, y;
+        int sides;           // 1 = left, 2 = right
+    };
+
+    const Grid &grid;
+    const vector<Segment> &solid;
+    vector<uint32_t> seen;
+    uint32_t stamp;
+    vector<Corner> corners;  // grazed during the current trace
+
+    SightTracer(const Grid &grid, const vector<Segment> &solid)
+        : grid(grid), solid(solid), seen(solid.size(), 0), stamp(0) {}
+
+    bool clear(const Point &a, const Point &b) {
+        if (++stamp == 0) {
+            fill(seen.begin(), seen.end(), 0);
+            stamp = 1;
+        }
+        corners.clear();
+        Segment sight = {a.x, a.y, b.x, b.y};
+        return forEachBlock(grid, sight, [&](uint32_t block) {
+            for (uint32_t i = grid.start[block]; i < grid.start[block + 1]; i++) {
+                uint32_t line = grid.lines[i];
+                if (seen[line] == stamp) continue;
+                seen[line] = stamp;
+                double x, y;
+                int side;
+                Contact c = contact(sight, solid[line], &x, &y, &side);
+                if (c == Contact::Blocked) return false;
+                if (c == Contact::Corner && !graze(x, y, side > 0 ? 1 : 2)) return false;
+            }
+            return true;
+        });
+    }
+
+    // False once the corner has one-sided lines on both sides of the sight
+    bool graze(double x, double y, int side) {
+        for (Corner &c : corners) {
+            if (c.x != x || c.y != y) continue;
+            c.sides |= side;
+            return c.sides != 3;
+        }
+        corners.push_back({x, y, side});
+        return true;
+    }
+};
+
+}
+
+static int findRoot(vector<int> &parent, int i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+const double PortalInset = 1.0 / 16; // map units between a portal's end and its end sample
+
+bool buildReject(const MapView &map, vector<char> *out, unsigned threads) {
+    if (!out || !validLines(map)) return false;
+    size_t sectorCount = map.sectors().size();
+    if (sectorCount == 0) return false;
+
+    // Sector on each side of each line; -1 = no side
+    auto sideSector = [&](uint16_t side) -> int {
+        if (side == 0xFFFF || side >= map.sidedefs().size()) return -1;
+        uint16_t sector = map.sidedefs()[side].sector;
+        return sector < sectorCount ? sector : -1;
+    };
+
+    Grid grid;
+    if (!gridBounds(map.vertexes(), &grid)) return false;
+
+    vector<Segment> solid;
+    vector<uint32_t> solidIds;
+    vector<vector<Point>> samples(sectorCount);
+    vector<int> parent(sectorCount);
+    for (size_t s = 0; s < sectorCount; s++) parent[s] = static_cast<int>(s);
+
+    size_t words = (sectorCount + 63) / 64;
+    vector<uint64_t> visible(sectorCount * words, 0);
+    auto setVisible = [&](size_t i, size_t j) { visible[i * words + j / 64] |= 1ULL << (j % 64); };
+    auto isVisible = [&](size_t i, size_t j) { return (visible[i * words + j / 64] >> (j % 64)) & 1; };
+
+    for (const MapLinedef &line : map.linedefs()) {
+        Segment seg = lineSegment(map, line);
+        int front = sideSector(line.sidenum[0]);
+        int back = sideSector(line.sidenum[1]);
+        if (front < 0 || back < 0) {
+            solidIds.push_back(static_cast<uint32_t>(solid.size()));
+            solid.push_back(seg);
+            continue;
+        }
+        if (front == back) continue;
+
+        // Adjacent sectors always see each other; farther ones are traced
+        // from up to four points inside the shared line and from just
+        // inside its ends, where the sight lines that only pass a portal at
+        // its edge start
+        setVisible(front, back);
+        setVisible(back, front);
+        parent[findRoot(parent, front)] = findRoot(parent, back);
+
+        double length = hypot(seg.x2 - seg.x1, seg.y2 - seg.y1);
+        int n = max(1, min(4, static_cast<int>(length / 32)));
+        vector<double> at;
+        for (int k = 0; k < n; k++) at.push_back((k + 0.5) / n);
+        if (length > 4 * PortalInset) {
+            at.push_back(PortalInset / length);
+            at.push_back(1 - PortalInset / length);
+        }
+        for (double t : at) {
+            Point p = {seg.x1 + (seg.x2 - seg.x1) * t, seg.y1 + (seg.y2 - seg.y1) * t};
+            samples[front].push_back(p);
+            samples[back].push_back(p);
+        }
+    }
+    binSegments(&grid, solid, solidIds);
+
+    vector<int> component(sectorCount);
+    for (size_t s = 0; s < sectorCount; s++) {
+        component[s] = findRoot(parent, static_cast<int>(s));
+        setVisible(s, s);
+    }
+
+    // Upper triangle, one row at a time per worker: rows never share words
+    atomic<size_t> nextRow(0);
+    auto worker = [&]() {
+        SightTracer tracer(grid, solid);
+        size_t i;
+        while ((i = nextRow.fetch_add(1)) < sectorCount) {
+            for (size_t j = i + 1; j < sectorCount; j++) {
+                if (component[i] != component[j] || isVisible(i, j)) continue;
+
+                bool seen = false;
+                for (const Point &a : samples[i]) {
+                    for (const Point &b : samples[j])
+                        if ((seen = tracer.clear(a, b))) break;
+                    if (seen) break;
+                }
+                if (seen) setVisible(i, j);
+            }
+        }
+    };
+
+    if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+    threads = static_cast<unsigned>(min<size_t>(threads, sectorCount));
+    vector<thread> pool;
+    try {
+        for (unsigned t = 1; t < threads; t++)
+            pool.emplace_back(worker);
+    } catch (const system_error &) {
+        // fewer workers; rows are handed out as they ask
+    }
+    worker();
+    for (thread &t : pool)
+        t.join();
+
+    // Mirror, then pack the complement row-major, LSB first
+    for (size_t i = 0; i < sectorCount; i++)
+        for (size_t j = i + 1; j < sectorCount; j++)
+            if (isVisible(i, j)) setVisible(j, i);
+
+    out->assign((sectorCount * sectorCount + 7) / 8, 0);
+    for (size_t i = 0; i < sectorCount; i++) {
+        for (size_t j = 0; j < sectorCount; j++) {
+            if (isVisible(i, j)) continue;
+            size_t bit = i * sectorCount + j;
+            (*out)[bit / 8] = static_cast<char>((*out)[bit / 8] | (1 << (bit % 8)));
+        }
+    }
+    return true;
+}
+
+// Nodes
+
+namespace {
+
+struct BspSeg {
+    double x1, y1, x2, y2;
+    int v1, v2;          // original vertex ids; -1 for points made by splits
+    uint16_t linedef;
+    uint8_t side;
+};
+
+// Always taken from a linedef, so the line itself is exact
+struct Partition {
+    double x, y, dx, dy;
+};
+
+struct BspBuild {
+    bool leaf;
+    vector<BspSeg> segs;    // leaves only
+    Partition line;
+    BspBuild *child[2];     // front (right of the line), back
+
+    BspBuild() : leaf(true), line{0, 0, 0, 0}, child{nullptr, nullptr} {}
+    ~BspBuild() {
+        delete child[0];
+        delete child[1];
+    }
+};
+
+struct SideCounts {
+    int front;
+    int back;
+    int splits;
+};
+
+// Seg endpoints in columns for the scoring kernels
+struct SegColumns {
+    vector<double> x1, y1, x2, y2;
+
+    explicit SegColumns(const vector<BspSeg> &segs) {
+        for (const BspSeg &s : segs) {
+            x1.push_back(s.x1);
+            y1.push_back(s.y1);
+            x2.push_back(s.x2);
+            y2.push_back(s.y2);
+        }
+    }
+};
+
+}
+
+static const double OnLine = 0.01;     // distance at which a point counts as on the line
+static const int SplitCost = 8;
+static const size_t MaxCandidates = 128;
+static const size_t ParallelSubtree = 64; // smaller subtrees stay with their worker
+
+enum SegSide { Front, Back, Split };
+
+// a, b: signed distances of the seg's ends (right of the line positive);
+// dot: seg direction against the line's, deciding segs lying on it
+static SegSide segSide(double a, double b, double dot) {
+    bool aFront = a > OnLine, aBack = a < -OnLine;
+    bool bFront = b > OnLine, bBack = b < -OnLine;
+    if ((aFront && bBack) || (aBack && bFront)) return Split;
+    if (aFront || bFront) return Front;
+    if (aBack || bBack) return Back;
+    return dot > 0 ? Front : Back;
+}
+
+static void countScalar(const SegColumns &c, size_t from, size_t n, const Partition &p,
+                        double invLength, SideCounts *k) {
+    for (size_t i = from; i < n; i++) {
+        double a = (p.dy * (c.x1[i] - p.x) - p.dx * (c.y1[i] - p.y)) * invLength;
+        double b = (p.dy * (c.x2[i] - p.x) - p.dx * (c.y2[i] - p.y)) * invLength;
+        double dot = (c.x2[i] - c.x1[i]) * p.dx + (c.y2[i] - c.y1[i]) * p.dy;
+        switch (segSide(a, b, dot)) {
+        case Front: k->front++; break;
+        case Back:  k->back++; break;
+        default:    k->splits++; break;
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void countAvx2(const SegColumns &c, size_t n, const Partition &p, double invLength, SideCounts *k) {
+    const __m256d px = _mm256_set1_pd(p.x), py = _mm256_set1_pd(p.y);
+    const __m256d dx = _mm256_set1_pd(p.dx), dy = _mm256_set1_pd(p.dy);
+    const __m256d inv = _mm256_set1_pd(invLength);
+    const __m256d eps = _mm256_set1_pd(OnLine), negEps = _mm256_set1_pd(-OnLine);
+    const __m256d zero = _mm256_setzero_pd();
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x1 = _mm256_loadu_pd(&c.x1[i]), y1 = _mm256_loadu_pd(&c.y1[i]);
+        __m256d x2 = _mm256_loadu_pd(&c.x2[i]), y2 = _mm256_loadu_pd(&c.y2[i]);
+        __m256d a = _mm256_mul_pd(_mm256_sub_pd(_mm256_mul_pd(dy, _mm256_sub_pd(x1, px)),
+                                                _mm256_mul_pd(dx, _mm256_sub_pd(y1, py))), inv);
+        __m256d b = _mm256_mul_pd(_mm256_sub_pd(_mm256_mul_pd(dy, _mm256_sub_pd(x2, px)),
+                                                _mm256_mul_pd(dx, _mm256_sub_pd(y2, py))), inv);
+        __m256d dot = _mm256_add_pd(_mm256_mul_pd(_mm256_sub_pd(x2, x1), dx),
+                                    _mm256_mul_pd(_mm256_sub_pd(y2, y1), dy));
+
+        __m256d anyFront = _mm256_or_pd(_mm256_cmp_pd(a, eps, _CMP_GT_OQ), _mm256_cmp_pd(b, eps, _CMP_GT_OQ));
+        __m256d anyBack = _mm256_or_pd(_mm256_cmp_pd(a, negEps, _CMP_LT_OQ), _mm256_cmp_pd(b, negEps, _CMP_LT_OQ));
+        // one end in front and the other behind is exactly a split
+        int split = _mm256_movemask_pd(_mm256_and_pd(anyFront, anyBack));
+        int front = _mm256_movemask_pd(anyFront) & ~split;
+        int back = _mm256_movemask_pd(anyBack) & ~split;
+        int on = ~(front | back | split) & 0xF;
+        int along = _mm256_movemask_pd(_mm256_cmp_pd(dot, zero, _CMP_GT_OQ));
+
+        k->splits += __builtin_popcount(split);
+        k->front += __builtin_popcount(front | (on & along));
+        k->back += __builtin_popcount(back | (on & ~along));
+    }
+    countScalar(c, i, n, p, invLength, k);
+}
+
+static SideCounts countSides(const SegColumns &c, const Partition &p) {
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    SideCounts k = {0, 0, 0};
+    double invLength = 1.0 / hypot(p.dx, p.dy);
+    if (avx2) countAvx2(c, c.x1.size(), p, invLength, &k);
+    else countScalar(c, 0, c.x1.size(), p, invLength, &k);
+    return k;
+}
+
+static Partition segLine(const MapView &map, const BspSeg &seg) {
+    const MapLinedef &line = map.linedefs()[seg.linedef];
+    const MapVertex &a = map.vertexes()[seg.side ? line.v2 : line.v1];
+    const MapVertex &b = map.vertexes()[seg.side ? line.v1 : line.v2];
+    return Partition{static_cast<double>(a.x), static_cast<double>(a.y),
+                     static_cast<double>(b.x - a.x), static_cast<double>(b.y - a.y)};
+}
+
+// Lowest-cost line that has segs behind it or splits some; false when there
+// is none, i.e. the set is convex
+static bool choosePartition(const MapView &map, const vector<BspSeg> &segs, Partition *best) {
+    // one candidate per linedef
+    vector<pair<uint16_t, size_t>> lines;
+    for (size_t i = 0; i < segs.size(); i++)
+        lines.push_back({segs[i].linedef, i});
+    sort(lines.begin(), lines.end());
+    vector<size_t> candidates;
+    for (size_t i = 0; i < lines.size(); i++)
+        if (i == 0 || lines[i].first != lines[i - 1].first) candidates.push_back(lines[i].second);
+
+    SegColumns columns(segs);
+    size_t stride = max<size_t>(1, candidates.size() / MaxCandidates);
+    long bestCost = -1;
+    for (size_t pass = 0; pass < 2 && bestCost < 0; pass++) {
+        // a strided sample first; everything only if no sampled line divides
+        for (size_t c = 0; c < candidates.size(); c++) {
+            bool sampled = c % stride == 0;
+            if (pass == 0 ? !sampled : sampled) continue;
+
+            Partition p = segLine(map, segs[candidates[c]]);
+            SideCounts k = countSides(columns, p);
+            if (k.back == 0 && k.splits == 0) continue;
+
+            long cost = static_cast<long>(k.splits) * SplitCost + abs(k.front - k.back);
+            if (bestCost < 0 || cost < bestCost) {
+                bestCost = cost;
+                *best = p;
+            }
+        }
+        if (stride == 1) break;
+    }
+    return bestCost >= 0;
+}
+
+static void splitSegs(const vector<BspSeg> &segs, const Partition &p,
+                      vector<BspSeg> *front, vector<BspSeg> *back) {
+    double invLength = 1.0 / hypot(p.dx, p.dy);
+    for (const BspSeg &s : segs) {
+        double a = (p.dy * (s.x1 - p.x) - p.dx * (s.y1 - p.y)) * invLength;
+        double b = (p.dy * (s.x2 - p.x) - p.dx * (s.y2 - p.y)) * invLength;
+        double dot = (s.x2 - s.x1) * p.dx + (s.y2 - s.y1) * p.dy;
+        switch (segSide(a, b, dot)) {
+        case Front: front->push_back(s); break;
+        case Back:  back->push_back(s); break;
+        default: {
+            double t = a / (a - b);
+            double x = s.x1 + (s.x2 - s.x1) * t, y = s.y1 + (s.y2 - s.y1) * t;
+            BspSeg first = s, second = s;
+            first.x2 = second.x1 = x;
+            first.y2 = second.y1 = y;
+            first.v2 = second.v1 = -1;
+            (a > 0 ? front : back)->push_back(first);
+            (a > 0 ? back : front)->push_back(second);
+            break;
+        }
+        }
+    }
+}
+
+namespace {
+
+// Work-stealing pool: each worker pushes and pops subtrees at the back of
+// its own queue and steals from the front of the others'
+struct BspTask {
+    BspBuild *node;
+    vector<BspSeg> segs;
+};
+
+struct BspQueue {
+    mutex lock;
+    deque<BspTask> tasks;
+};
+
+struct BspContext {
+    const MapView &map;
+    vector<unique_ptr<BspQueue>> queues;
+    atomic<int> pending;
+
+    BspContext(const MapView &map, unsigned workers) : map(map), pending(0) {
+        for (unsigned i = 0; i < workers; i++)
+            queues.emplace_back(new BspQueue());
+    }
+
+    void push(unsigned worker, BspTask task) {
+        pending++;
+        lock_guard<mutex> guard(queues[worker]->lock);
+        queues[worker]->tasks.push_back(move(task));
+    }
+
+    bool take(unsigned worker, BspTask *task) {
+        for (size_t n = 0; n < queues.size(); n++) {
+            BspQueue &q = *queues[(worker + n) % queues.size()];
+            lock_guard<mutex> guard(q.lock);
+            if (q.tasks.empty()) continue;
+            if (n == 0) {
+                *task = move(q.tasks.back());
+                q.tasks.pop_back();
+            } else {
+                *task = move(q.tasks.front());
+                q.tasks.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+};
+
+}
+
+// Partitions down the front side in a loop; back subtrees big enough to be
+// worth moving go to the queue, the rest recurse here
+static void buildSubtree(BspContext &ctx, BspBuild *node, vector<BspSeg> segs, unsigned worker) {
+    while (true) {
+        Partition line;
+        vector<BspSeg> front, back;
+        if (choosePartition(ctx.map, segs, &line))
+            splitSegs(segs, line, &front, &back);
+        if (front.empty() || back.empty()) {
+            node->leaf = true;
+            node->segs = move(segs);
+            return;
+        }
+
+        node->leaf = false;
+        node->line = line;
+        node->child[0] = new BspBuild();
+        node->child[1] = new BspBuild();
+        if (back.size() >= ParallelSubtree && ctx.queues.size() > 1)
+            ctx.push(worker, BspTask{node->child[1], move(back)});
+        else
+            buildSubtree(ctx, node->child[1], move(back), worker);
+
+        node = node->child[0];
+        segs = move(front);
+    }
+}
+
+namespace {
+
+// Lays the finished tree out the way the engine wants it: children before
+// parents, the root last, each subsector's segs contiguous
+struct BspWriter {
+    const MapView &map;
+    vector<MapVertex> vertexes;
+    unordered_map<uint32_t, int> madeVertexes;  // packed (x, y) -> index
+    vector<MapSeg> segs;
+    vector<MapSubsector> subsectors;
+    vector<MapNode> nodes;
+    bool overflow;
+
+    explicit BspWriter(const MapView &map)
+        : map(map), vertexes(map.vertexes().begin(), map.vertexes().end()), overflow(false) {}
+
+    int vertex(double x, double y, int original) {
+        if (original >= 0) return original;
+        MapVertex v = {static_cast<int16_t>(lround(x)), static_cast<int16_t>(lround(y))};
+        uint32_t key = static_cast<uint16_t>(v.x) | static_cast<uint32_t>(static_cast<uint16_t>(v.y)) << 16;
+        auto it = madeVertexes.find(key);
+        if (it != madeVertexes.end()) return it->second;
+        vertexes.push_back(v);
+        return madeVertexes[key] = static_cast<int>(vertexes.size() - 1);
+    }
+
+    // Returns the child reference (subsector | 0x8000, or node index) and
+    // the subtree's bounding box: top, bottom, left, right
+    uint16_t write(const BspBuild *node, int16_t box[4]) {
+        if (node->leaf) {
+            double top = -1e9, bottom = 1e9, left = 1e9, right = -1e9;
+            MapSubsector ss = {static_cast<uint16_t>(node->segs.size()), static_cast<uint16_t>(segs.size())};
+            for (const BspSeg &s : node->segs) {
+                const MapLinedef &line = map.linedefs()[s.linedef];
+                const MapVertex &start = map.vertexes()[s.side ? line.v2 : line.v1];
+                MapSeg out;
+                out.v1 = static_cast<uint16_t>(vertex(s.x1, s.y1, s.v1));
+                out.v2 = static_cast<uint16_t>(vertex(s.x2, s.y2, s.v2));
+                out.angle = static_cast<int16_t>(static_cast<int32_t>(lround(atan2(s.y2 - s.y1, s.x2 - s.x1) * 32768.0 / M_PI)));
+                out.linedef = s.linedef;
+                out.side = s.side;
+                out.offset = static_cast<int16_t>(lround(hypot(s.x1 - start.x, s.y1 - start.y)));
+                segs.push_back(out);
+
+                top = max(top, max(s.y1, s.y2));
+                bottom = min(bottom, min(s.y1, s.y2));
+                left = min(left, min(s.x1, s.x2));
+                right = max(right, max(s.x1, s.x2));
+            }
+            box[0] = static_cast<int16_t>(ceil(top));
+            box[1] = static_cast<int16_t>(floor(bottom));
+            box[2] = static_cast<int16_t>(floor(left));
+            box[3] = static_cast<int16_t>(ceil(right));
+            subsectors.push_back(ss);
+            if (subsectors.size() > 0x7FFF) overflow = true;
+            return static_cast<uint16_t>((subsectors.size() - 1) | 0x8000);
+        }
+
+        MapNode out;
+        out.x = static_cast<int16_t>(node->line.x);
+        out.y = static_cast<int16_t>(node->line.y);
+        out.dx = static_cast<int16_t>(node->line.dx);
+        out.dy = static_cast<int16_t>(node->line.dy);
+        for (int c = 0; c < 2; c++)
+            out.children[c] = write(node->child[c], out.bbox[c]);
+
+        box[0] = max(out.bbox[0][0], out.bbox[1][0]);
+        box[1] = min(out.bbox[0][1], out.bbox[1][1]);
+        box[2] = min(out.bbox[0][2], out.bbox[1][2]);
+        box[3] = max(out.bbox[0][3], out.bbox[1][3]);
+        nodes.push_back(out);
+        if (nodes.size() > 0x7FFF) overflow = true;
+        return static_cast<uint16_t>(nodes.size() - 1);
+    }
+};
+
+}
+
+template <typename T>
+static void packRecords(const vector<T> &records, vector<char> *out) {
+    out->resize(records.size() * sizeof(T));
+    if (!records.empty()) memcpy(out->data(), records.data(), out->size());
+}
+
+bool buildNodes(const MapView &map, NodeLumps *out, unsigned threads) {
+    if (!out || !validLines(map)) return false;
+
+    vector<BspSeg> segs;
+    for (size_t i = 0; i < map.linedefs().size(); i++) {
+        const MapLinedef &line = map.linedefs()[i];
+        const MapVertex &a = map.vertexes()[line.v1];
+        const MapVertex &b = map.vertexes()[line.v2];
+        if (a.x == b.x && a.y == b.y) continue; // no direction to partition with
+
+        uint16_t id = static_cast<uint16_t>(i);
+        if (line.sidenum[0] != 0xFFFF)
+            segs.push_back(BspSeg{double(a.x), double(a.y), double(b.x), double(b.y), line.v1, line.v2, id, 0});
+        if (line.sidenum[1] != 0xFFFF)
+            segs.push_back(BspSeg{double(b.x), double(b.y), double(a.x), double(a.y), line.v2, line.v1, id, 1});
+    }
+    if (segs.empty()) return false;
+
+    if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+    BspContext ctx(map, threads);
+    BspBuild root;
+    ctx.push(0, BspTask{&root, move(segs)});
+
+    auto worker = [&ctx](unsigned id) {
+        while (ctx.pending > 0) {
+            BspTask task;
+            if (!ctx.take(id, &task)) {
+                this_thread::yield();
+                continue;
+            }
+            buildSubtree(ctx, task.node, move(task.segs), id);
+            ctx.pending--;
+        }
+    };
+    vector<thread> pool;
+    try {
+        for (unsigned t = 1; t < threads; t++)
+            pool.emplace_back(worker, t);
+    } catch (const system_error &) {
+        // fewer workers; take() steals from every queue, so none is stranded
+    }
+    worker(0);
+    for (thread &t : pool)
+        t.join();
+
+    BspWriter writer(map);
+    int16_t box[4];
+    writer.write(&root, box);
+    if (writer.overflow || writer.vertexes.size() > 0xFFFF || writer.segs.size() > 0xFFFF) return false;
+
+    packRecords(writer.vertexes, &out->vertexes);
+    packRecords(writer.segs, &out->segs);
+    packRecords(writer.subsectors, &out->subsectors);
+    packRecords(writer.nodes, &out->nodes);
+    return true;
+}
+
+// Writing back
+
+static bool replaceLump(Wad *wad, const string &path, const vector<char> &bytes) {
+    if (wad->truncateFile(path) < 0) return false;
+    if (bytes.empty()) return true;
+    int64_t length = static_cast<int64_t>(bytes.size());
+    return wad->writeToFile(path, bytes.data(), length) == length;
+}
+
+bool rebuildBlockmapAndReject(Wad *wad, const string &path, unsigned threads) {
+    if (!wad) return false;
+    MapView map = wad->mapView(path);
+    if (!map.valid() || !map.has(MapView::Blockmap) || !map.has(MapView::Reject)) return false;
+
+    vector<char> blockmap, reject;
+    if (!buildBlockmap(map, &blockmap) || !buildReject(map, &reject, threads)) return false;
+
+    string dir = path;
+    while (dir.size() > 1 && dir.back() == '/') dir.pop_back();
+    return replaceLump(wad, dir + "/" + MapView::lumpName(MapView::Blockmap).str(), blockmap) &&
+           replaceLump(wad, dir + "/" + MapView::lumpName(MapView::Reject).str(), reject);
+}
+
+bool rebuildNodes(Wad *wad, const string &path, unsigned threads) {
+    if (!wad) return false;
+    MapView map = wad->mapView(path);
+    const MapView::Lump written[] = {MapView::Vertexes, MapView::Segs, MapView::Subsectors, MapView::Nodes};
+    if (!map.valid()) return false;
+    for (MapView::Lump lump : written)
+        if (!map.has(lump)) return false;
+
+    NodeLumps lumps;
+    if (!buildNodes(map, &lumps, threads)) return false;
+
+    string dir = path;
+    while (dir.size() > 1 && dir.back() == '/') dir.pop_back();
+    const vector<char> *bytes[] = {&lumps.vertexes, &lumps.segs, &lumps.subsectors, &lumps.nodes};
+    for (int i = 0; i < 4; i++)
+        if (!replaceLump(wad, dir + "/" + MapView::lumpName(written[i]).str(), *bytes[i])) return false;
+    return true;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "MapView.h"
+
+using namespace std;
+
+class Wad;
+
+// Builders for the map lumps that are derived from the geometry. They read
+// a MapView and produce the new lump bytes; nothing is written to the Wad.
+
+// BLOCKMAP: a 128x128-unit grid over the map, origin 8 units below/left of
+// the lowest vertex, listing the linedefs touching each block. Lines are
+// binned in one pass and grouped with a counting sort, and every empty
+// block shares a single list. Fails if the map has no lines or the lump
+// would overflow its 16-bit offsets.
+bool buildBlockmap(const MapView &map, vector<char> *out);
+
+// REJECT: bit (i * sectors + j) is set when nothing in sector j can be seen
+// from sector i. Sectors that no chain of two-sided lines connects are
+// rejected outright; for the rest a sight line is traced between points
+// sampled along the two sectors' two-sided lines, their ends included.
+// Crossing or running along a one-sided line blocks it; grazing a wall's
+// end does not, unless walls meet there on both sides of it. Errs toward
+// visible. Rows are spread over `threads` workers (0 = one per core) into a
+// 64-bit-word matrix, then packed.
+bool buildReject(const MapView &map, vector<char> *out, unsigned threads = 0);
+
+// Rebuilds BLOCKMAP and REJECT of the E#M# directory at `path` and writes
+// them back through truncateFile() + writeToFile(). Both lumps must already
+// exist in the directory. Returns false, leaving the Wad untouched, if
+// either cannot be built.
+bool rebuildBlockmapAndReject(Wad *wad, const string &path, unsigned threads = 0);
+
+// NODES/SEGS/SSECTORS, plus VERTEXES grown by the vertices that splitting
+// lines creates (the original vertices keep their indices)
+struct NodeLumps {
+    vector<char> vertexes;
+    vector<char> segs;
+    vector<char> subsectors;
+    vector<char> nodes;
+};
+
+// Binary space partition of the map's linedefs. Partition lines are picked
+// by scoring every candidate line against the whole seg set at once (an
+// AVX2 kernel four segs at a time, scalar otherwise): splits cost 8, and
+// the difference between the sides is added. Subtrees are independent once
+// a partition is chosen, so they are built as tasks on `threads` workers
+// (0 = one per core) that steal from each other's queues. The output does
+// not depend on the thread count.
+bool buildNodes(const MapView &map, NodeLumps *out, unsigned threads = 0);
+
+// Builds the nodes of the E#M# directory at `path` and writes VERTEXES,
+// SEGS, SSECTORS and NODES back into it. Returns false, leaving the Wad
+// untouched, if the lumps are missing or cannot be built.
+bool rebuildNodes(Wad *wad, const string &path, unsigned threads = 0);
@@ -0,0 +1,39 @@
+#include "MapView.h"
+#include "Wad.h"
+
+using namespace std;
+
+// MapView::Lump follows the order of the format's map lumps
+static_assert(DoomFormat::mapLumps.size() == MapView::LumpCount, "map lump table");
+static_assert(DoomFormat::mapLumps[MapView::Blockmap] == LumpName::literal("BLOCKMAP"), "map lump order");
+
+LumpName MapView::lumpName(Lump lump) {
+    return DoomFormat::mapLumps[lump];
+}
+
+MapView::MapView() : found(false) {
+    for (int i = 0; i < LumpCount; i++)
+        lumps[i] = {nullptr, 0};
+}
+
+MapView Wad::mapView(const string &path) {
+    MapView view;
+
+    Node* dir = lookupNode(path);
+    if (!dir || !dir->isDirectory || !(dir->flags & MapMarker) || format == GameFormat::Hexen)
+        return view;
+    view.found = true;
+
+    for (Node* c : dir->children) {
+        if (c->isDirectory) continue;
+
+        int k = FormatRules<DoomFormat>::mapLumpIndex(c->name);
+        if (k < 0 || !makeResident(c)) continue;
+
+        // an empty lump is still present, just with no records
+        view.lumps[k].data = c->length == 0 ? "" : bytesOf(c);
+        view.lumps[k].length = c->length;
+    }
+
+    return view;
+}
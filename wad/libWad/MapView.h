@@ -0,0 +1,156 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "LumpName.h"
+
+using namespace std;
+
+// On-disk DOOM map records. They are packed so a view can sit on any byte
+// address; all fields are little-endian like the rest of the WAD.
+#pragma pack(push, 1)
+
+struct MapThing {          // THINGS
+    int16_t x;
+    int16_t y;
+    int16_t angle;
+    int16_t type;
+    int16_t flags;
+};
+
+struct MapLinedef {        // LINEDEFS
+    uint16_t v1;
+    uint16_t v2;
+    int16_t flags;
+    int16_t special;
+    int16_t tag;
+    uint16_t sidenum[2];   // right, left; 0xFFFF = no side
+};
+
+struct MapSidedef {        // SIDEDEFS
+    int16_t textureOffset;
+    int16_t rowOffset;
+    char upperTexture[8];
+    char lowerTexture[8];
+    char middleTexture[8];
+    uint16_t sector;
+};
+
+struct MapVertex {         // VERTEXES
+    int16_t x;
+    int16_t y;
+};
+
+struct MapSeg {            // SEGS
+    uint16_t v1;
+    uint16_t v2;
+    int16_t angle;
+    uint16_t linedef;
+    int16_t side;          // 0 = right sidedef, 1 = left
+    int16_t offset;
+};
+
+struct MapSubsector {      // SSECTORS
+    uint16_t segCount;
+    uint16_t firstSeg;
+};
+
+struct MapNode {           // NODES
+    int16_t x;
+    int16_t y;
+    int16_t dx;
+    int16_t dy;
+    int16_t bbox[2][4];    // right, left; top, bottom, left, right
+    uint16_t children[2];  // high bit set = subsector index
+};
+
+struct MapSector {         // SECTORS
+    int16_t floorHeight;
+    int16_t ceilingHeight;
+    char floorTexture[8];
+    char ceilingTexture[8];
+    int16_t lightLevel;
+    int16_t special;
+    int16_t tag;
+};
+
+#pragma pack(pop)
+
+static_assert(sizeof(MapThing) == 10, "THINGS record");
+static_assert(sizeof(MapLinedef) == 14, "LINEDEFS record");
+static_assert(sizeof(MapSidedef) == 30, "SIDEDEFS record");
+static_assert(sizeof(MapVertex) == 4, "VERTEXES record");
+static_assert(sizeof(MapSeg) == 12, "SEGS record");
+static_assert(sizeof(MapSubsector) == 4, "SSECTORS record");
+static_assert(sizeof(MapNode) == 28, "NODES record");
+static_assert(sizeof(MapSector) == 26, "SECTORS record");
+
+// Read-only array view over a lump's records. Trailing bytes that do not
+// make up a whole record are ignored.
+template <typename T>
+class RecordSpan {
+
+public:
+    RecordSpan() : base(nullptr), count(0) {}
+    RecordSpan(const char *bytes, size_t length)
+        : base(reinterpret_cast<const T*>(bytes)), count(bytes ? length / sizeof(T) : 0) {}
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    const T& operator[](size_t i) const { return base[i]; }  // unchecked
+    const T* at(size_t i) const { return i < count ? base + i : nullptr; }
+
+    const T* begin() const { return base; }
+    const T* end() const { return base + count; }
+
+private:
+    const T* base;
+    size_t count;
+};
+
+// The lumps of one E#M# map directory, viewed in place. Obtained from
+// Wad::mapView(); valid until the Wad is destroyed or the lumps are rewritten.
+class MapView {
+
+public:
+    enum Lump {
+        Things, Linedefs, Sidedefs, Vertexes, Segs,
+        Subsectors, Nodes, Sectors, Reject, Blockmap,
+        LumpCount
+    };
+
+    static LumpName lumpName(Lump lump);
+
+    MapView();
+
+    bool valid() const { return found; } // the path named a map directory
+
+    RecordSpan<MapThing> things() const { return span<MapThing>(Things); }
+    RecordSpan<MapLinedef> linedefs() const { return span<MapLinedef>(Linedefs); }
+    RecordSpan<MapSidedef> sidedefs() const { return span<MapSidedef>(Sidedefs); }
+    RecordSpan<MapVertex> vertexes() const { return span<MapVertex>(Vertexes); }
+    RecordSpan<MapSeg> segs() const { return span<MapSeg>(Segs); }
+    RecordSpan<MapSubsector> subsectors() const { return span<MapSubsector>(Subsectors); }
+    RecordSpan<MapNode> nodes() const { return span<MapNode>(Nodes); }
+    RecordSpan<MapSector> sectors() const { return span<MapSector>(Sectors); }
+    RecordSpan<uint8_t> reject() const { return span<uint8_t>(Reject); }
+    RecordSpan<int16_t> blockmap() const { return span<int16_t>(Blockmap); }
+
+    bool has(Lump lump) const { return lumps[lump].data != nullptr; }
+
+private:
+    friend class Wad;
+
+    struct Bytes {
+        const char *data;
+        size_t length;
+    };
+
+    template <typename T>
+    RecordSpan<T> span(Lump lump) const { return RecordSpan<T>(lumps[lump].data, lumps[lump].length); }
+
+    bool found;
+    Bytes lumps[LumpCount];
+};
@@ -0,0 +1,505 @@
+#include "Wad.h"
+#include "Digest.h"
+#include "WadHeader.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+
+// Patch file, all integers little-endian:
+//   "WADP", u32 version, char[4] target magic,
+//   u32 source entry count, u64 source file size, u32 target entry count,
+//   then per target entry: char[8] name, u8 op and the op's fields
+//     Empty:   -
+//     Keep:    u32 source index, u64 source xxh64
+//     Literal: u32 length, u64 xxh64, bytes
+//     Delta:   u32 source index, u64 source xxh64, u32 length, u64 xxh64,
+//              u32 ops size, ops
+// Delta ops rebuild the lump front to back:
+//   0 copy:   u32 source offset, u32 length
+//   1 insert: u32 length, bytes
+
+namespace {
+
+enum PatchOp : uint8_t { Empty, Keep, Literal, Delta };
+enum DeltaOp : uint8_t { Copy, Insert };
+
+const uint32_t PatchVersion = 1;
+const size_t IoChunk = 1 << 20;
+const uint32_t DeltaMin = 1024;        // smaller changed lumps are sent whole
+const uint32_t DeltaMax = 16 << 20;    // both sides of a delta are held in memory
+const size_t DeltaBlock = 32;
+const uint32_t DeltaOpsMax = 2 * DeltaMax; // a delta's ops are about its length at most
+
+struct RawEntry {
+    uint32_t offset;
+    uint32_t length;
+    LumpName name;
+};
+
+// Sequential output through a fixed buffer; `failed` sticks
+class BufferedOut {
+
+public:
+    explicit BufferedOut(int fd) : fd(fd), used(0), total(0), failed(false), buffer(IoChunk) {}
+
+    void put(const void *data, size_t length) {
+        const char *p = static_cast<const char*>(data);
+        while (length && !failed) {
+            size_t take = min(length, buffer.size() - used);
+            memcpy(buffer.data() + used, p, take);
+            used += take;
+            total += take;
+            p += take;
+            length -= take;
+            if (used == buffer.size()) flush();
+        }
+    }
+    template <typename T> void put(T value) { put(&value, sizeof(value)); }
+
+    bool flush() {
+        size_t done = 0;
+        while (done < used && !failed) {
+            ssize_t w = ::write(fd, buffer.data() + done, used - done);
+            if (w <= 0) failed = true;
+            else done += static_cast<size_t>(w);
+        }
+        used = 0;
+        return !failed;
+    }
+
+    uint64_t written() const { return total; }
+    bool ok() const { return !failed; }
+
+private:
+    int fd;
+    size_t used;
+    uint64_t total;
+    bool failed;
+    vector<char> buffer;
+};
+
+// Sequential input through a fixed buffer
+class BufferedIn {
+
+public:
+    explicit BufferedIn(int fd) : fd(fd), at(0), filled(0), buffer(IoChunk) {}
+
+    bool get(void *out, size_t length) {
+        char *p = static_cast<char*>(out);
+        while (length) {
+            if (at == filled) {
+                ssize_t r = ::read(fd, buffer.data(), buffer.size());
+                if (r <= 0) return false;
+                at = 0;
+                filled = static_cast<size_t>(r);
+            }
+            size_t take = min(length, filled - at);
+            memcpy(p, buffer.data() + at, take);
+            at += take;
+            p += take;
+            length -= take;
+        }
+        return true;
+    }
+    template <typename T> bool get(T *value) { return get(value, sizeof(*value)); }
+
+    bool atEnd() {
+        if (at < filled) return false;
+        char c;
+        return !get(&c, 1);
+    }
+
+private:
+    int fd;
+    size_t at;
+    size_t filled;
+    vector<char> buffer;
+};
+
+}
+
+static bool readExact(int fd, char *out, size_t length, uint64_t offset) {
+    while (length) {
+        ssize_t r = pread(fd, out, length, static_cast<off_t>(offset));
+        if (r <= 0) return false;
+        out += r;
+        length -= static_cast<size_t>(r);
+        offset += static_cast<uint64_t>(r);
+    }
+    return true;
+}
+
+// Copies [offset, offset + length) of `fd` to `out` a chunk at a time,
+// hashing as it goes
+static bool copyRange(int fd, uint64_t offset, uint32_t length, BufferedOut &out, uint64_t *hash) {
+    vector<char> chunk(min<size_t>(length, IoChunk));
+    Xxh64 state;
+    while (length) {
+        size_t take = min<size_t>(length, chunk.size());
+        if (!readExact(fd, chunk.data(), take, offset)) return false;
+        state.update(chunk.data(), take);
+        out.put(chunk.data(), take);
+        offset += take;
+        length -= static_cast<uint32_t>(take);
+    }
+    *hash = state.digest();
+    return out.ok();
+}
+
+// Only the classic header: patches carry 32-bit offsets and lengths
+static bool readDirectory(int fd, uint64_t *fileSize, vector<RawEntry> *entries) {
+    struct stat st;
+    WadHeader header;
+    if (fstat(fd, &st) != 0 || readWadHeader(fd, &header) != WadHeaderStatus::Ok || header.extended) return false;
+    *fileSize = static_cast<uint64_t>(st.st_size);
+
+    if (!wadTableFits(header, *fileSize)) return false;
+    size_t count = static_cast<size_t>(header.count);
+    vector<char> table(count * 16);
+    if (!readExact(fd, table.data(), table.size(), header.tableOffset)) return false;
+
+    entries->resize(count);
+    for (size_t i = 0; i < count; i++) {
+        RawEntry &e = (*entries)[i];
+        memcpy(&e.offset, table.data() + i * 16, 4);
+        memcpy(&e.length, table.data() + i * 16 + 4, 4);
+        e.name = LumpName::fromBytes(table.data() + i * 16 + 8);
+        if (e.length && static_cast<uint64_t>(e.offset) + e.length > *fileSize) return false;
+    }
+    return true;
+}
+
+static bool classicWad(const string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    WadHeader header;
+    bool classic = readWadHeader(fd, &header) == WadHeaderStatus::Ok && !header.extended;
+    close(fd);
+    return classic;
+}
+
+// Byte-level delta of `target` against `source`: source blocks are indexed
+// by a polynomial hash, a window of the same size rolls over the target,
+// and every verified hit is grown in both directions into one copy
+static void encodeDelta(const vector<char> &source, const vector<char> &target, vector<char> *ops) {
+    const uint64_t Base = 0x100000001B3ULL;
+    uint64_t top = 1; // Base^(DeltaBlock - 1), for dropping the window's first byte
+    for (size_t i = 1; i < DeltaBlock; i++) top *= Base;
+    auto windowHash = [&](const char *p) {
+        uint64_t h = 0;
+        for (size_t i = 0; i < DeltaBlock; i++) h = h * Base + static_cast<uint8_t>(p[i]);
+        return h;
+    };
+
+    unordered_map<uint64_t, uint32_t> blocks;
+    blocks.reserve(source.size() / DeltaBlock);
+    for (size_t off = 0; off + DeltaBlock <= source.size(); off += DeltaBlock)
+        blocks.emplace(windowHash(source.data() + off), static_cast<uint32_t>(off));
+
+    auto putU32 = [&](uint32_t v) { ops->insert(ops->end(), reinterpret_cast<char*>(&v), reinterpret_cast<char*>(&v) + 4); };
+    auto insert = [&](size_t from, size_t to) {
+        if (from == to) return;
+        ops->push_back(static_cast<char>(Insert));
+        putU32(static_cast<uint32_t>(to - from));
+        ops->insert(ops->end(), target.begin() + from, target.begin() + to);
+    };
+
+    size_t pending = 0, i = 0, n = target.size();
+    uint64_t h = n >= DeltaBlock ? windowHash(target.data()) : 0;
+    while (i + DeltaBlock <= n) {
+        auto hit = blocks.find(h);
+        if (hit != blocks.end() && memcmp(source.data() + hit->second, target.data() + i, DeltaBlock) == 0) {
+            size_t from = hit->second, at = i, length = DeltaBlock;
+            while (at > pending && from > 0 && source[from - 1] == target[at - 1]) {
+                from--;
+                at--;
+                length++;
+            }
+            while (at + length < n && from + length < source.size() && source[from + length] == target[at + length])
+                length++;
+
+            insert(pending, at);
+            ops->push_back(static_cast<char>(Copy));
+            putU32(static_cast<uint32_t>(from));
+            putU32(static_cast<uint32_t>(length));
+            i = pending = at + length;
+            if (i + DeltaBlock <= n) h = windowHash(target.data() + i);
+            continue;
+        }
+        if (i + DeltaBlock < n)
+            h = (h - static_cast<uint8_t>(target[i]) * top) * Base + static_cast<uint8_t>(target[i + DeltaBlock]);
+        i++;
+    }
+    insert(pending, n);
+}
+
+// Fails as soon as the output would grow past `length`, so malformed ops
+// cannot run up memory before the lump's hash is checked
+static bool decodeDelta(const vector<char> &source, const vector<char> &ops, uint32_t length,
+                        vector<char> *target) {
+    size_t at = 0;
+    auto getU32 = [&](uint32_t *v) {
+        if (at + 4 > ops.size()) return false;
+        memcpy(v, ops.data() + at, 4);
+        at += 4;
+        return true;
+    };
+    while (at < ops.size()) {
+        uint8_t op = static_cast<uint8_t>(ops[at++]);
+        uint32_t run;
+        if (op == Copy) {
+            uint32_t from;
+            if (!getU32(&from) || !getU32(&run) || static_cast<uint64_t>(from) + run > source.size() ||
+                target->size() + run > length) return false;
+            target->insert(target->end(), source.begin() + from, source.begin() + from + run);
+        } else if (op == Insert) {
+            if (!getU32(&run) || at + run > ops.size() || target->size() + run > length) return false;
+            target->insert(target->end(), ops.begin() + at, ops.begin() + at + run);
+            at += run;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Wad::diff(const string &sourcePath, const string &targetPath, const string &patchPath, DiffStats *stats) {
+    WadDigest from, to;
+    if (!classicWad(sourcePath) || !classicWad(targetPath) || !digestWad(sourcePath, &from) ||
+        !digestWad(targetPath, &to))
+        return false;
+
+    // Each lump's path as buildTree() would place it; repeated paths get #n
+    auto pathsOf = [](const vector<LumpDigest> &lumps) {
+        vector<string> paths(lumps.size());
+        vector<string> directories = {""};
+        unordered_map<string, int> seen;
+        auto lumpAt = [&](size_t i) -> const LumpDigest & { return lumps[i]; };
+        auto place = [&](Placed what, size_t i, uint8_t) {
+            if (what == Placed::Close) {
+                directories.pop_back();
+                return;
+            }
+            string path = directories.back() + "/" + cleanName(lumps[i].name).str();
+            if (what == Placed::Directory) directories.push_back(path);
+            int n = seen[path]++;
+            paths[i] = n ? path + "#" + to_string(n) : path;
+        };
+        GameFormat format = detectFormat(lumps.size(), [&](size_t i) { return lumps[i].name; });
+        withFormat(format, [&](auto rules) { placeLumps<decltype(rules)>(lumps.size(), lumpAt, place); });
+        return paths;
+    };
+    vector<string> sourcePaths = pathsOf(from.lumps), targetPaths = pathsOf(to.lumps);
+
+    unordered_map<string, uint32_t> byPath;
+    unordered_map<uint64_t, uint32_t> byContent;
+    for (uint32_t i = 0; i < from.lumps.size(); i++) {
+        if (!from.lumps[i].length) continue;
+        byPath[sourcePaths[i]] = i;
+        byContent.emplace(from.lumps[i].xxh64, i);
+    }
+
+    int sourceFd = ::open(sourcePath.c_str(), O_RDONLY);
+    int targetFd = ::open(targetPath.c_str(), O_RDONLY);
+    int patchFd = ::open(patchPath.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    char magic[4] = {};
+    bool ok = sourceFd >= 0 && targetFd >= 0 && patchFd >= 0 && readExact(targetFd, magic, 4, 0);
+
+    DiffStats counts = {0, 0, 0, 0, 0, 0};
+    BufferedOut out(patchFd);
+    out.put("WADP", 4);
+    out.put(PatchVersion);
+    out.put(magic, 4);
+    out.put(static_cast<uint32_t>(from.lumps.size()));
+    out.put(from.fileSize);
+    out.put(static_cast<uint32_t>(to.lumps.size()));
+
+    unordered_set<string> kept;
+    for (size_t i = 0; i < to.lumps.size() && ok; i++) {
+        const LumpDigest &lump = to.lumps[i];
+        char name[8];
+        lump.name.toBytes(name);
+        out.put(name, 8);
+        if (!lump.length) {
+            out.put(static_cast<uint8_t>(Empty));
+            continue;
+        }
+
+        auto atPath = byPath.find(targetPaths[i]);
+        bool known = atPath != byPath.end();
+        if (known) kept.insert(targetPaths[i]);
+        if (known && from.lumps[atPath->second].length == lump.length && from.lumps[atPath->second].xxh64 == lump.xxh64) {
+            counts.unchanged++;
+            out.put(static_cast<uint8_t>(Keep));
+            out.put(atPath->second);
+            out.put(lump.xxh64);
+            continue;
+        }
+        if (known) counts.changed++;
+        else counts.added++;
+
+        // moved or duplicated from elsewhere in the source
+        auto same = byContent.find(lump.xxh64);
+        if (same != byContent.end() && from.lumps[same->second].length == lump.length) {
+            out.put(static_cast<uint8_t>(Keep));
+            out.put(same->second);
+            out.put(lump.xxh64);
+            continue;
+        }
+
+        const LumpDigest *base = known ? &from.lumps[atPath->second] : nullptr;
+        if (base && lump.length >= DeltaMin && lump.length <= DeltaMax && base->length <= DeltaMax) {
+            vector<char> source(base->length), target(lump.length), ops;
+            ok = readExact(sourceFd, source.data(), source.size(), base->offset) &&
+                 readExact(targetFd, target.data(), target.size(), lump.offset);
+            if (!ok) break;
+            encodeDelta(source, target, &ops);
+            if (ops.size() + 16 < target.size() - target.size() / 8) {
+                counts.deltas++;
+                out.put(static_cast<uint8_t>(Delta));
+                out.put(atPath->second);
+                out.put(base->xxh64);
+                out.put(static_cast<uint32_t>(lump.length));
+                out.put(lump.xxh64);
+                out.put(static_cast<uint32_t>(ops.size()));
+                out.put(ops.data(), ops.size());
+            } else {
+                out.put(static_cast<uint8_t>(Literal));
+                out.put(static_cast<uint32_t>(lump.length));
+                out.put(lump.xxh64);
+                out.put(target.data(), target.size());
+            }
+            continue;
+        }
+
+        out.put(static_cast<uint8_t>(Literal));
+        out.put(static_cast<uint32_t>(lump.length));
+        out.put(lump.xxh64);
+        uint64_t hash;
+        ok = copyRange(targetFd, lump.offset, static_cast<uint32_t>(lump.length), out, &hash) && hash == lump.xxh64;
+    }
+    ok = ok && out.flush();
+    counts.patchBytes = out.written();
+    for (const auto &entry : byPath)
+        if (!kept.count(entry.first)) counts.removed++;
+
+    if (sourceFd >= 0) close(sourceFd);
+    if (targetFd >= 0) close(targetFd);
+    if (patchFd >= 0) close(patchFd);
+    if (!ok) {
+        unlink(patchPath.c_str());
+        return false;
+    }
+    if (stats) *stats = counts;
+    return true;
+}
+
+bool Wad::applyPatch(const string &sourcePath, const string &patchPath, const string &outputPath) {
+    int sourceFd = ::open(sourcePath.c_str(), O_RDONLY);
+    int patchFd = ::open(patchPath.c_str(), O_RDONLY);
+    string tempPath = outputPath + ".tmp";
+    int outFd = ::open(tempPath.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0666);
+
+    uint64_t sourceSize = 0;
+    vector<RawEntry> sources;
+    bool ok = sourceFd >= 0 && patchFd >= 0 && outFd >= 0 && readDirectory(sourceFd, &sourceSize, &sources);
+
+    BufferedIn in(patchFd);
+    char tag[4], magic[4];
+    uint32_t version = 0, sourceCount = 0, targetCount = 0;
+    uint64_t expectedSize = 0;
+    ok = ok && in.get(tag, 4) && memcmp(tag, "WADP", 4) == 0 && in.get(&version) && version == PatchVersion &&
+         in.get(magic, 4) && in.get(&sourceCount) && in.get(&expectedSize) && in.get(&targetCount) &&
+         sourceCount == sources.size() && expectedSize == sourceSize;
+
+    // Same layout as saveWad(): header, lump data in directory order, directory
+    BufferedOut out(outFd);
+    const char zeros[12] = {};
+    out.put(zeros, sizeof(zeros));
+    vector<RawEntry> written;
+    for (uint32_t i = 0; i < targetCount && ok; i++) {
+        char name[8];
+        uint8_t op;
+        if (!in.get(name, 8) || !in.get(&op)) { ok = false; break; }
+        RawEntry entry = {static_cast<uint32_t>(out.written()), 0, LumpName::fromBytes(name)};
+
+        uint32_t index, length;
+        uint64_t hash, check;
+        switch (op) {
+        case Empty:
+            break;
+        case Keep:
+            ok = in.get(&index) && in.get(&hash) && index < sources.size() &&
+                 copyRange(sourceFd, sources[index].offset, sources[index].length, out, &check) && check == hash;
+            entry.length = ok ? sources[index].length : 0;
+            break;
+        case Literal: {
+            ok = in.get(&length) && in.get(&hash);
+            vector<char> chunk(min<size_t>(length, IoChunk));
+            Xxh64 state;
+            for (uint32_t left = length; ok && left;) {
+                size_t take = min<size_t>(left, chunk.size());
+                ok = in.get(chunk.data(), take);
+                state.update(chunk.data(), take);
+                out.put(chunk.data(), take);
+                left -= static_cast<uint32_t>(take);
+            }
+            ok = ok && state.digest() == hash;
+            entry.length = length;
+            break;
+        }
+        case Delta: {
+            uint32_t opsSize;
+            ok = in.get(&index) && in.get(&check) && in.get(&length) && in.get(&hash) && in.get(&opsSize) &&
+                 index < sources.size() && sources[index].length <= DeltaMax && length <= DeltaMax &&
+                 opsSize <= DeltaOpsMax;
+            if (!ok) break;
+            vector<char> source(sources[index].length), ops(opsSize), target;
+            target.reserve(length);
+            ok = readExact(sourceFd, source.data(), source.size(), sources[index].offset) &&
+                 xxh64(source.data(), source.size()) == check && in.get(ops.data(), ops.size()) &&
+                 decodeDelta(source, ops, length, &target) && target.size() == length &&
+                 xxh64(target.data(), target.size()) == hash;
+            if (ok) out.put(target.data(), target.size());
+            entry.length = length;
+            break;
+        }
+        default:
+            ok = false;
+        }
+        if (out.written() > UINT32_MAX) ok = false;
+        written.push_back(entry);
+    }
+    ok = ok && in.atEnd();
+
+    uint64_t tableOffset = out.written();
+    for (const RawEntry &e : written) {
+        char name[8];
+        e.name.toBytes(name);
+        out.put(e.offset);
+        out.put(e.length);
+        out.put(name, 8);
+    }
+    ok = ok && out.flush() && tableOffset <= UINT32_MAX;
+
+    char header[12];
+    memcpy(header, magic, 4);
+    uint32_t count = static_cast<uint32_t>(written.size()), offset = static_cast<uint32_t>(tableOffset);
+    memcpy(header + 4, &count, 4);
+    memcpy(header + 8, &offset, 4);
+    ok = ok && pwrite(outFd, header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header));
+
+    if (sourceFd >= 0) close(sourceFd);
+    if (patchFd >= 0) close(patchFd);
+    if (outFd >= 0) close(outFd);
+    if (ok && rename(tempPath.c_str(), outputPath.c_str()) == 0) return true;
+    unlink(tempPath.c_str());
+    return false;
+}
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Digest.h"
+
+using namespace std;
+
+// Path -> value table behind Wad's path lookups. Keys are hashed once with
+// XXH64; the top bits pick one of the shards, the low bits a slot in that
+// shard's open-addressed, linearly probed table. Key bytes are copied into
+// an append-only arena per shard and never move.
+//
+// Entries are only ever added or given a new value, so find() takes no
+// lock: a slot's hash is stored last, after its key and value, and a grown
+// table is published whole while the old one is kept until clear(). Writers
+// lock only their own shard. clear() and reserve() are for when nothing
+// else is using the map.
+template <typename V>
+class PathMap {
+
+public:
+    PathMap() = default;
+    PathMap(const PathMap &) = delete;
+    PathMap &operator=(const PathMap &) = delete;
+
+    V find(const char *key, size_t length) const {
+        uint64_t hash = hashOf(key, length);
+        const Table *table = shards[hash >> (64 - ShardBits)].table.load(memory_order_acquire);
+        if (!table) return V();
+        for (size_t i = hash & table->mask;; i = (i + 1) & table->mask) {
+            const Slot &slot = table->slots[i];
+            uint64_t seen = slot.hash.load(memory_order_acquire);
+            if (seen == 0) return V();
+            if (seen == hash && slot.length == length && memcmp(slot.key, key, length) == 0)
+                return slot.value.load(memory_order_acquire);
+        }
+    }
+    V find(const string &key) const { return find(key.data(), key.size()); }
+
+    void set(const string &key, V value) { set(key.data(), key.size(), value); } // adds or replaces
+    void set(const char *key, size_t length, V value) {
+        uint64_t hash = hashOf(key, length);
+        Shard &shard = shards[hash >> (64 - ShardBits)];
+        lock_guard<mutex> guard(shard.lock);
+
+        Table *table = shard.table.load(memory_order_relaxed);
+        if (table) {
+            for (size_t i = hash & table->mask;; i = (i + 1) & table->mask) {
+                Slot &slot = table->slots[i];
+                uint64_t seen = slot.hash.load(memory_order_relaxed);
+                if (seen == 0) break;
+                if (seen == hash && slot.length == length && memcmp(slot.key, key, length) == 0) {
+                    slot.value.store(value, memory_order_release);
+                    return;
+                }
+            }
+        }
+        // at most three quarters full, so probes stay short and always end
+        if (!table || (table->count + 1) * 4 > (table->mask + 1) * 3)
+            table = grow(shard, table ? (table->mask + 1) * 2 : MinCapacity);
+        place(table, hash, intern(shard, key, length), length, value);
+    }
+
+    void reserve(size_t count) {
+        size_t capacity = MinCapacity;
+        while (capacity * 3 < (count / ShardCount + 1) * 4) capacity *= 2;
+        for (Shard &shard : shards) {
+            lock_guard<mutex> guard(shard.lock);
+            const Table *table = shard.table.load(memory_order_relaxed);
+            if (!table || table->mask + 1 < capacity) grow(shard, capacity);
+        }
+    }
+
+    void clear() {
+        for (Shard &shard : shards) {
+            lock_guard<mutex> guard(shard.lock);
+            shard.table.store(nullptr, memory_order_release);
+            shard.tables.clear();
+            shard.arena.clear();
+            shard.arenaUsed = shard.arenaSize = 0;
+        }
+    }
+
+    // f(const char *key, size_t length, V value) for every entry, in no order
+    template <typename F>
+    void forEach(F f) const {
+        for (const Shard &shard : shards) {
+            const Table *table = shard.table.load(memory_order_acquire);
+            if (!table) continue;
+            for (size_t i = 0; i <= table->mask; i++) {
+                const Slot &slot = table->slots[i];
+                if (slot.hash.load(memory_order_acquire))
+                    f(slot.key, slot.length, slot.value.load(memory_order_acquire));
+            }
+        }
+    }
+
+private:
+    static constexpr unsigned ShardBits = 4;
+    static constexpr size_t ShardCount = size_t(1) << ShardBits;
+    static constexpr size_t MinCapacity = 16;
+    static constexpr size_t ArenaChunk = 64 * 1024;
+
+    struct Slot {
+        atomic<uint64_t> hash{0};    // 0 = empty; stored last
+        const char *key = nullptr;   // in the shard's arena
+        size_t length = 0;
+        atomic<V> value{V()};
+    };
+
+    struct Table {
+        size_t mask;                 // capacity - 1
+        size_t count;
+        unique_ptr<Slot[]> slots;
+    };
+
+    struct alignas(64) Shard {       // a cache line each, so writers do not share one
+        mutex lock;                  // writers only
+        atomic<Table*> table{nullptr};
+        vector<unique_ptr<Table>> tables; // the current one last
+        vector<unique_ptr<char[]>> arena;
+        size_t arenaUsed = 0;
+        size_t arenaSize = 0;
+    };
+
+    Shard shards[ShardCount];
+
+    static uint64_t hashOf(const char *key, size_t length) {
+        uint64_t hash = xxh64(key, length);
+        return hash ? hash : 1;
+    }
+
+    static const char *intern(Shard &shard, const char *key, size_t length) {
+        if (shard.arenaUsed + length > shard.arenaSize) {
+            shard.arenaSize = max(ArenaChunk, length);
+            shard.arena.emplace_back(new char[shard.arenaSize]);
+            shard.arenaUsed = 0;
+        }
+        char *copy = shard.arena.back().get() + shard.arenaUsed;
+        memcpy(copy, key, length);
+        shard.arenaUsed += length;
+        return copy;
+    }
+
+    // into a table with room; the caller holds the shard's lock
+    static void place(Table *table, uint64_t hash, const char *key, size_t length, V value) {
+        size_t i = hash & table->mask;
+        while (table->slots[i].hash.load(memory_order_relaxed)) i = (i + 1) & table->mask;
+        Slot &slot = table->slots[i];
+        slot.key = key;
+        slot.length = length;
+        slot.value.store(value, memory_order_relaxed);
+        slot.hash.store(hash, memory_order_release);
+        table->count++;
+    }
+
+    static Table *grow(Shard &shard, size_t capacity) {
+        unique_ptr<Table> bigger(new Table{capacity - 1, 0, unique_ptr<Slot[]>(new Slot[capacity])});
+        const Table *old = shard.table.load(memory_order_relaxed);
+        if (old) {
+            for (size_t i = 0; i <= old->mask; i++) {
+                const Slot &slot = old->slots[i];
+                uint64_t hash = slot.hash.load(memory_order_relaxed);
+                if (hash) place(bigger.get(), hash, slot.key, slot.length, slot.value.load(memory_order_relaxed));
+            }
+        }
+        Table *table = bigger.get();
+        shard.tables.push_back(move(bigger));
+        shard.table.store(table, memory_order_release);
+        return table;
+    }
+};
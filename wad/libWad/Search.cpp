@@ -0,0 +1,448 @@
+#include "Search.h"
+#include "Wad.h"
+#include <immintrin.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <system_error>
+
+using namespace std;
+
+typedef PatternMatcher::Pattern Pattern;
+
+// Pattern matching
+
+static inline uint8_t lower(uint8_t c) {
+    return static_cast<uint8_t>(c - 'A') < 26 ? c | 0x20 : c;
+}
+
+static bool matchesAt(const Pattern &pattern, const uint8_t *at, bool fold) {
+    const uint8_t *bytes = reinterpret_cast<const uint8_t*>(pattern.bytes.data());
+    if (!fold) return memcmp(at, bytes, pattern.bytes.size()) == 0;
+    for (size_t i = 0; i < pattern.bytes.size(); i++)
+        if (lower(at[i]) != bytes[i]) return false;
+    return true;
+}
+
+// Positions [from, starts) one at a time; also the tail of the vector kernels
+static void scanScalar(const Pattern *patterns, size_t count, const uint8_t *data, size_t length,
+                       size_t from, size_t starts, bool fold, vector<PatternMatch> *out) {
+    for (size_t i = from; i < starts; i++) {
+        for (size_t p = 0; p < count; p++) {
+            const Pattern &pattern = patterns[p];
+            size_t n = pattern.bytes.size();
+            if (i + n > length) continue;
+            if ((data[i] | pattern.firstFold) != pattern.first) continue;
+            if ((data[i + n - 1] | pattern.lastFold) != pattern.last) continue;
+            if (matchesAt(pattern, data + i, fold)) out->push_back({pattern.index, i});
+        }
+    }
+}
+
+// The vector kernels go through the data once per group of up to this many
+// patterns, each group size its own loop so the compare vectors stay in
+// registers
+constexpr size_t PatternGroup = 4;
+
+static bool byOffset(const PatternMatch &a, const PatternMatch &b) {
+    return a.offset != b.offset ? a.offset < b.offset : a.pattern < b.pattern;
+}
+
+// A block of positions at a time: each pattern's first byte is compared at
+// every position and its last byte n - 1 further on, and only the positions
+// where both hold are verified. OR-ing in 0x20 folds letters; it also lets
+// a few non-letters through, which the verification turns away. Returns
+// where the blocks stopped, the same for every group.
+template <bool Fold, size_t N>
+__attribute__((target("sse2")))
+static size_t scanGroupSse2(const Pattern *group, size_t longest, const uint8_t *data, size_t length,
+                            size_t starts, vector<PatternMatch> *out) {
+    __m128i first[N], last[N], firstFold[N], lastFold[N];
+    size_t tail[N];
+    for (size_t p = 0; p < N; p++) {
+        first[p] = _mm_set1_epi8(static_cast<char>(group[p].first));
+        last[p] = _mm_set1_epi8(static_cast<char>(group[p].last));
+        firstFold[p] = _mm_set1_epi8(static_cast<char>(group[p].firstFold));
+        lastFold[p] = _mm_set1_epi8(static_cast<char>(group[p].lastFold));
+        tail[p] = group[p].bytes.size() - 1;
+    }
+
+    size_t i = 0;
+    // every load stays within data
+    for (; i < starts && i + 16 + longest - 1 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i hit[N], any = _mm_setzero_si128();
+        for (size_t p = 0; p < N; p++) {
+            __m128i head = block, end = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + tail[p]));
+            if (Fold) {
+                head = _mm_or_si128(head, firstFold[p]);
+                end = _mm_or_si128(end, lastFold[p]);
+            }
+            hit[p] = _mm_and_si128(_mm_cmpeq_epi8(head, first[p]), _mm_cmpeq_epi8(end, last[p]));
+            any = _mm_or_si128(any, hit[p]);
+        }
+        if (!_mm_movemask_epi8(any)) continue; // nearly every block
+
+        uint32_t live = starts - i < 16 ? (1u << (starts - i)) - 1 : 0xFFFF;
+        for (size_t p = 0; p < N; p++) {
+            uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(hit[p])) & live;
+            for (; mask; mask &= mask - 1) {
+                size_t at = i + static_cast<unsigned>(__builtin_ctz(mask));
+                if (matchesAt(group[p], data + at, Fold)) out->push_back({group[p].index, at});
+            }
+        }
+    }
+    return i;
+}
+
+template <bool Fold, size_t N>
+__attribute__((target("avx2")))
+static size_t scanGroupAvx2(const Pattern *group, size_t longest, const uint8_t *data, size_t length,
+                            size_t starts, vector<PatternMatch> *out) {
+    __m256i first[N], last[N], firstFold[N], lastFold[N];
+    size_t tail[N];
+    for (size_t p = 0; p < N; p++) {
+        first[p] = _mm256_set1_epi8(static_cast<char>(group[p].first));
+        last[p] = _mm256_set1_epi8(static_cast<char>(group[p].last));
+        firstFold[p] = _mm256_set1_epi8(static_cast<char>(group[p].firstFold));
+        lastFold[p] = _mm256_set1_epi8(static_cast<char>(group[p].lastFold));
+        tail[p] = group[p].bytes.size() - 1;
+    }
+
+    size_t i = 0;
+    for (; i < starts && i + 32 + longest - 1 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i hit[N], any = _mm256_setzero_si256();
+        for (size_t p = 0; p < N; p++) {
+            __m256i head = block, end = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + tail[p]));
+            if (Fold) {
+                head = _mm256_or_si256(head, firstFold[p]);
+                end = _mm256_or_si256(end, lastFold[p]);
+            }
+            hit[p] = _mm256_and_si256(_mm256_cmpeq_epi8(head, first[p]), _mm256_cmpeq_epi8(end, last[p]));
+            any = _mm256_or_si256(any, hit[p]);
+        }
+        if (!_mm256_movemask_epi8(any)) continue; // nearly every block
+
+        uint32_t live = starts - i < 32 ? (1u << (starts - i)) - 1 : 0xFFFFFFFF;
+        for (size_t p = 0; p < N; p++) {
+            uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(hit[p])) & live;
+            for (; mask; mask &= mask - 1) {
+                size_t at = i + static_cast<unsigned>(__builtin_ctz(mask));
+                if (matchesAt(group[p], data + at, Fold)) out->push_back({group[p].index, at});
+            }
+        }
+    }
+    return i;
+}
+
+// scanGroup<Fold, n>() for a group of n <= N patterns
+template <bool Fold, size_t N = PatternGroup>
+static size_t scanGroup(SearchKernel kernel, size_t n, const Pattern *group, size_t longest,
+                        const uint8_t *data, size_t length, size_t starts, vector<PatternMatch> *out) {
+    if (n == N) {
+        return kernel == SearchKernel::Avx2 ? scanGroupAvx2<Fold, N>(group, longest, data, length, starts, out)
+                                            : scanGroupSse2<Fold, N>(group, longest, data, length, starts, out);
+    }
+    if constexpr (N > 1) return scanGroup<Fold, N - 1>(kernel, n, group, longest, data, length, starts, out);
+    return 0;
+}
+
+bool searchKernelSupported(SearchKernel kernel) {
+    switch (kernel) {
+    case SearchKernel::Avx2: return __builtin_cpu_supports("avx2");
+    case SearchKernel::Sse2: return __builtin_cpu_supports("sse2");
+    default:                 return true;
+    }
+}
+
+PatternMatcher::PatternMatcher(const vector<string> &list, bool ignoreCase, SearchKernel kernel)
+    : maxLength(0), fold(ignoreCase), kernel(kernel) {
+    for (size_t i = 0; i < list.size(); i++) {
+        if (list[i].empty()) continue;
+        Pattern p;
+        p.bytes = list[i];
+        if (fold)
+            for (char &c : p.bytes) c = static_cast<char>(lower(static_cast<uint8_t>(c)));
+        p.first = static_cast<uint8_t>(p.bytes.front());
+        p.last = static_cast<uint8_t>(p.bytes.back());
+        p.firstFold = fold && static_cast<uint8_t>(p.first - 'a') < 26 ? 0x20 : 0;
+        p.lastFold = fold && static_cast<uint8_t>(p.last - 'a') < 26 ? 0x20 : 0;
+        p.index = static_cast<uint32_t>(i);
+        maxLength = max(maxLength, p.bytes.size());
+        patterns.push_back(p);
+    }
+
+    if (this->kernel == SearchKernel::Best) {
+        if (searchKernelSupported(SearchKernel::Avx2)) this->kernel = SearchKernel::Avx2;
+        else if (searchKernelSupported(SearchKernel::Sse2)) this->kernel = SearchKernel::Sse2;
+        else this->kernel = SearchKernel::Scalar;
+    } else if (!searchKernelSupported(this->kernel)) {
+        this->kernel = SearchKernel::Scalar;
+    }
+}
+
+void PatternMatcher::scan(const char *data, size_t length, size_t starts, vector<PatternMatch> *out) const {
+    if (patterns.empty() || !out) return;
+    const uint8_t *bytes = reinterpret_cast<const uint8_t*>(data);
+    starts = min(starts, length);
+    if (kernel == SearchKernel::Scalar) {
+        scanScalar(patterns.data(), patterns.size(), bytes, length, 0, starts, fold, out);
+        return;
+    }
+
+    size_t mark = out->size(), end = 0;
+    for (size_t g = 0; g < patterns.size(); g += PatternGroup) {
+        size_t n = min(patterns.size() - g, PatternGroup);
+        end = fold ? scanGroup<true>(kernel, n, patterns.data() + g, maxLength, bytes, length, starts, out)
+                   : scanGroup<false>(kernel, n, patterns.data() + g, maxLength, bytes, length, starts, out);
+    }
+    scanScalar(patterns.data(), patterns.size(), bytes, length, end, starts, fold, out);
+    // the vector loops report a group of patterns at a time
+    if (!is_sorted(out->begin() + mark, out->end(), byOffset)) sort(out->begin() + mark, out->end(), byOffset);
+}
+
+// Searching WAD files
+
+// Lump bytes one task scans: small lumps are grouped up to it and larger
+// ones split into pieces of it
+const uint64_t SearchChunk = 1 << 20;
+
+// One file while it is being searched: its tree, built as loadWad() would
+// but with no lumps read, and its bytes mapped when it is a plain WAD
+struct Wad::SearchFile {
+    struct Lump {
+        string path;
+        Node* node;
+        uint64_t length;     // what the file holds of it
+    };
+    struct Found {
+        uint32_t lump;
+        uint32_t pattern;
+        uint64_t offset;
+    };
+
+    uint32_t index;
+    unique_ptr<Wad> wad;     // has no IoEngine, so it never saves
+    const char *bytes = nullptr;
+    size_t size = 0;
+    vector<Lump> lumps;      // content nodes in tree order
+    atomic<size_t> pending{0}; // tasks not yet done
+    atomic<bool> broken{false};  // a packed block could not be read
+    mutex lock;
+    vector<Found> found;
+
+    ~SearchFile() {
+        if (bytes) munmap(const_cast<char*>(bytes), size);
+    }
+
+    bool open(const string &path);
+};
+
+// Lumps [first, last) of a file, each from begin up to end (or its length)
+struct Wad::SearchTask {
+    SearchFile *file;
+    uint32_t first;
+    uint32_t last;
+    uint64_t begin;
+    uint64_t end;
+};
+
+bool Wad::SearchFile::open(const string &path) {
+    wad.reset(new Wad(path));
+    Wad &w = *wad;
+    w.fileDescriptor = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (w.fileDescriptor < 0 || fstat(w.fileDescriptor, &st) != 0) return false;
+    size = static_cast<size_t>(st.st_size);
+
+    w.loadHeader();
+    if (w.magic == "WADZ") {
+        w.loadContainer(); // leaves the magic alone unless it can read the container
+    } else if (w.magic == "IWAD" || w.magic == "PWAD") {
+        // a table that cannot be in the file is not a WAD, whatever the count says
+        uint64_t entrySize = w.extended ? 24 : 16;
+        if (w.descriptorCount > size / entrySize || w.descriptorOffset > size - w.descriptorCount * entrySize)
+            return false;
+        w.loadDescriptors();
+        if (size) {
+            void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, w.fileDescriptor, 0);
+            if (mapped == MAP_FAILED) return false;
+            bytes = static_cast<const char*>(mapped);
+            madvise(mapped, size, MADV_WILLNEED); // a cold file is read ahead while earlier pieces scan
+        }
+    }
+    if (w.magic != "IWAD" && w.magic != "PWAD") return false;
+    w.buildTree();
+
+    auto walk = [&](auto &self, Node* node, const string &prefix) -> void {
+        for (Node* child : node->children) {
+            string path = prefix + "/" + child->base.str();
+            if (child->isDirectory) {
+                self(self, child, path);
+                continue;
+            }
+            uint64_t length = child->length;
+            if (!w.packed) // the part the file holds
+                length = child->offset < size ? min<uint64_t>(length, size - child->offset) : 0;
+            lumps.push_back({path, child, length});
+        }
+    };
+    walk(walk, w.root, "");
+    return true;
+}
+
+bool Wad::search(const vector<string> &files, const vector<string> &patterns,
+                 const SearchOptions &options, vector<SearchHit> *hits, vector<uint32_t> *unreadable) {
+    PatternMatcher matcher(patterns, options.ignoreCase, options.kernel);
+    unsigned threads = options.threads ? options.threads : max(1u, thread::hardware_concurrency());
+    size_t overlap = matcher.longest() ? matcher.longest() - 1 : 0;
+
+    mutex lock;                  // everything below
+    condition_variable ready;
+    deque<SearchTask> queue;
+    size_t nextFile = 0;
+    unsigned opening = 0;        // workers reading a directory, which may add tasks
+    vector<SearchHit> results;
+    vector<uint32_t> failed;
+
+    // The worker finishing a file's last task hands its hits over, paths
+    // and all, and closes it
+    auto finish = [&](SearchFile *file) {
+        sort(file->found.begin(), file->found.end(), [](const SearchFile::Found &a, const SearchFile::Found &b) {
+            if (a.lump != b.lump) return a.lump < b.lump;
+            return a.offset != b.offset ? a.offset < b.offset : a.pattern < b.pattern;
+        });
+        vector<SearchHit> done;
+        done.reserve(file->found.size());
+        for (const SearchFile::Found &f : file->found)
+            done.push_back({file->index, file->lumps[f.lump].path, f.offset, f.pattern});
+        uint32_t index = file->index;
+        bool broken = file->broken;
+        delete file;
+        lock_guard<mutex> guard(lock);
+        if (broken) failed.push_back(index);
+        results.insert(results.end(), make_move_iterator(done.begin()), make_move_iterator(done.end()));
+    };
+
+    auto run = [&](const SearchTask &task, vector<PatternMatch> *matches, vector<char> *buffer) {
+        SearchFile *file = task.file;
+        vector<SearchFile::Found> found;
+        for (uint32_t l = task.first; l < task.last; l++) {
+            const SearchFile::Lump &lump = file->lumps[l];
+            uint64_t begin = task.begin, end = min(task.end, lump.length);
+            if (begin >= end) continue;
+            // the piece after this one may only start a match this one finishes
+            uint64_t stop = min(end + overlap, lump.length);
+
+            const char *data;
+            if (file->bytes) {
+                data = file->bytes + lump.node->offset + begin;
+            } else {
+                buffer->resize(stop - begin);
+                if (file->wad->readBlocks(lump.node, buffer->data(), static_cast<int64_t>(stop - begin),
+                                          static_cast<int64_t>(begin)) < 0) {
+                    file->broken = true;
+                    continue;
+                }
+                data = buffer->data();
+            }
+            matches->clear();
+            matcher.scan(data, stop - begin, end - begin, matches);
+            for (const PatternMatch &m : *matches)
+                found.push_back({l, m.pattern, begin + m.offset});
+        }
+        if (!found.empty()) {
+            lock_guard<mutex> guard(file->lock);
+            file->found.insert(file->found.end(), found.begin(), found.end());
+        }
+        if (--file->pending == 0) finish(file);
+    };
+
+    // Queued pieces are taken before another file is opened, so only about
+    // as many files as workers are open at once
+    auto work = [&]() {
+        vector<PatternMatch> matches;
+        vector<char> buffer;
+        unique_lock<mutex> guard(lock);
+        for (;;) {
+            if (!queue.empty()) {
+                SearchTask task = queue.front();
+                queue.pop_front();
+                guard.unlock();
+                run(task, &matches, &buffer);
+                guard.lock();
+                continue;
+            }
+            if (nextFile == files.size()) {
+                if (opening == 0) break;
+                ready.wait(guard);
+                continue;
+            }
+
+            uint32_t index = static_cast<uint32_t>(nextFile++);
+            opening++;
+            guard.unlock();
+
+            SearchFile *file = new SearchFile;
+            file->index = index;
+            vector<SearchTask> tasks;
+            bool ok = file->open(files[index]);
+            if (ok) {
+                uint32_t group = 0;
+                uint64_t grouped = 0;
+                for (uint32_t l = 0; l < file->lumps.size(); l++) {
+                    uint64_t length = file->lumps[l].length;
+                    if (grouped && grouped + length > SearchChunk) {
+                        tasks.push_back({file, group, l, 0, UINT64_MAX});
+                        grouped = 0;
+                    }
+                    if (length > SearchChunk) {
+                        for (uint64_t at = 0; at < length; at += SearchChunk)
+                            tasks.push_back({file, l, l + 1, at, at + SearchChunk});
+                        continue;
+                    }
+                    if (!grouped) group = l;
+                    grouped += length;
+                }
+                if (grouped) tasks.push_back({file, group, static_cast<uint32_t>(file->lumps.size()), 0, UINT64_MAX});
+            }
+            if (tasks.empty()) delete file;
+            else file->pending = tasks.size();
+
+            guard.lock();
+            opening--;
+            if (!ok) failed.push_back(index);
+            if (tasks.size() > 1) queue.insert(queue.end(), tasks.begin() + 1, tasks.end());
+            ready.notify_all();
+            if (!tasks.empty()) {
+                guard.unlock();
+                run(tasks.front(), &matches, &buffer);
+                guard.lock();
+            }
+        }
+    };
+
+    vector<thread> pool;
+    try {
+        for (unsigned t = 1; t < threads; t++) pool.emplace_back(work);
+    } catch (const system_error &) {
+        // fewer workers; this thread searches whatever files they leave
+    }
+    work();
+    for (thread &t : pool) t.join();
+
+    stable_sort(results.begin(), results.end(), [](const SearchHit &a, const SearchHit &b) { return a.file < b.file; });
+    if (hits) hits->insert(hits->end(), make_move_iterator(results.begin()), make_move_iterator(results.end()));
+    sort(failed.begin(), failed.end());
+    if (unreadable) unreadable->insert(unreadable->end(), failed.begin(), failed.end());
+    return failed.empty();
+}
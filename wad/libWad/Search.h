@@ -0,0 +1,56 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+// Substring search for a set of byte patterns. Every position is filtered
+// against each pattern's first and last byte a vector at a time, and only
+// the positions where both agree are compared in full, so text and binary
+// lumps scan at close to memory speed. All kernels report identical
+// matches; Best picks AVX2, then SSE2, then the scalar loop at runtime,
+// and unsupported kernels fall back to Scalar.
+enum class SearchKernel { Best, Scalar, Sse2, Avx2 };
+
+bool searchKernelSupported(SearchKernel kernel);
+
+struct PatternMatch {
+    uint32_t pattern;    // index into the matcher's patterns
+    uint64_t offset;
+};
+
+class PatternMatcher {
+
+public:
+    // ignoreCase folds ASCII letters only; an empty pattern never matches.
+    // The cost of a scan grows with the number of patterns.
+    explicit PatternMatcher(const vector<string> &patterns, bool ignoreCase = false,
+                            SearchKernel kernel = SearchKernel::Best);
+
+    size_t longest() const { return maxLength; } // a split scan overlaps by longest() - 1
+
+    // Appends the matches that lie wholly within [data, data + length) and
+    // start before `starts`, in order of offset, then pattern
+    void scan(const char *data, size_t length, size_t starts, vector<PatternMatch> *out) const;
+    void scan(const char *data, size_t length, vector<PatternMatch> *out) const {
+        scan(data, length, length, out);
+    }
+
+    struct Pattern {         // as the kernels see it
+        string bytes;        // lower-cased when folding
+        uint8_t first;
+        uint8_t last;
+        uint8_t firstFold;   // 0x20 when first is a letter and case is folded
+        uint8_t lastFold;
+        uint32_t index;
+    };
+
+private:
+    vector<Pattern> patterns; // the non-empty ones
+    size_t maxLength;
+    bool fold;
+    SearchKernel kernel;
+};
@@ -0,0 +1,195 @@
+#include "Wad.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <cstring>
+
+using namespace std;
+
+// Region layout: a header, the lump bytes at their offsets in the plain
+// layout (the file itself for a plain WAD), then the tree image
+// treeImage() writes for the index cache. The publisher fills everything
+// else before it sets `ready`, so an attacher that sees it set sees it all.
+static const char SharedMagic[4] = {'W', 'S', 'H', 'M'};
+static const uint32_t SharedVersion = 1;
+static const auto PublishTimeout = chrono::seconds(30); // then the publisher is presumed dead
+
+struct SharedHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t ready;
+    char wadMagic[4];
+    uint64_t fileSize;       // identity of the WAD the region was built from
+    int64_t mtime;
+    uint64_t device;
+    uint64_t inode;
+    uint64_t dataOffset;
+    uint64_t dataSize;
+    uint64_t imageOffset;
+    uint64_t imageSize;
+};
+
+static void identify(const struct stat &st, SharedHeader *header) {
+    header->fileSize = static_cast<uint64_t>(st.st_size);
+    header->mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    header->device = static_cast<uint64_t>(st.st_dev);
+    header->inode = static_cast<uint64_t>(st.st_ino);
+}
+
+bool Wad::releaseShared(const string &name) {
+    return shm_unlink(name.c_str()) == 0;
+}
+
+bool Wad::openShared(const string &name) {
+    // A stale or abandoned region is unlinked by attachShared(); a lost
+    // race to publish means someone else is publishing, so attach again
+    for (int attempt = 0; attempt < 3; attempt++) {
+        if (attachShared(name) || publishShared(name)) return true;
+    }
+    return false;
+}
+
+bool Wad::attachShared(const string &name) {
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) return false;
+
+    struct stat file;
+    if (fstat(fileDescriptor, &file) != 0) {
+        close(fd);
+        return false;
+    }
+
+    // The publisher sizes the region before writing any of it
+    auto deadline = chrono::steady_clock::now() + PublishTimeout;
+    struct stat st = {};
+    while (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) < sizeof(SharedHeader) &&
+           chrono::steady_clock::now() < deadline)
+        this_thread::sleep_for(chrono::milliseconds(1));
+    size_t size = static_cast<size_t>(st.st_size);
+    void *map = size >= sizeof(SharedHeader) ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    char *region = static_cast<char*>(map);
+    const SharedHeader *shared = reinterpret_cast<const SharedHeader*>(region);
+    while (!__atomic_load_n(&shared->ready, __ATOMIC_ACQUIRE) && chrono::steady_clock::now() < deadline)
+        this_thread::sleep_for(chrono::milliseconds(1));
+
+    SharedHeader expected;
+    identify(file, &expected);
+    bool valid = __atomic_load_n(&shared->ready, __ATOMIC_ACQUIRE) &&
+                 memcmp(shared->magic, SharedMagic, 4) == 0 && shared->version == SharedVersion &&
+                 shared->fileSize == expected.fileSize && shared->mtime == expected.mtime &&
+                 shared->device == expected.device && shared->inode == expected.inode &&
+                 shared->dataOffset + shared->dataSize <= size &&
+                 shared->imageOffset + shared->imageSize <= size &&
+                 buildFromImage(region + shared->imageOffset, shared->imageSize);
+    if (!valid) {
+        munmap(map, size);
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    magic.assign(shared->wadMagic, 4);
+    const char *data = region + shared->dataOffset;
+    uint64_t dataSize = shared->dataSize;
+    function<void(Node*)> point = [&](Node* node) {
+        for (Node* c : node->children) point(c);
+        if (!node->isDirectory && node->length > 0 &&
+            static_cast<uint64_t>(node->offset) + node->length <= dataSize)
+            node->view = data + node->offset;
+    };
+    point(root);
+
+    sharedRegion = region;
+    sharedSize = size;
+    return true;
+}
+
+bool Wad::publishShared(const string &name) {
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) return false;
+
+    // From here the Wad is loaded whatever becomes of the region; lumps are
+    // copied into the region rather than read at load
+    loadHeader();
+    if (magic == "WADZ") loadContainer();
+    else loadDescriptors();
+    buildTree();
+    loadFileData();
+
+    vector<Node*> lumps;
+    function<void(Node*)> collect = [&](Node* node) {
+        for (Node* c : node->children) collect(c);
+        if (!node->isDirectory && node->length > 0) lumps.push_back(node);
+    };
+    collect(root);
+
+    SharedHeader header = {};
+    struct stat file;
+    string image = treeImage();
+    bool ok = fstat(fileDescriptor, &file) == 0 && !image.empty();
+    if (ok) {
+        memcpy(header.magic, SharedMagic, 4);
+        header.version = SharedVersion;
+        memcpy(header.wadMagic, magic.data(), min<size_t>(magic.size(), 4));
+        identify(file, &header);
+        for (const Node* node : lumps)
+            header.dataSize = max<uint64_t>(header.dataSize, static_cast<uint64_t>(node->offset) + node->length);
+        header.dataOffset = (sizeof(SharedHeader) + 63) & ~uint64_t(63);
+        header.imageOffset = (header.dataOffset + header.dataSize + 7) & ~uint64_t(7);
+        header.imageSize = image.size();
+    }
+    size_t size = static_cast<size_t>(header.imageOffset + header.imageSize);
+    void *map = ok && ftruncate(fd, static_cast<off_t>(size)) == 0
+                    ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                    : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        return true;
+    }
+    char *region = static_cast<char*>(map);
+    char *data = region + header.dataOffset;
+
+    // Plain lumps come straight from the file through the I/O engine; a
+    // container's are decompressed into place
+    deque<IoRequest> reads;
+    for (Node* node : lumps) {
+        if (packed) {
+            ok = ok && readBlocks(node, data + node->offset, static_cast<int64_t>(node->length), 0) ==
+                           static_cast<int64_t>(node->length);
+            continue;
+        }
+        reads.push_back({fileDescriptor, false, data + node->offset, node->length,
+                         static_cast<off_t>(node->offset), 0});
+        io->submit(&reads.back());
+    }
+    io->wait();
+    for (const IoRequest &r : reads)
+        ok = ok && r.result == static_cast<ssize_t>(r.length);
+    if (!ok) {
+        munmap(map, size);
+        shm_unlink(name.c_str());
+        return true;
+    }
+
+    memcpy(region + header.imageOffset, image.data(), image.size());
+    memcpy(region, &header, sizeof(header));
+    __atomic_store_n(&reinterpret_cast<SharedHeader*>(region)->ready, 1, __ATOMIC_RELEASE);
+    mprotect(region, size, PROT_READ);
+
+    for (Node* node : lumps)
+        node->view = data + node->offset;
+    sharedRegion = region;
+    sharedSize = size;
+    return true;
+}
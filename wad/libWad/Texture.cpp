@@ -0,0 +1,218 @@
+#include "Texture.h"
+#include "Wad.h"
+#include <cstring>
+
+using namespace std;
+
+static int32_t readInt(const char *p) {
+    int32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static int16_t readShort(const char *p) {
+    int16_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+TextureCompositor::TextureCompositor(Wad *wad, size_t budgetBytes)
+    : wad(wad), budget(budgetBytes), parsedGeneration(0), parsed(false) {
+    counters = Stats{0, 0, 0, 0, 0};
+}
+
+shared_ptr<const RgbaImage> TextureCompositor::get(const string &name, int palette, int light) {
+    LumpName packed;
+    if (!LumpName::fromString(name, &packed)) return nullptr;
+
+    Key key;
+    TextureDef def;
+    vector<LumpName> patchNames;
+    shared_ptr<const Palette> pal;
+    {
+        lock_guard<mutex> guard(lock);
+        if (!refresh()) return nullptr;
+
+        key = {parsedGeneration, packed.upper().bits, palette, light};
+        auto hit = entries.find(key);
+        if (hit != entries.end()) {
+            lru.splice(lru.begin(), lru, hit->second);
+            counters.hits++;
+            return hit->second->image;
+        }
+        counters.misses++;
+
+        auto found = textureIndex.find(key.name);
+        if (found == textureIndex.end()) return nullptr;
+        def = textures[found->second];
+        for (const TextureDef::Patch &patch : def.patches) {
+            if (patch.pname < 0 || static_cast<size_t>(patch.pname) >= pnames.size()) return nullptr;
+            patchNames.push_back(pnames[patch.pname]);
+        }
+        pal = colours;
+    }
+
+    // Composed without the lock, so one render does not hold up every other
+    // lookup; when two threads compose the same texture the first insert wins
+    shared_ptr<const RgbaImage> image = compose(def, patchNames, *pal, palette, light);
+    if (!image) return nullptr;
+
+    lock_guard<mutex> guard(lock);
+    auto raced = entries.find(key);
+    if (raced != entries.end()) {
+        lru.splice(lru.begin(), lru, raced->second);
+        return raced->second->image;
+    }
+    if (parsed && key.generation == parsedGeneration) insert(key, image);
+    return image;
+}
+
+bool TextureCompositor::definition(const string &name, TextureDef *out) {
+    LumpName packed;
+    if (!LumpName::fromString(name, &packed)) return false;
+
+    lock_guard<mutex> guard(lock);
+    if (!refresh()) return false;
+
+    auto it = textureIndex.find(packed.upper().bits);
+    if (it == textureIndex.end()) return false;
+    *out = textures[it->second];
+    return true;
+}
+
+size_t TextureCompositor::textureCount() {
+    lock_guard<mutex> guard(lock);
+    return refresh() ? textures.size() : 0;
+}
+
+TextureCompositor::Stats TextureCompositor::stats() const {
+    lock_guard<mutex> guard(lock);
+    return counters;
+}
+
+// Definitions
+
+bool TextureCompositor::refresh() {
+    uint64_t generation = wad ? wad->getGeneration() : 0;
+    if (parsed && generation == parsedGeneration) return true;
+
+    // Cached images from older generations can never be hit again
+    lru.clear();
+    entries.clear();
+    counters.bytes = 0;
+    counters.entries = 0;
+
+    parsed = false;
+    pnames.clear();
+    textures.clear();
+    textureIndex.clear();
+    shared_ptr<Palette> loaded = make_shared<Palette>();
+    colours = loaded;
+    if (!wad || !loaded->load(wad)) return false;
+
+    vector<char> lump;
+    if (!wad->readAll(wad->findLump("PNAMES"), &lump) || lump.size() < 4) return false;
+    int32_t count = readInt(lump.data());
+    if (count < 0 || 4 + static_cast<size_t>(count) * 8 > lump.size()) return false;
+    for (int32_t i = 0; i < count; i++)
+        pnames.push_back(LumpName::fromBytes(lump.data() + 4 + i * 8).upper());
+
+    // TEXTURE2 (registered/commercial) is optional; later entries win
+    bool any = false;
+    const char *tables[] = {"TEXTURE1", "TEXTURE2"};
+    for (const char *table : tables) {
+        if (!wad->readAll(wad->findLump(table), &lump)) continue;
+        if (!parseTextures(lump)) return false;
+        any = true;
+    }
+    if (!any) return false;
+
+    parsedGeneration = generation;
+    parsed = true;
+    return true;
+}
+
+bool TextureCompositor::parseTextures(const vector<char> &lump) {
+    const char *data = lump.data();
+    size_t length = lump.size();
+    if (length < 4) return false;
+
+    int32_t count = readInt(data);
+    if (count < 0 || 4 + static_cast<size_t>(count) * 4 > length) return false;
+
+    for (int32_t i = 0; i < count; i++) {
+        int32_t offset = readInt(data + 4 + i * 4);
+        // name[8], masked, width, height, columndirectory, patchcount
+        if (offset < 0 || static_cast<size_t>(offset) + 22 > length) return false;
+        const char *entry = data + offset;
+
+        int16_t patchCount = readShort(entry + 20);
+        if (patchCount < 0 || static_cast<size_t>(offset) + 22 + patchCount * 10 > length)
+            return false;
+
+        TextureDef def;
+        def.name = LumpName::fromBytes(entry).upper();
+        def.width = readShort(entry + 12);
+        def.height = readShort(entry + 14);
+        if (def.width <= 0 || def.height <= 0) return false;
+
+        // originx, originy, patch, stepdir, colormap
+        for (int16_t p = 0; p < patchCount; p++) {
+            const char *mp = entry + 22 + p * 10;
+            TextureDef::Patch patch = {readShort(mp), readShort(mp + 2), readShort(mp + 4)};
+            def.patches.push_back(patch);
+        }
+
+        auto existing = textureIndex.find(def.name.bits);
+        if (existing != textureIndex.end()) {
+            textures[existing->second] = def;
+        } else {
+            textureIndex[def.name.bits] = textures.size();
+            textures.push_back(def);
+        }
+    }
+    return true;
+}
+
+// Composition and cache
+
+shared_ptr<const RgbaImage> TextureCompositor::compose(const TextureDef &def, const vector<LumpName> &patchNames,
+                                                       const Palette &pal, int palette, int light) {
+    size_t pixelCount = static_cast<size_t>(def.width) * def.height;
+    vector<uint8_t> indices(pixelCount, 0);
+    vector<uint32_t> opaque(pixelCount, 0);
+
+    vector<char> bytes;
+    for (size_t i = 0; i < def.patches.size(); i++) {
+        const TextureDef::Patch &patch = def.patches[i];
+        if (!wad->readAll(wad->findLump(patchNames[i]), &bytes)) return nullptr;
+        if (!drawPatch(bytes.data(), bytes.size(), patch.originX, patch.originY,
+                       indices.data(), opaque.data(), def.width, def.height))
+            return nullptr;
+    }
+
+    shared_ptr<RgbaImage> image = make_shared<RgbaImage>();
+    image->width = def.width;
+    image->height = def.height;
+    if (!finishIndexed(indices.data(), opaque.data(), pal, palette, light, image.get()))
+        return nullptr;
+    return image;
+}
+
+void TextureCompositor::insert(const Key &key, shared_ptr<const RgbaImage> image) {
+    size_t bytes = image->pixels.size() * sizeof(uint32_t);
+    if (bytes > budget) return; // would evict everything and still not fit
+
+    while (!lru.empty() && counters.bytes + bytes > budget) {
+        Entry &victim = lru.back();
+        counters.bytes -= victim.bytes;
+        entries.erase(victim.key);
+        lru.pop_back();
+        counters.evictions++;
+    }
+
+    lru.push_front(Entry{key, image, bytes});
+    entries[key] = lru.begin();
+    counters.bytes += bytes;
+    counters.entries = entries.size();
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <cstdint>
+
+#include "LumpName.h"
+#include "Image.h"
+
+using namespace std;
+
+class Wad;
+
+// One TEXTURE1/TEXTURE2 entry: a canvas and the PNAMES patches drawn on it
+struct TextureDef {
+    struct Patch {
+        int originX;
+        int originY;
+        int pname;           // index into PNAMES
+    };
+
+    LumpName name;
+    int width;
+    int height;
+    vector<Patch> patches;
+};
+
+// Composes wall textures from TEXTURE1/TEXTURE2 + PNAMES and keeps the
+// results in an LRU bounded by `budgetBytes` of RGBA pixels. Entries are keyed
+// by (Wad generation, texture name, palette, light), so anything written to
+// the Wad after a texture was built is never served stale.
+class TextureCompositor {
+
+public:
+    TextureCompositor(Wad *wad, size_t budgetBytes);
+
+    // nullptr if the texture is unknown or one of its lumps is malformed
+    shared_ptr<const RgbaImage> get(const string &name, int palette = 0, int light = 0);
+
+    // Copies the definition into *out, as a refresh may replace the table;
+    // false if unknown
+    bool definition(const string &name, TextureDef *out);
+    size_t textureCount();
+
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        size_t bytes;         // pixels currently cached
+        size_t entries;
+    };
+    Stats stats() const;
+
+private:
+    struct Key {
+        uint64_t generation;
+        uint64_t name;
+        int palette;
+        int light;
+
+        bool operator==(const Key &o) const {
+            return generation == o.generation && name == o.name &&
+                   palette == o.palette && light == o.light;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key &k) const {
+            uint64_t h = k.name * 0x9E3779B97F4A7C15ULL;
+            h ^= k.generation + 0x632BE59BD9B4E019ULL + (h << 6) + (h >> 2);
+            h ^= static_cast<uint64_t>(k.palette * 64 + k.light) + (h << 6) + (h >> 2);
+            return static_cast<size_t>(h);
+        }
+    };
+
+    struct Entry {
+        Key key;
+        shared_ptr<const RgbaImage> image;
+        size_t bytes;
+    };
+
+    bool refresh();   // (re)parses definitions if the Wad generation moved
+    bool parseTextures(const vector<char> &lump);
+    // Runs without the lock, on what get() copied out under it
+    shared_ptr<const RgbaImage> compose(const TextureDef &def, const vector<LumpName> &patchNames,
+                                        const Palette &colours, int palette, int light);
+    void insert(const Key &key, shared_ptr<const RgbaImage> image);
+
+    Wad *wad;
+    size_t budget;
+
+    mutable mutex lock;
+    uint64_t parsedGeneration;
+    bool parsed;
+    shared_ptr<const Palette> colours;             // replaced whole, so a compose keeps its own
+    vector<LumpName> pnames;
+    vector<TextureDef> textures;
+    unordered_map<uint64_t, size_t> textureIndex;  // upper-cased name -> textures[]
+
+    list<Entry> lru;                                // front = most recent
+    unordered_map<Key, list<Entry>::iterator, KeyHash> entries;
+    Stats counters;
+};
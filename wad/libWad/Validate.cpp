@@ -0,0 +1,375 @@
+#include "Wad.h"
+#include "WadHeader.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <system_error>
+#include <cerrno>
+#include <cstring>
+
+using namespace std;
+
+// Wad::validate() works from the raw header and directory rather than from
+// a loaded tree: the loader tolerates short reads and guesses where map
+// directories end, so a loaded Wad no longer shows what is wrong with the
+// file.
+
+namespace {
+
+struct Entry {
+    uint64_t offset;
+    uint64_t length;
+    LumpName name;
+    char raw[8];
+    bool inFile;        // the lump's bytes lie within the file
+};
+
+// One check's findings; each map gets its own, so workers share nothing
+struct Findings {
+    const vector<Entry> &entries;
+    vector<Wad::Issue> issues;
+
+    explicit Findings(const vector<Entry> &entries) : entries(entries) {}
+
+    void add(Wad::Issue::Severity severity, int lump, const string &message) {
+        issues.push_back({severity, lump, lump < 0 ? "" : entries[lump].name.str(), message});
+    }
+    void error(int lump, const string &message) { add(Wad::Issue::Error, lump, message); }
+    void warning(int lump, const string &message) { add(Wad::Issue::Warning, lump, message); }
+};
+
+// The map lumps following a marker: directory index per MapView::Lump, -1 if absent
+struct MapLumps {
+    int marker;
+    int index[MapView::LumpCount];
+};
+
+}
+
+static const size_t recordSizes[MapView::LumpCount] = {
+    sizeof(MapThing), sizeof(MapLinedef), sizeof(MapSidedef), sizeof(MapVertex), sizeof(MapSeg),
+    sizeof(MapSubsector), sizeof(MapNode), sizeof(MapSector), 1, 2
+};
+
+// Without these there is no map; the rest can be rebuilt from them
+static bool requiredLump(int kind) {
+    return kind == MapView::Things || kind == MapView::Linedefs || kind == MapView::Sidedefs ||
+           kind == MapView::Vertexes || kind == MapView::Sectors;
+}
+
+// Reports how many records of `bytes` fail `bad`, and the first of them
+template <typename T, typename Bad>
+static void checkRecords(Findings &f, int lump, const vector<char> &bytes, const char *what, Bad bad) {
+    size_t count = bytes.size() / sizeof(T), failed = 0, first = 0;
+    for (size_t i = 0; i < count; i++) {
+        T record;
+        memcpy(&record, bytes.data() + i * sizeof(T), sizeof(T));
+        if (!bad(record)) continue;
+        if (failed++ == 0) first = i;
+    }
+    if (failed)
+        f.error(lump, to_string(failed) + " record(s) reference " + what + " (first: record " + to_string(first) + ")");
+}
+
+static void checkMap(int fd, const vector<Entry> &entries, const MapLumps &map, Findings &f) {
+    size_t counts[MapView::LumpCount] = {};
+    vector<char> bytes[MapView::LumpCount];
+    bool readable[MapView::LumpCount] = {};
+
+    for (int k = 0; k < MapView::LumpCount; k++) {
+        string name = MapView::lumpName(static_cast<MapView::Lump>(k)).str();
+        int lump = map.index[k];
+        if (lump < 0) {
+            if (requiredLump(k)) f.error(map.marker, "has no " + name);
+            else f.warning(map.marker, "has no " + name);
+            continue;
+        }
+
+        const Entry &e = entries[lump];
+        if (e.length % recordSizes[k])
+            f.error(lump, "length " + to_string(e.length) + " is not a whole number of " +
+                          to_string(recordSizes[k]) + "-byte records");
+        counts[k] = e.length / recordSizes[k];
+
+        // only the lumps holding indices are read; the rest need just a count
+        if (k != MapView::Linedefs && k != MapView::Sidedefs && k != MapView::Segs &&
+            k != MapView::Subsectors && k != MapView::Nodes) continue;
+        if (!e.inFile) continue; // already reported
+        bytes[k].resize(e.length);
+        ssize_t r = pread(fd, bytes[k].data(), bytes[k].size(), static_cast<off_t>(e.offset));
+        if (r != static_cast<ssize_t>(bytes[k].size())) {
+            f.error(lump, "cannot be read");
+            continue;
+        }
+        readable[k] = true;
+    }
+
+    size_t vertexes = counts[MapView::Vertexes], sidedefs = counts[MapView::Sidedefs];
+    size_t linedefs = counts[MapView::Linedefs], sectors = counts[MapView::Sectors];
+    size_t segs = counts[MapView::Segs], subsectors = counts[MapView::Subsectors];
+    size_t nodes = counts[MapView::Nodes];
+
+    if (readable[MapView::Linedefs]) {
+        int lump = map.index[MapView::Linedefs];
+        const vector<char> &b = bytes[MapView::Linedefs];
+        checkRecords<MapLinedef>(f, lump, b, "missing vertexes", [&](const MapLinedef &l) {
+            return l.v1 >= vertexes || l.v2 >= vertexes;
+        });
+        checkRecords<MapLinedef>(f, lump, b, "a missing right sidedef", [&](const MapLinedef &l) {
+            return l.sidenum[0] >= sidedefs;
+        });
+        checkRecords<MapLinedef>(f, lump, b, "a missing left sidedef", [&](const MapLinedef &l) {
+            return l.sidenum[1] != 0xFFFF && l.sidenum[1] >= sidedefs;
+        });
+    }
+
+    if (readable[MapView::Sidedefs]) {
+        checkRecords<MapSidedef>(f, map.index[MapView::Sidedefs], bytes[MapView::Sidedefs], "missing sectors",
+                                 [&](const MapSidedef &s) { return s.sector >= sectors; });
+    }
+
+    if (readable[MapView::Segs]) {
+        int lump = map.index[MapView::Segs];
+        const vector<char> &b = bytes[MapView::Segs];
+        const vector<char> &lines = bytes[MapView::Linedefs];
+        checkRecords<MapSeg>(f, lump, b, "missing vertexes", [&](const MapSeg &s) {
+            return s.v1 >= vertexes || s.v2 >= vertexes;
+        });
+        checkRecords<MapSeg>(f, lump, b, "missing linedefs", [&](const MapSeg &s) {
+            return s.linedef >= linedefs;
+        });
+        checkRecords<MapSeg>(f, lump, b, "a linedef side that does not exist", [&](const MapSeg &s) {
+            if (s.side != 0 && s.side != 1) return true;
+            if (!readable[MapView::Linedefs] || s.linedef >= linedefs) return false; // reported above
+            MapLinedef l;
+            memcpy(&l, lines.data() + s.linedef * sizeof(MapLinedef), sizeof(l));
+            return l.sidenum[s.side] == 0xFFFF;
+        });
+    }
+
+    if (readable[MapView::Subsectors]) {
+        checkRecords<MapSubsector>(f, map.index[MapView::Subsectors], bytes[MapView::Subsectors],
+                                   "segs past the end of SEGS", [&](const MapSubsector &s) {
+            return s.segCount == 0 || static_cast<size_t>(s.firstSeg) + s.segCount > segs;
+        });
+    }
+
+    if (readable[MapView::Nodes]) {
+        checkRecords<MapNode>(f, map.index[MapView::Nodes], bytes[MapView::Nodes],
+                              "missing nodes or subsectors", [&](const MapNode &n) {
+            for (uint16_t child : n.children) {
+                if (child & 0x8000 ? (child & 0x7FFFu) >= subsectors : child >= nodes) return true;
+            }
+            return false;
+        });
+    }
+}
+
+bool Wad::validate(const string &path, vector<Issue> *issues, unsigned threads, GameFormat format) {
+    vector<Entry> entries;
+    Findings f(entries);
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        f.error(-1, string("cannot open: ") + strerror(errno));
+        if (fd >= 0) close(fd);
+        if (issues) issues->insert(issues->end(), f.issues.begin(), f.issues.end());
+        return false;
+    }
+    uint64_t fileSize = static_cast<uint64_t>(st.st_size);
+
+    // Header, classic or extended
+    WadHeader header;
+    WadHeaderStatus status = readWadHeader(fd, &header);
+    if (status != WadHeaderStatus::Ok) {
+        f.error(-1, wadHeaderProblem(status));
+        close(fd);
+        if (issues) issues->insert(issues->end(), f.issues.begin(), f.issues.end());
+        return false;
+    }
+    if (memcmp(header.magic, "IWAD", 4) != 0 && memcmp(header.magic, "PWAD", 4) != 0)
+        f.warning(-1, "magic is neither IWAD nor PWAD");
+
+    uint64_t count = header.count, tableOffset = header.tableOffset;
+    if (count > 0 && tableOffset < header.size)
+        f.error(-1, "directory table overlaps the header");
+
+    // Directory table; a truncated one is read as far as it goes, like loadDescriptors()
+    uint64_t present = count;
+    if (!wadTableFits(header, fileSize)) {
+        present = tableOffset >= fileSize ? 0 : (fileSize - tableOffset) / header.entrySize;
+        f.error(-1, "directory table runs past the end of the file: " + to_string(present) + " of " +
+                    to_string(count) + " entries are there");
+    }
+    uint64_t tableEnd = tableOffset + present * header.entrySize;
+    vector<char> table(static_cast<size_t>(present) * header.entrySize);
+    if (!table.empty() && pread(fd, table.data(), table.size(), static_cast<off_t>(tableOffset)) !=
+                          static_cast<ssize_t>(table.size())) {
+        f.error(-1, "directory table cannot be read");
+        table.clear();
+    }
+    entries.resize(table.size() / header.entrySize);
+    for (size_t i = 0; i < entries.size(); i++) {
+        Entry &e = entries[i];
+        const char *raw = table.data() + i * header.entrySize;
+        readWadEntry(header, raw, &e.offset, &e.length, &e.name);
+        memcpy(e.raw, raw + header.entrySize - 8, 8);
+        e.inFile = false;
+    }
+
+    // Names and data ranges
+    for (size_t i = 0; i < entries.size(); i++) {
+        Entry &e = entries[i];
+        int lump = static_cast<int>(i);
+        for (char c : e.raw) {
+            if (c == '\0') break;
+            if (c < 0x21 || c > 0x7E) {
+                f.warning(lump, "name has unprintable characters");
+                break;
+            }
+        }
+
+        if (e.length == 0) continue; // markers: the offset means nothing
+        if (e.offset > fileSize || e.length > fileSize - e.offset) {
+            f.error(lump, "data (" + to_string(e.length) + " bytes at " + to_string(e.offset) +
+                          ") runs past the end of the file");
+            continue;
+        }
+        uint64_t end = e.offset + e.length;
+        e.inFile = true;
+        if (e.offset < header.size)
+            f.error(lump, "data overlaps the header");
+        else if (count > 0 && e.offset < tableEnd && end > tableOffset)
+            f.error(lump, "data overlaps the directory table");
+    }
+
+    // Overlapping lumps; identical ranges are one lump listed twice, which is fine
+    vector<int> byOffset;
+    for (size_t i = 0; i < entries.size(); i++)
+        if (entries[i].inFile) byOffset.push_back(static_cast<int>(i));
+    sort(byOffset.begin(), byOffset.end(), [&](int a, int b) {
+        if (entries[a].offset != entries[b].offset) return entries[a].offset < entries[b].offset;
+        return entries[a].length != entries[b].length ? entries[a].length > entries[b].length : a < b;
+    });
+    int reach = -1; // the lump extending furthest so far
+    for (int i : byOffset) {
+        if (reach >= 0) {
+            const Entry &r = entries[reach], &e = entries[i];
+            bool same = r.offset == e.offset && r.length == e.length;
+            if (!same && e.offset < static_cast<uint64_t>(r.offset) + r.length) {
+                int later = max(i, reach), earlier = min(i, reach); // reported on the later entry
+                f.error(later, "data overlaps lump " + to_string(earlier) + " (" + entries[earlier].name.str() + ")");
+            }
+            if (static_cast<uint64_t>(e.offset) + e.length <= static_cast<uint64_t>(r.offset) + r.length)
+                continue;
+        }
+        reach = i;
+    }
+
+    // _START/_END balance; an unmatched _END unwinds the way buildTree() does
+    vector<int> open;
+    for (size_t i = 0; i < entries.size(); i++) {
+        uint8_t flags = NamespaceRules::classify(entries[i].name);
+        int lump = static_cast<int>(i);
+        if (flags & NamespaceStart) {
+            open.push_back(lump);
+        } else if (flags & NamespaceEnd) {
+            LumpName target = cleanName(entries[i].name);
+            auto match = find_if(open.rbegin(), open.rend(), [&](int s) {
+                return NamespaceRules::closes(target, cleanName(entries[s].name));
+            });
+            if (match == open.rend()) {
+                f.error(lump, "has no matching _START");
+                continue;
+            }
+            if (match != open.rbegin())
+                f.error(lump, "closes " + entries[*match].name.str() + " while " +
+                              entries[open.back()].name.str() + " is still open");
+            open.erase(match.base() - 1, open.end());
+        }
+    }
+    for (int s : open)
+        f.error(s, "is never closed by an _END");
+
+    // Map directories, checked against what buildTree() will make of them
+    // under the format the loader would detect
+    if (format == GameFormat::Auto)
+        format = detectFormat(entries.size(), [&](size_t i) { return entries[i].name; });
+    vector<MapLumps> maps;
+    withFormat(format, [&](auto rules) {
+        using Rules = decltype(rules);
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (!Rules::isMapMarker(entries[i].name)) continue;
+
+            MapLumps m;
+            m.marker = static_cast<int>(i);
+            fill(m.index, m.index + MapView::LumpCount, -1);
+            uint32_t seen = 0;
+            size_t j = i + 1;
+            for (; j < entries.size(); j++) {
+                int k = Rules::mapLumpIndex(entries[j].name);
+                if (k < 0 || (seen & (1u << k))) break;
+                seen |= 1u << k;
+                if (k < MapView::LumpCount) m.index[k] = static_cast<int>(j);
+            }
+            size_t expected = j - i - 1;
+            if (expected == 0) continue; // a map directory holding other lumps, not a map
+            if (Rules::doomRecords) maps.push_back(m); // Hexen's records are laid out differently
+
+            const Entry &marker = entries[i];
+            bool directory = i + 1 >= entries.size() || marker.length == 0 ||
+                             (Rules::classify(entries[i + 1].name) & NamespaceStart) ||
+                             entries[i + 1].offset != marker.offset + marker.length;
+            if (!directory) {
+                f.error(m.marker, "has data and its first lump follows it directly, so it loads as a plain lump");
+                continue;
+            }
+
+            size_t grouped = 0;
+            for (j = i + 1; j < entries.size(); j++) {
+                if (Rules::classify(entries[j].name)) break;
+                if (grouped > 0 && entries[j].offset != entries[j - 1].offset + entries[j - 1].length) break;
+                grouped++;
+            }
+            if (grouped < expected)
+                f.error(m.marker, "only " + to_string(grouped) + " of its " + to_string(expected) +
+                                  " lumps are contiguous; the loader ends the map there");
+            else if (grouped > expected)
+                f.warning(static_cast<int>(i + 1 + expected), "directly follows the lumps of " +
+                                                              marker.name.str() + " and loads inside its directory");
+        }
+    });
+
+    // Map contents, one map per task
+    vector<Findings> mapFindings(maps.size(), Findings(entries));
+    atomic<size_t> nextMap(0);
+    auto worker = [&]() {
+        for (size_t m; (m = nextMap++) < maps.size();)
+            checkMap(fd, entries, maps[m], mapFindings[m]);
+    };
+    if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+    threads = static_cast<unsigned>(min<size_t>(threads, max<size_t>(1, maps.size())));
+    vector<thread> pool;
+    try {
+        for (unsigned t = 1; t < threads; t++)
+            pool.emplace_back(worker);
+    } catch (const system_error &) {
+        // fewer workers; this thread checks whatever maps they leave
+    }
+    worker();
+    for (thread &t : pool)
+        t.join();
+    close(fd);
+
+    for (const Findings &m : mapFindings)
+        f.issues.insert(f.issues.end(), m.issues.begin(), m.issues.end());
+    stable_sort(f.issues.begin(), f.issues.end(), [](const Issue &a, const Issue &b) { return a.lump < b.lump; });
+
+    bool clean = none_of(f.issues.begin(), f.issues.end(), [](const Issue &i) { return i.severity == Issue::Error; });
+    if (issues) issues->insert(issues->end(), f.issues.begin(), f.issues.end());
+    return clean;
+}
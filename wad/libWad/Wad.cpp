@@ -1,27 +1,82 @@
 #include "Wad.h"
+#include "Lz.h"
+#include "Digest.h"
+#include "WadHeader.h"
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <climits>
+#include <algorithm>
 #include <functional>
+#include <deque>
+#include <thread>
+#include <system_error>
+#include <new>
+#include <atomic>
 #include <cstring>
+#include <cstdio>
 
 using namespace std;
 
+// WADZ container: header, then the compressed blocks, then an index of one
+// entry per lump (its offset in the raw layout, length, name and first
+// block) followed by one per block (file offset and stored size)
+static const uint32_t ContainerVersion = 2;  // 64-bit lump offsets and lengths
+static const uint32_t ContainerHeaderSize = 32;
+static const uint32_t ContainerLumpEntry = 28;
+static const uint32_t ContainerBlockEntry = 12;
+static const uint32_t DefaultBlockSize = 64 * 1024; // Lz offsets reach 64 KiB back
+
+// The classic and extended headers and ContainerMagic are in WadHeader.h
+
 // Static Constructor
 Wad* Wad::loadWad(const string &path) {
+    return loadWad(path, LoadOptions());
+}
+
+Wad* Wad::loadWad(const string &path, const LoadOptions &options) {
 
     Wad* wad = new Wad(path);
 
-    int descriptor = open(path.c_str(), O_RDONLY);
+    int descriptor = ::open(path.c_str(), O_RDONLY);
     if (descriptor < 0) {
         delete wad;
         return nullptr;
     }
 
     wad->fileDescriptor = descriptor;
+    wad->io = IoEngine::create(options.io);
+    wad->indexCache = options.indexCache;
+    wad->prefetch = options.prefetch;
+    wad->format = options.format;
+    wad->readOnly = options.readOnly;
+    wad->cacheBytes = options.cacheBytes;
+    wad->coldTarget = options.cacheBytes / 4;
+    for (const string &name : options.pinned) {
+        LumpName pinned;
+        if (LumpName::fromString(name, &pinned)) wad->pinnedNames.push_back(pinned.upper().bits);
+    }
+    if (!options.shared.empty()) {
+        wad->readOnly = true;
+        if (wad->openShared(options.shared)) return wad;
+    }
 
+    // Lump reads are queued before the tree is built so the I/O overlaps it
     wad->loadHeader();
-    wad->loadDescriptors();
-    wad->buildTree();
+    if (wad->magic == string(ContainerMagic, 4)) {
+        wad->loadContainer();
+    } else {
+        wad->loadDescriptors();
+        if (!options.lazy && !options.cacheBytes)
+            wad->startFileData(options.threads ? options.threads : thread::hardware_concurrency());
+    }
+    wad->loadCounters = {wad->lumpReads.size(), wad->readsIssued.load()};
+    if (!wad->indexCache || !wad->loadIndex()) {
+        wad->buildTree();
+        if (wad->indexCache) wad->saveIndex();
+    }
     wad->loadFileData();
 
     // wad->printTree(); // debug
@@ -31,14 +86,37 @@ Wad* Wad::loadWad(const string &path) {
 
 // Private Constructor 
 Wad::Wad(const string &path)
-        : fileDescriptor(-1), wadPath(path), magic(""), descriptorCount(0),
-      descriptorOffset(0), root(nullptr) {
+        : fileDescriptor(-1), wadPath(path), magic(""), format(GameFormat::Auto), descriptorCount(0),
+      descriptorOffset(0), extended(false), extendOnSave(false), root(nullptr), generation(0), indexCache(false),
+      directoryCrc(0), prefetch(true), readOnly(false),
+      sharedRegion(nullptr), sharedSize(0), cacheBytes(0), coldTarget(0), testBytes(0), stats(),
+      packed(false), packOnSave(false),
+      blockSize(DefaultBlockSize), io(nullptr) {
+}
+
+Wad::Node::Node(LumpName n, bool dir, uint8_t f)
+    : name(n), base(cleanName(n)), flags(f), isDirectory(dir),
+      offset(0), length(0), block(0), view(nullptr), prefetched(false),
+      cache(CacheNone), referenced(false), hits(0), parent(nullptr) {
 }
 
 // Destructor
 Wad::~Wad() {
-    saveWad();
+    // an untouched container is left as it is rather than recompressed
+    if (io && !readOnly && !(packed && packOnSave && generation == 0)) saveWad();
     close(fileDescriptor);   
+    delete io;
+    if (sharedRegion) munmap(sharedRegion, sharedSize);
+
+    // handles and MapViews die with the Wad
+    vector<Node*> pending;
+    if (root) pending.push_back(root);
+    while (!pending.empty()) {
+        Node* node = pending.back();
+        pending.pop_back();
+        pending.insert(pending.end(), node->children.begin(), node->children.end());
+        delete node;
+    }
 }
 
 // Getters
@@ -46,6 +124,48 @@ string Wad::getMagic() const {
     return magic;
 }
 
+GameFormat Wad::getFormat() const {
+    return format;
+}
+
+Wad::LoadStats Wad::loadStats() const {
+    return loadCounters;
+}
+
+uint64_t Wad::getGeneration() const {
+    return generation;
+}
+
+bool Wad::isCompressed() const {
+    return packOnSave;
+}
+
+bool Wad::isReadOnly() const {
+    return readOnly;
+}
+
+bool Wad::isExtended() const {
+    return extendOnSave;
+}
+
+Wad::LumpHandle Wad::findLump(const string &name) const {
+    LumpName packed;
+    if (!LumpName::fromString(name, &packed)) return InvalidHandle;
+    return findLump(packed);
+}
+
+Wad::LumpHandle Wad::findLump(LumpName name) const {
+    uint64_t bits = name.upper().bits;
+    Node* node = nameIndex.find(reinterpret_cast<const char*>(&bits), sizeof(bits));
+    if (!node) return InvalidHandle;
+    return static_cast<LumpHandle>(reinterpret_cast<uintptr_t>(node));
+}
+
+void Wad::indexName(Node* node) {
+    uint64_t bits = node->name.upper().bits;
+    nameIndex.set(reinterpret_cast<const char*>(&bits), sizeof(bits), node);
+}
+
 bool Wad::isContent(const string &path) const {
     Node* node = lookupNode(path);
     if (!node) return false;
@@ -59,33 +179,127 @@ bool Wad::isDirectory(const string &path) const {
     return node->isDirectory;
 }
 
-int Wad::getSize(const string &path) const {
+int64_t Wad::getSize(const string &path) const {
     Node* node = lookupNode(path);
     if (!node) return -1;
     if (node->isDirectory) return -1;
-    return static_cast<int>(node->length); //length is uint32
+    return static_cast<int64_t>(node->length);
 }
 
-int Wad::getContents(const string &path, char *buffer, int length, int offset) {
+int64_t Wad::getContents(const string &path, char *buffer, int64_t length, int64_t offset) {
     if (!buffer || length <= 0) return -1;
 
     Node* node = lookupNode(path);
     if (!node || node->isDirectory) return -1; // must be a file
 
-    // Out-of-range offset means no bytes available
-    if (offset < 0 || offset >= static_cast<int>(node->data.size()))
-        return 0;
+    return readNode(node, buffer, length, offset);
+}
 
-    // Compute how many bytes we can copy
-    int available = static_cast<int>(node->data.size()) - offset;
-    int toCopy = min(length, available);
+int Wad::readv(vector<ReadRequest> &requests) {
+    // Resolve everything first so the reads can be issued in file order
+    struct Pending {
+        Node* node;
+        size_t index;
+        uint64_t fileOffset;
+        int64_t length;
+        bool resident;
+    };
+    vector<Pending> pending;
+    pending.reserve(requests.size());
+    const int64_t maxRun = 1 << 30;
+
+    int succeeded = 0;
+    for (size_t i = 0; i < requests.size(); i++) {
+        ReadRequest &req = requests[i];
+        req.result = -1;
+        if (!req.buffer || req.length <= 0) continue;
+
+        Node* node = req.handle != InvalidHandle ? fromHandle(req.handle) : lookupNode(req.path);
+        if (!node || node->isDirectory) continue;
+
+        // Out-of-range offset means no bytes available
+        if (req.offset < 0 || static_cast<uint64_t>(req.offset) >= node->length) {
+            req.result = 0;
+            succeeded++;
+            continue;
+        }
 
-    if (toCopy > 0)
-        copy(node->data.begin() + offset,
-                  node->data.begin() + offset + toCopy,
-                  buffer);
+        // container lumps decompress one at a time rather than joining a
+        // run, reads larger than one preadv() can move go alone, and with
+        // a cache every read goes through it
+        int64_t available = static_cast<int64_t>(node->length) - req.offset;
+        int64_t length = min(req.length, available);
+        if (!cacheBytes && !isResident(node)) prefetchGroup(node); // the cache prefetches on a miss
+        if (cacheBytes || (!isResident(node) && (packed || length > maxRun))) {
+            req.result = readNode(node, req.buffer, req.length, req.offset);
+            if (req.result >= 0) succeeded++;
+            continue;
+        }
+
+        pending.push_back({node, i, node->offset + static_cast<uint64_t>(req.offset),
+                           length, isResident(node)});
+    }
+
+    sort(pending.begin(), pending.end(), [](const Pending &a, const Pending &b) {
+        return a.fileOffset < b.fileOffset;
+    });
+
+    // Non-resident ranges are coalesced into runs; small holes between
+    // neighbouring lumps are read into a throwaway buffer rather than
+    // splitting the run into separate syscalls.
+    const uint64_t maxGap = 4096;
+    vector<char> hole;
+    vector<iovec> iov;
+    vector<size_t> runMembers;
+    uint64_t runStart = 0, runEnd = 0;
+
+    auto flushRun = [&]() {
+        if (iov.empty()) return;
+        ssize_t r = preadv(fileDescriptor, iov.data(), static_cast<int>(iov.size()),
+                           static_cast<off_t>(runStart));
+        for (size_t m : runMembers) {
+            const Pending &p = pending[m];
+            ReadRequest &req = requests[p.index];
+            if (r < 0) continue;
+            ssize_t got = r - static_cast<ssize_t>(p.fileOffset - runStart);
+            req.result = max<int64_t>(0, min<int64_t>(got, p.length));
+            succeeded++;
+        }
+        iov.clear();
+        runMembers.clear();
+    };
+
+    for (size_t m = 0; m < pending.size(); m++) {
+        const Pending &p = pending[m];
+        ReadRequest &req = requests[p.index];
+
+        if (p.resident) {
+            memcpy(req.buffer, bytesOf(p.node) + req.offset, static_cast<size_t>(p.length));
+            req.result = p.length;
+            succeeded++;
+            continue;
+        }
+
+        if (!iov.empty() &&
+            (p.fileOffset < runEnd || p.fileOffset - runEnd > maxGap || iov.size() + 2 > IOV_MAX))
+            flushRun();
+
+        if (iov.empty()) {
+            runStart = p.fileOffset;
+            runEnd = p.fileOffset;
+        }
 
-    return toCopy;
+        if (p.fileOffset > runEnd) {
+            hole.resize(maxGap);
+            iov.push_back({hole.data(), static_cast<size_t>(p.fileOffset - runEnd)});
+        }
+        iov.push_back({req.buffer, static_cast<size_t>(p.length)});
+        runMembers.push_back(m);
+        runEnd = p.fileOffset + static_cast<uint64_t>(p.length);
+    }
+    flushRun();
+
+    return succeeded;
 }
 
 int Wad::getDirectory(const string &path, vector<string> *directory) {
@@ -96,7 +310,7 @@ int Wad::getDirectory(const string &path, vector<string> *directory) {
     directory->clear();
 
     for (Node* child : node->children) {
-        directory->push_back(this->cleanName(child->name));
+        directory->push_back(child->base.str());
     }
     return static_cast<int>(directory->size());
 }
@@ -106,6 +320,8 @@ int Wad::getDirectory(const string &path, vector<string> *directory) {
 
 // Setters
 void Wad::createDirectory(const string &path) {
+    if (readOnly) return;
+
     // Normalize the path 
     string cleaned = path;
 
@@ -122,23 +338,23 @@ void Wad::createDirectory(const string &path) {
     if (parts.empty())
         return;
 
+    // Components longer than a lump name can never match or be created
+    vector<LumpName> names(parts.size());
+    for (size_t i = 0; i < parts.size(); i++) {
+        if (!LumpName::fromString(parts[i], &names[i]))
+            return;
+    }
+
     // Check *parents* first
     {
         Node* temp = root;
 
-        for (size_t i = 0; i < parts.size() - 1; i++) {
-            const string &comp = parts[i];
+        for (size_t i = 0; i < names.size() - 1; i++) {
             bool found = false;
 
             // Walk children
             for (Node* c : temp->children) {
-                string name = c->name;
-
-                // Strip "_START"
-                if (name.size() > 6 && name.substr(name.size() - 6) == "_START")
-                    name = name.substr(0, name.size() - 6);
-
-                if (c->isDirectory && name == comp) {
+                if (c->isDirectory && c->base == names[i]) {
                     found = true;
                     temp = c;
                     break;
@@ -150,17 +366,17 @@ void Wad::createDirectory(const string &path) {
             }
 
             // Cannot create inside a map directory
-            if (isMapMarker(comp)) {
+            if (classify(names[i]) & MapMarker) {
                 return;
             }
         }
     }
 
     // The directory we want to create
-    const string &last = parts.back();
+    LumpName last = names.back();
 
     // Cannot create inside a map directory
-    if (isMapMarker(last)) {
+    if (classify(last) & MapMarker) {
         return;
     }
 
@@ -169,25 +385,21 @@ void Wad::createDirectory(const string &path) {
         return;
     }
 
+    static const LumpName startSuffix = LumpName::literal("_START");
+
     // Finally, we create directory
     Node* curr = root;
     string absPath;
 
-    for (const string &component : parts) {
+    for (size_t i = 0; i < parts.size(); i++) {
         absPath += "/";
-        absPath += component;
+        absPath += parts[i];
 
         Node* next = nullptr;
 
         // Find existing directory
         for (Node* c : curr->children) {
-            string name = c->name;
-
-            // Strip "_START"
-            if (name.size() > 6 && name.substr(name.size() - 6) == "_START")
-                name = name.substr(0, name.size() - 6);
-
-            if (c->isDirectory && name == component) {
+            if (c->isDirectory && c->base == names[i]) {
                 next = c;
                 break;
             }
@@ -195,14 +407,14 @@ void Wad::createDirectory(const string &path) {
 
         // Create if missing
         if (!next) {
-            string nodeName = component + "_START";
-
-            next = new Node(nodeName, true);
+            LumpName start = names[i].append(startSuffix);
+            next = new Node(start, true, classify(start));
             next->parent = curr;
             curr->children.push_back(next);
 
             next->offset = 0;
-            pathMap[absPath] = next;
+            pathMap.set(absPath, next);
+            generation++;
         }
 
         curr = next;
@@ -212,7 +424,7 @@ void Wad::createDirectory(const string &path) {
 }
 
 void Wad::createFile(const string &path) {
-    if (path.empty()) return;
+    if (path.empty() || readOnly) return;
 
     // Normalize
     string cleaned = path;
@@ -225,8 +437,10 @@ void Wad::createFile(const string &path) {
     vector<string> parts = tokenize(cleaned);
     if (parts.empty()) return;
 
-    // Filename is last component
-    string filename = parts.back();
+    // Filename is last component; enforce maximum lump name length (8 chars)
+    LumpName filename;
+    if (!LumpName::fromString(parts.back(), &filename))
+        return;
     parts.pop_back();
 
     // Build parent path
@@ -250,9 +464,8 @@ void Wad::createFile(const string &path) {
         return;
     }
 
-    // Cant create stuff in E#M# directories
-    string parentNameStripped = cleanName(parent->name);
-    if (isMapMarker(parentNameStripped)) return;
+    // Cant create stuff in map directories
+    if (parent->flags & MapMarker) return;
 
     for (Node* c : parent->children) {
         if (!c) continue;
@@ -261,25 +474,14 @@ void Wad::createFile(const string &path) {
             return;
         }
         // Also reject if a directory exists with same base name (e.g., "foo" and "foo_START")
-        if (c->isDirectory) {
-            string childBase = cleanName(c->name);
-            if (childBase == filename) return;
-        }
+        if (c->isDirectory && c->base == filename) return;
     }
 
     // cant make map markers
-    if (isMapMarker(filename))
-        return;
-
-    // WAD rule checks
-
-    // Enforce maximum lump name length (8 chars)
-    if (filename.size() > 8)
+    if (classify(filename) & MapMarker)
         return;
 
-
-
-    Node* fileNode = new Node(filename, false);
+    Node* fileNode = new Node(filename, false, classify(filename));
     fileNode->parent = parent;
     fileNode->offset = 0; 
     fileNode->length = 0;
@@ -287,14 +489,16 @@ void Wad::createFile(const string &path) {
     parent->children.push_back(fileNode);
 
     string fullPath;
-    if (parentPath == "/") fullPath = "/" + filename;
-    else fullPath = parentPath + "/" + filename;
-    pathMap[fullPath] = fileNode;
+    if (parentPath == "/") fullPath = "/" + filename.str();
+    else fullPath = parentPath + "/" + filename.str();
+    pathMap.set(fullPath, fileNode);
+    indexName(fileNode);
+    generation++;
 
     // printTree(); // Debug
 }
 
-int Wad::writeToFile(const string &path, const char *buffer, int length, int offset) {
+int64_t Wad::writeToFile(const string &path, const char *buffer, int64_t length, int64_t offset) {
     // validation
     if (path.empty()) return -1;
     if (!buffer && length > 0) return -1; // nothing to copy
@@ -305,22 +509,94 @@ int Wad::writeToFile(const string &path, const char *buffer, int length, int off
     if (!node) return -1;
     if (node->isDirectory) return -1;
 
+    return writeNode(node, buffer, length, offset);
+}
+
+int Wad::truncateFile(const string &path) {
+    Node* node = lookupNode(path);
+    if (!node || node->isDirectory || readOnly) return -1;
+
+    if (cacheBytes) forget(node);
+    vector<char>().swap(node->data);
+    node->length = 0;
+    generation++;
+    return 0;
+}
+
+void Wad::setCompressed(bool compressed) {
+    if (compressed == packOnSave || readOnly) return;
+    packOnSave = compressed;
+    generation++;
+}
+
+void Wad::setExtended(bool wide) {
+    if (wide == extendOnSave || readOnly) return;
+    extendOnSave = wide;
+    generation++;
+}
+
+Wad::LumpHandle Wad::open(const string &path) const {
+    Node* node = lookupNode(path);
+    if (!node || node->isDirectory) return InvalidHandle;
+    return static_cast<LumpHandle>(reinterpret_cast<uintptr_t>(node));
+}
+
+int64_t Wad::size(LumpHandle handle) const {
+    Node* node = fromHandle(handle);
+    if (!node) return -1;
+    return static_cast<int64_t>(node->length);
+}
+
+int64_t Wad::read(LumpHandle handle, char *buffer, int64_t length, int64_t offset) {
+    if (!buffer || length <= 0) return -1;
+    Node* node = fromHandle(handle);
+    if (!node) return -1;
+    return readNode(node, buffer, length, offset);
+}
+
+bool Wad::readAll(LumpHandle handle, vector<char> *out) {
+    Node* node = fromHandle(handle);
+    if (!node || !out) return false;
+
+    out->resize(node->length);
+    if (node->length == 0) return true;
+    return readNode(node, out->data(), static_cast<int64_t>(node->length), 0) ==
+           static_cast<int64_t>(node->length);
+}
+
+int64_t Wad::write(LumpHandle handle, const char *buffer, int64_t length, int64_t offset) {
+    if (!buffer && length > 0) return -1;
+    if (length < 0 || offset < 0) return -1;
+    Node* node = fromHandle(handle);
+    if (!node) return -1;
+    return writeNode(node, buffer, length, offset);
+}
+
+int64_t Wad::writeNode(Node* node, const char *buffer, int64_t length, int64_t offset) {
+    if (readOnly) return -1;
+
     // file not empty, cannot write
     if (node->length > 0) return 0;
 
     // nothing to write
     if (length == 0) return 0;
+    if (offset > MaxLumpSize - length) return -1;
 
     // fix size of file data buffer if necessary
     size_t requiredSize = static_cast<size_t>(offset) + static_cast<size_t>(length);
     if (node->data.size() < requiredSize) {
-        node->data.resize(requiredSize);
+        try {
+            node->data.resize(requiredSize);
+        } catch (const bad_alloc &) {
+            return -1;
+        }
     }
 
     // Copy bytes from buffer into node->data
     memcpy(node->data.data() + offset, buffer, static_cast<size_t>(length));
     // Update node length
-    node->length = static_cast<uint32_t>(node->data.size());
+    node->length = node->data.size();
+    generation++;
 
     return length;
 }
@@ -333,63 +609,282 @@ void Wad::loadHeader() {
     if (fileDescriptor < 0) return;
     
     // Header layout: 4-byte magic, 4-byte = uint32 descriptor count, 4-byte = uint32 descriptor offset
-    lseek(fileDescriptor, 0, SEEK_SET);
-
-    char magicBuf[4];
-    ssize_t r = read(fileDescriptor, magicBuf, 4);
-    if (r != 4) return;
-    magic.assign(magicBuf, 4);
-
-    uint32_t count = 0;
-    uint32_t offset = 0;
-    r = read(fileDescriptor, &count, sizeof(count));
-    if (r != (ssize_t)sizeof(count)) return;
-    r = read(fileDescriptor, &offset, sizeof(offset));
-    if (r != (ssize_t)sizeof(offset)) return;
+    char header[ExtendedHeaderSize];
+    ssize_t r = pread(fileDescriptor, header, sizeof(header), 0);
+    if (r < 4) return;
+    magic.assign(header, 4);
+
+    if (memcmp(header, ExtendedMagic, 4) == 0) {
+        // set first so an extended header this cannot read is never saved over
+        extended = true;
+        extendOnSave = true;
+        uint32_t version;
+        memcpy(&version, header + 4, 4);
+        if (r != (ssize_t)sizeof(header) || version != ExtendedVersion) {
+            readOnly = true;
+            return;
+        }
+        magic.assign(header + 8, 4);
+        memcpy(&descriptorCount, header + 16, 8);
+        memcpy(&descriptorOffset, header + 24, 8);
+        directoryCrc = crc32c(header, ExtendedHeaderSize);
+        return;
+    }
+    if (r < (ssize_t)ClassicHeaderSize) return;
 
+    uint32_t count, offset;
+    memcpy(&count, header + 4, 4);
+    memcpy(&offset, header + 8, 4);
     descriptorCount = count;
     descriptorOffset = offset;
+    directoryCrc = crc32c(header, ClassicHeaderSize);
 }
 
 void Wad::loadDescriptors() {
     if (fileDescriptor < 0 || descriptorCount == 0) return;
 
-    lseek(fileDescriptor, static_cast<off_t>(descriptorOffset), SEEK_SET);
+    // Whole table in one read; each entry: offset (4), length (4), name (8),
+    // or with the extended header offset (8), length (8), name (8)
+    size_t entrySize = extended ? 24 : 16;
+    // no bigger than what the file can hold, so a bogus count is a short table
+    struct stat st;
+    if (fstat(fileDescriptor, &st) != 0 || descriptorOffset >= static_cast<uint64_t>(st.st_size)) return;
+    uint64_t fits = (static_cast<uint64_t>(st.st_size) - descriptorOffset) / entrySize;
+    vector<char> table(static_cast<size_t>(min(descriptorCount, fits)) * entrySize);
+    ssize_t r = pread(fileDescriptor, table.data(), table.size(),
+                      static_cast<off_t>(descriptorOffset));
+    if (r <= 0) return;
+    size_t count = static_cast<size_t>(r) / entrySize; // a short read keeps the complete entries
+    directoryCrc = crc32c(table.data(), count * entrySize, directoryCrc); // continues loadHeader()'s
 
     descriptors.clear();
-    descriptors.reserve(descriptorCount);
+    descriptors.reserve(count);
 
-    for (uint32_t i = 0; i < descriptorCount; ++i) {
+    for (size_t i = 0; i < count; ++i) {
+        const char *entry = table.data() + i * entrySize;
         Descriptor d;
-        ssize_t r = read(fileDescriptor, &d.offset, sizeof(d.offset));
-        if (r != (ssize_t)sizeof(d.offset)) break;
-        r = read(fileDescriptor, &d.length, sizeof(d.length));
-        if (r != (ssize_t)sizeof(d.length)) break;
+        if (extended) {
+            memcpy(&d.offset, entry, 8);
+            memcpy(&d.length, entry + 8, 8);
+        } else {
+            uint32_t offset, length;
+            memcpy(&offset, entry, 4);
+            memcpy(&length, entry + 4, 4);
+            d.offset = offset;
+            d.length = length;
+        }
+        d.name = LumpName::fromBytes(entry + entrySize - 8);
+        d.block = 0;
+        descriptors.push_back(d);
+    }
+}
 
-        char nameBytes[8];
-        r = read(fileDescriptor, nameBytes, 8);
-        if (r != 8) break;
+void Wad::loadContainer() {
+    // set first so a container this cannot read is never saved over
+    packed = true;
+    packOnSave = true;
+
+    char header[ContainerHeaderSize];
+    if (pread(fileDescriptor, header, sizeof(header), 0) != (ssize_t)sizeof(header)) return;
+
+    uint32_t version, lumpCount, size, blockCount;
+    uint64_t indexOffset;
+    memcpy(&version, header + 4, 4);
+    memcpy(&lumpCount, header + 12, 4);
+    memcpy(&size, header + 16, 4);
+    memcpy(&blockCount, header + 20, 4);
+    memcpy(&indexOffset, header + 24, 8);
+    if (version != ContainerVersion || size == 0 || size > DefaultBlockSize) return;
+
+    // The index must lie within the file before anything is allocated for
+    // it, so a truncated or crafted header fails here
+    struct stat st;
+    if (fstat(fileDescriptor, &st) != 0) return;
+    uint64_t fileSize = static_cast<uint64_t>(st.st_size);
+    uint64_t indexSize = static_cast<uint64_t>(lumpCount) * ContainerLumpEntry +
+                         static_cast<uint64_t>(blockCount) * ContainerBlockEntry;
+    if (indexOffset > fileSize || indexSize > fileSize - indexOffset) return;
+
+    magic.assign(header + 8, 4);
+    blockSize = size;
+    descriptorCount = lumpCount;
+
+    vector<char> index(indexSize);
+    if (pread(fileDescriptor, index.data(), index.size(), static_cast<off_t>(indexOffset)) !=
+        static_cast<ssize_t>(index.size()))
+        return;
 
-        int nlen = 8;
-        while (nlen > 0 && (nameBytes[nlen - 1] == '\0' || nameBytes[nlen - 1] == ' '))
-            --nlen;
+    directoryCrc = crc32c(index.data(), index.size(), crc32c(header, sizeof(header)));
+
+    const char *entry = index.data() + static_cast<size_t>(lumpCount) * ContainerLumpEntry;
+    // blocks sit between the header and the index; the index ends at the
+    // first one that does not, and the lumps that need it with it
+    blocks.resize(blockCount);
+    for (uint32_t i = 0; i < blockCount; ++i) {
+        Block &b = blocks[i];
+        memcpy(&b.offset, entry, 8);
+        memcpy(&b.size, entry + 8, 4);
+        entry += ContainerBlockEntry;
+        if (b.offset < ContainerHeaderSize || b.offset > indexOffset || b.size > indexOffset - b.offset) {
+            blocks.resize(i);
+            break;
+        }
+    }
 
-        bool hasSlash = (nlen > 0 && nameBytes[nlen - 1] == '/');
-        if (hasSlash) --nlen;
+    // lumps whose blocks are not all in the index end the directory, as a
+    // short table does for a plain WAD
+    descriptors.clear();
+    descriptors.reserve(lumpCount);
+    for (uint32_t i = 0; i < lumpCount; ++i) {
+        entry = index.data() + static_cast<size_t>(i) * ContainerLumpEntry;
+        Descriptor d;
+        memcpy(&d.offset, entry, 8);
+        memcpy(&d.length, entry + 8, 8);
+        d.name = LumpName::fromBytes(entry + 16);
+        memcpy(&d.block, entry + 24, 4);
+        uint64_t needed = (d.length + blockSize - 1) / blockSize;
+        if (d.block + needed > blocks.size()) break;
+        descriptors.push_back(d);
+    }
+}
 
-        d.name.assign(nameBytes, nameBytes + nlen);
-        if (hasSlash) d.name += '/';
+// pread() until `length` bytes, end of file or an error; a single call
+// moves at most about 2 GB
+static ssize_t readFully(int fd, char *buffer, size_t length, off_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t r = pread(fd, buffer + done, length - done, offset + static_cast<off_t>(done));
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) return -1;
+        if (r == 0) break;
+        done += static_cast<size_t>(r);
+    }
+    return static_cast<ssize_t>(done);
+}
 
-        descriptors.push_back(d);
+// Reads a file-ordered slice of lump requests, merging lumps that sit back
+// to back on disk into a single preadv()
+static void readSlice(IoRequest **reqs, size_t count) {
+    size_t i = 0;
+    while (i < count) {
+        size_t j = i + 1;
+        size_t runBytes = reqs[i]->length;
+        while (j < count && j - i < IOV_MAX &&
+               reqs[j]->offset == reqs[j - 1]->offset + static_cast<off_t>(reqs[j - 1]->length)) {
+            runBytes += reqs[j]->length;
+            j++;
+        }
+
+        vector<iovec> iov(j - i);
+        for (size_t k = i; k < j; k++)
+            iov[k - i] = {reqs[k]->buffer, reqs[k]->length};
+
+        ssize_t r = preadv(reqs[i]->fd, iov.data(), static_cast<int>(iov.size()), reqs[i]->offset);
+        if (r == static_cast<ssize_t>(runBytes)) {
+            for (size_t k = i; k < j; k++)
+                reqs[k]->result = static_cast<ssize_t>(reqs[k]->length);
+        } else {
+            // short or failed run: settle each lump on its own
+            for (size_t k = i; k < j; k++) {
+                ssize_t one = readFully(reqs[k]->fd, static_cast<char*>(reqs[k]->buffer),
+                                        reqs[k]->length, reqs[k]->offset);
+                reqs[k]->result = one < 0 ? -errno : one;
+            }
+        }
+        i = j;
+    }
+}
+
+void Wad::startFileData(unsigned threads) {
+    lumpBuffers.assign(descriptors.size(), vector<char>());
+    lumpOwners.assign(descriptors.size(), nullptr);
+    lumpReads.clear();
+    lumpReads.reserve(descriptors.size()); // engine holds pointers into this
+
+    for (size_t i = 0; i < descriptors.size(); ++i) {
+        const Descriptor &d = descriptors[i];
+        if (d.length == 0) continue;
+
+        lumpBuffers[i].resize(d.length);
+        lumpReads.push_back({fileDescriptor, false, lumpBuffers[i].data(), d.length,
+                             static_cast<off_t>(d.offset), 0});
+    }
+    if (lumpReads.empty()) return;
+
+    // Issue in file order, whatever order the directory lists lumps in
+    lumpOrder.resize(lumpReads.size());
+    for (size_t i = 0; i < lumpReads.size(); ++i)
+        lumpOrder[i] = &lumpReads[i];
+    sort(lumpOrder.begin(), lumpOrder.end(), [](const IoRequest *a, const IoRequest *b) {
+        return a->offset < b->offset;
+    });
+
+    off_t spanStart = lumpOrder.front()->offset;
+    off_t spanEnd = spanStart;
+    size_t totalBytes = 0;
+    for (const IoRequest *r : lumpOrder) {
+        spanEnd = max(spanEnd, r->offset + static_cast<off_t>(r->length));
+        totalBytes += r->length;
+    }
+    posix_fadvise(fileDescriptor, spanStart, spanEnd - spanStart, POSIX_FADV_WILLNEED);
+
+    // io_uring keeps the reads in flight while the tree is built, but
+    // submit() blocks whenever the ring is full, so one loader feeds it;
+    // nothing else uses the engine until loadFileData() has joined it
+    if (io->kind() == IoEngine::Uring) {
+        auto submitAll = [this]() {
+            for (IoRequest *r : lumpOrder) {
+                io->submit(r);
+                readsIssued.fetch_add(1, memory_order_relaxed);
+            }
+        };
+        try {
+            loaders.emplace_back(submitAll);
+        } catch (const system_error &) {
+            submitAll();
+        }
+        return;
+    }
+
+    // Otherwise a pool of workers each takes one contiguous, byte-balanced
+    // slice of the file-ordered list; a slice no thread could be started
+    // for is read here instead
+    if (threads == 0) threads = 1;
+    size_t perWorker = totalBytes / threads + 1;
+    size_t begin = 0, acc = 0;
+    for (size_t i = 0; i < lumpOrder.size(); ++i) {
+        acc += lumpOrder[i]->length;
+        if (acc >= perWorker || i + 1 == lumpOrder.size()) {
+            auto slice = [this, first = lumpOrder.data() + begin, count = i + 1 - begin]() {
+                readSlice(first, count);
+                readsIssued.fetch_add(count, memory_order_relaxed);
+            };
+            try {
+                loaders.emplace_back(slice);
+            } catch (const system_error &) {
+                slice();
+            }
+            begin = i + 1;
+            acc = 0;
+        }
     }
 }
 
 void Wad::buildTree() {
+    if (format == GameFormat::Auto)
+        format = detectFormat(descriptors.size(), [&](size_t i) { return descriptors[i].name; });
+    withFormat(format, [&](auto rules) { buildTreeAs<decltype(rules)>(); });
+}
+
+template <typename Rules>
+void Wad::buildTreeAs() {
     // Reset state
-    root = new Node("", true);
+    root = new Node(LumpName(), true, 0);
     root->parent = nullptr;
     pathMap.clear();
-    pathMap["/"] = root;
+    pathMap.reserve(descriptors.size() + 1);
+    pathMap.set("/", root);
+    nameIndex.clear();
 
     vector<Node*> stack;
     stack.push_back(root);
@@ -397,144 +892,244 @@ void Wad::buildTree() {
     auto addPath = [&](Node* n) {
         string abs = "";
         Node* cur = n;
-        vector<string> parts;
+        vector<LumpName> parts;
         while (cur && cur != root) {
-            string cleaned = this->cleanName(cur->name);
-            if (!cleaned.empty())  // skip empty names
-                parts.push_back(cleaned);
+            if (!cur->base.empty())  // skip empty names
+                parts.push_back(cur->base);
             cur = cur->parent;
         }
         for (auto it = parts.rbegin(); it != parts.rend(); ++it) {
-            if (!abs.empty())
-                abs += "/";
-            abs += *it;
+            abs += "/";
+            abs += it->str();
         }
         if (abs.empty()) abs = "/";
-        else abs = "/" + abs;  // ensure leading slash
-        pathMap[abs] = n;
-    };
-
-    auto isNamespaceStart = [](const string& nm) {
-        return nm.size() > 6 && nm.compare(nm.size() - 6, 6, "_START") == 0;
-    };
-    auto isNamespaceEnd = [](const string& nm) {
-        return nm.size() > 4 && nm.compare(nm.size() - 4, 4, "_END") == 0;
-    };
-
-    auto isEMDirectory = [&](size_t i) {
-        if (!isMapMarker(descriptors[i].name)) return false;
-        if (i + 1 >= descriptors.size()) return true; // last descriptor = directory
-        const Descriptor &cur  = descriptors[i];
-        const Descriptor &next = descriptors[i + 1];
-        bool nextIsNamespaceStart = isNamespaceStart(next.name);
-        bool offsetMismatch = (next.offset != cur.offset + cur.length);
-        bool zeroLengthMarker = (cur.length == 0);
-        return nextIsNamespaceStart || offsetMismatch || zeroLengthMarker;
+        pathMap.set(abs, n);
     };
 
-    for (size_t i = 0; i < descriptors.size(); ++i) {
+    // placeLumps() decides the shape, as it does for diff()
+    auto descriptorAt = [&](size_t i) -> const Descriptor & { return descriptors[i]; };
+    placeLumps<Rules>(descriptors.size(), descriptorAt, [&](Placed what, size_t i, uint8_t flags) {
         const Descriptor &d = descriptors[i];
-        const string &name = d.name;
-
-        // Close EM directories if necessary
-        while (stack.size() > 1) {
-            Node* top = stack.back();
-            if (!(top->isDirectory && isMapMarker(top->name))) break;
-            if (isNamespaceStart(name)) { stack.pop_back(); continue; }
-            if (top->children.empty()) break;
-            Node* lastChild = top->children.back();
-            if (!lastChild->isDirectory && d.offset != lastChild->offset + lastChild->length) {
-                stack.pop_back();
-                continue;
-            }
+        switch (what) {
+        case Placed::Close:
+            stack.pop_back();
             break;
-        }
-
-        // Namespace start → directory
-        if (isNamespaceStart(name)) {
-            Node* dir = new Node(name, true);
+        case Placed::End:
+            break;
+        case Placed::Directory: {
+            Node* dir = new Node(d.name, true, flags);
             dir->parent = stack.back();
             stack.back()->children.push_back(dir);
             stack.push_back(dir);
             addPath(dir);
-            continue;
+            break;
         }
-
-        // Namespace end → pop matching start
-        if (isNamespaceEnd(name)) {
-            string target = name.substr(0, name.size()-4); // remove _END
-
-            while (stack.size() > 1) { // don't pop root
-                Node* top = stack.back();
-                string topNameClean = this->cleanName(top->name);
-                if (topNameClean == target) {
-                    stack.pop_back();
-                    break;
-                } else {
-                    stack.pop_back();
-                }
+        case Placed::File: {
+            // it adopts the buffer its queued read is filling
+            Node* file = new Node(d.name, false, flags);
+            file->parent = stack.back();
+            file->offset = d.offset;
+            file->length = d.length;
+            file->block = d.block;
+            if (i < lumpBuffers.size()) {
+                file->data.swap(lumpBuffers[i]);
+                lumpOwners[i] = file;
             }
-            continue;
+            stack.back()->children.push_back(file);
+            addPath(file);
+            indexName(file);
+            break;
         }
+        }
+    });
+}
 
-        // EM directories
-        if (isEMDirectory(i)) {
-            Node* dir = new Node(name, true);
-            dir->parent = stack.back();
-            stack.back()->children.push_back(dir);
-            stack.push_back(dir);
-            addPath(dir);
-            continue;
+void Wad::loadFileData()
+{
+    for (thread &t : loaders)
+        t.join();
+    loaders.clear();
+    io->wait();
+
+    // containers queue no reads at load
+    size_t r = 0;
+    for (size_t i = 0; i < lumpOwners.size(); ++i) {
+        if (descriptors[i].length == 0) continue;
+        const IoRequest &req = lumpReads[r++];
+        Node* node = lumpOwners[i];
+        if (node && req.result < 0) {
+            errno = static_cast<int>(-req.result);
+            perror("pread");
+            node->data.clear();
         }
+    }
+
+    // marker descriptors that carried bytes never got an owner
+    lumpBuffers.clear();
+    lumpOwners.clear();
+    lumpReads.clear();
+    lumpOrder.clear();
+}
+
+Wad::Node* Wad::fromHandle(LumpHandle handle) {
+    // handles are only ever minted by open(), from live content nodes
+    return reinterpret_cast<Node*>(static_cast<uintptr_t>(handle));
+}
+
+bool Wad::isResident(const Node* node) {
+    return node->view || node->data.size() == static_cast<size_t>(node->length);
+}
+
+const char* Wad::bytesOf(const Node* node) {
+    return node->view ? node->view : node->data.data();
+}
+
+bool Wad::makeResident(Node* node) {
+    if (cacheBytes) return holdResident(node);
+    if (isResident(node)) return true;
+
+    vector<char> bytes;
+    if (!fetchLump(node, &bytes)) return false;
+    node->data.swap(bytes);
+    return true;
+}
 
-        // Regular file
-        Node* file = new Node(name, false);
-        file->parent = stack.back();
-        file->offset = d.offset;
-        file->length = d.length;
-        stack.back()->children.push_back(file);
-        addPath(file);
+bool Wad::fetchLump(Node* node, vector<char> *bytes) {
+    prefetchGroup(node);
+    bytes->resize(node->length);
+    if (packed)
+        return readBlocks(node, bytes->data(), static_cast<int64_t>(bytes->size()), 0) ==
+               static_cast<int64_t>(bytes->size());
+    return readFully(fileDescriptor, bytes->data(), bytes->size(), static_cast<off_t>(node->offset)) ==
+           static_cast<ssize_t>(bytes->size());
+}
+
+int64_t Wad::readNode(Node* node, char *buffer, int64_t length, int64_t offset) {
+    // Out-of-range offset means no bytes available
+    if (offset < 0 || static_cast<uint64_t>(offset) >= node->length)
+        return 0;
+
+    // Compute how many bytes we can copy
+    int64_t available = static_cast<int64_t>(node->length) - offset;
+    int64_t toCopy = min(length, available);
+
+    if (cacheBytes && !node->view) {
+        if (readCached(node, buffer, toCopy, offset)) return toCopy;
+    } else if (isResident(node)) {
+        memcpy(buffer, bytesOf(node) + offset, static_cast<size_t>(toCopy));
+        return toCopy;
     }
+
+    prefetchGroup(node);
+    if (packed) return readBlocks(node, buffer, toCopy, offset);
+
+    // bytes were never loaded (or the load failed): go to the file
+    ssize_t r = readFully(fileDescriptor, buffer, static_cast<size_t>(toCopy),
+                          static_cast<off_t>(node->offset + offset));
+    if (r < 0) return -1;
+    return r;
 }
 
-void Wad::loadFileData()
-{
-    for (auto &pair : pathMap)
-    {
-        Node* node = pair.second;
-        if (!node->isDirectory && node->length > 0)
-        {
-            node->data.resize(node->length);
-            off_t off = static_cast<off_t>(node->offset);
-
-            ssize_t r = pread(fileDescriptor, node->data.data(), node->length, off);
-            if (r < 0) {
-                perror("pread");
-                node->data.clear();
-            }
+void Wad::prefetchGroup(Node* node) {
+    Node* dir = node->parent;
+    if (!prefetch || !dir || dir == root) return;
+    if (__atomic_exchange_n(&dir->prefetched, true, __ATOMIC_RELAXED)) return;
+
+    // The directory's lumps still on disk, as runs of (nearly) adjacent
+    // byte ranges; a container's are their blocks, stored in the same order.
+    // With a cache, admit() and makeRoom() swap lumps' bytes under
+    // cacheLock, so residency is read under it and the advice given after
+    const uint64_t maxGap = 64 * 1024;
+    vector<pair<uint64_t, uint64_t>> runs;
+    uint64_t runStart = 0, runEnd = 0;
+    auto flush = [&]() {
+        if (runEnd > runStart) runs.push_back({runStart, runEnd - runStart});
+    };
+    unique_lock<mutex> guard(cacheLock, defer_lock);
+    if (cacheBytes) guard.lock();
+    for (const Node* c : dir->children) {
+        if (c->isDirectory || c->length == 0 || isResident(c)) continue;
+        uint64_t from = c->offset, to = c->offset + c->length;
+        if (packed) {
+            uint64_t last = c->block + (c->length - 1) / blockSize;
+            if (last >= blocks.size()) continue;
+            from = blocks[c->block].offset;
+            to = blocks[last].offset + blocks[last].size;
+        }
+        if (runEnd > runStart && from >= runStart && from <= runEnd + maxGap) {
+            runEnd = max(runEnd, to);
+            continue;
         }
+        flush();
+        runStart = from;
+        runEnd = to;
     }
+    flush();
+    if (guard.owns_lock()) guard.unlock();
+
+    for (const auto &run : runs)
+        posix_fadvise(fileDescriptor, static_cast<off_t>(run.first), static_cast<off_t>(run.second),
+                      POSIX_FADV_WILLNEED);
+}
+
+int64_t Wad::readBlocks(const Node* node, char *buffer, int64_t length, int64_t offset) {
+    // A lump's blocks are stored back to back, so the ones the range
+    // touches come in with one read; each is then decoded on its own
+    if (length == 0) return 0;
+    uint64_t first = static_cast<uint64_t>(offset) / blockSize;
+    uint64_t last = static_cast<uint64_t>(offset + length - 1) / blockSize;
+    if (node->block + last >= blocks.size()) return -1;
+
+    const Block &begin = blocks[node->block + first];
+    const Block &end = blocks[node->block + last];
+    if (end.offset < begin.offset) return -1;
+    vector<char> stored(end.offset + end.size - begin.offset);
+    if (readFully(fileDescriptor, stored.data(), stored.size(), static_cast<off_t>(begin.offset)) !=
+        static_cast<ssize_t>(stored.size()))
+        return -1;
+
+    vector<char> scratch;
+    for (uint64_t b = first; b <= last; b++) {
+        const Block &block = blocks[node->block + b];
+        uint64_t rawStart = b * blockSize;
+        uint32_t rawSize = static_cast<uint32_t>(min<uint64_t>(blockSize, node->length - rawStart));
+        if (block.offset < begin.offset || block.offset + block.size - begin.offset > stored.size())
+            return -1;
+        const char *in = stored.data() + (block.offset - begin.offset);
+
+        // the part of this block the caller wants
+        uint64_t from = max(rawStart, static_cast<uint64_t>(offset));
+        uint64_t to = min(rawStart + rawSize, static_cast<uint64_t>(offset + length));
+        char *dest = buffer + (from - static_cast<uint64_t>(offset));
+
+        if (block.size == rawSize) {
+            memcpy(dest, in + (from - rawStart), to - from);
+        } else if (from == rawStart && to == rawStart + rawSize) {
+            if (!lzDecompress(in, block.size, dest, rawSize)) return -1;
+        } else {
+            scratch.resize(rawSize);
+            if (!lzDecompress(in, block.size, scratch.data(), rawSize)) return -1;
+            memcpy(dest, scratch.data() + (from - rawStart), to - from);
+        }
+    }
+    return length;
 }
 
 Wad::Node* Wad::lookupNode(const string &path) const {
+    // Paths as callers usually pass them are looked up as they are
+    if (!path.empty() && path[0] == '/' && (path.size() == 1 || path.back() != '/'))
+        return pathMap.find(path);
+
     // Normalize: ensure leading '/', remove trailing '/' (except root)
     string p = path;
     if (p.empty()) p = "/";
     if (p[0] != '/') p = string("/") + p;
     if (p.size() > 1 && p.back() == '/') p.pop_back();
-
-    auto it = pathMap.find(p);
-    if (it == pathMap.end()) return nullptr;
-    return it->second;
+    return pathMap.find(p);
 }
 
-bool Wad::isMapMarker(const string &name) const {
-    // If your WAD uses E#M# markers as maps:
-    if (name.size() == 4 && name[0] == 'E' && isdigit(name[1]) &&
-        name[2] == 'M' && isdigit(name[3])) {
-        return true;
-    }
-    return false;
+uint8_t Wad::classify(LumpName name) const {
+    return classifyLump(format, name);
 }
 
 vector<string> Wad::tokenize(const string &path) const {
@@ -593,120 +1188,269 @@ vector<string> Wad::tokenize(const string &path) const {
 //     rec(root, 0);
 // }
 
-void Wad::saveWad() {
-    if (!root) return;
-
-    vector<Descriptor> newDescriptors;
-    vector<uint8_t> newLumpData;
+// Directory order and offsets a save writes: each directory becomes its
+// marker (plus an _END for namespaces) and lump data follows the header
+// back to back. owners[i] is the node layout[i] takes its bytes from.
+uint64_t Wad::layoutTree(vector<Descriptor> *layout, vector<Node*> *owners, uint32_t headerSize) {
+    uint64_t lumpDataSize = 0;
 
-    const uint32_t headerSize = 12;
-
-    // Recursive writer
-    function<void(Node*)> writeNode = [&](Node* node) {
-        if (!node) return;
+    function<void(Node*)> emit = [&](Node* node) {
+        Descriptor desc;
+        desc.offset = headerSize + lumpDataSize;
+        desc.name = node->name;
+        desc.block = 0;
 
         // DIRECTORY
         if (node->isDirectory) {
-            Descriptor startDesc;
-            // store absolute offset: headerSize + current lump-data size
-            startDesc.offset = headerSize + static_cast<uint32_t>(newLumpData.size());
-            startDesc.length = 0;
-            startDesc.name = node->name;
-            newDescriptors.push_back(startDesc);
+            desc.length = 0;
+            layout->push_back(desc);
+            owners->push_back(nullptr);
 
             for (Node* c : node->children)
-                writeNode(c);
-
-            if (node->name.size() > 6 &&
-                node->name.compare(node->name.size() - 6, 6, "_START") == 0) {
-                Descriptor endDesc;
-                endDesc.offset = headerSize + static_cast<uint32_t>(newLumpData.size());
-                endDesc.length = 0;
-                endDesc.name = node->name.substr(0, node->name.size() - 6) + "_END";
-                newDescriptors.push_back(endDesc);
+                emit(c);
+
+            if (node->flags & NamespaceStart) {
+                static const LumpName endSuffix = LumpName::literal("_END");
+                desc.offset = headerSize + lumpDataSize;
+                desc.name = node->base.append(endSuffix);
+                layout->push_back(desc);
+                owners->push_back(nullptr);
             }
-
             return;
         }
 
         // FILE (LUMP)
-        Descriptor fileDesc;
-        // absolute offset into final file:
-        fileDesc.offset = headerSize + static_cast<uint32_t>(newLumpData.size());
-        fileDesc.length = node->length;
-        fileDesc.name = node->name;
-        newDescriptors.push_back(fileDesc);
-
-        if (node->length > 0) {
-            size_t base = newLumpData.size();
-            newLumpData.resize(base + node->length);
-
-            // Prefer in-memory data if present and sized correctly
-            if (!node->data.empty() &&
-                node->data.size() == static_cast<size_t>(node->length)) {
-                memcpy(&newLumpData[base], node->data.data(), node->length);
-            } else {
-                // fallback: read from original file using node->offset (which is absolute)
-                lseek(fileDescriptor, static_cast<off_t>(node->offset), SEEK_SET);
-                ssize_t r = read(fileDescriptor, &newLumpData[base], node->length);
-                if (r < 0) {
-                    // read error: zero-fill to be safe
-                    fill(&newLumpData[base], &newLumpData[base + node->length], 0);
-                } else if (static_cast<size_t>(r) < static_cast<size_t>(node->length)) {
-                    // partial read: zero the remainder
-                    fill(&newLumpData[base + r], &newLumpData[base + node->length], 0);
-                }
-            }
-        }
+        desc.length = node->length;
+        layout->push_back(desc);
+        owners->push_back(node);
+        lumpDataSize += node->length;
     };
 
-    // start recursive write from root's children
     for (Node* n : root->children)
-        writeNode(n);
+        emit(n);
+    return lumpDataSize;
+}
+
+void Wad::saveWad() {
+    if (!root) return;
+
+    vector<Descriptor> newDescriptors;
+    vector<Node*> owners;
+    uint64_t lumpDataSize = layoutTree(&newDescriptors, &owners, ClassicHeaderSize);
+
+    // Lumps whose bytes never made it into memory are fetched from the
+    // original file before it gets truncated underneath them; a container's
+    // are decompressed
+    deque<IoRequest> fills;
+    for (Node* node : owners) {
+        if (!node || node->length == 0 || isResident(node)) continue;
+        if (packed) {
+            if (!makeResident(node)) node->data.assign(node->length, 0);
+            continue;
+        }
+        node->data.assign(node->length, 0);
+        fills.push_back({fileDescriptor, false, node->data.data(), node->length,
+                         static_cast<off_t>(node->offset), 0});
+        io->submit(&fills.back());
+    }
+    io->wait(); // failed or short reads leave zeros, as before
+
+    if (packOnSave) {
+        saveContainer(newDescriptors, owners);
+        return;
+    }
+
+    // The classic header holds 32-bit offsets; past that, or when asked,
+    // the extended one shifts everything back by its extra 20 bytes
+    bool wide = extendOnSave || ClassicHeaderSize + lumpDataSize > UINT32_MAX;
+    uint32_t headerSize = wide ? ExtendedHeaderSize : ClassicHeaderSize;
+    if (wide) {
+        for (Descriptor &desc : newDescriptors)
+            desc.offset += ExtendedHeaderSize - ClassicHeaderSize;
+    }
 
     // Now write the WAD file
-    int fd = open(wadPath.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    int fd = ::open(wadPath.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0666);
     if (fd < 0) {
         return;
     }
 
-    // Header: magic (4), descriptor count (4), descriptor offset (4)
-    write(fd, magic.data(), 4);
-    uint32_t descriptorCount = static_cast<uint32_t>(newDescriptors.size());
+    // Each lump's bytes are queued straight from its node
+    deque<IoRequest> writes;   // engine holds pointers; deque never moves them
+    for (size_t i = 0; i < owners.size(); i++) {
+        Node* node = owners[i];
+        if (!node || node->length == 0) continue;
+        writes.push_back({fd, true, node->data.data(), node->length,
+                          static_cast<off_t>(newDescriptors[i].offset), 0});
+        io->submit(&writes.back());
+    }
+
+    // Header: magic (4), descriptor count (4), descriptor offset (4); or
+    // "WADX", version (4), magic (4), reserved (4), count (8), offset (8)
+    char header[ExtendedHeaderSize] = {};
+    uint64_t descriptorCount = newDescriptors.size();
     // descriptorOffset = header size + lump-data size
-    uint32_t descriptorOffset = headerSize + static_cast<uint32_t>(newLumpData.size());
-    write(fd, &descriptorCount, sizeof(descriptorCount));
-    write(fd, &descriptorOffset, sizeof(descriptorOffset));
-
-    // Lump data block
-    if (!newLumpData.empty()) {
-        ssize_t w = write(fd, newLumpData.data(), newLumpData.size());
-        if (w < 0) {
-            close(fd);
-            return;
-        }
+    uint64_t descriptorOffset = headerSize + lumpDataSize;
+    if (wide) {
+        memcpy(header, ExtendedMagic, 4);
+        memcpy(header + 4, &ExtendedVersion, 4);
+        memcpy(header + 8, magic.data(), min<size_t>(magic.size(), 4));
+        memcpy(header + 16, &descriptorCount, 8);
+        memcpy(header + 24, &descriptorOffset, 8);
+    } else {
+        uint32_t count = static_cast<uint32_t>(descriptorCount);
+        uint32_t offset = static_cast<uint32_t>(descriptorOffset);
+        memcpy(header, magic.data(), min<size_t>(magic.size(), 4));
+        memcpy(header + 4, &count, 4);
+        memcpy(header + 8, &offset, 4);
     }
 
-    // Descriptor table (each descriptor: offset (4), length (4), name (8))
-    for (auto &desc : newDescriptors) {
-        write(fd, &desc.offset, sizeof(desc.offset));
-        write(fd, &desc.length, sizeof(desc.length));
+    // Descriptor table (each descriptor: offset (4), length (4), name (8),
+    // or offset (8), length (8), name (8) after the extended header)
+    size_t entrySize = wide ? 24 : 16;
+    vector<char> table(newDescriptors.size() * entrySize);
+    for (size_t i = 0; i < newDescriptors.size(); i++) {
+        const Descriptor &desc = newDescriptors[i];
+        char *entry = table.data() + i * entrySize;
+        if (wide) {
+            memcpy(entry, &desc.offset, 8);
+            memcpy(entry + 8, &desc.length, 8);
+        } else {
+            uint32_t offset = static_cast<uint32_t>(desc.offset);
+            uint32_t length = static_cast<uint32_t>(desc.length);
+            memcpy(entry, &offset, 4);
+            memcpy(entry + 4, &length, 4);
+        }
+        desc.name.toBytes(entry + entrySize - 8);
+    }
 
-        char nameBytes[8] = {};
-        size_t copyLen = min<size_t>(desc.name.size(), 8);
-        copy(desc.name.begin(), desc.name.begin() + copyLen, nameBytes);
-        write(fd, nameBytes, 8);
+    writes.push_back({fd, true, header, headerSize, 0, 0});
+    io->submit(&writes.back());
+    if (!table.empty()) {
+        writes.push_back({fd, true, table.data(), table.size(),
+                          static_cast<off_t>(descriptorOffset), 0});
+        io->submit(&writes.back());
+    }
+    io->wait();
+
+    bool failed = false;
+    for (const IoRequest &w : writes) {
+        if (w.result < 0) {
+            errno = static_cast<int>(-w.result);
+            perror("write");
+            failed = true;
+            break;
+        }
     }
 
     close(fd);
+
+    // the same directory builds the same tree, so a cached image stays good
+    if (indexCache && !failed &&
+        crc32c(table.data(), table.size(), crc32c(header, headerSize)) == directoryCrc)
+        touchIndex();
 }
 
-string Wad::cleanName(const string &name) const {
-    if (name.size() > 6 && name.compare(name.size() - 6, 6, "_START") == 0)
-        return name.substr(0, name.size() - 6);
+void Wad::saveContainer(const vector<Descriptor> &layout, const vector<Node*> &owners) {
+    // Every lump is cut into blocks; blocks are compressed independently,
+    // one worker per core, and kept raw when compression would not shrink them
+    struct Job {
+        const char *raw;
+        uint32_t size;
+        vector<char> packed;   // empty: stored raw
+    };
+    vector<Job> jobs;
+    vector<uint32_t> firstBlock(layout.size());
+    for (size_t i = 0; i < layout.size(); i++) {
+        firstBlock[i] = static_cast<uint32_t>(jobs.size());
+        const Node* node = owners[i];
+        if (!node) continue;
+        for (uint64_t at = 0; at < node->length; at += blockSize)
+            jobs.push_back({node->data.data() + at,
+                            static_cast<uint32_t>(min<uint64_t>(blockSize, node->length - at)), {}});
+    }
+
+    atomic<size_t> next(0);
+    auto work = [&]() {
+        vector<char> out(lzBound(blockSize));
+        for (size_t j = next++; j < jobs.size(); j = next++) {
+            Job &job = jobs[j];
+            size_t n = lzCompress(job.raw, job.size, out.data());
+            if (n < job.size) job.packed.assign(out.begin(), out.begin() + n);
+        }
+    };
+    unsigned threads = max(1u, thread::hardware_concurrency());
+    vector<thread> pool;
+    try {
+        for (unsigned t = 1; t < threads && t < jobs.size(); t++)
+            pool.emplace_back(work);
+    } catch (const system_error &) {
+        // fewer helpers; this thread takes whatever they leave
+    }
+    work();
+    for (thread &t : pool)
+        t.join();
+
+    int fd = ::open(wadPath.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    if (fd < 0) {
+        return;
+    }
+
+    deque<IoRequest> writes;
+    vector<char> index(layout.size() * ContainerLumpEntry + jobs.size() * ContainerBlockEntry);
+    char *blockEntry = index.data() + layout.size() * ContainerLumpEntry;
+    uint64_t at = ContainerHeaderSize;
+    for (const Job &job : jobs) {
+        const char *bytes = job.packed.empty() ? job.raw : job.packed.data();
+        uint32_t stored = job.packed.empty() ? job.size : static_cast<uint32_t>(job.packed.size());
+        writes.push_back({fd, true, const_cast<char*>(bytes), stored, static_cast<off_t>(at), 0});
+        io->submit(&writes.back());
+        memcpy(blockEntry, &at, 8);
+        memcpy(blockEntry + 8, &stored, 4);
+        blockEntry += ContainerBlockEntry;
+        at += stored;
+    }
+
+    for (size_t i = 0; i < layout.size(); i++) {
+        char *entry = index.data() + i * ContainerLumpEntry;
+        memcpy(entry, &layout[i].offset, 8);
+        memcpy(entry + 8, &layout[i].length, 8);
+        layout[i].name.toBytes(entry + 16);
+        memcpy(entry + 24, &firstBlock[i], 4);
+    }
+
+    // Header: "WADZ", version, inner magic, lump count, block size, block
+    // count, index offset
+    char header[ContainerHeaderSize] = {};
+    memcpy(header, ContainerMagic, 4);
+    memcpy(header + 4, &ContainerVersion, 4);
+    memcpy(header + 8, magic.data(), min<size_t>(magic.size(), 4));
+    uint32_t lumpCount = static_cast<uint32_t>(layout.size());
+    uint32_t blockCount = static_cast<uint32_t>(jobs.size());
+    memcpy(header + 12, &lumpCount, 4);
+    memcpy(header + 16, &blockSize, 4);
+    memcpy(header + 20, &blockCount, 4);
+    memcpy(header + 24, &at, 8);
+
+    writes.push_back({fd, true, header, ContainerHeaderSize, 0, 0});
+    io->submit(&writes.back());
+    if (!index.empty()) {
+        writes.push_back({fd, true, index.data(), index.size(), static_cast<off_t>(at), 0});
+        io->submit(&writes.back());
+    }
+    io->wait();
+
+    for (const IoRequest &w : writes) {
+        if (w.result < 0) {
+            errno = static_cast<int>(-w.result);
+            perror("write");
+            break;
+        }
+    }
 
-    if (name.size() > 4 && name.compare(name.size() - 4, 4, "_END") == 0)
-        return name.substr(0, name.size() - 4);
+    close(fd);
+}
 
-    return name;
-}
\ No newline at end of file
+LumpName Wad::cleanName(LumpName name) {
+    return NamespaceRules::clean(name);
+}
@@ -4,32 +4,242 @@
 #include <vector>
 #include <unordered_map>
 #include <cstdint>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <list>
+
+#include "LumpName.h"
+#include "IoEngine.h"
+#include "MapView.h"
+#include "PathMap.h"
+#include "Format.h"
+#include "Search.h"
 
 using namespace std;
 
 class Wad {
 
 public:
+    // Load-time tuning; loadWad(path) uses the defaults
+    struct LoadOptions {
+        IoEngine::Kind io = IoEngine::Auto; // engine for lump loads and saves
+        unsigned threads = 0;  // POSIX loader workers; 0 = one per core
+        bool indexCache = false; // reuse the tree image kept beside the WAD
+        bool lazy = false;     // read lumps on first use rather than at load
+        bool prefetch = true;  // see below
+        string shared;         // shared-memory region to attach or publish; "" = none
+        uint64_t cacheBytes = 0; // lump cache budget; 0 = keep every lump (see below)
+        vector<string> pinned = {"PLAYPAL", "COLORMAP", "PNAMES", "TEXTURE1", "TEXTURE2"};
+        GameFormat format = GameFormat::Auto; // whose map markers make directories
+        bool readOnly = false; // refuse changes and never save, as in shared mode
+    };
+
+    // Prefetch: the first read of a lump that is not in memory (lazy loads,
+    // containers) asks the kernel to read ahead the rest of its map or
+    // namespace, which readers nearly always go on to consume, so a cold
+    // map costs about one sequential read instead of one seek per lump.
+    //
+    // Shared mode (LoadOptions::shared names a POSIX shared-memory region):
+    // the first process to open the WAD publishes its tree image and lump
+    // bytes into the region, and later ones map it read-only, building only
+    // their tree nodes and pointing every lump at the shared bytes. The
+    // region is republished when the WAD's size or mtime no longer match
+    // it. A shared Wad is read-only: changes are refused and nothing is
+    // saved on close. Without shared memory it falls back to a private,
+    // still read-only, load.
+    static bool releaseShared(const string &name); // unlinks a region; mappings stay valid
+    bool isReadOnly() const;
+
     // Static Constructor & Destructor
     static Wad* loadWad(const string &path);
+    static Wad* loadWad(const string &path, const LoadOptions &options);
     ~Wad(); // saves any changes and closes file
 
     // Getters
     string getMagic() const;
+    GameFormat getFormat() const; // as given in LoadOptions or detected from the directory
 
     bool isContent(const string &path) const;
     bool isDirectory(const string &path) const;
 
-    int getSize(const string &path) const;
+    // Sizes and offsets are 64-bit throughout, for WADs past 4 GB. A write
+    // that would end past MaxLumpSize fails (-1) rather than allocating it
+    static constexpr int64_t MaxLumpSize = int64_t(1) << 40;
+    int64_t getSize(const string &path) const;
 
-    int getContents(const string &path, char *buffer, int length, int offset = 0);
+    int64_t getContents(const string &path, char *buffer, int64_t length, int64_t offset = 0);
 
     int getDirectory(const string &path, vector<string> *directory);
 
+    // Lump handles: resolve a path once, then access the lump directly.
+    // A handle stays valid for the lifetime of the Wad and fits in a
+    // fuse_file_info::fh.
+    typedef uint64_t LumpHandle;
+    static constexpr LumpHandle InvalidHandle = 0;
+
+    LumpHandle open(const string &path) const; // InvalidHandle unless path is content
+    int64_t size(LumpHandle handle) const;
+    int64_t read(LumpHandle handle, char *buffer, int64_t length, int64_t offset = 0);
+    int64_t write(LumpHandle handle, const char *buffer, int64_t length, int64_t offset = 0);
+    bool readAll(LumpHandle handle, vector<char> *out); // whole lump into out
+
+    // Finds a lump by its 8-character name anywhere in the tree, ignoring
+    // case; when names repeat the last one in directory order wins
+    LumpHandle findLump(const string &name) const;
+    LumpHandle findLump(LumpName name) const;
+
+    // Lump cache (LoadOptions::cacheBytes): lumps are read on first use, as
+    // with `lazy`, and kept while they fit the budget. Past it, CLOCK-Pro
+    // picks what to evict, so lumps read more than once outlast a one-pass
+    // scan through the rest. Lumps named in `pinned`, and those a MapView
+    // has been given, stay until the Wad closes; a lump over a quarter of
+    // the budget is read from the file every time; written lumps are not
+    // cache entries and always stay.
+    struct CacheStats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t bytes;      // resident in the cache, pinned included
+        uint64_t pinnedBytes;
+        uint64_t hotBytes;
+    };
+    struct CacheEntry {
+        LumpHandle handle;
+        uint64_t bytes;
+        uint64_t hits;       // since the Wad was loaded, across evictions
+        bool hot;
+        bool pinned;
+    };
+    CacheStats cacheStats() const;
+    vector<CacheEntry> cacheEntries() const; // resident entries, in no particular order
+
+    // How far loadWad() overlapped the lump reads with building the tree:
+    // reads queued in all, and how many the loaders had issued (submitted
+    // to io_uring, or read by a POSIX worker) when the build began
+    struct LoadStats {
+        uint64_t lumpReads;
+        uint64_t issuedAtTree;
+    };
+    LoadStats loadStats() const;
+
+    // Bumped by every change to the tree or to lump contents, so caches of
+    // derived data can tell when they are stale
+    uint64_t getGeneration() const;
+
+    // Batched reads: one entry per (path or handle, buffer, length, offset) request
+    struct ReadRequest {
+        string path;
+        char *buffer;
+        int64_t length;
+        int64_t offset;
+        int64_t result;      // set by readv(): same meaning as getContents()
+        LumpHandle handle = InvalidHandle; // used instead of path when set
+    };
+
+    // Fulfils every request in one pass ordered by file offset; lumps that are
+    // not held in memory are read with coalesced preadv() calls.
+    // Returns the number of requests that did not fail (result >= 0).
+    int readv(vector<ReadRequest> &requests);
+
+    // Zero-copy typed view of a map directory's lumps (E#M# or MAP##); not
+    // valid for Hexen maps, whose records are laid out differently
+    MapView mapView(const string &path);
+
+    // Consistency check of a WAD file on disk, done without loading it: the
+    // header and directory against the file size, overlapping lumps,
+    // _START/_END balance, map directories the loader would group wrongly
+    // under `format` (detected when Auto), and each map's record sizes and
+    // index references (not for Hexen). Maps are checked on
+    // `threads` workers (0 = one per core); only their lumps are read.
+    struct Issue {
+        enum Severity { Warning, Error };
+        Severity severity;
+        int lump;            // directory index, -1 for the header and table
+        string name;         // the lump's name, "" when lump is -1
+        string message;
+    };
+
+    // Appends what it finds to *issues in directory order; true when none
+    // of it is an Error
+    static bool validate(const string &path, vector<Issue> *issues, unsigned threads = 0,
+                         GameFormat format = GameFormat::Auto);
+
+    // Lump-level patches between two versions of a WAD file. Target lumps
+    // are matched to source lumps by their path in the tree, then by content
+    // (XXH64 and length) wherever they moved; a patch lists the target's
+    // directory with each lump kept from the source, sent whole, or, when a
+    // changed lump is large enough, sent as a byte-level delta against the
+    // source lump at its path. Both files are read and the patch written a
+    // chunk at a time, lump by lump. Patches carry 32-bit fields, so both
+    // sides must have the classic header: extended and WADZ files are
+    // refused (see WadHeader.h).
+    struct DiffStats {
+        unsigned unchanged;  // same path, same bytes
+        unsigned changed;    // same path, different bytes
+        unsigned added;      // path not in the source
+        unsigned removed;    // source paths the target no longer has
+        unsigned deltas;     // changed lumps sent as deltas
+        uint64_t patchBytes;
+    };
+    static bool diff(const string &sourcePath, const string &targetPath, const string &patchPath,
+                     DiffStats *stats = nullptr);
+
+    // Streams the target out to outputPath (which may be sourcePath) in the
+    // layout saveWad() writes, through a temporary file renamed into place.
+    // Every lump taken from the source is checked against the digest the
+    // patch recorded; false, leaving outputPath alone, on any mismatch.
+    static bool applyPatch(const string &sourcePath, const string &patchPath, const string &outputPath);
+
+    // Search of many WAD files for byte patterns (see Search.h), done
+    // without loading them: each file's directory is read and grouped as
+    // loadWad() would, then its lumps are scanned where they lie in the
+    // mapped file (containers a block range at a time). Files are opened
+    // and lumps scanned as independent tasks on `threads` workers (0 = one
+    // per core); lumps larger than a task are split, so one big IWAD is
+    // spread over every worker as well.
+    struct SearchOptions {
+        unsigned threads = 0;
+        bool ignoreCase = false;   // ASCII letters
+        SearchKernel kernel = SearchKernel::Best;
+    };
+    struct SearchHit {
+        uint32_t file;       // index into files
+        string path;         // the lump's path in the tree
+        uint64_t offset;     // of the match within the lump
+        uint32_t pattern;    // index into patterns
+    };
+
+    // Appends to *hits in order of file, directory, offset, then pattern.
+    // False if a file could not be read as a WAD, or a packed lump in it
+    // could not be decoded; its index goes to *unreadable when given, once,
+    // and the other files are still searched.
+    static bool search(const vector<string> &files, const vector<string> &patterns,
+                       const SearchOptions &options, vector<SearchHit> *hits,
+                       vector<uint32_t> *unreadable = nullptr);
+
+    // WADZ: the same tree stored as a container whose lumps are compressed
+    // independently in fixed-size blocks, each of which can be decompressed
+    // alone. loadWad() opens either kind; lumps of a container are not read
+    // at load, and a read decompresses only the blocks it touches. Saves
+    // keep the kind the file had unless this changes it; they compress the
+    // blocks on one worker per core. A container nothing was changed in is
+    // not rewritten on close.
+    void setCompressed(bool compressed);
+    bool isCompressed() const;
+
+    // Extended header: "WADX", the usual magic, then 64-bit directory count
+    // and offset, and 64-bit lump offsets and lengths in the directory.
+    // loadWad() opens either header; a save writes the extended one when
+    // the file could not be described with 32-bit fields, or when asked to.
+    void setExtended(bool extended);
+    bool isExtended() const;
+
     // Setters
     void createDirectory(const string &path);
     void createFile(const string &path);
-    int writeToFile(const string &path, const char *buffer, int length, int offset = 0);
+    int64_t writeToFile(const string &path, const char *buffer, int64_t length, int64_t offset = 0);
+    int truncateFile(const string &path); // empties a lump so it can be written again; -1 if not content
 
 private:
     // Private Constructor: only loadWad() calls it
@@ -37,26 +247,59 @@ private:
 
     // Helper Structures
     struct Descriptor {
-        uint32_t offset;
-        uint32_t length;
-        string name;         // decoded from 8 bytes
+        uint64_t offset;
+        uint64_t length;
+        LumpName name;       // decoded from 8 bytes
+        uint32_t block;      // first compressed block (containers only)
+    };
+
+    // One compressed block of a container
+    struct Block {
+        uint64_t offset;
+        uint32_t size;       // stored bytes; equal to the raw size when stored raw
+    };
+
+    // Node::flags bits, classified once when the node is created
+    enum : uint8_t {
+        NamespaceStart = LumpClass::NamespaceStart,
+        NamespaceEnd   = LumpClass::NamespaceEnd,
+        MapMarker      = LumpClass::MapMarker
+    };
+
+    // Node::cache states
+    enum : uint8_t {
+        CacheNone,    // not a cache entry
+        CacheCold,    // resident, on coldClock
+        CacheHot,     // resident, on hotClock
+        CacheTest,    // evicted cold lump still on testQueue
+        CachePinned   // resident until close
     };
 
     struct Node { // represents a file or directory in the WAD tree
-        string name;
+        LumpName name;            // raw on-disk name (directories keep _START)
+        LumpName base;            // name with _START/_END stripped, as listed
+        uint8_t flags;
         bool isDirectory;
-        uint32_t offset;          // only valid if content file
-        uint32_t length;          // only valid if content file
+        uint64_t offset;          // only valid if content file
+        uint64_t length;          // only valid if content file
+        uint32_t block;           // first block, if loaded from a container
+        const char *view;         // bytes in the shared region, when attached
+        bool prefetched;          // directory: readahead issued for its lumps
+        uint8_t cache;            // Cache* state, under cacheLock
+        bool referenced;          // read since a clock hand last passed it
+        uint32_t hits;
+        list<Node*>::iterator slot; // in the clock or queue its state names
         vector<char> data;
         vector<Node*> children;
         Node* parent;
 
-        Node(string n, bool dir)
-            : name(n), isDirectory(dir), offset(0), length(0), parent(nullptr) {}
+        Node(LumpName n, bool dir, uint8_t flags);
     };
 
     Node* root;
-    unordered_map<string, Node*> pathMap;
+    PathMap<Node*> pathMap;            // lookups need no lock, see PathMap.h
+    PathMap<Node*> nameIndex;          // upper-cased LumpName bits -> last lump; lock-free lookups too
+    uint64_t generation;
     vector<Descriptor> descriptors;
 
     // WAD attributes
@@ -64,26 +307,97 @@ private:
     string wadPath;               // real filesystem path
 
     string magic;
-    uint32_t descriptorCount;
-    uint32_t descriptorOffset;
+    GameFormat format;                 // never Auto once loaded
+    uint64_t descriptorCount;
+    uint64_t descriptorOffset;
+    bool extended;                     // the file on disk has the extended header
+    bool extendOnSave;                 // the next save writes it regardless
+
+    bool indexCache;                   // LoadOptions::indexCache
+    uint32_t directoryCrc;             // CRC32C of the header and directory as read
+
+    bool prefetch;                     // LoadOptions::prefetch
+    bool readOnly;                     // shared mode
+    char *sharedRegion;                // mapped region, or nullptr
+    size_t sharedSize;
+
+    uint64_t cacheBytes;               // LoadOptions::cacheBytes; 0 = no cache
+    vector<uint64_t> pinnedNames;      // upper-cased LumpName bits
+    mutable mutex cacheLock;
+    list<Node*> coldClock, hotClock, testQueue, pinnedLumps;
+    uint64_t coldTarget;               // bytes the cold clock may grow to before hot gives way
+    uint64_t testBytes;
+    CacheStats stats;
+
+    bool packed;                       // the file on disk is a container
+    bool packOnSave;                   // the next save writes a container
+    uint32_t blockSize;                // raw bytes per container block
+    vector<Block> blocks;
 
+    IoEngine* io;
+    vector<vector<char>> lumpBuffers;  // per descriptor, filled while buildTree() runs
+    vector<IoRequest> lumpReads;
+    vector<Node*> lumpOwners;          // file node that adopted each buffer
+    vector<IoRequest*> lumpOrder;      // lumpReads sorted by file offset
+    vector<thread> loaders;            // POSIX prefetch workers, or the io_uring submitter
+    atomic<uint64_t> readsIssued{0};   // lumpReads handed on by the loaders so far
+    LoadStats loadCounters{0, 0};
 
 
     // helpers
     void loadHeader();
     void loadDescriptors();
-    void buildTree();
-    void loadFileData();
+    void loadContainer();  // loadDescriptors() for a container
+    void startFileData(unsigned threads); // queues every lump read before the tree is built
+    void buildTree();     // buildTreeAs() for the format's rules
+    template <typename Rules> void buildTreeAs();
+    void loadFileData();  // waits for the queued reads
+
+    // Index cache (path + ".index"): an image of the built tree, valid while
+    // the WAD's size, mtime and directoryCrc match it
+    bool loadIndex();     // buildTree() from the image; false if missing or stale
+    void saveIndex() const;
+    void touchIndex() const; // re-stamps the image after a save that kept the directory
+    string treeImage() const;
+    bool buildFromImage(const char *image, size_t size);
+
+    bool openShared(const string &name); // attach, else publish; false leaves the Wad unloaded
+    bool attachShared(const string &name);
+    bool publishShared(const string &name);
+
+    bool readCached(Node* node, char *buffer, int64_t length, int64_t offset); // false: not cacheable, read the file
+    bool holdResident(Node* node);   // makeResident() with a cache: pins the lump
+    void forget(Node* node);         // drops the lump's entry before truncateFile()
+    void admit(Node* node, vector<char> *bytes); // the rest under cacheLock
+    void attach(Node* node, uint8_t state);
+    void detach(Node* node);
+    void makeRoom(uint64_t bytes);
 
     Node* lookupNode(const string &path) const;
+    static Node* fromHandle(LumpHandle handle);
+
+    void indexName(Node* node);               // nameIndex entry for a lump, replacing any earlier one
+    static bool isResident(const Node* node); // lump bytes are held in node->data or node->view
+    void prefetchGroup(Node* node);           // readahead for the rest of node's directory, once
+    static const char* bytesOf(const Node* node);
+    bool makeResident(Node* node);            // loads node->data from the file if needed
+    bool fetchLump(Node* node, vector<char> *bytes); // the whole lump from the file
+    int64_t readNode(Node* node, char *buffer, int64_t length, int64_t offset); // getContents() on a resolved node
+    int64_t writeNode(Node* node, const char *buffer, int64_t length, int64_t offset); // writeToFile() on a resolved node
+    int64_t readBlocks(const Node* node, char *buffer, int64_t length, int64_t offset); // readNode() from a container
+
+    uint8_t classify(LumpName name) const; // under the Wad's format
 
-    bool isMapMarker(const string &name) const; // E#M# checker
+    struct SearchFile;   // search() state, in Search.cpp
+    struct SearchTask;
 
     vector<string> tokenize(const string &path) const; // cuts up path into its parts
 
     // void printTree() const; // for debugging
 
+    uint64_t layoutTree(vector<Descriptor> *layout, vector<Node*> *owners, uint32_t headerSize); // directory a save writes, owners nullptr for markers; returns the lump bytes
     void saveWad(); // saves all data stored virtually back into WAD file
+    void saveContainer(const vector<Descriptor> &layout, const vector<Node*> &owners);
 
-    string cleanName(const std::string &name) const; // cleans _START and _END markers directory names
+    static LumpName cleanName(LumpName name); // cleans _START and _END markers directory names
 };
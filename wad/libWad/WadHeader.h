@@ -0,0 +1,96 @@
+#pragma once
+
+#include <unistd.h>
+#include <cstdint>
+#include <cstring>
+
+#include "LumpName.h"
+
+using namespace std;
+
+// The headers a WAD file can start with, for the readers that take the
+// file apart directly (validate(), digestWad(), diff(), applyPatch())
+// rather than through loadWad():
+//   classic:  magic (4), count (4), table offset (4);
+//             entries offset (4), length (4), name (8)
+//   extended: "WADX", version (4), magic (4), reserved (4), count (8),
+//             table offset (8); entries offset (8), length (8), name (8)
+//   WADZ:     a compressed container, which only loadWad() reads
+static const char ExtendedMagic[4] = {'W', 'A', 'D', 'X'};
+static const uint32_t ExtendedVersion = 1;
+static const uint32_t ExtendedHeaderSize = 32;
+static const uint32_t ClassicHeaderSize = 12;
+static const char ContainerMagic[4] = {'W', 'A', 'D', 'Z'};
+
+struct WadHeader {
+    char magic[4];           // IWAD or PWAD as a rule; inside an extended header
+    bool extended;
+    uint64_t count;
+    uint64_t tableOffset;
+    uint32_t size;           // of the header itself
+    uint32_t entrySize;      // of one directory entry
+};
+
+enum class WadHeaderStatus { Ok, Short, Container, UnknownVersion };
+
+inline WadHeaderStatus readWadHeader(int fd, WadHeader *out) {
+    char raw[ExtendedHeaderSize];
+    ssize_t r = pread(fd, raw, sizeof(raw), 0);
+    if (r >= 4 && memcmp(raw, ContainerMagic, 4) == 0) return WadHeaderStatus::Container;
+    if (r >= 4 && memcmp(raw, ExtendedMagic, 4) == 0) {
+        if (r < static_cast<ssize_t>(ExtendedHeaderSize)) return WadHeaderStatus::Short;
+        uint32_t version;
+        memcpy(&version, raw + 4, 4);
+        if (version != ExtendedVersion) return WadHeaderStatus::UnknownVersion;
+        memcpy(out->magic, raw + 8, 4);
+        memcpy(&out->count, raw + 16, 8);
+        memcpy(&out->tableOffset, raw + 24, 8);
+        out->extended = true;
+        out->size = ExtendedHeaderSize;
+        out->entrySize = 24;
+        return WadHeaderStatus::Ok;
+    }
+    if (r < static_cast<ssize_t>(ClassicHeaderSize)) return WadHeaderStatus::Short;
+    uint32_t count, offset;
+    memcpy(out->magic, raw, 4);
+    memcpy(&count, raw + 4, 4);
+    memcpy(&offset, raw + 8, 4);
+    out->count = count;
+    out->tableOffset = offset;
+    out->extended = false;
+    out->size = ClassicHeaderSize;
+    out->entrySize = 16;
+    return WadHeaderStatus::Ok;
+}
+
+// Directory entry `raw`, laid out as `header` says
+inline void readWadEntry(const WadHeader &header, const char *raw, uint64_t *offset, uint64_t *length,
+                         LumpName *name) {
+    if (header.extended) {
+        memcpy(offset, raw, 8);
+        memcpy(length, raw + 8, 8);
+        *name = LumpName::fromBytes(raw + 16);
+    } else {
+        uint32_t o, l;
+        memcpy(&o, raw, 4);
+        memcpy(&l, raw + 4, 4);
+        *offset = o;
+        *length = l;
+        *name = LumpName::fromBytes(raw + 8);
+    }
+}
+
+// Whether the directory table lies within a file of fileSize bytes; checked
+// before anything is allocated for it, so a bogus count fails here
+inline bool wadTableFits(const WadHeader &header, uint64_t fileSize) {
+    return header.tableOffset <= fileSize && header.count <= (fileSize - header.tableOffset) / header.entrySize;
+}
+
+inline const char *wadHeaderProblem(WadHeaderStatus status) {
+    switch (status) {
+    case WadHeaderStatus::Short: return "file is shorter than its header";
+    case WadHeaderStatus::Container: return "unsupported format: WADZ container (open it with the library)";
+    case WadHeaderStatus::UnknownVersion: return "unsupported format: unknown WADX version";
+    default: return "";
+    }
+}
@@ -2,22 +2,172 @@
 
 #include <fuse.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <cstring>
 #include <cstdio>
 #include <cstdlib>
 #include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 
 #include "../libWad/Wad.h"
+#include "../libWad/Convert.h"
 
 using namespace std;
 
 static Wad *g_wad = nullptr;
 
+// Converted views (-c): /.converted mirrors the tree and lists every lump
+// LumpEncoder understands under its name plus .png/.wav/.mid. A file is
+// encoded on first access, only as far as reads have reached. Its bytes are
+// kept while it is open and dropped with the last release; files looked at
+// but not open (getattr) are kept for the ConvertedIdleMax most recently
+// used, so a long-running mount holds encodings only for what is in use.
+static bool g_converted = false;
+static Palette g_palette;
+static const string g_convertedRoot = "/.converted";
+static const size_t ConvertedIdleMax = 32;
+
+struct ConvertedFile {
+    mutex lock;
+    uint64_t generation;
+    unique_ptr<LumpEncoder> encoder;
+    vector<char> bytes;  // encoded so far
+    unsigned opens = 0;  // these two under g_convertedLock
+    uint64_t lastUse = 0;
+};
+
+// What an open converted file's fi->fh points at; FUSE may read one handle
+// from several threads, so the swap to a fresh encoding is under `lock`
+struct ConvertedHandle {
+    mutex lock;
+    shared_ptr<ConvertedFile> file;
+};
+
+static mutex g_convertedLock;
+static unordered_map<string, shared_ptr<ConvertedFile>> g_convertedFiles;
+static uint64_t g_convertedClock = 0;
+
+static bool isConverted(const string &path) {
+    return g_converted && path.compare(0, g_convertedRoot.size(), g_convertedRoot) == 0 &&
+           (path.size() == g_convertedRoot.size() || path[g_convertedRoot.size()] == '/');
+}
+
+// Path inside the real tree; "/" for the view's root
+static string convertedSource(const string &path) {
+    string rest = path.substr(g_convertedRoot.size());
+    return rest.empty() ? "/" : rest;
+}
+
+static bool isConvertedDirectory(const string &path) {
+    string source = convertedSource(path);
+    return source == "/" || g_wad->isDirectory(source);
+}
+
+// Drops the least recently used files no one has open; under g_convertedLock
+static void trimConverted() {
+    size_t idle = 0;
+    for (const auto &entry : g_convertedFiles)
+        if (entry.second->opens == 0) idle++;
+    while (idle > ConvertedIdleMax) {
+        auto oldest = g_convertedFiles.end();
+        for (auto it = g_convertedFiles.begin(); it != g_convertedFiles.end(); ++it)
+            if (it->second->opens == 0 && (oldest == g_convertedFiles.end() || it->second->lastUse < oldest->second->lastUse))
+                oldest = it;
+        g_convertedFiles.erase(oldest);
+        idle--;
+    }
+}
+
+// nullptr unless path names a convertible lump with the right extension;
+// `opening` counts an open, which releaseConverted() undoes
+static shared_ptr<ConvertedFile> convertedFile(const string &path, bool opening = false) {
+    string source = convertedSource(path);
+    size_t dot = source.find_last_of('.');
+    if (dot == string::npos || dot < source.find_last_of('/')) return nullptr;
+    string extension = source.substr(dot);
+    source.erase(dot);
+
+    uint64_t generation = g_wad->getGeneration();
+    {
+        lock_guard<mutex> guard(g_convertedLock);
+        auto it = g_convertedFiles.find(path);
+        if (it != g_convertedFiles.end() && it->second->generation == generation) {
+            it->second->lastUse = ++g_convertedClock;
+            if (opening) it->second->opens++;
+            return it->second;
+        }
+    }
+
+    // Creating an encoder measures its output (a whole MUS conversion), so
+    // it is done outside the lock; a file another thread made meanwhile wins
+    LumpEncoder *encoder = LumpEncoder::create(g_wad, source, g_palette);
+    if (!encoder || extension != LumpEncoder::extension(encoder->format())) {
+        delete encoder;
+        return nullptr;
+    }
+    shared_ptr<ConvertedFile> made = make_shared<ConvertedFile>();
+    made->generation = generation;
+    made->encoder.reset(encoder);
+
+    lock_guard<mutex> guard(g_convertedLock);
+    shared_ptr<ConvertedFile> &file = g_convertedFiles[path];
+    if (!file || file->generation != generation) file = made;
+    file->lastUse = ++g_convertedClock;
+    if (opening) file->opens++;
+    shared_ptr<ConvertedFile> result = file;
+    trimConverted();
+    return result;
+}
+
+// The last release of a file drops its encoding
+static void releaseConverted(const string &path, const shared_ptr<ConvertedFile> &file) {
+    lock_guard<mutex> guard(g_convertedLock);
+    if (--file->opens > 0) return;
+    auto it = g_convertedFiles.find(path);
+    if (it != g_convertedFiles.end() && it->second == file) g_convertedFiles.erase(it);
+}
+
+static int readConverted(ConvertedFile *file, char *buf, size_t size, off_t offset) {
+    lock_guard<mutex> guard(file->lock);
+    size_t want = min(static_cast<size_t>(offset) + size, file->encoder->size());
+    while (file->bytes.size() < want) {
+        size_t have = file->bytes.size();
+        file->bytes.resize(have + 64 * 1024);
+        int r = file->encoder->produce(file->bytes.data() + have, 64 * 1024);
+        if (r <= 0) {
+            file->bytes.resize(have);
+            return -EIO;
+        }
+        file->bytes.resize(have + r);
+    }
+
+    if (static_cast<size_t>(offset) >= want) return 0;
+    size_t n = want - static_cast<size_t>(offset);
+    memcpy(buf, file->bytes.data() + offset, n);
+    return static_cast<int>(n);
+}
+
 static int get_attr(const char *path, struct stat *stbuf) {
     memset(stbuf, 0, sizeof(struct stat));
 
     if (!g_wad) return -EIO;
 
+    if (isConverted(path)) {
+        if (isConvertedDirectory(path)) {
+            stbuf->st_mode = S_IFDIR | 0555;
+            stbuf->st_nlink = 2;
+            return 0;
+        }
+        shared_ptr<ConvertedFile> file = convertedFile(path);
+        if (!file) return -ENOENT;
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = static_cast<off_t>(file->encoder->size());
+        return 0;
+    }
+
     if (string(path) == "/" || g_wad->isDirectory(path)) {
         stbuf->st_mode = S_IFDIR | 0777;
         stbuf->st_nlink = 2;
@@ -44,6 +194,25 @@ static int readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
 
+    if (isConverted(path)) {
+        string source = convertedSource(path);
+        vector<string> entries;
+        if (g_wad->getDirectory(source, &entries) < 0) return -ENOENT;
+
+        string prefix = source == "/" ? source : source + "/";
+        for (const auto &name : entries) {
+            string child = prefix + name;
+            if (g_wad->isDirectory(child)) {
+                filler(buf, name.c_str(), NULL, 0);
+                continue;
+            }
+            LumpEncoder::Format format = LumpEncoder::detect(g_wad, child, g_palette);
+            if (format != LumpEncoder::None)
+                filler(buf, (name + LumpEncoder::extension(format)).c_str(), NULL, 0);
+        }
+        return 0;
+    }
+
     vector<string> entries;
     int rc = g_wad->getDirectory(path, &entries);
     if (rc < 0) return -ENOENT;
@@ -51,6 +220,8 @@ static int readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     for (const auto &name : entries) {
         filler(buf, name.c_str(), NULL, 0);
     }
+    if (g_converted && string(path) == "/")
+        filler(buf, g_convertedRoot.c_str() + 1, NULL, 0);
 
     return 0;
 }
@@ -58,6 +229,7 @@ static int readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 int mknod(const char *path, mode_t mode, dev_t rdev) {
     (void) mode; (void) rdev;
     if (!g_wad) return -EIO;
+    if (isConverted(path)) return -EROFS;
 
     if (g_wad->isContent(path) || g_wad->isDirectory(path)) return -EEXIST;
 
@@ -70,6 +242,7 @@ int mknod(const char *path, mode_t mode, dev_t rdev) {
 int mkdir(const char *path, mode_t mode) {
     (void) mode;
     if (!g_wad) return -EIO;
+    if (isConverted(path)) return -EROFS;
 
     if (g_wad->isContent(path) || g_wad->isDirectory(path)) return -EEXIST;
 
@@ -79,24 +252,84 @@ int mkdir(const char *path, mode_t mode) {
     return -EIO;
 }
 
+// Resolve the path once per open file; read/write then go through fi->fh
+static int open(const char *path, struct fuse_file_info *fi) {
+    if (!g_wad) return -EIO;
+
+    // A converted file's handle holds it, so eviction never pulls it away
+    if (isConverted(path)) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EROFS;
+        shared_ptr<ConvertedFile> file = convertedFile(path, true);
+        if (!file) return -ENOENT;
+        ConvertedHandle *held = new ConvertedHandle;
+        held->file = file;
+        fi->fh = reinterpret_cast<uint64_t>(held);
+        return 0;
+    }
+
+    Wad::LumpHandle handle = g_wad->open(path);
+    if (handle == Wad::InvalidHandle) return -ENOENT;
+
+    fi->fh = handle;
+    return 0;
+}
+
 static int read(const char *path, char *buf, size_t size, off_t offset, 
                 struct fuse_file_info *fi) {
-    (void) fi;
     if (!g_wad) return -EIO;
+    if (isConverted(path)) {
+        if (!fi || fi->fh == Wad::InvalidHandle) {
+            shared_ptr<ConvertedFile> file = convertedFile(path);
+            return file ? readConverted(file.get(), buf, size, offset) : -ENOENT;
+        }
+        // a lump rewritten since the open is encoded afresh
+        ConvertedHandle *held = reinterpret_cast<ConvertedHandle*>(fi->fh);
+        shared_ptr<ConvertedFile> file;
+        {
+            lock_guard<mutex> guard(held->lock);
+            if (held->file->generation != g_wad->getGeneration()) {
+                shared_ptr<ConvertedFile> fresh = convertedFile(path, true);
+                if (!fresh) return -ENOENT;
+                releaseConverted(path, held->file);
+                held->file = fresh;
+            }
+            file = held->file;
+        }
+        return readConverted(file.get(), buf, size, offset);
+    }
 
-    int r = g_wad->getContents(path, buf, static_cast<int>(size), static_cast<int>(offset));
+    int64_t r;
+    if (fi && fi->fh != Wad::InvalidHandle)
+        r = g_wad->read(fi->fh, buf, static_cast<int64_t>(size), offset);
+    else
+        r = g_wad->getContents(path, buf, static_cast<int64_t>(size), offset);
     if (r < 0) return -EIO;
-    return r;
+    return static_cast<int>(r); // at most size, which FUSE keeps small
 }
 
 static int write(const char *path, const char *buf, size_t size, off_t offset,
                  struct fuse_file_info *fi) {
-    (void) fi;
     if (!g_wad) return -EIO;
-
-    int r = g_wad->writeToFile(path, buf, static_cast<int>(size), static_cast<int>(offset));
+    if (isConverted(path)) return -EROFS;
+    if (offset < 0 || offset > Wad::MaxLumpSize - static_cast<int64_t>(size)) return -EFBIG;
+
+    int64_t r;
+    if (fi && fi->fh != Wad::InvalidHandle)
+        r = g_wad->write(fi->fh, buf, static_cast<int64_t>(size), offset);
+    else
+        r = g_wad->writeToFile(path, buf, static_cast<int64_t>(size), offset);
     if (r < 0) return -EIO;
-    return r;
+    return static_cast<int>(r);
+}
+
+static int release(const char *path, struct fuse_file_info *fi) {
+    if (isConverted(path) && fi && fi->fh != Wad::InvalidHandle) {
+        ConvertedHandle *held = reinterpret_cast<ConvertedHandle*>(fi->fh);
+        releaseConverted(path, held->file);
+        delete held;
+        fi->fh = Wad::InvalidHandle;
+    }
+    return 0;
 }
 
 static struct fuse_operations wfs_oper;
@@ -107,10 +340,20 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    // -m <MiB> keeps lump contents within a cache of that size
     bool pass_single = false;
+    Wad::LoadOptions options;
     int argi = 1;
-    if (strcmp(argv[argi], "-s") == 0) {
-        pass_single = true;
+    while (argi < argc && (strcmp(argv[argi], "-s") == 0 || strcmp(argv[argi], "-c") == 0 ||
+                           strcmp(argv[argi], "-m") == 0)) {
+        if (argv[argi][1] == 'm') {
+            if (++argi >= argc) return 1;
+            options.cacheBytes = strtoull(argv[argi], nullptr, 10) << 20;
+        } else if (argv[argi][1] == 's') {
+            pass_single = true;
+        } else {
+            g_converted = true;
+        }
         argi++;
     }
 
@@ -121,10 +364,11 @@ int main(int argc, char *argv[])
     string wadPath = argv[argi++];
     char *mountpoint = argv[argi++];
 
-    g_wad = Wad::loadWad(wadPath);
+    g_wad = Wad::loadWad(wadPath, options);
     if (!g_wad) {
         return 1;
     }
+    if (g_converted) g_palette.load(g_wad); // without PLAYPAL only sounds and music convert
 
     vector<char*> fuse_argv;
     fuse_argv.push_back(argv[0]);
@@ -140,8 +384,10 @@ int main(int argc, char *argv[])
     wfs_oper.readdir = readdir;
     wfs_oper.mknod = mknod;
     wfs_oper.mkdir = mkdir;
+    wfs_oper.open = open;
     wfs_oper.read = read;
     wfs_oper.write = write;
+    wfs_oper.release = release;
 
     int ret = fuse_main(fuse_argc, fuse_argv.data(), &wfs_oper, g_wad);
 
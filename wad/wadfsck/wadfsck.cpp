@@ -0,0 +1,79 @@
+#include <iostream>
+#include <sstream>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include "Wad.h"
+
+using namespace std;
+
+// Checks WAD files without loading or modifying them.
+// Usage: wadfsck [-q] [-j threads] file...
+// Exit status: 0 all clean, 1 some file has errors, 2 bad usage.
+
+static string report(const string &path, const vector<Wad::Issue> &issues, bool clean, bool quiet)
+{
+    ostringstream out;
+    for (const Wad::Issue &issue : issues) {
+        if (quiet && issue.severity == Wad::Issue::Warning) continue;
+        out << path << ": " << (issue.severity == Wad::Issue::Error ? "error" : "warning") << ": ";
+        if (issue.lump >= 0) out << "#" << issue.lump << " " << issue.name << ": ";
+        out << issue.message << "\n";
+    }
+    if (!quiet) out << path << ": " << (clean ? "ok" : "FAILED") << "\n";
+    return out.str();
+}
+
+int main(int argc, char *argv[])
+{
+    bool quiet = false;
+    unsigned threads = 0;
+    int argi = 1;
+    while (argi < argc && argv[argi][0] == '-') {
+        if (strcmp(argv[argi], "-q") == 0) {
+            quiet = true;
+            argi++;
+        } else if (strcmp(argv[argi], "-j") == 0 && argi + 1 < argc) {
+            threads = static_cast<unsigned>(atoi(argv[argi + 1]));
+            argi += 2;
+        } else {
+            break;
+        }
+    }
+    if (argi >= argc) {
+        cerr << "usage: " << argv[0] << " [-q] [-j threads] file..." << endl;
+        return 2;
+    }
+
+    vector<string> paths(argv + argi, argv + argc);
+    if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+
+    // A single file spreads its maps over the workers; several files are
+    // checked one per worker, with reports printed in argument order
+    vector<string> reports(paths.size());
+    vector<char> clean(paths.size());
+    unsigned perFile = paths.size() == 1 ? threads : 1;
+    atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i; (i = next++) < paths.size();) {
+            vector<Wad::Issue> issues;
+            clean[i] = Wad::validate(paths[i], &issues, perFile);
+            reports[i] = report(paths[i], issues, clean[i], quiet);
+        }
+    };
+    vector<thread> pool;
+    for (unsigned t = 1; t < threads && t < paths.size(); t++)
+        pool.emplace_back(worker);
+    worker();
+    for (thread &t : pool)
+        t.join();
+
+    int status = 0;
+    for (size_t i = 0; i < paths.size(); i++) {
+        cout << reports[i];
+        if (!clean[i]) status = 1;
+    }
+    return status;
+}
@@ -0,0 +1,93 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include "Wad.h"
+
+using namespace std;
+
+// Searches the lumps of WAD files for strings or, with -x, hex byte
+// sequences, printing "file:path:offset" per match (and the pattern when
+// there are several), or with -l each file that has one.
+// Usage: wadgrep [-i] [-x] [-l] [-j threads] (-e pattern)... | pattern  file...
+// Exit status: 0 something matched, 1 nothing did, 2 bad usage or a file
+// could not be read.
+
+static bool fromHex(const string &text, string *out)
+{
+    string digits;
+    for (char c : text)
+        if (c != ' ' && c != ':') digits += c;
+    if (digits.empty() || digits.size() % 2) return false;
+    out->clear();
+    for (size_t i = 0; i < digits.size(); i += 2) {
+        char pair[3] = {digits[i], digits[i + 1], 0};
+        char *end;
+        long byte = strtol(pair, &end, 16);
+        if (*end) return false;
+        out->push_back(static_cast<char>(byte));
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    Wad::SearchOptions options;
+    bool hex = false, list = false;
+    vector<string> given;
+    int argi = 1;
+    while (argi < argc && argv[argi][0] == '-') {
+        if (strcmp(argv[argi], "-i") == 0) {
+            options.ignoreCase = true;
+            argi++;
+        } else if (strcmp(argv[argi], "-x") == 0) {
+            hex = true;
+            argi++;
+        } else if (strcmp(argv[argi], "-l") == 0) {
+            list = true;
+            argi++;
+        } else if (strcmp(argv[argi], "-j") == 0 && argi + 1 < argc) {
+            options.threads = static_cast<unsigned>(atoi(argv[argi + 1]));
+            argi += 2;
+        } else if (strcmp(argv[argi], "-e") == 0 && argi + 1 < argc) {
+            given.push_back(argv[argi + 1]);
+            argi += 2;
+        } else {
+            break;
+        }
+    }
+    if (given.empty() && argi < argc) given.push_back(argv[argi++]);
+
+    vector<string> patterns(given.size());
+    bool usable = !given.empty() && argi < argc;
+    for (size_t i = 0; usable && i < given.size(); i++) {
+        if (hex) usable = fromHex(given[i], &patterns[i]);
+        else patterns[i] = given[i];
+        usable = usable && !patterns[i].empty();
+    }
+    if (!usable) {
+        cerr << "usage: " << argv[0] << " [-i] [-x] [-l] [-j threads] (-e pattern)... | pattern  file..." << endl;
+        return 2;
+    }
+
+    vector<string> files(argv + argi, argv + argc);
+    vector<Wad::SearchHit> hits;
+    vector<uint32_t> unreadable;
+    bool ok = Wad::search(files, patterns, options, &hits, &unreadable);
+    for (uint32_t i : unreadable)
+        cerr << files[i] << ": not a readable WAD" << endl;
+
+    for (size_t i = 0; i < hits.size(); i++) {
+        const Wad::SearchHit &hit = hits[i];
+        if (list) {
+            if (i == 0 || hits[i - 1].file != hit.file) cout << files[hit.file] << "\n";
+            continue;
+        }
+        cout << files[hit.file] << ":" << hit.path << ":" << hit.offset;
+        if (given.size() > 1) cout << ": " << given[hit.pattern];
+        cout << "\n";
+    }
+    if (!ok) return 2;
+    return hits.empty() ? 1 : 0;
+}
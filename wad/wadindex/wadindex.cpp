@@ -0,0 +1,85 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include "Corpus.h"
+
+using namespace std;
+
+// Keeps an inverted index over many WAD files and answers lookups from it.
+//   wadindex [-j threads] update index (file... | -)
+//       rewrites index to cover the files ("-" reads one path per line from
+//       stdin), reusing what it knows of unchanged ones
+//   wadindex index name LUMP | word WORD | thing TYPE
+//       prints "file<TAB>where" per hit: the lump's directory, the text
+//       lump holding the word, or the map holding the thing
+// Exit status: 0 something was found (or the update succeeded), 1 nothing
+// was, 2 bad usage or an unreadable index.
+
+static int usage(const char *self)
+{
+    cerr << "usage: " << self << " [-j threads] update index (file... | -)" << endl
+         << "       " << self << " index name|word|thing value" << endl;
+    return 2;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned threads = 0;
+    int argi = 1;
+    if (argi + 1 < argc && strcmp(argv[argi], "-j") == 0) {
+        threads = static_cast<unsigned>(atoi(argv[argi + 1]));
+        argi += 2;
+    }
+    if (argc - argi < 3) return usage(argv[0]);
+
+    if (strcmp(argv[argi], "update") == 0) {
+        string indexPath = argv[argi + 1];
+        vector<string> files;
+        if (argc - argi == 3 && strcmp(argv[argi + 2], "-") == 0) {
+            for (string line; getline(cin, line);)
+                if (!line.empty()) files.push_back(line);
+        } else {
+            files.assign(argv + argi + 2, argv + argc);
+        }
+        CorpusIndex::UpdateStats stats;
+        if (!CorpusIndex::update(indexPath, files, threads, &stats)) {
+            cerr << indexPath << ": could not write the index" << endl;
+            return 2;
+        }
+        cerr << stats.kept << " kept, " << stats.indexed << " indexed, " << stats.removed << " removed, "
+             << stats.failed << " not WADs" << endl;
+        return 0;
+    }
+
+    if (argc - argi != 3) return usage(argv[0]);
+    CorpusIndex *index = CorpusIndex::open(argv[argi]);
+    if (!index) {
+        cerr << argv[argi] << ": not a readable index" << endl;
+        return 2;
+    }
+    string kind = argv[argi + 1], value = argv[argi + 2];
+    vector<CorpusIndex::Hit> hits;
+    if (kind == "name") {
+        hits = index->findName(value);
+    } else if (kind == "word") {
+        hits = index->findWord(value);
+    } else if (kind == "thing") {
+        char *end;
+        long type = strtol(value.c_str(), &end, 10);
+        if (*end || type < 0 || type > UINT16_MAX) {
+            delete index;
+            return usage(argv[0]);
+        }
+        hits = index->findThing(static_cast<uint16_t>(type));
+    } else {
+        delete index;
+        return usage(argv[0]);
+    }
+
+    for (const CorpusIndex::Hit &hit : hits)
+        cout << index->path(hit.file) << "\t" << hit.where.str() << "\n";
+    delete index;
+    return hits.empty() ? 1 : 0;
+}
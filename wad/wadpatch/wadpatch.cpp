@@ -0,0 +1,55 @@
+#include <iostream>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Wad.h"
+#include "WadHeader.h"
+
+using namespace std;
+
+// Lump-level patches between WAD versions.
+// Usage: wadpatch diff <old.wad> <new.wad> <patch>
+//        wadpatch apply <old.wad> <patch> <out.wad>   (out may be old.wad)
+// Only WADs with the classic header can be patched.
+
+// Says why a WAD cannot be patched when its header is the reason
+static bool explainUnsupported(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    WadHeader header;
+    WadHeaderStatus status = readWadHeader(fd, &header);
+    close(fd);
+    if (status == WadHeaderStatus::Ok && !header.extended) return false;
+    cerr << path << ": " << (status == WadHeaderStatus::Ok ? "unsupported format: WADX extended header"
+                                                           : wadHeaderProblem(status)) << endl;
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 5 || (strcmp(argv[1], "diff") != 0 && strcmp(argv[1], "apply") != 0)) {
+        cerr << "usage: " << argv[0] << " diff <old.wad> <new.wad> <patch>" << endl;
+        cerr << "       " << argv[0] << " apply <old.wad> <patch> <out.wad>" << endl;
+        return 2;
+    }
+
+    if (strcmp(argv[1], "apply") == 0) {
+        if (!Wad::applyPatch(argv[2], argv[3], argv[4])) {
+            if (!explainUnsupported(argv[2])) cerr << argv[3] << ": cannot apply to " << argv[2] << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    Wad::DiffStats stats;
+    if (!Wad::diff(argv[2], argv[3], argv[4], &stats)) {
+        bool explained = explainUnsupported(argv[2]);
+        if (!explainUnsupported(argv[3]) && !explained)
+            cerr << "cannot diff " << argv[2] << " and " << argv[3] << endl;
+        return 1;
+    }
+    cout << stats.unchanged << " unchanged, " << stats.changed << " changed (" << stats.deltas << " as deltas), "
+         << stats.added << " added, " << stats.removed << " removed; patch " << stats.patchBytes << " bytes" << endl;
+    return 0;
+}
@@ -0,0 +1,66 @@
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Digest.h"
+#include "WadHeader.h"
+
+using namespace std;
+
+// Digests of WAD files: one "crc32c xxh64 path" line per file, or with -m
+// the full per-lump manifest. -c reuses and refreshes the <wad>.digest
+// cache beside each file. Exit status: 0 all digested, 1 some file failed,
+// 2 bad usage.
+// Usage: wadsum [-m] [-c] [-j threads] file...
+
+int main(int argc, char *argv[])
+{
+    bool manifest = false, cached = false;
+    unsigned threads = 0;
+    int argi = 1;
+    while (argi < argc && argv[argi][0] == '-') {
+        if (strcmp(argv[argi], "-m") == 0) {
+            manifest = true;
+            argi++;
+        } else if (strcmp(argv[argi], "-c") == 0) {
+            cached = true;
+            argi++;
+        } else if (strcmp(argv[argi], "-j") == 0 && argi + 1 < argc) {
+            threads = static_cast<unsigned>(atoi(argv[argi + 1]));
+            argi += 2;
+        } else {
+            break;
+        }
+    }
+    if (argi >= argc) {
+        cerr << "usage: " << argv[0] << " [-m] [-c] [-j threads] file..." << endl;
+        return 2;
+    }
+
+    int status = 0;
+    for (; argi < argc; argi++) {
+        WadDigest digest;
+        bool ok = cached ? digestWadCached(argv[argi], &digest, threads) : digestWad(argv[argi], &digest, threads);
+        if (!ok) {
+            int fd = open(argv[argi], O_RDONLY);
+            WadHeader header;
+            WadHeaderStatus headerStatus = fd < 0 ? WadHeaderStatus::Ok : readWadHeader(fd, &header);
+            if (fd >= 0) close(fd);
+            cerr << argv[argi] << ": "
+                 << (headerStatus == WadHeaderStatus::Ok ? "cannot digest" : wadHeaderProblem(headerStatus)) << endl;
+            status = 1;
+            continue;
+        }
+
+        if (manifest) {
+            cout << "# " << argv[argi] << "\n" << formatManifest(digest);
+        } else {
+            char line[64];
+            snprintf(line, sizeof(line), "%08x %016llx  ", digest.crc32c, static_cast<unsigned long long>(digest.xxh64));
+            cout << line << argv[argi] << "\n";
+        }
+    }
+    return status;
+}
@@ -0,0 +1,45 @@
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <sys/stat.h>
+#include "Wad.h"
+
+using namespace std;
+
+// Converts a WAD into a WADZ container, or back with -d. The output may be
+// the input itself.
+// Usage: wadz [-d] input output
+
+int main(int argc, char *argv[])
+{
+    bool decompress = argc == 4 && strcmp(argv[1], "-d") == 0;
+    if (argc != 3 && !decompress) {
+        cerr << "usage: " << argv[0] << " [-d] input output" << endl;
+        return 2;
+    }
+    string input = argv[argc - 2];
+    string output = argv[argc - 1];
+
+    // The conversion happens in place when the Wad is saved, so work on a copy
+    if (input != output) {
+        ifstream in(input, ios::binary);
+        ofstream out(output, ios::binary | ios::trunc);
+        if (!in || !out || !(out << in.rdbuf())) {
+            cerr << argv[0] << ": cannot copy " << input << " to " << output << endl;
+            return 1;
+        }
+    }
+
+    Wad* wad = Wad::loadWad(output);
+    if (!wad) {
+        cerr << argv[0] << ": cannot open " << output << endl;
+        return 1;
+    }
+    wad->setCompressed(!decompress);
+    delete wad;
+
+    struct stat before, after;
+    if (stat(input.c_str(), &before) == 0 && stat(output.c_str(), &after) == 0 && input != output)
+        cout << input << ": " << before.st_size << " -> " << after.st_size << " bytes" << endl;
+    return 0;
+}